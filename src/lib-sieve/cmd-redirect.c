@@ -75,6 +75,8 @@ const struct sieve_operation_def cmd_redirect_operation = {
 static bool act_redirect_equals
 	(const struct sieve_script_env *senv, const struct sieve_action *act1,
 		const struct sieve_action *act2);
+static const char *act_redirect_get_identity
+	(const struct sieve_script_env *senv, const struct sieve_action *act);
 static int act_redirect_check_duplicate
 	(const struct sieve_runtime_env *renv,
 		const struct sieve_action *act,
@@ -90,6 +92,7 @@ const struct sieve_action_def act_redirect = {
 	.name = "redirect",
 	.flags = SIEVE_ACTFLAG_TRIES_DELIVER,
 	.equals = act_redirect_equals,
+	.get_identity = act_redirect_get_identity,
 	.check_duplicate = act_redirect_check_duplicate,
 	.print = act_redirect_print,
 	.commit = act_redirect_commit
@@ -264,6 +267,16 @@ static bool act_redirect_equals
 		(rd_ctx1->to_address, rd_ctx2->to_address, TRUE) == 0 );
 }
 
+static const char *act_redirect_get_identity
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	const struct sieve_action *act)
+{
+	struct act_redirect_context *rd_ctx =
+		(struct act_redirect_context *) act->context;
+
+	return rd_ctx->to_address;
+}
+
 static int act_redirect_check_duplicate
 (const struct sieve_runtime_env *renv ATTR_UNUSED,
 	const struct sieve_action *act,
@@ -285,9 +298,79 @@ static void act_redirect_print
 	*keep = FALSE;
 }
 
+/* Message data shared by all recipients of a redirected message */
+
+struct act_redirect_message {
+	const char *msg_id, *new_msg_id;
+	const char *recipient, *resent_id, *list_id;
+};
+
+static int act_redirect_get_message
+(const struct sieve_action_exec_env *aenv, struct mail *mail,
+	struct act_redirect_message *msg_r)
+{
+	const struct sieve_message_data *msgdata = aenv->msgdata;
+	struct sieve_message_context *msgctx = aenv->msgctx;
+
+	i_zero(msg_r);
+
+	/* Read identifying headers */
+	if ( mail_get_first_header
+		(msgdata->mail, "resent-message-id", &msg_r->resent_id) < 0 ) {
+		return sieve_result_mail_error(aenv, mail,
+			"failed to read header field `resent-message-id'");
+	}
+	if ( msg_r->resent_id == NULL ) {
+		if ( mail_get_first_header
+			(msgdata->mail, "resent-from", &msg_r->resent_id) < 0 ) {
+			return sieve_result_mail_error(aenv, mail,
+				"failed to read header field `resent-from'");
+		}
+	}
+	if ( mail_get_first_header
+		(msgdata->mail, "list-id", &msg_r->list_id) < 0 ) {
+		return sieve_result_mail_error(aenv, mail,
+			"failed to read header field `list-id'");
+	}
+
+	/* Create Message-ID for the message if it has none */
+	msg_r->msg_id = msgdata->id;
+	if ( msg_r->msg_id == NULL ) {
+		msg_r->msg_id = msg_r->new_msg_id =
+			sieve_message_get_new_id(aenv->svinst);
+	}
+
+	if ( (aenv->flags & SIEVE_EXECUTE_FLAG_NO_ENVELOPE) == 0 )
+		msg_r->recipient = sieve_message_get_orig_recipient(msgctx);
+	else
+		msg_r->recipient = sieve_get_user_email(aenv->svinst);
+
+	return SIEVE_EXEC_OK;
+}
+
+static const char *act_redirect_get_duplicate_id
+(const struct act_redirect_message *msg, const char *to_address)
+{
+	/* Base the duplicate ID on:
+	   - the message id
+	   - the recipient running this Sieve script
+	   - redirect target address
+	   - if this message is resent: the message-id or from-address of
+		   the original message
+	   - if the message came through a mailing list: the mailinglist ID
+	 */
+	return t_strdup_printf("%s-%s-%s-%s-%s", msg->msg_id,
+		(msg->recipient != NULL ? msg->recipient : ""), to_address,
+		(msg->resent_id != NULL ? msg->resent_id : ""),
+		(msg->list_id != NULL ? msg->list_id : ""));
+}
+
+/* Sending the message */
+
 static int act_redirect_send
 (const struct sieve_action_exec_env *aenv, struct mail *mail,
-	struct act_redirect_context *ctx, const char *new_msg_id)
+	const char *const *to_addresses, const char *new_msg_id,
+	const char **error_r)
 	ATTR_NULL(4)
 {
 	static const char *hide_headers[] =
@@ -298,10 +381,12 @@ static int act_redirect_send
 	struct sieve_address_source env_from = svinst->redirect_from;
 	struct istream *input;
 	struct ostream *output;
-	const char *sender, *error;
+	const char *sender;
 	struct sieve_smtp_context *sctx;
 	int ret;
 
+	*error_r = NULL;
+
 	/* Just to be sure */
 	if ( !sieve_smtp_available(senv) ) {
 		sieve_result_global_warning
@@ -348,7 +433,10 @@ static int act_redirect_send
 	}
 
 	/* Open SMTP transport */
-	sctx = sieve_smtp_start_single(senv, ctx->to_address, sender, &output);
+	sctx = sieve_smtp_start(senv, sender);
+	for ( ; *to_addresses != NULL; to_addresses++ )
+		sieve_smtp_add_rcpt(sctx, *to_addresses);
+	output = sieve_smtp_send(sctx);
 
 	/* Remove unwanted headers */
 	input = i_stream_create_header_filter
@@ -393,23 +481,132 @@ static int act_redirect_send
   i_stream_unref(&input);
 
 	/* Close SMTP transport */
-	if ( (ret=sieve_smtp_finish(sctx, &error)) <= 0 ) {
-		if ( ret < 0 ) {
-			sieve_result_global_error(aenv,
-				"failed to redirect message to <%s>: %s "
-				"(temporary failure)",
-				str_sanitize(ctx->to_address, 256), str_sanitize(error, 512));
-			return SIEVE_EXEC_TEMP_FAILURE;
-		}
+	if ( (ret=sieve_smtp_finish(sctx, error_r)) <= 0 ) {
+		if ( *error_r == NULL )
+			*error_r = "unknown error";
+		return ( ret < 0 ? SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE );
+	}
+
+	return SIEVE_EXEC_OK;
+}
 
+static void act_redirect_log_failure
+(const struct sieve_action_exec_env *aenv, const char *to_address,
+	int status, const char *error)
+{
+	if ( status == SIEVE_EXEC_TEMP_FAILURE ) {
+		sieve_result_global_error(aenv,
+			"failed to redirect message to <%s>: %s "
+			"(temporary failure)",
+			str_sanitize(to_address, 256), str_sanitize(error, 512));
+	} else {
 		sieve_result_global_log_error(aenv,
 			"failed to redirect message to <%s>: %s "
 			"(permanent failure)",
-			str_sanitize(ctx->to_address, 256), str_sanitize(error, 512));
-		return SIEVE_EXEC_FAILURE;
+			str_sanitize(to_address, 256), str_sanitize(error, 512));
 	}
+}
 
-	return SIEVE_EXEC_OK;
+/* Redirects of the same message version that are committed later on in this
+   execution; the message is sent to these in the same SMTP transaction */
+
+ARRAY_DEFINE_TYPE(act_redirect_context, struct act_redirect_context *);
+
+static void act_redirect_get_batch
+(const struct sieve_action *action,
+	const struct sieve_action_exec_env *aenv, struct mail *mail,
+	const struct act_redirect_message *msg,
+	ARRAY_TYPE(const_string) *to_addresses,
+	ARRAY_TYPE(act_redirect_context) *batch)
+{
+	const struct sieve_script_env *senv = aenv->scriptenv;
+	struct sieve_result_iterate_context *rictx;
+	const struct sieve_action *oact;
+	bool found = FALSE;
+
+	rictx = sieve_result_iterate_init(aenv->result);
+	while ( (oact=sieve_result_iterate_next(rictx, NULL)) != NULL ) {
+		struct act_redirect_context *octx =
+			(struct act_redirect_context *) oact->context;
+		struct mail *omail;
+		const char *dupeid;
+
+		if ( oact == action ) {
+			found = TRUE;
+			continue;
+		}
+		if ( !found || oact->def != &act_redirect || oact->executed ||
+			octx->batched )
+			continue;
+
+		omail = ( oact->mail != NULL ?
+			oact->mail : sieve_message_get_mail(aenv->msgctx) );
+		if ( omail != mail )
+			continue;
+
+		/* Duplicates are discarded by their own commit */
+		dupeid = act_redirect_get_duplicate_id(msg, octx->to_address);
+		if ( sieve_action_duplicate_check(senv, dupeid, strlen(dupeid)) )
+			continue;
+
+		array_append(to_addresses, &octx->to_address, 1);
+		array_append(batch, &octx, 1);
+	}
+}
+
+static int act_redirect_send_batch
+(const struct sieve_action *action,
+	const struct sieve_action_exec_env *aenv, struct mail *mail,
+	const struct act_redirect_message *msg, const char **error_r)
+{
+	struct act_redirect_context *ctx =
+		(struct act_redirect_context *) action->context;
+	ARRAY_TYPE(const_string) to_addresses;
+	ARRAY_TYPE(act_redirect_context) batch;
+	struct act_redirect_context *const *octxp;
+	int ret;
+
+	t_array_init(&to_addresses, 4);
+	t_array_init(&batch, 4);
+	array_append(&to_addresses, &ctx->to_address, 1);
+
+	act_redirect_get_batch(action, aenv, mail, msg, &to_addresses, &batch);
+	array_append_zero(&to_addresses);
+
+	ret = act_redirect_send(aenv, mail, array_idx(&to_addresses, 0),
+		msg->new_msg_id, error_r);
+	if ( array_count(&batch) == 0 )
+		return ret;
+
+	if ( ret == SIEVE_EXEC_OK ) {
+		const struct sieve_script_env *senv = aenv->scriptenv;
+		time_t dupe_expiry =
+			ioloop_time + aenv->svinst->redirect_duplicate_period;
+
+		/* The later redirects only need to record the result. Their messages
+		   are marked as forwarded right away, because another action may
+		   still fail before their own commit is reached; a retried delivery
+		   must not redirect them again. */
+		array_foreach(&batch, octxp) {
+			const char *dupeid =
+				act_redirect_get_duplicate_id(msg, (*octxp)->to_address);
+
+			sieve_action_duplicate_mark(senv, dupeid, strlen(dupeid),
+				dupe_expiry);
+			(*octxp)->batched = TRUE;
+		}
+		return SIEVE_EXEC_OK;
+	}
+
+	/* The SMTP server does not tell which recipient failed permanently, so
+	   each redirect tries on its own then */
+	if ( ret == SIEVE_EXEC_FAILURE && *error_r != NULL ) {
+		const char *to_address[] = { ctx->to_address, NULL };
+
+		return act_redirect_send(aenv, mail, to_address,
+			msg->new_msg_id, error_r);
+	}
+	return ret;
 }
 
 static int act_redirect_commit
@@ -423,78 +620,41 @@ static int act_redirect_commit
 	struct sieve_message_context *msgctx = aenv->msgctx;
 	struct mail *mail =	( action->mail != NULL ?
 		action->mail : sieve_message_get_mail(msgctx) );
-	const struct sieve_message_data *msgdata = aenv->msgdata;
 	const struct sieve_script_env *senv = aenv->scriptenv;
-	const char *msg_id = msgdata->id, *new_msg_id = NULL;
-	const char *dupeid, *resent_id = NULL;
-	const char *list_id = NULL;
-	const char *recipient;
+	struct act_redirect_message msg;
+	const char *dupeid, *error = NULL;
 	int ret;
 
 	/*
 	 * Prevent mail loops
 	 */
 
-	/* Read identifying headers */
-	if ( mail_get_first_header
-		(msgdata->mail, "resent-message-id", &resent_id) < 0 ) {
-		return sieve_result_mail_error(aenv, mail,
-			"failed to read header field `resent-message-id'");
-	}
-	if ( resent_id == NULL ) {
-		if ( mail_get_first_header
-			(msgdata->mail, "resent-from", &resent_id) < 0 ) {
-			return sieve_result_mail_error(aenv, mail,
-				"failed to read header field `resent-from'");
-		}
-	}
-	if ( mail_get_first_header
-		(msgdata->mail, "list-id", &list_id) < 0 ) {
-		return sieve_result_mail_error(aenv, mail,
-			"failed to read header field `list-id'");
-	}
+	if ( (ret=act_redirect_get_message(aenv, mail, &msg)) != SIEVE_EXEC_OK )
+		return ret;
+	dupeid = act_redirect_get_duplicate_id(&msg, ctx->to_address);
 
-	/* Create Message-ID for the message if it has none */
-	if ( msg_id == NULL ) {	
-		msg_id = new_msg_id =
-			sieve_message_get_new_id(aenv->svinst);
-	}
+	if ( ctx->batched ) {
+		/* Already sent along with an earlier redirect */
+		ret = SIEVE_EXEC_OK;
+	} else {
+		/* Check whether we've seen this message before */
+		if (sieve_action_duplicate_check
+			(senv, dupeid, strlen(dupeid))) {
+			sieve_result_global_log(aenv,
+				"discarded duplicate forward to <%s>",
+				str_sanitize(ctx->to_address, 128));
+			*keep = FALSE;
+			return SIEVE_EXEC_OK;
+		}
 
-	if ( (aenv->flags & SIEVE_EXECUTE_FLAG_NO_ENVELOPE) == 0 )
-		recipient = sieve_message_get_orig_recipient(msgctx);
-	else
-		recipient = sieve_get_user_email(aenv->svinst);
+		/*
+		 * Try to forward the message
+		 */
 
-	/* Base the duplicate ID on:
-	   - the message id
-	   - the recipient running this Sieve script
-	   - redirect target address
-	   - if this message is resent: the message-id or from-address of
-		   the original message
-	   - if the message came through a mailing list: the mailinglist ID
-	 */
-	dupeid = t_strdup_printf("%s-%s-%s-%s-%s", msg_id,
-		(recipient != NULL ? recipient : ""), ctx->to_address,
-		(resent_id != NULL ? resent_id : ""),
-		(list_id != NULL ? list_id : ""));
-
-	/* Check whether we've seen this message before */
-	if (sieve_action_duplicate_check
-		(senv, dupeid, strlen(dupeid))) {
-		sieve_result_global_log(aenv,
-			"discarded duplicate forward to <%s>",
-			str_sanitize(ctx->to_address, 128));
-		*keep = FALSE;
-		return SIEVE_EXEC_OK;
+		ret = act_redirect_send_batch(action, aenv, mail, &msg, &error);
 	}
 
-	/*
-	 * Try to forward the message
-	 */
-
-	if ( (ret=act_redirect_send
-		(aenv, mail, ctx, new_msg_id)) == SIEVE_EXEC_OK) {
-
+	if ( ret == SIEVE_EXEC_OK ) {
 		/* Mark this message id as forwarded to the specified destination */
 		sieve_action_duplicate_mark(senv, dupeid, strlen(dupeid),
 			ioloop_time + svinst->redirect_duplicate_period);
@@ -511,6 +671,8 @@ static int act_redirect_commit
 		return SIEVE_EXEC_OK;
 	}
 
+	if ( error != NULL )
+		act_redirect_log_failure(aenv, ctx->to_address, ret, error);
 	return ret;
 }
 
@@ -5,6 +5,9 @@
  */
 
 #include "lib.h"
+#include "str.h"
+#include "buffer.h"
+#include "array.h"
 
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
@@ -20,6 +23,21 @@
 static int mcht_contains_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static void *mcht_contains_keyset_compile
+	(pool_t pool, const struct sieve_comparator *cmp,
+		string_t *const *keys, unsigned int count);
+static int mcht_contains_keyset_match
+	(struct sieve_match_context *mctx, void *keyset,
+		const char *val, size_t val_size);
+static bool mcht_contains_stream_init
+	(struct sieve_match_context *mctx, string_t *const *keys,
+		unsigned int count);
+static void mcht_contains_stream_value_begin
+	(struct sieve_match_context *mctx);
+static int mcht_contains_stream_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+static int mcht_contains_stream_value_end
+	(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -29,16 +47,131 @@ const struct sieve_match_type_def contains_match_type = {
 	SIEVE_OBJECT("contains",
 		&match_type_operand, SIEVE_MATCH_TYPE_CONTAINS),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_contains_match_key
+	.match_key = mcht_contains_match_key,
+	.keyset_compile = mcht_contains_keyset_compile,
+	.keyset_match = mcht_contains_keyset_match,
+	.stream_init = mcht_contains_stream_init,
+	.stream_value_begin = mcht_contains_stream_value_begin,
+	.stream_value_more = mcht_contains_stream_value_more,
+	.stream_value_end = mcht_contains_stream_value_end
 };
 
 /*
  * Match-type implementation
  */
 
-/* FIXME: Naive substring match implementation. Should switch to more
- * efficient algorithm if large values need to be searched (e.g. message body).
+/* Substring search for i;octet and i;ascii-casemap
+ *
+ *   Short values and keys are searched by scanning for the first key
+ *   character (using memchr() where possible). Longer values use the
+ *   Boyer-Moore-Horspool algorithm, which can skip up to the length of the key
+ *   for each comparison. For i;ascii-casemap both cases of a character share
+ *   a single entry in the skip table.
  */
+
+#define MCHT_CONTAINS_HORSPOOL_MIN_KEY_SIZE 4
+#define MCHT_CONTAINS_HORSPOOL_MIN_VALUE_SIZE 256
+
+static inline bool mcht_contains_equal
+(const unsigned char *val, const unsigned char *key, size_t size,
+	bool casemap)
+{
+	size_t i;
+
+	if ( !casemap )
+		return ( memcmp(val, key, size) == 0 );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i_tolower(val[i]) != i_tolower(key[i]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static const unsigned char *mcht_contains_scan
+(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, bool casemap)
+{
+	const unsigned char *vp = val;
+	const unsigned char *vend = val + (val_size - key_size) + 1;
+	unsigned char lc = key[0], uc = key[0];
+
+	if ( casemap ) {
+		lc = (unsigned char)i_tolower(key[0]);
+		uc = (unsigned char)i_toupper(key[0]);
+	}
+
+	if ( lc != uc ) {
+		/* First key character has two cases */
+		for ( ; vp < vend; vp++ ) {
+			if ( (*vp == lc || *vp == uc) &&
+				mcht_contains_equal(vp + 1, key + 1, key_size - 1, casemap) )
+				return vp;
+		}
+		return NULL;
+	}
+
+	while ( vp < vend &&
+		(vp=memchr(vp, key[0], vend - vp)) != NULL ) {
+		if ( mcht_contains_equal(vp + 1, key + 1, key_size - 1, casemap) )
+			return vp;
+		vp++;
+	}
+	return NULL;
+}
+
+static const unsigned char *mcht_contains_horspool
+(const unsigned char *val, size_t val_size,
+	const unsigned char *key, size_t key_size, bool casemap)
+{
+	size_t skip[256];
+	size_t last = key_size - 1, pos, i;
+	unsigned char key_last = key[last];
+
+	for ( i = 0; i < N_ELEMENTS(skip); i++ )
+		skip[i] = key_size;
+	for ( i = 0; i < last; i++ ) {
+		if ( casemap ) {
+			skip[(unsigned char)i_tolower(key[i])] = last - i;
+			skip[(unsigned char)i_toupper(key[i])] = last - i;
+		} else {
+			skip[key[i]] = last - i;
+		}
+	}
+	if ( casemap )
+		key_last = (unsigned char)i_tolower(key_last);
+
+	for ( pos = 0; pos <= val_size - key_size; pos += skip[val[pos + last]] ) {
+		unsigned char c = val[pos + last];
+
+		if ( casemap )
+			c = (unsigned char)i_tolower(c);
+		if ( c == key_last && mcht_contains_equal(val + pos, key, last, casemap) )
+			return val + pos;
+	}
+	return NULL;
+}
+
+const char *sieve_match_substring_find
+(const char *val, size_t val_size, const char *key, size_t key_size,
+	bool casemap)
+{
+	const unsigned char *v = (const unsigned char *)val;
+	const unsigned char *k = (const unsigned char *)key;
+
+	if ( key_size == 0 )
+		return val;
+	if ( key_size > val_size )
+		return NULL;
+
+	if ( key_size >= MCHT_CONTAINS_HORSPOOL_MIN_KEY_SIZE &&
+		val_size >= MCHT_CONTAINS_HORSPOOL_MIN_VALUE_SIZE ) {
+		return (const char *)
+			mcht_contains_horspool(v, val_size, k, key_size, casemap);
+	}
+	return (const char *)mcht_contains_scan(v, val_size, k, key_size, casemap);
+}
+
 static int mcht_contains_match_key
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
 	const char *key, size_t key_size)
@@ -52,6 +185,15 @@ static int mcht_contains_match_key
 	if ( val_size == 0 )
 		return ( key_size == 0 ? 1 : 0 );
 
+	if ( cmp->def == &i_octet_comparator )
+		return ( sieve_match_substring_find
+			(val, val_size, key, key_size, FALSE) != NULL ? 1 : 0 );
+	if ( cmp->def == &i_ascii_casemap_comparator )
+		return ( sieve_match_substring_find
+			(val, val_size, key, key_size, TRUE) != NULL ? 1 : 0 );
+
+	/* Generic implementation for other comparators */
+
 	if ( cmp->def == NULL || cmp->def->char_match == NULL )
 		return 0;
 
@@ -63,4 +205,297 @@ static int mcht_contains_match_key
 	return ( kp == kend ? 1 : 0 );
 }
 
+/*
+ * Precompiled key set
+ *
+ *   For a long list of constant keys, all keys are searched in a single pass
+ *   over the value using an Aho-Corasick automaton. Each node of the key trie
+ *   has a failure link to the node for the longest proper suffix of its path
+ *   that is also in the trie. Children are kept in sibling lists, except for
+ *   the root, which has a direct transition table.
+ */
+
+struct mcht_contains_node {
+	unsigned int first_child, next_sibling;
+	unsigned int fail;
+
+	unsigned char chr;
+	bool output:1;
+};
+
+struct mcht_contains_keyset {
+	ARRAY(struct mcht_contains_node) nodes;
+	unsigned int root[256];
+
+	bool casemap:1;
+	bool match_all:1;
+};
+
+static inline unsigned char
+mcht_contains_fold(const struct mcht_contains_keyset *kset, unsigned char c)
+{
+	return ( kset->casemap ? i_tolower(c) : c );
+}
+
+static inline unsigned int mcht_contains_child
+(const struct mcht_contains_keyset *kset, unsigned int node, unsigned char c)
+{
+	const struct mcht_contains_node *nodes;
+	unsigned int child;
+
+	/* Node index 0 is the root, which is never a child; it signals failure */
+	if ( node == 0 )
+		return kset->root[c];
+
+	nodes = array_idx(&kset->nodes, 0);
+	for ( child = nodes[node].first_child; child != 0;
+		child = nodes[child].next_sibling ) {
+		if ( nodes[child].chr == c )
+			return child;
+	}
+	return 0;
+}
+
+static void mcht_contains_keyset_add
+(struct mcht_contains_keyset *kset, const unsigned char *key, size_t key_size)
+{
+	struct mcht_contains_node *node;
+	unsigned int cur = 0, child;
+	size_t i;
+
+	if ( key_size == 0 ) {
+		kset->match_all = TRUE;
+		return;
+	}
+
+	for ( i = 0; i < key_size; i++ ) {
+		unsigned char c = mcht_contains_fold(kset, key[i]);
+
+		child = mcht_contains_child(kset, cur, c);
+		if ( child == 0 ) {
+			child = array_count(&kset->nodes);
+			node = array_append_space(&kset->nodes);
+			node->chr = c;
+
+			if ( cur == 0 ) {
+				kset->root[c] = child;
+			} else {
+				struct mcht_contains_node *parent =
+					array_idx_modifiable(&kset->nodes, cur);
+
+				node->next_sibling = parent->first_child;
+				parent->first_child = child;
+			}
+		}
+		cur = child;
+	}
+
+	node = array_idx_modifiable(&kset->nodes, cur);
+	node->output = TRUE;
+}
+
+static void mcht_contains_keyset_link(struct mcht_contains_keyset *kset)
+{
+	struct mcht_contains_node *nodes;
+	ARRAY(unsigned int) queue;
+	unsigned int i, c, head;
+
+	nodes = array_idx_modifiable(&kset->nodes, 0);
+
+	/* Breadth-first, so that failure links always point to nodes that
+	   were already completed */
+	t_array_init(&queue, array_count(&kset->nodes));
+	for ( c = 0; c < N_ELEMENTS(kset->root); c++ ) {
+		if ( kset->root[c] != 0 )
+			array_append(&queue, &kset->root[c], 1);
+	}
+
+	for ( head = 0; head < array_count(&queue); head++ ) {
+		unsigned int cur = *array_idx(&queue, head);
+
+		for ( i = nodes[cur].first_child; i != 0; i = nodes[i].next_sibling ) {
+			unsigned int fail = nodes[cur].fail, next;
+
+			while ( (next=mcht_contains_child(kset, fail, nodes[i].chr)) == 0 &&
+				fail != 0 )
+				fail = nodes[fail].fail;
+
+			nodes[i].fail = next;
+			if ( nodes[next].output )
+				nodes[i].output = TRUE;
+			array_append(&queue, &i, 1);
+		}
+	}
+}
+
+static void *mcht_contains_keyset_compile
+(pool_t pool, const struct sieve_comparator *cmp,
+	string_t *const *keys, unsigned int count)
+{
+	struct mcht_contains_keyset *kset;
+	unsigned int i;
+
+	if ( cmp->def != &i_octet_comparator &&
+		cmp->def != &i_ascii_casemap_comparator )
+		return NULL;
+
+	kset = p_new(pool, struct mcht_contains_keyset, 1);
+	kset->casemap = ( cmp->def == &i_ascii_casemap_comparator );
+	p_array_init(&kset->nodes, pool, 64);
+
+	/* Root node */
+	(void)array_append_space(&kset->nodes);
+
+	for ( i = 0; i < count; i++ )
+		mcht_contains_keyset_add(kset, str_data(keys[i]), str_len(keys[i]));
+
+	mcht_contains_keyset_link(kset);
+	return kset;
+}
+
+static int mcht_contains_keyset_match
+(struct sieve_match_context *mctx ATTR_UNUSED, void *keyset,
+	const char *val, size_t val_size)
+{
+	struct mcht_contains_keyset *kset = (struct mcht_contains_keyset *)keyset;
+	const struct mcht_contains_node *nodes = array_idx(&kset->nodes, 0);
+	const unsigned char *vp = (const unsigned char *)val;
+	const unsigned char *vend = vp + val_size;
+	unsigned int cur = 0, next;
+
+	if ( kset->match_all )
+		return 1;
+
+	for ( ; vp < vend; vp++ ) {
+		unsigned char c = mcht_contains_fold(kset, *vp);
+
+		while ( (next=mcht_contains_child(kset, cur, c)) == 0 && cur != 0 )
+			cur = nodes[cur].fail;
+		cur = next;
+
+		if ( nodes[cur].output )
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Streaming match
+ *
+ *   Each chunk is searched directly. Occurrences that span a chunk boundary
+ *   are found by also searching the last bytes of the previous chunks
+ *   (one less than the longest key) together with the start of the new chunk.
+ */
+
+struct mcht_contains_stream {
+	string_t *const *keys;
+	unsigned int keys_count;
+
+	/* Trailing part of the value that a key occurrence can start in */
+	buffer_t *carry;
+	size_t carry_size;
+
+	bool casemap:1;
+	bool match_all:1;
+};
+
+static bool mcht_contains_stream_init
+(struct sieve_match_context *mctx, string_t *const *keys, unsigned int count)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_contains_stream *stream;
+	unsigned int i;
+
+	if ( cmp->def != &i_octet_comparator &&
+		cmp->def != &i_ascii_casemap_comparator )
+		return FALSE;
+
+	stream = p_new(mctx->pool, struct mcht_contains_stream, 1);
+	stream->keys = keys;
+	stream->keys_count = count;
+	stream->casemap = ( cmp->def == &i_ascii_casemap_comparator );
+
+	for ( i = 0; i < count; i++ ) {
+		size_t key_size = str_len(keys[i]);
+
+		/* An empty key matches any value */
+		if ( key_size == 0 )
+			stream->match_all = TRUE;
+		else if ( key_size - 1 > stream->carry_size )
+			stream->carry_size = key_size - 1;
+	}
+
+	stream->carry = buffer_create_dynamic
+		(mctx->pool, stream->carry_size * 2 + 1);
+	mctx->stream_data = (void *)stream;
+	return TRUE;
+}
+
+static void mcht_contains_stream_value_begin
+(struct sieve_match_context *mctx)
+{
+	struct mcht_contains_stream *stream =
+		(struct mcht_contains_stream *)mctx->stream_data;
+
+	buffer_set_used_size(stream->carry, 0);
+}
+
+static bool mcht_contains_stream_find
+(struct mcht_contains_stream *stream, const char *data, size_t size)
+{
+	unsigned int i;
+
+	for ( i = 0; i < stream->keys_count; i++ ) {
+		if ( str_len(stream->keys[i]) > 0 && sieve_match_substring_find
+			(data, size, str_c(stream->keys[i]), str_len(stream->keys[i]),
+				stream->casemap) != NULL )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int mcht_contains_stream_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	struct mcht_contains_stream *stream =
+		(struct mcht_contains_stream *)mctx->stream_data;
+	buffer_t *carry = stream->carry;
+	size_t keep = stream->carry_size;
+
+	if ( stream->match_all )
+		return 1;
+
+	if ( size < keep ) {
+		/* Small chunk: search it together with what precedes it */
+		buffer_append(carry, data, size);
+		if ( mcht_contains_stream_find(stream, carry->data, carry->used) )
+			return 1;
+		if ( carry->used > keep )
+			buffer_delete(carry, 0, carry->used - keep);
+		return 0;
+	}
+
+	/* Search across the boundary with the previous chunk */
+	if ( carry->used > 0 ) {
+		buffer_append(carry, data, keep);
+		if ( mcht_contains_stream_find(stream, carry->data, carry->used) )
+			return 1;
+	}
+
+	if ( mcht_contains_stream_find(stream, data, size) )
+		return 1;
+
+	buffer_set_used_size(carry, 0);
+	buffer_append(carry, data + size - keep, keep);
+	return 0;
+}
+
+static int mcht_contains_stream_value_end
+(struct sieve_match_context *mctx)
+{
+	struct mcht_contains_stream *stream =
+		(struct mcht_contains_stream *)mctx->stream_data;
 
+	/* Only an empty key can match an empty value */
+	return ( stream->match_all ? 1 : 0 );
+}
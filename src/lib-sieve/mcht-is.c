@@ -5,6 +5,8 @@
  */
 
 #include "lib.h"
+#include "str.h"
+#include "hash.h"
 
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
@@ -20,6 +22,21 @@
 static int mcht_is_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static void *mcht_is_keyset_compile
+	(pool_t pool, const struct sieve_comparator *cmp,
+		string_t *const *keys, unsigned int count);
+static int mcht_is_keyset_match
+	(struct sieve_match_context *mctx, void *keyset,
+		const char *val, size_t val_size);
+static bool mcht_is_stream_init
+	(struct sieve_match_context *mctx, string_t *const *keys,
+		unsigned int count);
+static void mcht_is_stream_value_begin
+	(struct sieve_match_context *mctx);
+static int mcht_is_stream_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+static int mcht_is_stream_value_end
+	(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -28,7 +45,13 @@ static int mcht_is_match_key
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is",
 		&match_type_operand, SIEVE_MATCH_TYPE_IS),
-	.match_key = mcht_is_match_key
+	.match_key = mcht_is_match_key,
+	.keyset_compile = mcht_is_keyset_compile,
+	.keyset_match = mcht_is_keyset_match,
+	.stream_init = mcht_is_stream_init,
+	.stream_value_begin = mcht_is_stream_value_begin,
+	.stream_value_more = mcht_is_stream_value_more,
+	.stream_value_end = mcht_is_stream_value_end
 };
 
 /*
@@ -50,3 +73,170 @@ static int mcht_is_match_key
 	return 0;
 }
 
+/*
+ * Precompiled key set
+ *
+ *   For a long list of constant keys, the value is looked up in a hash table
+ *   rather than compared to each key in turn.
+ */
+
+struct mcht_is_keyset {
+	HASH_TABLE(const char *, void *) keys;
+};
+
+static void *mcht_is_keyset_compile
+(pool_t pool, const struct sieve_comparator *cmp,
+	string_t *const *keys, unsigned int count)
+{
+	struct mcht_is_keyset *kset;
+	unsigned int i;
+
+	kset = p_new(pool, struct mcht_is_keyset, 1);
+	if ( cmp->def == &i_ascii_casemap_comparator ) {
+		hash_table_create(&kset->keys, pool, count, strcase_hash, strcasecmp);
+	} else if ( cmp->def == &i_octet_comparator ) {
+		hash_table_create(&kset->keys, pool, count, str_hash, strcmp);
+	} else {
+		return NULL;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		const char *key = str_c(keys[i]);
+
+		/* Keys with embedded NUL characters cannot be stored as C strings;
+		   leave these lists to the normal key comparison */
+		if ( strlen(key) != str_len(keys[i]) )
+			return NULL;
+
+		key = p_strdup(pool, key);
+		if ( hash_table_lookup(kset->keys, key) == NULL )
+			hash_table_insert(kset->keys, key, POINTER_CAST(1));
+	}
+
+	return kset;
+}
+
+static int mcht_is_keyset_match
+(struct sieve_match_context *mctx ATTR_UNUSED, void *keyset,
+	const char *val, size_t val_size)
+{
+	struct mcht_is_keyset *kset = (struct mcht_is_keyset *)keyset;
+	int match;
+
+	/* A value with an embedded NUL never equals one of the keys */
+	if ( memchr(val, '\0', val_size) != NULL )
+		return 0;
+
+	T_BEGIN {
+		match = ( hash_table_lookup(kset->keys, t_strndup(val, val_size))
+			!= NULL ? 1 : 0 );
+	} T_END;
+	return match;
+}
+
+/*
+ * Streaming match
+ *
+ *   Each chunk is compared to the corresponding part of every key that still
+ *   matches; no part of the value needs to be retained.
+ */
+
+struct mcht_is_stream {
+	string_t *const *keys;
+	unsigned int keys_count;
+
+	/* Per key: whether the value seen so far is a prefix of the key */
+	bool *prefix;
+	uoff_t value_size;
+
+	bool casemap:1;
+};
+
+static bool mcht_is_stream_init
+(struct sieve_match_context *mctx, string_t *const *keys, unsigned int count)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_is_stream *stream;
+
+	if ( cmp->def != &i_octet_comparator &&
+		cmp->def != &i_ascii_casemap_comparator )
+		return FALSE;
+
+	stream = p_new(mctx->pool, struct mcht_is_stream, 1);
+	stream->keys = keys;
+	stream->keys_count = count;
+	stream->prefix = p_new(mctx->pool, bool, count + 1);
+	stream->casemap = ( cmp->def == &i_ascii_casemap_comparator );
+
+	mctx->stream_data = (void *)stream;
+	return TRUE;
+}
+
+static void mcht_is_stream_value_begin
+(struct sieve_match_context *mctx)
+{
+	struct mcht_is_stream *stream =
+		(struct mcht_is_stream *)mctx->stream_data;
+	unsigned int i;
+
+	stream->value_size = 0;
+	for ( i = 0; i < stream->keys_count; i++ )
+		stream->prefix[i] = TRUE;
+}
+
+static bool mcht_is_stream_equal
+(const char *key, const char *data, size_t size, bool casemap)
+{
+	size_t i;
+
+	if ( !casemap )
+		return ( memcmp(key, data, size) == 0 );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i_tolower(key[i]) != i_tolower(data[i]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int mcht_is_stream_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	struct mcht_is_stream *stream =
+		(struct mcht_is_stream *)mctx->stream_data;
+	unsigned int i;
+
+	for ( i = 0; i < stream->keys_count; i++ ) {
+		const char *key = str_c(stream->keys[i]);
+		size_t key_size = str_len(stream->keys[i]);
+
+		if ( !stream->prefix[i] )
+			continue;
+
+		if ( stream->value_size + size > key_size ) {
+			stream->prefix[i] = FALSE;
+		} else {
+			stream->prefix[i] = mcht_is_stream_equal
+				(key + stream->value_size, data, size, stream->casemap);
+		}
+	}
+	stream->value_size += size;
+
+	/* The match is only known once the end of the value is seen */
+	return 0;
+}
+
+static int mcht_is_stream_value_end
+(struct sieve_match_context *mctx)
+{
+	struct mcht_is_stream *stream =
+		(struct mcht_is_stream *)mctx->stream_data;
+	unsigned int i;
+
+	for ( i = 0; i < stream->keys_count; i++ ) {
+		if ( stream->prefix[i] &&
+			stream->value_size == str_len(stream->keys[i]) )
+			return 1;
+	}
+	return 0;
+}
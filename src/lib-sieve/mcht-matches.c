@@ -6,6 +6,9 @@
 
 #include "lib.h"
 #include "str.h"
+#include "buffer.h"
+#include "array.h"
+#include "hash.h"
 
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
@@ -18,9 +21,26 @@
  * Forward declarations
  */
 
+static void mcht_matches_match_init(struct sieve_match_context *mctx);
 static int mcht_matches_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static void mcht_matches_match_deinit(struct sieve_match_context *mctx);
+static void *mcht_matches_keyset_compile
+	(pool_t pool, const struct sieve_comparator *cmp,
+		string_t *const *keys, unsigned int count);
+static int mcht_matches_keyset_match
+	(struct sieve_match_context *mctx, void *keyset,
+		const char *val, size_t val_size);
+static bool mcht_matches_stream_init
+	(struct sieve_match_context *mctx, string_t *const *keys,
+		unsigned int count);
+static void mcht_matches_stream_value_begin
+	(struct sieve_match_context *mctx);
+static int mcht_matches_stream_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+static int mcht_matches_stream_value_end
+	(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -30,13 +50,335 @@ const struct sieve_match_type_def matches_match_type = {
 	SIEVE_OBJECT("matches",
 		&match_type_operand, SIEVE_MATCH_TYPE_MATCHES),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_matches_match_key
+	.match_init = mcht_matches_match_init,
+	.match_key = mcht_matches_match_key,
+	.match_deinit = mcht_matches_match_deinit,
+	.keyset_compile = mcht_matches_keyset_compile,
+	.keyset_match = mcht_matches_keyset_match,
+	.stream_init = mcht_matches_stream_init,
+	.stream_value_begin = mcht_matches_stream_value_begin,
+	.stream_value_more = mcht_matches_stream_value_more,
+	.stream_value_end = mcht_matches_stream_value_end
 };
 
+/*
+ * Compiled pattern
+ *
+ *   <pattern> = <segment>*<segment>*...*<segment>
+ *   <segment> = a sequence of literal characters and '?' wildcards
+ *
+ * A segment always matches a fixed number of characters. The first segment is
+ * anchored at the start of the value and the last segment at the end. The
+ * segments in between are matched at their leftmost possible position, which
+ * makes each '*' match as little as possible (RFC 5229, Section 3.2). A
+ * segment never needs to be reconsidered once it is placed, so no
+ * backtracking is needed. The literal runs are located using the common
+ * substring search.
+ */
+
+struct mcht_matches_part {
+	/* Number of '?' wildcards preceding the literal */
+	unsigned int any;
+
+	const char *literal;
+	size_t literal_size;
+};
+
+struct mcht_matches_segment {
+	const struct mcht_matches_part *parts;
+	unsigned int parts_count;
+
+	/* Number of value characters matched by this segment */
+	size_t size;
+};
+
+struct mcht_matches_glob {
+	const struct mcht_matches_segment *segments;
+	unsigned int segments_count;
+};
+
+static struct mcht_matches_glob *mcht_matches_glob_compile
+(pool_t pool, const char *key, size_t key_size)
+{
+	struct mcht_matches_glob *glob;
+	ARRAY(struct mcht_matches_segment) segments;
+	ARRAY(struct mcht_matches_part) parts;
+	const char *kp, *kend = key + key_size;
+	string_t *literal;
+	unsigned int any = 0;
+	size_t size = 0;
+
+	glob = p_new(pool, struct mcht_matches_glob, 1);
+	p_array_init(&segments, pool, 4);
+	p_array_init(&parts, pool, 4);
+	literal = t_str_new(64);
+
+	for ( kp = key; ; kp++ ) {
+		struct mcht_matches_segment *seg;
+
+		if ( kp < kend && *kp != '*' && *kp != '?' ) {
+			/* Literal character; '\' escapes the next character */
+			if ( *kp == '\\' && kp + 1 < kend )
+				kp++;
+			str_append_c(literal, *kp);
+			continue;
+		}
+
+		/* Finish literal run (and trailing '?'s of a segment) */
+		if ( str_len(literal) > 0 ||
+			(any > 0 && (kp == kend || *kp == '*')) ) {
+			struct mcht_matches_part *part = array_append_space(&parts);
+
+			part->any = any;
+			part->literal_size = str_len(literal);
+			part->literal = p_memdup(pool, str_data(literal), str_len(literal));
+			size += any + str_len(literal);
+
+			any = 0;
+			str_truncate(literal, 0);
+		}
+
+		if ( kp < kend && *kp == '?' ) {
+			any++;
+			continue;
+		}
+
+		/* Finish segment */
+		seg = array_append_space(&segments);
+		seg->parts = array_get(&parts, &seg->parts_count);
+		seg->size = size;
+		size = 0;
+
+		if ( kp == kend )
+			break;
+		p_array_init(&parts, pool, 4);
+	}
+
+	glob->segments = array_get(&segments, &glob->segments_count);
+	return glob;
+}
+
+static inline bool mcht_matches_equal
+(const char *val, const char *key, size_t size, bool casemap)
+{
+	size_t i;
+
+	if ( !casemap )
+		return ( memcmp(val, key, size) == 0 );
+
+	for ( i = 0; i < size; i++ ) {
+		if ( i_tolower(val[i]) != i_tolower(key[i]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Match segment at a fixed position; caller checks that there is room */
+static bool mcht_matches_segment_match
+(const struct mcht_matches_segment *seg, const char *vp, bool casemap)
+{
+	unsigned int i;
+
+	for ( i = 0; i < seg->parts_count; i++ ) {
+		const struct mcht_matches_part *part = &seg->parts[i];
+
+		vp += part->any;
+		if ( !mcht_matches_equal(vp, part->literal, part->literal_size, casemap) )
+			return FALSE;
+		vp += part->literal_size;
+	}
+	return TRUE;
+}
+
+/* Find leftmost position of segment in [vp, vlimit) */
+static const char *mcht_matches_segment_find
+(const struct mcht_matches_segment *seg, const char *vp, const char *vlimit,
+	bool casemap)
+{
+	const struct mcht_matches_part *first;
+	const char *sp, *found, *pos;
+
+	if ( (size_t)(vlimit - vp) < seg->size )
+		return NULL;
+
+	/* Empty segment ("**") or only '?' wildcards */
+	if ( seg->parts_count == 0 || seg->parts[0].literal_size == 0 )
+		return vp;
+
+	/* Search for the first literal run */
+	first = &seg->parts[0];
+	sp = vp + first->any;
+	while ( (size_t)(vlimit - sp) >= seg->size - first->any ) {
+		found = sieve_match_substring_find
+			(sp, vlimit - sp, first->literal, first->literal_size, casemap);
+		if ( found == NULL )
+			return NULL;
+
+		pos = found - first->any;
+		if ( (size_t)(vlimit - pos) < seg->size )
+			return NULL;
+		if ( mcht_matches_segment_match(seg, pos, casemap) )
+			return pos;
+
+		sp = found + 1;
+	}
+	return NULL;
+}
+
+static void mcht_matches_glob_values
+(struct sieve_match_context *mctx, const struct mcht_matches_glob *glob,
+	const char *const *positions, const char *val, size_t val_size)
+{
+	struct sieve_match_values *mvalues;
+	unsigned int i, j, k;
+
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) == NULL )
+		return;
+
+	/* Skip ${0} for now; added below */
+	sieve_match_values_add(mvalues, NULL);
+
+	/* Values in order of the wildcards in the pattern */
+	for ( i = 0; i < glob->segments_count; i++ ) {
+		const struct mcht_matches_segment *seg = &glob->segments[i];
+		const char *vp = positions[i];
+
+		for ( j = 0; j < seg->parts_count; j++ ) {
+			for ( k = 0; k < seg->parts[j].any; k++ )
+				sieve_match_values_add_char(mvalues, *vp++);
+			vp += seg->parts[j].literal_size;
+		}
+
+		if ( i + 1 < glob->segments_count ) {
+			const char *star = positions[i] + seg->size;
+
+			sieve_match_values_add(mvalues,
+				t_str_new_const(star, positions[i+1] - star));
+		}
+	}
+
+	/* Set ${0} */
+	sieve_match_values_set(mvalues, 0, t_str_new_const(val, val_size));
+	sieve_match_values_commit(mctx->runenv, &mvalues);
+}
+
+static int mcht_matches_glob_match
+(struct sieve_match_context *mctx, const struct mcht_matches_glob *glob,
+	const char *val, size_t val_size, bool casemap)
+{
+	const struct mcht_matches_segment *segs = glob->segments;
+	unsigned int i, count = glob->segments_count;
+	const char *vp, *tail, **positions;
+
+	positions = t_new(const char *, count);
+	positions[0] = val;
+
+	if ( count == 1 ) {
+		/* No '*' wildcard: segment must match the value exactly */
+		if ( segs[0].size != val_size ||
+			!mcht_matches_segment_match(&segs[0], val, casemap) )
+			return 0;
+	} else {
+		/* First and last segment are anchored */
+		if ( val_size < segs[0].size + segs[count-1].size )
+			return 0;
+		tail = val + val_size - segs[count-1].size;
+		if ( !mcht_matches_segment_match(&segs[0], val, casemap) ||
+			!mcht_matches_segment_match(&segs[count-1], tail, casemap) )
+			return 0;
+		positions[count-1] = tail;
+
+		/* Place the segments in between as early as possible */
+		vp = val + segs[0].size;
+		for ( i = 1; i < count - 1; i++ ) {
+			if ( (positions[i]=mcht_matches_segment_find
+				(&segs[i], vp, tail, casemap)) == NULL )
+				return 0;
+			vp = positions[i] + segs[i].size;
+		}
+	}
+
+	mcht_matches_glob_values(mctx, glob, positions, val, val_size);
+	return 1;
+}
+
 /*
  * Match-type implementation
  */
 
+struct mcht_matches_context {
+	/* Compiled patterns for the keys seen by this match */
+	HASH_TABLE(const char *, struct mcht_matches_glob *) globs;
+	bool casemap:1;
+	bool compiled:1;
+};
+
+static void mcht_matches_match_init(struct sieve_match_context *mctx)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_matches_context *ctx;
+
+	ctx = p_new(mctx->pool, struct mcht_matches_context, 1);
+
+	/* Compiled patterns are only used for the comparators we can handle
+	   directly; others use the generic implementation below */
+	if ( cmp->def == &i_octet_comparator ||
+		cmp->def == &i_ascii_casemap_comparator ) {
+		ctx->compiled = TRUE;
+		ctx->casemap = ( cmp->def == &i_ascii_casemap_comparator );
+		hash_table_create(&ctx->globs, mctx->pool, 0, str_hash, strcmp);
+	}
+
+	mctx->data = (void *)ctx;
+}
+
+static void mcht_matches_match_deinit(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+
+	if ( hash_table_is_created(ctx->globs) )
+		hash_table_destroy(&ctx->globs);
+}
+
+static int mcht_matches_match_key_generic
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		const char *key, size_t key_size);
+
+static int mcht_matches_match_key
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const char *key, size_t key_size)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	struct mcht_matches_glob *glob;
+
+	if ( !ctx->compiled ) {
+		return mcht_matches_match_key_generic
+			(mctx, val, val_size, key, key_size);
+	}
+
+	/* Compile each key once per match; keys with embedded NUL characters
+	   cannot be used as hash key and are compiled each time */
+	if ( memchr(key, '\0', key_size) != NULL ) {
+		glob = mcht_matches_glob_compile
+			(pool_datastack_create(), key, key_size);
+	} else if ( (glob=hash_table_lookup(ctx->globs, key)) == NULL ) {
+		const char *hkey = p_strndup(mctx->pool, key, key_size);
+
+		glob = mcht_matches_glob_compile(mctx->pool, hkey, key_size);
+		hash_table_insert(ctx->globs, hkey, glob);
+	}
+
+	return mcht_matches_glob_match(mctx, glob, val, val_size, ctx->casemap);
+}
+
+/*
+ * Generic implementation
+ *
+ *   Used for comparators other than i;octet and i;ascii-casemap.
+ */
+
 /* Quick 'n dirty debug */
 //#define MATCH_DEBUG
 #ifdef MATCH_DEBUG
@@ -80,7 +422,7 @@ static char _scan_key_section
 	return '\0';
 }
 
-static int mcht_matches_match_key
+static int mcht_matches_match_key_generic
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
 	const char *key, size_t key_size)
 {
@@ -438,3 +780,375 @@ static int mcht_matches_match_key
 	return 0;
 }
 
+/*
+ * Precompiled key set
+ *
+ *   For a long list of constant keys, the keys are indexed by their literal
+ *   prefix (the part before the first wildcard). Only keys of which the prefix
+ *   matches the start of the value are evaluated, in their original order, so
+ *   that the first matching key still determines the match values.
+ */
+
+struct mcht_matches_key {
+	const char *key;
+	size_t key_size;
+
+	struct mcht_matches_glob *glob;
+};
+
+struct mcht_matches_prefix {
+	ARRAY(unsigned int) keys;
+};
+
+struct mcht_matches_keyset {
+	ARRAY(struct mcht_matches_key) keys;
+	bool casemap:1;
+
+	/* Keys starting with a wildcard */
+	ARRAY(unsigned int) wildcard_keys;
+
+	/* Keys indexed by literal prefix */
+	HASH_TABLE(const char *, struct mcht_matches_prefix *) prefixes;
+	ARRAY(unsigned int) prefix_lengths;
+};
+
+static const char *
+mcht_matches_key_prefix(const char *key, size_t key_size)
+{
+	const char *kp = key, *kend = key + key_size;
+	string_t *prefix = t_str_new(key_size + 1);
+
+	while ( kp < kend && *kp != '*' && *kp != '?' ) {
+		if ( *kp == '\\' ) {
+			if ( ++kp == kend )
+				break;
+		}
+		str_append_c(prefix, *kp);
+		kp++;
+	}
+	return str_c(prefix);
+}
+
+static int mcht_matches_uint_cmp(const unsigned int *i1, const unsigned int *i2)
+{
+	if ( *i1 < *i2 )
+		return -1;
+	return ( *i1 > *i2 ? 1 : 0 );
+}
+
+static void *mcht_matches_keyset_compile
+(pool_t pool, const struct sieve_comparator *cmp,
+	string_t *const *keys, unsigned int count)
+{
+	struct mcht_matches_keyset *kset;
+	unsigned int i;
+
+	kset = p_new(pool, struct mcht_matches_keyset, 1);
+	if ( cmp->def == &i_ascii_casemap_comparator ) {
+		kset->casemap = TRUE;
+		hash_table_create(&kset->prefixes, pool, 0, strcase_hash, strcasecmp);
+	} else if ( cmp->def == &i_octet_comparator ) {
+		hash_table_create(&kset->prefixes, pool, 0, str_hash, strcmp);
+	} else {
+		return NULL;
+	}
+
+	p_array_init(&kset->keys, pool, count);
+	p_array_init(&kset->wildcard_keys, pool, 4);
+	p_array_init(&kset->prefix_lengths, pool, 8);
+
+	for ( i = 0; i < count; i++ ) {
+		struct mcht_matches_key *mkey;
+		struct mcht_matches_prefix *mprefix;
+		const char *prefix;
+		unsigned int len;
+
+		/* Keys with embedded NUL characters cannot be indexed */
+		if ( memchr(str_data(keys[i]), '\0', str_len(keys[i])) != NULL )
+			return NULL;
+
+		mkey = array_append_space(&kset->keys);
+		mkey->key = p_memdup(pool, str_data(keys[i]), str_len(keys[i]));
+		mkey->key_size = str_len(keys[i]);
+		mkey->glob = mcht_matches_glob_compile(pool, mkey->key, mkey->key_size);
+
+		prefix = mcht_matches_key_prefix(mkey->key, mkey->key_size);
+		len = strlen(prefix);
+
+		if ( len == 0 ) {
+			array_append(&kset->wildcard_keys, &i, 1);
+			continue;
+		}
+
+		mprefix = hash_table_lookup(kset->prefixes, prefix);
+		if ( mprefix == NULL ) {
+			const unsigned int *lengths;
+			unsigned int j, lcount;
+
+			mprefix = p_new(pool, struct mcht_matches_prefix, 1);
+			p_array_init(&mprefix->keys, pool, 2);
+			hash_table_insert(kset->prefixes, p_strdup(pool, prefix), mprefix);
+
+			lengths = array_get(&kset->prefix_lengths, &lcount);
+			for ( j = 0; j < lcount && lengths[j] != len; j++ );
+			if ( j == lcount )
+				array_append(&kset->prefix_lengths, &len, 1);
+		}
+		array_append(&mprefix->keys, &i, 1);
+	}
+
+	array_sort(&kset->prefix_lengths, mcht_matches_uint_cmp);
+	return kset;
+}
+
+static int mcht_matches_keyset_match
+(struct sieve_match_context *mctx, void *keyset,
+	const char *val, size_t val_size)
+{
+	struct mcht_matches_keyset *kset = (struct mcht_matches_keyset *)keyset;
+	const struct mcht_matches_key *keys = array_idx(&kset->keys, 0);
+	int match = 0;
+
+	T_BEGIN {
+		ARRAY(unsigned int) candidates;
+		const unsigned int *lengths, *cands;
+		unsigned int i, lcount, ccount;
+
+		t_array_init(&candidates, 16);
+		array_append_array(&candidates, &kset->wildcard_keys);
+
+		/* Collect keys of which the prefix matches the start of the value */
+		lengths = array_get(&kset->prefix_lengths, &lcount);
+		for ( i = 0; i < lcount && lengths[i] <= val_size; i++ ) {
+			struct mcht_matches_prefix *mprefix;
+
+			mprefix = hash_table_lookup
+				(kset->prefixes, t_strndup(val, lengths[i]));
+			if ( mprefix != NULL )
+				array_append_array(&candidates, &mprefix->keys);
+		}
+
+		/* Evaluate candidates in original key order */
+		array_sort(&candidates, mcht_matches_uint_cmp);
+		cands = array_get(&candidates, &ccount);
+		for ( i = 0; i < ccount && match == 0; i++ ) {
+			match = mcht_matches_glob_match
+				(mctx, keys[cands[i]].glob, val, val_size, kset->casemap);
+		}
+	} T_END;
+
+	return match;
+}
+
+/*
+ * Streaming match
+ *
+ *   The segments of each pattern are placed while the value is streamed,
+ *   exactly as mcht_matches_glob_match() places them: the first segment at the
+ *   start and each following one at its leftmost position after the previous.
+ *   Only the data in which the next segment can still start is retained, plus
+ *   the tail of the value for the final (end-anchored) segment. Placing a
+ *   middle segment beyond the start of the final segment makes the match fail
+ *   at the end, just like the search limit does for complete values.
+ */
+
+struct mcht_matches_stream_key {
+	const struct mcht_matches_glob *glob;
+
+	/* Next segment to place */
+	unsigned int segment;
+
+	/* Value data from the current search position onwards */
+	buffer_t *window;
+	uoff_t window_offset;
+
+	/* Last bytes of the value (for the final segment) */
+	buffer_t *tail;
+
+	bool failed:1;
+};
+
+struct mcht_matches_stream {
+	ARRAY(struct mcht_matches_stream_key) keys;
+	uoff_t value_size;
+
+	bool casemap:1;
+};
+
+static bool mcht_matches_stream_init
+(struct sieve_match_context *mctx, string_t *const *keys, unsigned int count)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_matches_stream *stream;
+	unsigned int i;
+
+	if ( cmp->def != &i_octet_comparator &&
+		cmp->def != &i_ascii_casemap_comparator )
+		return FALSE;
+
+	stream = p_new(mctx->pool, struct mcht_matches_stream, 1);
+	stream->casemap = ( cmp->def == &i_ascii_casemap_comparator );
+	p_array_init(&stream->keys, mctx->pool, count);
+
+	for ( i = 0; i < count; i++ ) {
+		struct mcht_matches_stream_key *skey;
+
+		skey = array_append_space(&stream->keys);
+		skey->glob = mcht_matches_glob_compile
+			(mctx->pool, str_c(keys[i]), str_len(keys[i]));
+		skey->window = buffer_create_dynamic(mctx->pool, 256);
+		skey->tail = buffer_create_dynamic(mctx->pool,
+			skey->glob->segments[skey->glob->segments_count-1].size + 1);
+	}
+
+	mctx->stream_data = (void *)stream;
+	return TRUE;
+}
+
+static void mcht_matches_stream_value_begin
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_stream *stream =
+		(struct mcht_matches_stream *)mctx->stream_data;
+	struct mcht_matches_stream_key *skey;
+
+	stream->value_size = 0;
+	array_foreach_modifiable(&stream->keys, skey) {
+		skey->segment = 0;
+		skey->window_offset = 0;
+		skey->failed = FALSE;
+		buffer_set_used_size(skey->window, 0);
+		buffer_set_used_size(skey->tail, 0);
+	}
+}
+
+static void mcht_matches_stream_window_skip
+(struct mcht_matches_stream_key *skey, size_t size)
+{
+	buffer_delete(skey->window, 0, size);
+	skey->window_offset += size;
+}
+
+static void mcht_matches_stream_key_more
+(struct mcht_matches_stream *stream, struct mcht_matches_stream_key *skey,
+	const char *data, size_t size)
+{
+	const struct mcht_matches_glob *glob = skey->glob;
+	const struct mcht_matches_segment *seg;
+	size_t tail_size = glob->segments[glob->segments_count-1].size;
+	const char *win, *pos;
+
+	if ( glob->segments_count == 1 ) {
+		/* No '*' wildcard: the value must not exceed the segment */
+		if ( skey->window->used + size > tail_size )
+			skey->failed = TRUE;
+		else
+			buffer_append(skey->window, data, size);
+		return;
+	}
+
+	/* Retain the tail of the value */
+	if ( size >= tail_size ) {
+		buffer_set_used_size(skey->tail, 0);
+		buffer_append(skey->tail, data + size - tail_size, tail_size);
+	} else {
+		buffer_append(skey->tail, data, size);
+		if ( skey->tail->used > tail_size )
+			buffer_delete(skey->tail, 0, skey->tail->used - tail_size);
+	}
+
+	if ( skey->segment == glob->segments_count - 1 )
+		return;
+	buffer_append(skey->window, data, size);
+
+	/* First segment is anchored at the start of the value */
+	if ( skey->segment == 0 ) {
+		seg = &glob->segments[0];
+		if ( skey->window->used < seg->size )
+			return;
+
+		win = skey->window->data;
+		if ( !mcht_matches_segment_match(seg, win, stream->casemap) ) {
+			skey->failed = TRUE;
+			return;
+		}
+		mcht_matches_stream_window_skip(skey, seg->size);
+		skey->segment++;
+	}
+
+	/* Place the segments in between as early as possible */
+	while ( skey->segment < glob->segments_count - 1 ) {
+		seg = &glob->segments[skey->segment];
+		win = skey->window->data;
+
+		pos = mcht_matches_segment_find
+			(seg, win, win + skey->window->used, stream->casemap);
+		if ( pos == NULL ) {
+			/* Keep only what the segment can still start in */
+			if ( seg->size > 0 && skey->window->used >= seg->size ) {
+				mcht_matches_stream_window_skip
+					(skey, skey->window->used - (seg->size - 1));
+			}
+			return;
+		}
+
+		mcht_matches_stream_window_skip(skey, (pos - win) + seg->size);
+		skey->segment++;
+	}
+
+	/* All segments placed, except the last one */
+	buffer_set_used_size(skey->window, 0);
+}
+
+static int mcht_matches_stream_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	struct mcht_matches_stream *stream =
+		(struct mcht_matches_stream *)mctx->stream_data;
+	struct mcht_matches_stream_key *skey;
+
+	array_foreach_modifiable(&stream->keys, skey) {
+		if ( !skey->failed )
+			mcht_matches_stream_key_more(stream, skey, data, size);
+	}
+	stream->value_size += size;
+
+	/* The match is only known once the end of the value is seen */
+	return 0;
+}
+
+static int mcht_matches_stream_value_end
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_stream *stream =
+		(struct mcht_matches_stream *)mctx->stream_data;
+	struct mcht_matches_stream_key *skey;
+
+	array_foreach_modifiable(&stream->keys, skey) {
+		const struct mcht_matches_glob *glob = skey->glob;
+		const struct mcht_matches_segment *last =
+			&glob->segments[glob->segments_count-1];
+
+		/* Place any remaining empty segments (e.g. for an empty value) */
+		if ( !skey->failed )
+			mcht_matches_stream_key_more(stream, skey, "", 0);
+		if ( skey->failed )
+			continue;
+
+		if ( glob->segments_count == 1 ) {
+			if ( skey->window->used == last->size &&
+				mcht_matches_segment_match
+					(last, skey->window->data, stream->casemap) )
+				return 1;
+			continue;
+		}
+
+		/* The final segment must start after the last placed segment */
+		if ( skey->segment == glob->segments_count - 1 &&
+			stream->value_size >= skey->window_offset + last->size &&
+			mcht_matches_segment_match
+				(last, skey->tail->data, stream->casemap) )
+			return 1;
+	}
+	return 0;
+}
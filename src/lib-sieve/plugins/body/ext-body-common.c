@@ -76,6 +76,31 @@ int ext_body_get_part_list
 	return SIEVE_EXEC_OK;
 }
 
+/*
+ * Streaming body part match
+ */
+
+int ext_body_match_parts
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const char * const *content_types, struct sieve_match_context *mctx)
+{
+	static const char * const _no_content_types[] = { "", NULL };
+
+	if ( content_types == NULL ) content_types = _no_content_types;
+
+	switch ( transform ) {
+	case TST_BODY_TRANSFORM_RAW:
+		return sieve_message_body_match_raw(renv, mctx);
+	case TST_BODY_TRANSFORM_CONTENT:
+		return sieve_message_body_match_content(renv, content_types, mctx);
+	case TST_BODY_TRANSFORM_TEXT:
+		return sieve_message_body_match_text(renv, mctx);
+	default:
+		break;
+	}
+	i_unreached();
+}
+
 static int ext_body_stringlist_next_item
 (struct sieve_stringlist *_strlist, string_t **str_r)
 {
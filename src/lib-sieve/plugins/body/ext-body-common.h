@@ -39,5 +39,8 @@ extern const struct sieve_operation_def body_operation;
 int ext_body_get_part_list
 	(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
 		const char * const *content_types, struct sieve_stringlist **strlist_r);
+int ext_body_match_parts
+	(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+		const char * const *content_types, struct sieve_match_context *mctx);
 
 #endif /* __EXT_BODY_COMMON_H */
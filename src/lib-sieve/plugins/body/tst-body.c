@@ -303,6 +303,7 @@ static int ext_body_operation_execute
 		SIEVE_MATCH_TYPE_DEFAULT(is_match_type);
 	unsigned int transform = TST_BODY_TRANSFORM_TEXT;
 	struct sieve_stringlist *ctype_list, *value_list, *key_list;
+	struct sieve_match_context *mctx;
 	bool mvalues_active;
 	const char * const *content_types = NULL;
 	int match, ret;
@@ -362,16 +363,28 @@ static int ext_body_operation_execute
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "body test");
 
-	/* Extract requested parts */
-	if ( (ret=ext_body_get_part_list(renv,
-		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
-		return ret;
-
 	/* Disable match values processing as required by RFC */
 	mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
 
-	/* Perform match */
-	match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+	if ( (mctx=sieve_match_stream_begin
+		(renv, &mcht, &cmp, key_list, &ret)) != NULL ) {
+		/* Match the requested parts while they are decoded */
+		ret = ext_body_match_parts(renv,
+			(enum tst_body_transform) transform, content_types, mctx);
+		match = sieve_match_end(&mctx, NULL);
+		if ( ret <= 0 )
+			match = -1;
+	} else if ( ret <= 0 ) {
+		/* Failed to read key list */
+		match = -1;
+	} else if ( (ret=ext_body_get_part_list(renv,
+		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 ) {
+		/* Failed to extract requested parts */
+		match = -1;
+	} else {
+		/* Perform match */
+		match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+	}
 
 	/* Restore match values processing */
 	(void)sieve_match_values_set_enabled(renv, mvalues_active);
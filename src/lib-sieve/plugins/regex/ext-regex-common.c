@@ -1,7 +1,16 @@
 /* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
  */
 
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "llist.h"
+#include "hash.h"
+
 #include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-extensions.h"
 #include "sieve-match-types.h"
 
 #include "ext-regex-common.h"
@@ -20,3 +29,223 @@ const struct sieve_operand_def regex_match_type_operand = {
 	.interface = &ext_match_types
 };
 
+/*
+ * Regular expressions
+ */
+
+/* Wrapper around the regerror function for easy access */
+const char *ext_regex_error(regex_t *regexp, int errorcode)
+{
+	size_t errsize = regerror(errorcode, regexp, NULL, 0);
+
+	if ( errsize > 0 ) {
+		char *errbuf;
+
+		buffer_t *error_buf =
+			buffer_create_dynamic(pool_datastack_create(), errsize);
+		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
+
+		errsize = regerror(errorcode, regexp, errbuf, errsize);
+
+		/* We don't want the error to start with a capital letter */
+		errbuf[0] = i_tolower(errbuf[0]);
+
+		buffer_append_space_unsafe(error_buf, errsize);
+
+		return str_c(error_buf);
+	}
+
+	return "";
+}
+
+/*
+ * Extension context
+ */
+
+struct ext_regex_cache_entry {
+	struct ext_regex_cache_entry *prev, *next;
+	int refcount;
+
+	char *key;
+	regex_t regexp;
+
+	bool cached:1;
+};
+
+struct ext_regex_context {
+	HASH_TABLE(const char *, struct ext_regex_cache_entry *) cache;
+	/* LRU list; most recently used entry at the head */
+	struct ext_regex_cache_entry *head, *tail;
+
+	unsigned int max_count, count;
+	struct ext_regex_cache_stats stats;
+};
+
+static void ext_regex_cache_entry_free(struct ext_regex_cache_entry *entry)
+{
+	regfree(&entry->regexp);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static void
+ext_regex_cache_remove(struct ext_regex_context *extctx,
+	struct ext_regex_cache_entry *entry)
+{
+	struct ext_regex_cache_entry *unref_entry = entry;
+
+	i_assert( entry->cached );
+
+	hash_table_remove(extctx->cache, entry->key);
+	DLLIST2_REMOVE(&extctx->head, &extctx->tail, entry);
+	extctx->count--;
+
+	entry->cached = FALSE;
+	ext_regex_cache_entry_unref(&unref_entry);
+}
+
+bool ext_regex_load
+(const struct sieve_extension *ext, void **context)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_regex_context *extctx;
+	unsigned long long int cache_size;
+
+	if ( *context != NULL )
+		ext_regex_unload(ext);
+
+	if ( !sieve_setting_get_uint_value
+		(svinst, "sieve_regex_cache_size", &cache_size) )
+		cache_size = EXT_REGEX_DEFAULT_CACHE_SIZE;
+
+	extctx = i_new(struct ext_regex_context, 1);
+	extctx->max_count = (unsigned int)cache_size;
+	hash_table_create(&extctx->cache, default_pool, 0, str_hash, strcmp);
+
+	*context = (void *)extctx;
+	return TRUE;
+}
+
+void ext_regex_unload(const struct sieve_extension *ext)
+{
+	struct ext_regex_context *extctx =
+		(struct ext_regex_context *)ext->context;
+
+	if ( extctx == NULL )
+		return;
+
+	if ( ext->svinst->debug && extctx->stats.compiled > 0 ) {
+		sieve_sys_debug(ext->svinst, "regex extension: "
+			"compiled %u expressions, reused %u times, %u evictions",
+			extctx->stats.compiled, extctx->stats.reused,
+			extctx->stats.evictions);
+	}
+
+	while ( extctx->head != NULL )
+		ext_regex_cache_remove(extctx, extctx->head);
+
+	hash_table_destroy(&extctx->cache);
+	i_free(extctx);
+}
+
+/*
+ * Cache of compiled regular expressions
+ */
+
+int ext_regex_cache_compile
+(const struct sieve_extension *ext, const char *pattern, int cflags,
+	struct ext_regex_cache_entry **entry_r, const char **error_r)
+{
+	struct ext_regex_context *extctx =
+		(struct ext_regex_context *)ext->context;
+	struct ext_regex_cache_entry *entry;
+	const char *key;
+	int ret;
+
+	*entry_r = NULL;
+	*error_r = NULL;
+
+	key = t_strdup_printf("%x:%s", cflags, pattern);
+	if ( extctx != NULL && extctx->max_count > 0 ) {
+		entry = hash_table_lookup(extctx->cache, key);
+		if ( entry != NULL ) {
+			DLLIST2_REMOVE(&extctx->head, &extctx->tail, entry);
+			DLLIST2_PREPEND(&extctx->head, &extctx->tail, entry);
+			extctx->stats.reused++;
+
+			entry->refcount++;
+			*entry_r = entry;
+			return 1;
+		}
+	}
+
+	entry = i_new(struct ext_regex_cache_entry, 1);
+	entry->refcount = 1;
+	if ( (ret=regcomp(&entry->regexp, pattern, cflags)) != 0 ) {
+		*error_r = ext_regex_error(&entry->regexp, ret);
+		regfree(&entry->regexp);
+		i_free(entry);
+		return -1;
+	}
+	entry->key = i_strdup(key);
+
+	if ( extctx == NULL ) {
+		*entry_r = entry;
+		return 1;
+	}
+
+	extctx->stats.compiled++;
+	if ( extctx->max_count == 0 ) {
+		*entry_r = entry;
+		return 1;
+	}
+
+	/* Make room */
+	while ( extctx->tail != NULL && extctx->count >= extctx->max_count ) {
+		extctx->stats.evictions++;
+		ext_regex_cache_remove(extctx, extctx->tail);
+	}
+
+	/* The cache holds its own reference */
+	entry->refcount++;
+	entry->cached = TRUE;
+	hash_table_insert(extctx->cache, entry->key, entry);
+	DLLIST2_PREPEND(&extctx->head, &extctx->tail, entry);
+	extctx->count++;
+
+	*entry_r = entry;
+	return 1;
+}
+
+const regex_t *
+ext_regex_cache_entry_get_regexp(struct ext_regex_cache_entry *entry)
+{
+	return &entry->regexp;
+}
+
+void ext_regex_cache_entry_unref(struct ext_regex_cache_entry **_entry)
+{
+	struct ext_regex_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	i_assert( entry->refcount > 0 );
+	if ( --entry->refcount > 0 )
+		return;
+
+	i_assert( !entry->cached );
+	ext_regex_cache_entry_free(entry);
+}
+
+void ext_regex_cache_get_stats
+(const struct sieve_extension *ext, struct ext_regex_cache_stats *stats_r)
+{
+	struct ext_regex_context *extctx =
+		(struct ext_regex_context *)ext->context;
+
+	if ( extctx == NULL ) {
+		i_zero(stats_r);
+		return;
+	}
+	*stats_r = extctx->stats;
+}
@@ -4,12 +4,28 @@
 #ifndef __EXT_REGEX_COMMON_H
 #define __EXT_REGEX_COMMON_H
 
+#include <sys/types.h>
+#include <regex.h>
+
 /*
  * Extension
  */
 
+#define EXT_REGEX_DEFAULT_CACHE_SIZE 128
+
+struct ext_regex_cache_stats {
+	/* Number of regcomp() calls for cacheable expressions */
+	unsigned int compiled;
+	/* Number of times a compiled expression was reused */
+	unsigned int reused;
+	unsigned int evictions;
+};
+
 extern const struct sieve_extension_def regex_extension;
 
+bool ext_regex_load(const struct sieve_extension *ext, void **context);
+void ext_regex_unload(const struct sieve_extension *ext);
+
 /*
  * Operand
  */
@@ -22,6 +38,31 @@ extern const struct sieve_operand_def regex_match_type_operand;
 
 extern const struct sieve_match_type_def regex_match_type;
 
+/*
+ * Regular expressions
+ */
+
+const char *ext_regex_error(regex_t *regexp, int errorcode);
+
+/*
+ * Cache of compiled regular expressions
+ *
+ *   Only used for constant keys. Entries are reference counted, so that they
+ *   remain valid while a match context uses them, even if evicted meanwhile.
+ */
+
+struct ext_regex_cache_entry;
+
+int ext_regex_cache_compile
+	(const struct sieve_extension *ext, const char *pattern, int cflags,
+		struct ext_regex_cache_entry **entry_r, const char **error_r);
+const regex_t *
+ext_regex_cache_entry_get_regexp(struct ext_regex_cache_entry *entry);
+void ext_regex_cache_entry_unref(struct ext_regex_cache_entry **_entry);
+
+void ext_regex_cache_get_stats
+	(const struct sieve_extension *ext, struct ext_regex_cache_stats *stats_r);
+
 #endif /* __EXT_REGEX_COMMON_H */
 
 
@@ -15,6 +15,7 @@
 #include "sieve-limits.h"
 #include "sieve-ast.h"
 #include "sieve-stringlist.h"
+#include "sieve-code.h"
 #include "sieve-commands.h"
 #include "sieve-validator.h"
 #include "sieve-interpreter.h"
@@ -24,8 +25,6 @@
 
 #include "ext-regex-common.h"
 
-#include <sys/types.h>
-#include <regex.h>
 #include <ctype.h>
 
 /*
@@ -60,31 +59,6 @@ const struct sieve_match_type_def regex_match_type = {
  * Match type validation
  */
 
-/* Wrapper around the regerror function for easy access */
-static const char *_regexp_error(regex_t *regexp, int errorcode)
-{
-	size_t errsize = regerror(errorcode, regexp, NULL, 0);
-
-	if ( errsize > 0 ) {
-		char *errbuf;
-
-		buffer_t *error_buf =
-			buffer_create_dynamic(pool_datastack_create(), errsize);
-		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
-
-		errsize = regerror(errorcode, regexp, errbuf, errsize);
-
-		/* We don't want the error to start with a capital letter */
-		errbuf[0] = i_tolower(errbuf[0]);
-
-		buffer_append_space_unsafe(error_buf, errsize);
-
-		return str_c(error_buf);
-	}
-
-	return "";
-}
-
 static int mcht_regex_validate_regexp
 (struct sieve_validator *valdtr,
 	struct sieve_match_type_context *mtctx ATTR_UNUSED,
@@ -97,7 +71,7 @@ static int mcht_regex_validate_regexp
 	if ( (ret=regcomp(&regexp, regex_str, cflags)) != 0 ) {
 		sieve_argument_validate_error(valdtr, key,
 			"invalid regular expression '%s' for regex match: %s",
-			str_sanitize(regex_str, 128), _regexp_error(&regexp, ret));
+			str_sanitize(regex_str, 128), ext_regex_error(&regexp, ret));
 
 		regfree(&regexp);
 		return -1;
@@ -170,7 +144,12 @@ static bool mcht_regex_validate_context
  */
 
 struct mcht_regex_key {
+	/* Compiled for this match only */
 	regex_t regexp;
+	/* Shared through the extension's cache (constant keys) */
+	struct ext_regex_cache_entry *cache_entry;
+
+	const regex_t *compiled;
 	int status;
 };
 
@@ -179,6 +158,7 @@ struct mcht_regex_context {
 	regmatch_t *pmatch;
 	size_t nmatch;
 	bool all_compiled:1;
+	bool constant_keys:1;
 };
 
 static void mcht_regex_match_init
@@ -212,6 +192,12 @@ static int mcht_regex_match_key
 
 	/* Execute regex */
 
+	if ( !sieve_runtime_resource_charge
+		(mctx->runenv, SIEVE_RESOURCE_REGEX_EXECUTIONS, 1) ) {
+		mctx->exec_status = SIEVE_EXEC_FAILURE;
+		return -1;
+	}
+
 	ret = regexec(regexp, val, ctx->nmatch, ctx->pmatch, 0);
 
 	/* Handle match values if necessary */
@@ -262,6 +248,7 @@ static int mcht_regex_match_keys
 	const struct sieve_runtime_env *renv = mctx->runenv;
 	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
+	const struct sieve_extension *this_ext = mctx->match_type->object.ext;
 	const struct sieve_comparator *cmp = mctx->comparator;
 	int match;
 
@@ -272,9 +259,13 @@ static int mcht_regex_match_keys
 
 		/* Regular expressions still need to be compiled */
 
-		if ( !array_is_created(&ctx->reg_expressions) )
+		if ( !array_is_created(&ctx->reg_expressions) ) {
 			p_array_init(&ctx->reg_expressions, mctx->pool, 16);
 
+			/* Only constant keys are cached beyond this match */
+			ctx->constant_keys = sieve_code_stringlist_is_constant(key_list);
+		}
+
 		i = 0;
 		match = 0;
 		while ( match == 0 &&
@@ -298,28 +289,42 @@ static int mcht_regex_match_keys
 
 					if ( rkey->status >= 0 ) {
 						const char *regex_str = str_c(key_item);
+						const char *error = NULL;
 						int rxret;
 
 						/* Indicate whether match values need to be produced */
 						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
 
 						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
+						if ( ctx->constant_keys ) {
+							if ( ext_regex_cache_compile(this_ext, regex_str, cflags,
+								&rkey->cache_entry, &error) > 0 ) {
+								rkey->compiled =
+									ext_regex_cache_entry_get_regexp(rkey->cache_entry);
+							}
+						} else if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags))
+							!= 0 ) {
+							error = ext_regex_error(&rkey->regexp, rxret);
+							regfree(&rkey->regexp);
+						} else {
+							rkey->compiled = &rkey->regexp;
+						}
+
+						if ( rkey->compiled == NULL ) {
 							sieve_runtime_error(renv, NULL,
 								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
+								str_sanitize(regex_str, 128), error);
 							rkey->status = -1;
 						} else {
 							rkey->status = 1;
 						}
 					}
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					rkey = array_idx_modifiable(&ctx->reg_expressions, i);
 				}
 
 				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+					match = mcht_regex_match_key(mctx, val, rkey->compiled);
 
 					if ( trace ) {
 						sieve_runtime_trace(renv, 0,
@@ -352,7 +357,7 @@ static int mcht_regex_match_keys
 		match = 0;
 		while ( match == 0 && i < count ) {
 			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+				match = mcht_regex_match_key(mctx, val, rkeys[i].compiled);
 
 				if ( trace ) {
 					sieve_runtime_trace(renv, 0,
@@ -378,7 +383,10 @@ void mcht_regex_match_deinit
 	if ( array_is_created(&ctx->reg_expressions) ) {
 		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
 		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
+			if ( rkeys[i].cache_entry != NULL )
+				ext_regex_cache_entry_unref(&rkeys[i].cache_entry);
+			else if ( rkeys[i].status > 0 )
+				regfree(&rkeys[i].regexp);
 		}
 	}
 }
@@ -9,6 +9,8 @@
 #include "sieve-settings.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
+#include "sieve-binary.h"
+#include "sieve-generator.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
 #include "sieve-runtime-trace.h"
@@ -448,6 +450,23 @@ static const char *ext_spamvirustest_get_score
 	return t_strdup_printf("%d", score);
 }
 
+void ext_spamvirustest_generate_wanted_headers
+(const struct sieve_codegen_env *cgenv, const struct sieve_extension *ext)
+{
+	struct ext_spamvirustest_data *ext_data =
+		(struct ext_spamvirustest_data *) ext->context;
+
+	if ( ext_data == NULL )
+		return;
+
+	sieve_binary_add_wanted_header
+		(cgenv->sbin, ext_data->status_header.header_name);
+	if ( ext_data->max_header.header_name != NULL ) {
+		sieve_binary_add_wanted_header
+			(cgenv->sbin, ext_data->max_header.header_name);
+	}
+}
+
 int ext_spamvirustest_get_value
 (const struct sieve_runtime_env *renv, const struct sieve_extension *ext,
 	 bool percent, const char **value_r)
@@ -24,6 +24,9 @@ void ext_spamvirustest_unload(const struct sieve_extension *ext);
 extern const struct sieve_command_def spamtest_test;
 extern const struct sieve_command_def virustest_test;
 
+void ext_spamvirustest_generate_wanted_headers
+(const struct sieve_codegen_env *cgenv, const struct sieve_extension *ext);
+
 int ext_spamvirustest_get_value
 (const struct sieve_runtime_env *renv, const struct sieve_extension *ext,
 	 bool percent, const char **value_r);
@@ -191,6 +191,9 @@ static bool tst_spamvirustest_generate
 	else
 		i_unreached();
 
+	/* Record configured status headers for prefetching */
+	ext_spamvirustest_generate_wanted_headers(cgenv, tst->ext);
+
 	/* Generate arguments */
 	return sieve_generate_arguments(cgenv, tst, NULL);
 }
@@ -26,6 +26,7 @@
 #include "sieve-result.h"
 #include "sieve-actions.h"
 #include "sieve-message.h"
+#include "sieve-mailbox-cache.h"
 #include "sieve-smtp.h"
 
 #include <ctype.h>
@@ -182,6 +183,8 @@ int sieve_action_opr_optional_read
 static bool act_store_equals
 	(const struct sieve_script_env *senv,
 		const struct sieve_action *act1, const struct sieve_action *act2);
+static const char *act_store_get_identity
+	(const struct sieve_script_env *senv, const struct sieve_action *act);
 
 static int act_store_check_duplicate
 	(const struct sieve_runtime_env *renv,
@@ -212,6 +215,7 @@ const struct sieve_action_def act_store = {
 		SIEVE_ACTFLAG_TRIES_DELIVER | 
 		SIEVE_ACTFLAG_MAIL_STORAGE,
 	.equals = act_store_equals,
+	.get_identity = act_store_get_identity,
 	.check_duplicate = act_store_check_duplicate,
 	.print = act_store_print,
 	.start = act_store_start,
@@ -317,6 +321,16 @@ static bool act_store_equals
 
 }
 
+static const char *act_store_get_identity
+(const struct sieve_script_env *senv, const struct sieve_action *act)
+{
+	struct act_store_context *st_ctx =
+		(struct act_store_context *) act->context;
+
+	return ( st_ctx == NULL ?
+		SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) : st_ctx->mailbox );
+}
+
 /* Result verification */
 
 static int act_store_check_duplicate
@@ -360,13 +374,16 @@ void sieve_act_store_get_storage_error
 
 static bool act_store_mailbox_open
 (const struct sieve_action_exec_env *aenv, const char *mailbox,
-	struct mailbox **box_r, enum mail_error *error_code_r, const char **error_r)
+	struct mailbox **box_r, bool *cached_r, enum mail_error *error_code_r,
+	const char **error_r)
 {
+	const struct sieve_script_env *senv = aenv->scriptenv;
 	struct mailbox *box;
 	struct mail_storage **storage = &(aenv->exec_status->last_storage);
 	enum mailbox_flags flags = 0;
 
 	*box_r = NULL;
+	*cached_r = FALSE;
 	*error_code_r = MAIL_ERROR_NONE;
 	*error_r = NULL;
 
@@ -379,20 +396,50 @@ static bool act_store_mailbox_open
 		return FALSE;
 	}
 
-	if (aenv->scriptenv->mailbox_autocreate)
+	if (senv->mailbox_autocreate)
 		flags |= MAILBOX_FLAG_AUTO_CREATE;
-	if (aenv->scriptenv->mailbox_autosubscribe)
+	if (senv->mailbox_autosubscribe)
 		flags |= MAILBOX_FLAG_AUTO_SUBSCRIBE;
-	*box_r = box = mailbox_alloc_delivery(
-		aenv->scriptenv->user, mailbox, flags);
+
+	/* Reuse the mailbox opened for an earlier message */
+	if ( senv->mailbox_cache != NULL &&
+		(box=sieve_mailbox_cache_get(senv->mailbox_cache,
+			senv->user, mailbox, flags)) != NULL ) {
+		*box_r = box;
+		*cached_r = TRUE;
+		*storage = mailbox_get_storage(box);
+		return TRUE;
+	}
+
+	*box_r = box = mailbox_alloc_delivery(senv->user, mailbox, flags);
 	*storage = mailbox_get_storage(box);
 
-	if (mailbox_open(box) == 0)
+	if (mailbox_open(box) == 0) {
+		if ( senv->mailbox_cache != NULL ) {
+			*cached_r = sieve_mailbox_cache_add
+				(senv->mailbox_cache, senv->user, mailbox, flags, box);
+		}
 		return TRUE;
+	}
 	*error_r = mailbox_get_last_error(box, error_code_r);
 	return FALSE;
 }
 
+static void act_store_mailbox_close
+(const struct sieve_action_exec_env *aenv,
+	struct act_store_transaction *trans)
+{
+	if ( trans->box == NULL )
+		return;
+
+	if ( trans->cached ) {
+		sieve_mailbox_cache_release
+			(aenv->scriptenv->mailbox_cache, &trans->box);
+	} else {
+		mailbox_free(&trans->box);
+	}
+}
+
 static int act_store_start
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void **tr_context)
@@ -404,7 +451,7 @@ static int act_store_start
 	pool_t pool = sieve_result_pool(aenv->result);
 	const char *error = NULL;
 	enum mail_error error_code = MAIL_ERROR_NONE;
-	bool disabled = FALSE, open_failed = FALSE;
+	bool disabled = FALSE, open_failed = FALSE, cached = FALSE;
 
 	/* If context is NULL, the store action is the result of (implicit) keep */
 	if ( ctx == NULL ) {
@@ -419,7 +466,7 @@ static int act_store_start
 	 */
 	if ( senv->user != NULL ) {
 		if ( !act_store_mailbox_open
-			(aenv, ctx->mailbox, &box, &error_code, &error) ) {
+			(aenv, ctx->mailbox, &box, &cached, &error_code, &error) ) {
 			open_failed = TRUE;
 		}
 	} else {
@@ -431,6 +478,7 @@ static int act_store_start
 
 	trans->context = ctx;
 	trans->box = box;
+	trans->cached = cached;
 	trans->flags = 0;
 
 	trans->disabled = disabled;
@@ -479,6 +527,41 @@ static struct mail_keywords *act_store_keywords_create
 	return box_keywords;
 }
 
+static int act_store_save
+(const struct sieve_action_exec_env *aenv,
+	struct act_store_transaction *trans, struct mail *mail,
+	struct mailbox_transaction_context *mail_trans)
+{
+	struct mail_save_context *save_ctx;
+	struct mail_keywords *keywords = NULL;
+	int status = SIEVE_EXEC_OK;
+
+	/* Store the message */
+	save_ctx = mailbox_save_alloc(mail_trans);
+
+	/* Apply keywords and flags that side-effects may have added */
+	if ( trans->flags_altered ) {
+		keywords = act_store_keywords_create(aenv, &trans->keywords, trans->box);
+
+		mailbox_save_set_flags(save_ctx, trans->flags, keywords);
+	} else {
+		mailbox_save_copy_flags(save_ctx, mail);
+	}
+
+	if ( mailbox_save_using_mail(&save_ctx, mail) < 0 ) {
+		sieve_act_store_get_storage_error(aenv, trans);
+		status = ( trans->error_code == MAIL_ERROR_TEMP ?
+			SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE );
+	}
+
+	/* Deallocate keywords */
+ 	if ( keywords != NULL ) {
+ 		mailbox_keywords_unref(&keywords);
+ 	}
+
+	return status;
+}
+
 static int act_store_execute
 (const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void *tr_context)
@@ -487,10 +570,8 @@ static int act_store_execute
 		(struct act_store_transaction *) tr_context;
 	struct mail *mail =	( action->mail != NULL ?
 		action->mail : aenv->msgdata->mail );
-	struct mail_save_context *save_ctx;
 	struct mail_keywords *keywords = NULL;
 	bool backends_equal = FALSE;
-	int status = SIEVE_EXEC_OK;
 
 	/* Verify transaction */
 	if ( trans == NULL ) return SIEVE_EXEC_FAILURE;
@@ -567,34 +648,18 @@ static int act_store_execute
 	 */
 	aenv->exec_status->last_storage = mailbox_get_storage(trans->box);
 
+	/* A cached mailbox has a transaction that is shared with the executions
+	 * for other messages, from which a single message cannot be rolled back.
+	 * The message is therefore only saved once the result is committed.
+	 */
+	if ( trans->cached )
+		return SIEVE_EXEC_OK;
+
 	/* Start mail transaction */
 	trans->mail_trans = mailbox_transaction_begin
 		(trans->box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
 
-	/* Store the message */
-	save_ctx = mailbox_save_alloc(trans->mail_trans);
-
-	/* Apply keywords and flags that side-effects may have added */
-	if ( trans->flags_altered ) {
-		keywords = act_store_keywords_create(aenv, &trans->keywords, trans->box);
-
-		mailbox_save_set_flags(save_ctx, trans->flags, keywords);
-	} else {
-		mailbox_save_copy_flags(save_ctx, mail);
-	}
-
-	if ( mailbox_save_using_mail(&save_ctx, mail) < 0 ) {
-		sieve_act_store_get_storage_error(aenv, trans);
-		status = ( trans->error_code == MAIL_ERROR_TEMP ?
-			SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE );
-	}
-
-	/* Deallocate keywords */
- 	if ( keywords != NULL ) {
- 		mailbox_keywords_unref(&keywords);
- 	}
-
-	return status;
+	return act_store_save(aenv, trans, mail, trans->mail_trans);
 }
 
 static void act_store_log_status
@@ -668,11 +733,12 @@ static void act_store_log_status
 }
 
 static int act_store_commit
-(const struct sieve_action *action ATTR_UNUSED,
+(const struct sieve_action *action,
 	const struct sieve_action_exec_env *aenv, void *tr_context, bool *keep)
 {
 	struct act_store_transaction *trans =
 		(struct act_store_transaction *) tr_context;
+	struct sieve_mailbox_cache *mbcache = aenv->scriptenv->mailbox_cache;
 	bool status = TRUE;
 
 	/* Verify transaction */
@@ -682,15 +748,13 @@ static int act_store_commit
 	if ( trans->disabled ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		*keep = FALSE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans);
 		return SIEVE_EXEC_OK;
 	} else if ( trans->redundant ) {
 		act_store_log_status(trans, aenv, FALSE, status);
 		aenv->exec_status->keep_original = TRUE;
 		aenv->exec_status->message_saved = TRUE;
-		if ( trans->box != NULL )
-			mailbox_free(&trans->box);
+		act_store_mailbox_close(aenv, trans);
 		return SIEVE_EXEC_OK;
 	}
 
@@ -699,8 +763,25 @@ static int act_store_commit
 	 */
 	aenv->exec_status->last_storage = mailbox_get_storage(trans->box);
 
-	/* Commit mailbox transaction */
-	status = ( mailbox_transaction_commit(&trans->mail_trans) == 0 );
+	if ( trans->cached ) {
+		struct mail *mail = ( action->mail != NULL ?
+			action->mail : aenv->msgdata->mail );
+
+		/* Save the message in the shared transaction, which is committed along
+		 * with those of other messages later on.
+		 */
+		status = ( act_store_save(aenv, trans, mail,
+			sieve_mailbox_cache_get_transaction(mbcache, trans->box)) ==
+				SIEVE_EXEC_OK );
+		if ( status && sieve_mailbox_cache_saved
+			(mbcache, trans->box, aenv->msgdata->mail->uid) < 0 ) {
+			sieve_act_store_get_storage_error(aenv, trans);
+			status = FALSE;
+		}
+	} else {
+		/* Commit mailbox transaction */
+		status = ( mailbox_transaction_commit(&trans->mail_trans) == 0 );
+	}
 
 	/* Note the fact that the message was stored at least once */
 	if ( status )
@@ -715,8 +796,7 @@ static int act_store_commit
 	*keep = !status;
 
 	/* Close mailbox */
-	if ( trans->box != NULL )
-		mailbox_free(&trans->box);
+	act_store_mailbox_close(aenv, trans);
 
 	if (status)
 		return SIEVE_EXEC_OK;
@@ -747,7 +827,7 @@ static void act_store_rollback
 		mailbox_transaction_rollback(&trans->mail_trans);
 
 	/* Close the mailbox */
-	mailbox_free(&trans->box);
+	act_store_mailbox_close(aenv, trans);
 }
 
 /*
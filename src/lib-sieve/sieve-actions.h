@@ -52,6 +52,10 @@ struct sieve_action_def {
 	bool (*equals)
 		(const struct sieve_script_env *senv, const struct sieve_action *act1,
 			const struct sieve_action *act2);
+	/* Key used by the result to find possible duplicates; check_duplicate()
+	   is only called for actions with an equal (case-insensitive) identity */
+	const char *(*get_identity)
+		(const struct sieve_script_env *senv, const struct sieve_action *act);
 
 	/* Result verification */
 
@@ -238,6 +242,8 @@ struct act_store_transaction {
 	bool flags_altered:1;
 	bool disabled:1;
 	bool redundant:1;
+	/* The mailbox belongs to the mailbox cache of the script environment */
+	bool cached:1;
 };
 
 int sieve_act_store_add_to_result
@@ -257,6 +263,9 @@ void sieve_act_store_get_storage_error
 
 struct act_redirect_context {
 	const char *to_address;
+
+	/* Sent in the SMTP transaction of an earlier redirect */
+	bool batched:1;
 };
 
 int sieve_act_redirect_add_to_result
@@ -0,0 +1,525 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+#include "array.h"
+#include "sha1.h"
+#include "hex-binary.h"
+#include "mkdir-parents.h"
+#include "eacces-error.h"
+
+#include "sieve-common.h"
+#include "sieve-limits.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+
+#include "sieve-binary-private.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+
+/*
+ * Binary cache
+ *
+ * Keeps loaded binaries in memory for the lifetime of the Sieve instance,
+ * indexed by the path of the binary file. A cached binary is only returned
+ * when the file on disk is still the same one that was loaded; the caller
+ * still needs to verify that it is up-to-date with the script.
+ */
+
+struct sieve_binary_cache_entry {
+	struct sieve_binary_cache_entry *prev, *next;
+
+	const char *path;
+	struct sieve_binary *sbin;
+	size_t size;
+};
+
+struct sieve_binary_cache {
+	pool_t pool;
+	struct sieve_instance *svinst;
+
+	HASH_TABLE(const char *, struct sieve_binary_cache_entry *) entries;
+	/* LRU list; most recently used entry at the head */
+	struct sieve_binary_cache_entry *head, *tail;
+
+	unsigned int max_count;
+	size_t max_size;
+
+	unsigned int count;
+	size_t size;
+
+	struct sieve_binary_cache_stats stats;
+};
+
+/*
+ * Cache object
+ */
+
+void sieve_binary_cache_init(struct sieve_instance *svinst)
+{
+	struct sieve_binary_cache *cache;
+	unsigned long long int uint_setting;
+	size_t size_setting;
+	unsigned int max_count;
+	size_t max_size;
+	pool_t pool;
+
+	max_count = SIEVE_DEFAULT_BINARY_CACHE_SIZE;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_binary_cache_size", &uint_setting) )
+		max_count = (unsigned int) uint_setting;
+
+	max_size = SIEVE_DEFAULT_BINARY_CACHE_MAX_MEMORY;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_binary_cache_max_memory", &size_setting) )
+		max_size = size_setting;
+
+	if ( max_count == 0 || max_size == 0 )
+		return;
+
+	pool = pool_alloconly_create("sieve_binary_cache", 1024);
+	cache = p_new(pool, struct sieve_binary_cache, 1);
+	cache->pool = pool;
+	cache->svinst = svinst;
+	cache->max_count = max_count;
+	cache->max_size = max_size;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+
+	svinst->binary_cache = cache;
+}
+
+static void sieve_binary_cache_entry_free
+(struct sieve_binary_cache *cache, struct sieve_binary_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->path);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+
+	i_assert(cache->count > 0 && cache->size >= entry->size);
+	cache->count--;
+	cache->size -= entry->size;
+
+	sieve_binary_unref(&entry->sbin);
+	i_free(entry);
+}
+
+void sieve_binary_cache_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+
+	if ( cache == NULL )
+		return;
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "binary cache: "
+			"%u hits, %u misses, %u stale, %u evictions",
+			cache->stats.hits, cache->stats.misses,
+			cache->stats.stale, cache->stats.evictions);
+	}
+
+	while ( cache->head != NULL )
+		sieve_binary_cache_entry_free(cache, cache->head);
+
+	hash_table_destroy(&cache->entries);
+	svinst->binary_cache = NULL;
+	pool_unref(&cache->pool);
+}
+
+/*
+ * Lookup
+ */
+
+static bool sieve_binary_cache_entry_valid
+(struct sieve_binary_cache_entry *entry, struct sieve_script *script)
+{
+	struct sieve_binary *sbin = entry->sbin;
+	const struct stat *cst;
+	struct stat st;
+
+	if ( sbin->file == NULL || sbin->script == NULL )
+		return FALSE;
+
+	/* Binaries from the shared store can be used for any script */
+	if ( !sbin->shared && !sieve_script_equals(sbin->script, script) )
+		return FALSE;
+
+	/* Verify that the file on disk is still the one we loaded */
+	if ( stat(entry->path, &st) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_sys_error(sbin->svinst,
+				"binary cache: stat(%s) failed: %m", entry->path);
+		}
+		return FALSE;
+	}
+
+	cst = &sbin->file->st;
+	return ( st.st_ino == cst->st_ino && CMP_DEV_T(st.st_dev, cst->st_dev) &&
+		st.st_size == cst->st_size && st.st_mtime == cst->st_mtime &&
+		ST_MTIME_NSEC(st) == ST_MTIME_NSEC(*cst) &&
+		st.st_ctime == cst->st_ctime );
+}
+
+struct sieve_binary *sieve_binary_cache_lookup
+(struct sieve_instance *svinst, const char *path,
+	struct sieve_script *script)
+{
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	struct sieve_binary_cache_entry *entry;
+	struct sieve_binary *sbin;
+
+	if ( cache == NULL || script == NULL )
+		return NULL;
+
+	entry = hash_table_lookup(cache->entries, path);
+	if ( entry == NULL ) {
+		cache->stats.misses++;
+		return NULL;
+	}
+
+	if ( !sieve_binary_cache_entry_valid(entry, script) ) {
+		cache->stats.stale++;
+		cache->stats.misses++;
+		sieve_binary_cache_entry_free(cache, entry);
+		return NULL;
+	}
+
+	/* Move to the head of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->stats.hits++;
+
+	/* Bind the binary to the script object of the caller, so that
+	   sieve_binary_up_to_date() checks the current state of the script */
+	sbin = entry->sbin;
+	if ( sbin->script != script ) {
+		sieve_script_ref(script);
+		sieve_script_unref(&sbin->script);
+		sbin->script = script;
+	}
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst,
+			"binary cache: using cached binary %s", path);
+	}
+
+	sieve_binary_ref(sbin);
+	return sbin;
+}
+
+/*
+ * Insertion
+ */
+
+void sieve_binary_cache_add(struct sieve_binary *sbin)
+{
+	struct sieve_instance *svinst = sbin->svinst;
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	struct sieve_binary_cache_entry *entry;
+	size_t size;
+
+	if ( cache == NULL || sbin->file == NULL || sbin->script == NULL ||
+		sbin->path == NULL )
+		return;
+
+	size = (size_t)sbin->file->st.st_size;
+	if ( size > cache->max_size )
+		return;
+
+	entry = hash_table_lookup(cache->entries, sbin->path);
+	if ( entry != NULL ) {
+		if ( entry->sbin == sbin )
+			return;
+		sieve_binary_cache_entry_free(cache, entry);
+	}
+
+	/* Make room */
+	while ( cache->tail != NULL && (cache->count >= cache->max_count ||
+		cache->size + size > cache->max_size) ) {
+		cache->stats.evictions++;
+		sieve_binary_cache_entry_free(cache, cache->tail);
+	}
+
+	entry = i_new(struct sieve_binary_cache_entry, 1);
+	entry->path = sbin->path;
+	entry->sbin = sbin;
+	entry->size = size;
+	sieve_binary_ref(sbin);
+
+	hash_table_insert(cache->entries, entry->path, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+	cache->size += size;
+}
+
+/*
+ * Statistics
+ */
+
+void sieve_binary_cache_get_stats
+(struct sieve_instance *svinst, struct sieve_binary_cache_stats *stats_r)
+{
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+
+	if ( cache == NULL ) {
+		i_zero(stats_r);
+		return;
+	}
+
+	*stats_r = cache->stats;
+	stats_r->count = cache->count;
+	stats_r->memory = cache->size;
+}
+
+/*
+ * Cache directory
+ *
+ * Binaries of scripts that cannot be saved at the location the script storage
+ * assigns (e.g. because that is not writable or because the storage has no
+ * location for binaries at all) are saved in the directory configured by
+ * sieve_binary_cache_dir. The files are named after a digest of the script
+ * location. The total size of the directory is bounded by removing the oldest
+ * binaries. Since that involves scanning the whole directory, it is done at
+ * most once per SIEVE_BINARY_CACHE_DIR_CLEANUP_INTERVAL by all processes
+ * together; the modification time of a stamp file in the directory records the
+ * last cleanup.
+ */
+
+#define SIEVE_BINARY_CACHE_DIR_CLEANUP_INTERVAL (10*60)
+#define SIEVE_BINARY_CACHE_DIR_CLEANUP_STAMP ".cleanup"
+
+struct sieve_binary_cache_dir_file {
+	const char *path;
+	time_t mtime;
+	uoff_t size;
+};
+
+const char *sieve_binary_cache_dir_get_path
+(struct sieve_script *script)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const char *location = sieve_script_location(script);
+	unsigned char digest[SHA1_RESULTLEN];
+
+	sha1_get_digest(location, strlen(location), digest);
+	return t_strconcat(svinst->binary_cache_dir, "/",
+		sieve_binfile_from_name(binary_to_hex(digest, sizeof(digest))), NULL);
+}
+
+static int sieve_binary_cache_dir_setup(struct sieve_instance *svinst)
+{
+	const char *dir = svinst->binary_cache_dir;
+
+	if ( mkdir_parents(dir, 0700) == 0 ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst,
+				"binary cache: created directory %s", dir);
+		}
+		return 0;
+	}
+
+	switch ( errno ) {
+	case EEXIST:
+		return 0;
+	case EACCES:
+		sieve_sys_error(svinst, "binary cache: %s",
+			eacces_error_get_creating("mkdir_parents", dir));
+		break;
+	default:
+		sieve_sys_error(svinst, "binary cache: "
+			"mkdir_parents(%s) failed: %m", dir);
+		break;
+	}
+	return -1;
+}
+
+static int
+sieve_binary_cache_dir_file_cmp(const struct sieve_binary_cache_dir_file *f1,
+	const struct sieve_binary_cache_dir_file *f2)
+{
+	if ( f1->mtime < f2->mtime )
+		return -1;
+	if ( f1->mtime > f2->mtime )
+		return 1;
+	return strcmp(f1->path, f2->path);
+}
+
+static bool sieve_binary_cache_dir_cleanup_due
+(struct sieve_instance *svinst)
+{
+	const char *stamp = t_strconcat(svinst->binary_cache_dir, "/",
+		SIEVE_BINARY_CACHE_DIR_CLEANUP_STAMP, NULL);
+	time_t now = time(NULL);
+	struct stat st;
+	int fd;
+
+	if ( stat(stamp, &st) == 0 ) {
+		if ( st.st_mtime + SIEVE_BINARY_CACHE_DIR_CLEANUP_INTERVAL > now &&
+			st.st_mtime <= now )
+			return FALSE;
+
+		/* Claim this cleanup; concurrent claims only cause a redundant scan */
+		if ( utime(stamp, NULL) < 0 ) {
+			sieve_sys_error(svinst, "binary cache: "
+				"utime(%s) failed: %m", stamp);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	if ( errno != ENOENT ) {
+		sieve_sys_error(svinst, "binary cache: "
+			"stat(%s) failed: %m", stamp);
+		return FALSE;
+	}
+
+	if ( (fd=open(stamp, O_WRONLY | O_CREAT, 0600)) < 0 ) {
+		sieve_sys_error(svinst, "binary cache: "
+			"open(%s) failed: %m", stamp);
+		return FALSE;
+	}
+	i_close_fd(&fd);
+	return TRUE;
+}
+
+static void sieve_binary_cache_dir_cleanup
+(struct sieve_instance *svinst, const char *keep_path)
+{
+	const char *dir = svinst->binary_cache_dir;
+	ARRAY(struct sieve_binary_cache_dir_file) files;
+	struct sieve_binary_cache_dir_file *file;
+	struct dirent *dp;
+	struct stat st;
+	uoff_t total = 0;
+	size_t len;
+	DIR *dirp;
+
+	if ( svinst->binary_cache_dir_max_size == 0 ||
+		!sieve_binary_cache_dir_cleanup_due(svinst) )
+		return;
+
+	if ( (dirp=opendir(dir)) == NULL ) {
+		sieve_sys_error(svinst, "binary cache: "
+			"opendir(%s) failed: %m", dir);
+		return;
+	}
+
+	t_array_init(&files, 64);
+	for (;;) {
+		errno = 0;
+		if ( (dp=readdir(dirp)) == NULL ) {
+			if ( errno != 0 ) {
+				sieve_sys_error(svinst, "binary cache: "
+					"readdir(%s) failed: %m", dir);
+			}
+			break;
+		}
+
+		/* Only consider binaries; temporary files are left alone */
+		len = strlen(dp->d_name);
+		if ( len <= strlen("."SIEVE_BINARY_FILEEXT) ||
+			strcmp(dp->d_name + len - strlen("."SIEVE_BINARY_FILEEXT),
+				"."SIEVE_BINARY_FILEEXT) != 0 )
+			continue;
+
+		file = array_append_space(&files);
+		file->path = t_strconcat(dir, "/", dp->d_name, NULL);
+		if ( stat(file->path, &st) < 0 || !S_ISREG(st.st_mode) ) {
+			array_delete(&files, array_count(&files)-1, 1);
+			continue;
+		}
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		total += st.st_size;
+	}
+
+	if ( closedir(dirp) < 0 ) {
+		sieve_sys_error(svinst, "binary cache: "
+			"closedir(%s) failed: %m", dir);
+	}
+
+	if ( total <= svinst->binary_cache_dir_max_size )
+		return;
+
+	/* Remove the oldest binaries first */
+	array_sort(&files, sieve_binary_cache_dir_file_cmp);
+	array_foreach_modifiable(&files, file) {
+		if ( total <= svinst->binary_cache_dir_max_size )
+			break;
+		if ( strcmp(file->path, keep_path) == 0 )
+			continue;
+
+		if ( unlink(file->path) < 0 && errno != ENOENT ) {
+			sieve_sys_error(svinst, "binary cache: "
+				"unlink(%s) failed: %m", file->path);
+			continue;
+		}
+		total -= file->size;
+
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary cache: "
+				"removed %s to limit the size of the cache directory",
+				file->path);
+		}
+	}
+}
+
+struct sieve_binary *sieve_binary_cache_dir_open
+(struct sieve_script *script, enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary *sbin;
+
+	if ( svinst->binary_cache_dir == NULL ) {
+		if ( error_r != NULL )
+			*error_r = SIEVE_ERROR_NOT_POSSIBLE;
+		return NULL;
+	}
+
+	T_BEGIN {
+		sbin = sieve_binary_open(svinst,
+			sieve_binary_cache_dir_get_path(script), script, error_r);
+	} T_END;
+	return sbin;
+}
+
+int sieve_binary_cache_dir_save
+(struct sieve_script *script, struct sieve_binary *sbin, bool update,
+	enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	int ret;
+
+	if ( svinst->binary_cache_dir == NULL ) {
+		if ( error_r != NULL )
+			*error_r = SIEVE_ERROR_NOT_POSSIBLE;
+		return -1;
+	}
+
+	T_BEGIN {
+		const char *path = sieve_binary_cache_dir_get_path(script);
+
+		if ( sieve_binary_cache_dir_setup(svinst) < 0 ) {
+			if ( error_r != NULL )
+				*error_r = SIEVE_ERROR_TEMP_FAILURE;
+			ret = -1;
+		} else {
+			ret = sieve_binary_save(sbin, path, update, 0600, error_r);
+		}
+
+		if ( ret > 0 ) {
+			if ( svinst->debug ) {
+				sieve_sys_debug(svinst, "binary cache: "
+					"saved binary for script `%s' as %s",
+					sieve_script_location(script), path);
+			}
+			sieve_binary_cache_dir_cleanup(svinst, path);
+		}
+	} T_END;
+	return ret;
+}
@@ -34,6 +34,8 @@ static inline sieve_size_t sieve_binary_emit_dynamic_data
 static inline void _sieve_binary_emit_data
 (struct sieve_binary_block *sblock, const void *data, sieve_size_t size)
 {
+	if ( sblock->data_const )
+		sieve_binary_block_make_writable(sblock);
 	buffer_append(sblock->data, data, size);
 }
 
@@ -47,6 +49,8 @@ static inline void _sieve_binary_update_data
 (struct sieve_binary_block *sblock, sieve_size_t address, const void *data,
 	sieve_size_t size)
 {
+	if ( sblock->data_const )
+		sieve_binary_block_make_writable(sblock);
 	buffer_write(sblock->data, address, data, size);
 }
 
@@ -180,6 +180,20 @@ bool sieve_binary_dumper_run
 		}
 	}
 
+	/* Dump wanted headers */
+
+	T_BEGIN {
+		const char *const *headers = sieve_binary_get_wanted_headers(sbin);
+
+		if ( *headers != NULL ) {
+			sieve_binary_dump_sectionf(denv, "Wanted headers (block: %d)",
+				SBIN_SYSBLOCK_WANTED_HEADERS);
+
+			for ( i = 0; headers[i] != NULL; i++ )
+				sieve_binary_dumpf(denv, "%3d: %s\n", i, headers[i]);
+		}
+	} T_END;
+
 	/* Dump main program */
 
 	sieve_binary_dump_sectionf
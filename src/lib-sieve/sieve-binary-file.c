@@ -11,6 +11,7 @@
 #include "ostream.h"
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
+#include "file-dotlock.h"
 
 #include "sieve-common.h"
 #include "sieve-error.h"
@@ -24,6 +25,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  * Macros
@@ -451,6 +453,9 @@ bool sieve_binary_file_open
 
 void sieve_binary_file_close(struct sieve_binary_file **file)
 {
+	if ( (*file)->close != NULL )
+		(*file)->close(*file);
+
 	if ( (*file)->fd != -1 ) {
 		if ( close((*file)->fd) < 0 ) {
 			sieve_sys_error((*file)->svinst,
@@ -464,120 +469,126 @@ void sieve_binary_file_close(struct sieve_binary_file **file)
 	*file = NULL;
 }
 
-#if 0 /* file_memory is currently unused */
-
-/* File loaded/mapped to memory */
+/* File mapped into memory */
 
 struct _file_memory {
 	struct sieve_binary_file binfile;
 
 	/* Pointer to the binary in memory */
 	const void *memory;
-	off_t memory_size;
+	size_t memory_size;
 };
 
-static const void *_file_memory_load_data
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
+static const void *_file_memory_get
+(struct sieve_binary_file *file, off_t *offset, size_t size)
 {
 	struct _file_memory *fmem = (struct _file_memory *) file;
+	size_t aligned;
 
 	*offset = SIEVE_BINARY_ALIGN(*offset);
+	aligned = (size_t) *offset;
 
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
-
-		return data;
+	if ( *offset < 0 || aligned > fmem->memory_size ||
+		size > fmem->memory_size - aligned ) {
+		sieve_sys_error(file->svinst,
+			"binary read: binary %s is truncated (more data expected)",
+			file->path);
+		return NULL;
 	}
 
-	return NULL;
+	*offset += size;
+	file->offset = *offset;
+	return CONST_PTR_OFFSET(fmem->memory, aligned);
 }
 
-static buffer_t *_file_memory_load_buffer
-	(struct sieve_binary_file *file, off_t *offset, size_t size)
+static const void *_file_memory_load_data
+(struct sieve_binary_file *file, off_t *offset, size_t size)
 {
-	struct _file_memory *fmem = (struct _file_memory *) file;
-
-	*offset = SIEVE_BINARY_ALIGN(*offset);
+	return _file_memory_get(file, offset, size);
+}
 
-	if ( (*offset) + size <= fmem->memory_size ) {
-		const void *data = PTR_OFFSET(fmem->memory, *offset);
-		*offset += size;
-		file->offset = *offset;
+static buffer_t *_file_memory_load_buffer
+(struct sieve_binary_file *file, off_t *offset, size_t size)
+{
+	const void *data;
+	buffer_t *buffer;
 
-		return buffer_create_const_data(file->pool, data, size);
-	}
+	if ( (data=_file_memory_get(file, offset, size)) == NULL )
+		return NULL;
 
-	return NULL;
+	/* Refer directly to the mapped memory; the block is copied once it
+	   needs to be modified */
+	buffer = p_new(file->pool, buffer_t, 1);
+	buffer_create_from_const_data(buffer, data, size);
+	return buffer;
 }
 
-static bool _file_memory_load(struct sieve_binary_file *file)
+static void _file_memory_close(struct sieve_binary_file *file)
 {
 	struct _file_memory *fmem = (struct _file_memory *) file;
-	int ret;
-	size_t size;
-	void *indata;
 
-	i_assert(file->fd > 0);
+	if ( munmap((void *)fmem->memory, fmem->memory_size) < 0 ) {
+		sieve_sys_error(file->svinst,
+			"binary close: munmap(%s) failed: %m", file->path);
+	}
+}
 
-	/* Allocate memory buffer
-	 */
-	indata = p_malloc(file->pool, file->st.st_size);
-	size = file->st.st_size;
+static struct sieve_binary_file *_file_memory_open
+(struct sieve_instance *svinst, const char *path, enum sieve_error *error_r)
+{
+	pool_t pool;
+	struct _file_memory *fmem;
+	struct sieve_binary_file *file;
+	void *memory;
 
-	file->offset = 0;
-	fmem->memory = indata;
-	fmem->memory_size = file->st.st_size;
+	pool = pool_alloconly_create("sieve_binary_file_memory", 1024);
+	fmem = p_new(pool, struct _file_memory, 1);
+	file = &fmem->binfile;
+	file->pool = pool;
+	file->path = p_strdup(pool, path);
+	file->load_data = _file_memory_load_data;
+	file->load_buffer = _file_memory_load_buffer;
 
-	/* Return to beginning of the file */
-	if ( lseek(file->fd, 0, SEEK_SET) == (off_t) -1 ) {
-		sieve_sys_error("failed to seek() in binary %s: %m", file->path);
-		return FALSE;
+	if ( !sieve_binary_file_open(file, svinst, path, error_r) ) {
+		pool_unref(&pool);
+		return NULL;
 	}
 
-	/* Read the whole file into memory */
-	while (size > 0) {
-		if ( (ret=read(file->fd, indata, size)) <= 0 ) {
-			sieve_sys_error("failed to read from binary %s: %m", file->path);
-			break;
-		}
-
-		indata = PTR_OFFSET(indata, ret);
-		size -= ret;
+	/* Empty files cannot be mapped; let the lazy reader report the
+	   problem */
+	if ( file->st.st_size <= 0 || (uoff_t)file->st.st_size > SSIZE_T_MAX ) {
+		sieve_binary_file_close(&file);
+		return NULL;
 	}
 
-	if ( size != 0 ) {
-		/* Failed to read the whole file */
-		return FALSE;
+	memory = mmap(NULL, (size_t)file->st.st_size, PROT_READ,
+		MAP_PRIVATE, file->fd, 0);
+	if ( memory == MAP_FAILED ) {
+		/* Special file systems may not support mapping; silently fall back
+		   to reading the binary lazily */
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary open: "
+				"mmap(%s) failed: %m (falling back to read())", path);
+		}
+		sieve_binary_file_close(&file);
+		return NULL;
 	}
 
-	return TRUE;
-}
-
-static struct sieve_binary_file *_file_memory_open(const char *path)
-{
-	pool_t pool;
-	struct _file_memory *file;
+	fmem->memory = memory;
+	fmem->memory_size = (size_t)file->st.st_size;
+	file->close = _file_memory_close;
+	file->mapped = TRUE;
 
-	pool = pool_alloconly_create("sieve_binary_file_memory", 1024);
-	file = p_new(pool, struct _file_memory, 1);
-	file->binfile.pool = pool;
-	file->binfile.path = p_strdup(pool, path);
-	file->binfile.load = _file_memory_load;
-	file->binfile.load_data = _file_memory_load_data;
-	file->binfile.load_buffer = _file_memory_load_buffer;
-
-	if ( !sieve_binary_file_open(&file->binfile, path) ) {
-		pool_unref(&pool);
-		return NULL;
+	/* The mapping stays valid without the file descriptor */
+	if ( close(file->fd) < 0 ) {
+		sieve_sys_error(svinst,
+			"binary open: close(fd=%s) failed: %m", path);
 	}
+	file->fd = -1;
 
-	return &file->binfile;
+	return file;
 }
 
-#endif /* file_memory is currently unused */
-
 /* File open in lazy mode (only read what is needed into memory) */
 
 static bool _file_lazy_read
@@ -705,6 +716,7 @@ bool sieve_binary_load_block
 	}
 
 	sblock->data = sbin->file->load_buffer(sbin->file, &offset, header->size);
+	sblock->data_const = sbin->file->mapped;
 	if ( sblock->data == NULL ) {
 		sieve_sys_error(sbin->svinst,
 			"binary load: failed to read block %d of binary %s (size=%d)",
@@ -894,11 +906,30 @@ struct sieve_binary *sieve_binary_open
 	unsigned int ext_count, i;
 	struct sieve_binary *sbin;
 	struct sieve_binary_file *file;
+	enum sieve_error error;
 
 	i_assert( script == NULL || sieve_script_svinst(script) == svinst );
 
-	//file = _file_memory_open(path);
-	if ( (file=_file_lazy_open(svinst, path, error_r)) == NULL )
+	/* Try the in-memory cache first */
+	if ( (sbin=sieve_binary_cache_lookup(svinst, path, script)) != NULL ) {
+		if ( error_r != NULL )
+			*error_r = SIEVE_ERROR_NONE;
+		return sbin;
+	}
+
+	/* Map the binary into memory if possible; fall back to reading it lazily
+	   if the file system does not support that */
+	file = NULL;
+	if ( svinst->binary_mmap ) {
+		file = _file_memory_open(svinst, path, &error);
+		if ( file == NULL && error != SIEVE_ERROR_NONE ) {
+			if ( error_r != NULL )
+				*error_r = error;
+			return NULL;
+		}
+	}
+	if ( file == NULL &&
+		(file=_file_lazy_open(svinst, path, error_r)) == NULL )
 		return NULL;
 
 	/* Create binary object */
@@ -934,3 +965,103 @@ struct sieve_binary *sieve_binary_open
 
 	return sbin;
 }
+
+/*
+ * Compile lock
+ *
+ * When a script changes, all processes notice that the binary is outdated at
+ * about the same moment. A dotlock next to the binary makes sure that only one
+ * of them compiles the script; the others wait for the lock and then find the
+ * binary it saved.
+ */
+
+static int _compile_lock_create
+(struct sieve_instance *svinst, const char *path, struct dotlock **lock_r)
+{
+	struct dotlock_settings set;
+	const char *dir, *p;
+	int ret;
+
+	/* In a directory that is not writable, creating the lock fails every
+	   time and the dotlock code logs that as an error; the script is then
+	   simply compiled without the lock */
+	p = strrchr(path, '/');
+	dir = ( p == NULL ? "." : ( p == path ? "/" : t_strdup_until(path, p) ) );
+	if ( access(dir, W_OK) < 0 &&
+		(errno == EACCES || errno == EROFS || errno == ENOENT) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "compile lock: "
+				"directory %s is not writable; not locking %s", dir, path);
+		}
+		return -1;
+	}
+
+	i_zero(&set);
+	set.timeout = svinst->compile_lock_timeout;
+	set.stale_timeout = svinst->compile_lock_timeout * 2;
+	set.use_excl_lock = TRUE;
+
+	ret = file_dotlock_create(&set, path, 0, lock_r);
+	if ( ret == 0 ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "compile lock: "
+				"timed out waiting for lock on %s", path);
+		}
+	} else if ( ret < 0 && errno != EACCES && errno != EROFS &&
+		errno != ENOENT ) {
+		sieve_sys_error(svinst, "compile lock: "
+			"file_dotlock_create(%s) failed: %m", path);
+	}
+	return ret;
+}
+
+bool sieve_binary_compile_lock
+(struct sieve_script *script, struct dotlock **lock_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const char *prefix;
+	int ret = -1;
+
+	*lock_r = NULL;
+	if ( svinst->compile_lock_timeout == 0 )
+		return FALSE;
+
+	T_BEGIN {
+		prefix = sieve_script_binary_get_prefix(script);
+		if ( prefix != NULL ) {
+			ret = _compile_lock_create(svinst,
+				t_strconcat(prefix, "."SIEVE_BINARY_FILEEXT, NULL), lock_r);
+		}
+
+		/* Binaries that cannot be saved with the script end up in the
+		   binary cache directory */
+		if ( ret < 0 && svinst->binary_cache_dir != NULL ) {
+			ret = _compile_lock_create(svinst,
+				sieve_binary_cache_dir_get_path(script), lock_r);
+		}
+	} T_END;
+
+	return ( ret > 0 );
+}
+
+void sieve_binary_compile_unlock(struct dotlock **lock)
+{
+	if ( *lock == NULL )
+		return;
+
+	/* Errors are logged by the dotlock code itself */
+	(void)file_dotlock_delete(lock);
+}
+
+void sieve_binary_set_compile_lock
+(struct sieve_binary *sbin, struct dotlock **lock)
+{
+	sieve_binary_release_compile_lock(sbin);
+	sbin->compile_lock = *lock;
+	*lock = NULL;
+}
+
+void sieve_binary_release_compile_lock(struct sieve_binary *sbin)
+{
+	sieve_binary_compile_unlock(&sbin->compile_lock);
+}
@@ -4,6 +4,8 @@
 #ifndef __SIEVE_BINARY_PRIVATE_H
 #define __SIEVE_BINARY_PRIVATE_H
 
+#include "hash.h"
+
 #include "sieve-common.h"
 #include "sieve-binary.h"
 #include "sieve-extensions.h"
@@ -27,6 +29,10 @@ struct sieve_binary_file {
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
 	buffer_t *(*load_buffer)
 		(struct sieve_binary_file *file, off_t *offset, size_t size);
+	void (*close)(struct sieve_binary_file *file);
+
+	/* Loaded buffers refer directly to the file contents in memory */
+	bool mapped:1;
 };
 
 bool sieve_binary_file_open
@@ -70,6 +76,9 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Data refers to memory that cannot be modified (e.g. a mapped file) */
+	bool data_const:1;
 };
 
 /*
@@ -105,9 +114,22 @@ struct sieve_binary {
 
 	/* Attributes of a loaded binary */
 	const char *path;
+	/* Lock held by this process while the new binary is not yet saved */
+	struct dotlock *compile_lock;
+
+	/* Loaded from the shared binary store; not bound to a particular script */
+	bool shared:1;
 
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
+
+	/* Header fields the compiled script is known to access */
+	ARRAY(const char *) wanted_headers;
+	bool wanted_headers_loaded:1;
+
+	/* Data derived from the code at runtime */
+	HASH_TABLE(struct sieve_binary_runtime_data *,
+		struct sieve_binary_runtime_data *) runtime_data;
 };
 
 struct sieve_binary *sieve_binary_create
@@ -144,6 +166,9 @@ struct sieve_binary_block *sieve_binary_block_create_id
 buffer_t *sieve_binary_block_get_buffer
 	(struct sieve_binary_block *sblock);
 
+void sieve_binary_block_make_writable
+	(struct sieve_binary_block *sblock);
+
 /* Extension registration */
 
 static inline struct sieve_binary_extension_reg *
@@ -0,0 +1,322 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "sha1.h"
+#include "hex-binary.h"
+#include "istream.h"
+#include "eacces-error.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-extensions.h"
+#include "sieve-script.h"
+
+#include "sieve-binary-private.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Shared binary store
+ *
+ * Binaries that depend on nothing but the script source are kept in a shared
+ * directory, named after a digest of the source, the enabled extensions, the
+ * configuration of extensions and plugins and the compile flags. Users with an
+ * identical script use the same binary file, which means that the script is
+ * compiled only once and that the binary cache applies across users. Any
+ * change in the extension configuration yields different names, so that
+ * binaries compiled for another configuration are never used.
+ *
+ * Since a binary from the store is executed on behalf of any user, only the
+ * owner of the store directory can add binaries to it. The directory must not
+ * be writable by anyone else, and binaries that are not owned by its owner or
+ * that are writable by anyone else are never used.
+ */
+
+struct sieve_binary_store {
+	const char *dir;
+
+	/* Owner of the directory; the only uid trusted to write binaries */
+	uid_t owner;
+	/* This process runs as the owner */
+	bool writable:1;
+
+	/* Digest of the settings read by extensions and plugins */
+	unsigned char config_digest[SHA1_RESULTLEN];
+};
+
+/*
+ * Store object
+ */
+
+void sieve_binary_store_init(struct sieve_instance *svinst)
+{
+	struct sieve_binary_store *store;
+	const struct sieve_instance_setting *settings;
+	const char *dir;
+	struct sha1_ctxt ctx;
+	struct stat st;
+	unsigned int count, i;
+
+	dir = sieve_setting_get(svinst, "sieve_binary_store");
+	if ( dir == NULL || *dir == '\0' )
+		return;
+
+	if ( *dir != '/' ) {
+		sieve_sys_error(svinst,
+			"binary store: sieve_binary_store must be an absolute path: %s",
+			dir);
+		return;
+	}
+
+	if ( stat(dir, &st) < 0 ) {
+		if ( errno == EACCES ) {
+			sieve_sys_error(svinst, "binary store: %s",
+				eacces_error_get("stat", dir));
+		} else {
+			sieve_sys_error(svinst,
+				"binary store: stat(%s) failed: %m", dir);
+		}
+		return;
+	}
+	if ( !S_ISDIR(st.st_mode) ) {
+		sieve_sys_error(svinst,
+			"binary store: %s is not a directory", dir);
+		return;
+	}
+	if ( (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ) {
+		sieve_sys_error(svinst,
+			"binary store: %s must not be writable by group or others; "
+			"store disabled", dir);
+		return;
+	}
+
+	store = p_new(svinst->pool, struct sieve_binary_store, 1);
+	store->dir = p_strdup(svinst->pool, dir);
+	store->owner = st.st_uid;
+	store->writable = ( geteuid() == st.st_uid );
+
+	/* Settings read by the core engine (e.g. the user's address) do not
+	   influence compilation; those read while loading extensions and plugins
+	   may. */
+	sha1_init(&ctx);
+	settings = array_get(&svinst->init_settings, &count);
+	for ( i = svinst->init_settings_core_count; i < count; i++ ) {
+		sha1_loop(&ctx, settings[i].identifier,
+			strlen(settings[i].identifier) + 1);
+		if ( settings[i].value != NULL ) {
+			sha1_loop(&ctx, settings[i].value,
+				strlen(settings[i].value) + 1);
+		}
+	}
+	sha1_result(&ctx, store->config_digest);
+
+	svinst->binary_store = store;
+}
+
+/*
+ * Binary names
+ */
+
+static int sieve_binary_store_get_key
+(struct sieve_binary_store *store, struct sieve_script *script,
+	enum sieve_compile_flags cpflags, const char **key_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const struct sieve_extension *const *exts;
+	unsigned char digest[SHA1_RESULTLEN];
+	struct sha1_ctxt ctx;
+	struct istream *input;
+	const unsigned char *data;
+	const char *item;
+	unsigned int count, i;
+	size_t size;
+
+	if ( sieve_script_get_stream(script, &input, NULL) < 0 )
+		return -1;
+
+	sha1_init(&ctx);
+	sha1_loop(&ctx, store->config_digest, sizeof(store->config_digest));
+
+	item = t_strdup_printf("%d.%d:%x\n", SIEVE_BINARY_VERSION_MAJOR,
+		SIEVE_BINARY_VERSION_MINOR, (unsigned int)cpflags);
+	sha1_loop(&ctx, item, strlen(item));
+
+	/* The set of enabled extensions can be changed after initialization */
+	exts = sieve_extensions_get_all(svinst, &count);
+	for ( i = 0; i < count; i++ ) {
+		const struct sieve_extension *ext = exts[i];
+
+		if ( !ext->enabled || ext->def == NULL )
+			continue;
+
+		item = t_strdup_printf("%s:%u:%d%d\n", sieve_extension_name(ext),
+			sieve_extension_version(ext), ext->global ? 1 : 0,
+			ext->implicit ? 1 : 0);
+		sha1_loop(&ctx, item, strlen(item));
+	}
+
+	/* Script source */
+	i_stream_seek(input, 0);
+	while ( i_stream_read_more(input, &data, &size) > 0 ) {
+		sha1_loop(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if ( input->stream_errno != 0 ) {
+		sieve_sys_error(svinst,
+			"binary store: failed to read script `%s': %s",
+			sieve_script_location(script), i_stream_get_error(input));
+		return -1;
+	}
+	i_stream_seek(input, 0);
+
+	sha1_result(&ctx, digest);
+	*key_r = binary_to_hex(digest, sizeof(digest));
+	return 0;
+}
+
+static const char *sieve_binary_store_path
+(struct sieve_binary_store *store, const char *key)
+{
+	return t_strconcat(store->dir, "/", sieve_binfile_from_name(key), NULL);
+}
+
+/*
+ * Loading
+ */
+
+static bool sieve_binary_store_file_trusted
+(struct sieve_binary_store *store, struct sieve_instance *svinst,
+	const char *path)
+{
+	struct stat st;
+
+	if ( lstat(path, &st) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_sys_error(svinst,
+				"binary store: lstat(%s) failed: %m", path);
+		} else if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary store: "
+				"no shared binary %s", path);
+		}
+		return FALSE;
+	}
+
+	if ( !S_ISREG(st.st_mode) || st.st_uid != store->owner ||
+		(st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ) {
+		sieve_sys_error(svinst, "binary store: "
+			"ignoring untrusted binary %s "
+			"(not a regular file owned by uid %ld and writable by it only)",
+			path, (long)store->owner);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+struct sieve_binary *sieve_binary_store_open
+(struct sieve_script *script, enum sieve_compile_flags cpflags,
+	const char **key_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary_store *store = svinst->binary_store;
+	struct sieve_binary *sbin;
+	const char *key, *path;
+	enum sieve_error error;
+
+	*key_r = NULL;
+	if ( store == NULL )
+		return NULL;
+
+	if ( sieve_binary_store_get_key(store, script, cpflags, &key) < 0 )
+		return NULL;
+	*key_r = key;
+
+	path = sieve_binary_store_path(store, key);
+	if ( !sieve_binary_store_file_trusted(store, svinst, path) )
+		return NULL;
+	if ( (sbin=sieve_binary_open(svinst, path, script, &error)) == NULL ) {
+		if ( svinst->debug && error == SIEVE_ERROR_NOT_FOUND ) {
+			sieve_sys_debug(svinst, "binary store: "
+				"no shared binary for script `%s'",
+				sieve_script_location(script));
+		}
+		return NULL;
+	}
+
+	/* The script metadata in the binary belongs to the script it was first
+	   compiled for; the name of the binary already guarantees that the source
+	   is identical. */
+	sbin->shared = TRUE;
+
+	if ( !sieve_binary_up_to_date(sbin, cpflags) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary store: "
+				"shared binary %s is not up-to-date", path);
+		}
+		sieve_binary_unref(&sbin);
+		return NULL;
+	}
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "binary store: "
+			"using shared binary %s for script `%s'",
+			path, sieve_script_location(script));
+	}
+	return sbin;
+}
+
+/*
+ * Saving
+ */
+
+static bool sieve_binary_store_can_share(struct sieve_binary *sbin)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	/* Extensions that check whether the binary is up-to-date track state
+	   outside the script source (e.g. included scripts) */
+	regs = array_get(&sbin->extensions, &ext_count);
+	for ( i = 0; i < ext_count; i++ ) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if ( binext != NULL && binext->binary_up_to_date != NULL )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+void sieve_binary_store_save(struct sieve_binary *sbin, const char *key)
+{
+	struct sieve_instance *svinst = sbin->svinst;
+	struct sieve_binary_store *store = svinst->binary_store;
+	const char *path;
+
+	if ( store == NULL || key == NULL )
+		return;
+
+	/* Only the owner of the store adds binaries */
+	if ( !store->writable )
+		return;
+
+	if ( !sieve_binary_store_can_share(sbin) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "binary store: "
+				"binary for script `%s' cannot be shared",
+				sieve_binary_script_location(sbin));
+		}
+		return;
+	}
+
+	path = sieve_binary_store_path(store, key);
+	if ( sieve_binary_save(sbin, path, TRUE, 0640, NULL) > 0 &&
+		svinst->debug ) {
+		sieve_sys_debug(svinst, "binary store: "
+			"stored binary for script `%s' as %s",
+			sieve_binary_script_location(sbin), path);
+	}
+}
@@ -112,6 +112,8 @@ static inline void sieve_binary_extensions_free(struct sieve_binary *sbin)
 	}
 }
 
+static void sieve_binary_runtime_data_free(struct sieve_binary *sbin);
+
 void sieve_binary_unref(struct sieve_binary **sbin)
 {
 	i_assert((*sbin)->refcount > 0);
@@ -119,6 +121,8 @@ void sieve_binary_unref(struct sieve_binary **sbin)
 	if (--(*sbin)->refcount != 0)
 		return;
 
+	sieve_binary_release_compile_lock(*sbin);
+	sieve_binary_runtime_data_free(*sbin);
 	sieve_binary_extensions_free(*sbin);
 
 	if ( (*sbin)->file != NULL )
@@ -161,6 +165,11 @@ bool sieve_binary_loaded(struct sieve_binary *sbin)
 	return ( sbin->file != NULL );
 }
 
+bool sieve_binary_shared(struct sieve_binary *sbin)
+{
+	return sbin->shared;
+}
+
 const char *sieve_binary_source(struct sieve_binary *sbin)
 {
 	if ( sbin->script != NULL && (sbin->path == NULL || sbin->file == NULL) )
@@ -281,9 +290,27 @@ struct sieve_binary_block *sieve_binary_block_get
 void sieve_binary_block_clear
 (struct sieve_binary_block *sblock)
 {
+	if ( sblock->data_const ) {
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->data_const = FALSE;
+		return;
+	}
 	buffer_set_used_size(sblock->data, 0);
 }
 
+void sieve_binary_block_make_writable
+(struct sieve_binary_block *sblock)
+{
+	const buffer_t *data = sblock->data;
+
+	if ( !sblock->data_const )
+		return;
+
+	sblock->data = buffer_create_dynamic(sblock->sbin->pool, data->used);
+	buffer_append_buf(sblock->data, data, 0, (size_t)-1);
+	sblock->data_const = FALSE;
+}
+
 buffer_t *sieve_binary_block_get_buffer
 (struct sieve_binary_block *sblock)
 {
@@ -330,7 +357,7 @@ bool sieve_binary_up_to_date
 	if ( sblock == NULL || sbin->script == NULL )
 		return FALSE;
 
-	if ( (ret=sieve_script_binary_read_metadata
+	if ( !sbin->shared && (ret=sieve_script_binary_read_metadata
 		(sbin->script, sblock, &offset)) <= 0 ) {
 		if (ret < 0) {
 			sieve_sys_debug(sbin->svinst, "binary up-to-date: "
@@ -487,3 +514,177 @@ int sieve_binary_extensions_count(struct sieve_binary *sbin)
 {
 	return (int) array_count(&sbin->extensions);
 }
+
+/*
+ * Wanted headers
+ */
+
+static bool sieve_binary_wanted_headers_load(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	sieve_size_t offset = 0;
+	string_t *field_name;
+
+	if ( sbin->wanted_headers_loaded )
+		return TRUE;
+	sbin->wanted_headers_loaded = TRUE;
+
+	p_array_init(&sbin->wanted_headers, sbin->pool, 8);
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_WANTED_HEADERS);
+	if ( sblock == NULL )
+		return FALSE;
+
+	while ( offset < sieve_binary_block_get_size(sblock) ) {
+		const char *name;
+
+		if ( !sieve_binary_read_string(sblock, &offset, &field_name) ) {
+			sieve_sys_error(sbin->svinst,
+				"binary %s: corrupt wanted headers block", sbin->path);
+			array_clear(&sbin->wanted_headers);
+			return FALSE;
+		}
+
+		name = p_strdup(sbin->pool, str_c(field_name));
+		array_append(&sbin->wanted_headers, &name, 1);
+	}
+	return TRUE;
+}
+
+void sieve_binary_add_wanted_header
+(struct sieve_binary *sbin, const char *field_name)
+{
+	struct sieve_binary_block *sblock;
+	const char *const *names, *name;
+	unsigned int count, i;
+
+	if ( !sieve_binary_wanted_headers_load(sbin) )
+		return;
+
+	names = array_get(&sbin->wanted_headers, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( strcasecmp(names[i], field_name) == 0 )
+			return;
+	}
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_WANTED_HEADERS);
+	i_assert( sblock != NULL );
+	(void)sieve_binary_emit_cstring(sblock, field_name);
+
+	name = p_strdup(sbin->pool, field_name);
+	array_append(&sbin->wanted_headers, &name, 1);
+}
+
+const char *const *sieve_binary_get_wanted_headers
+(struct sieve_binary *sbin)
+{
+	const char *const *names;
+	const char **headers;
+	unsigned int count;
+
+	(void)sieve_binary_wanted_headers_load(sbin);
+
+	names = array_get(&sbin->wanted_headers, &count);
+	headers = t_new(const char *, count + 1);
+	if ( count > 0 )
+		memcpy(headers, names, sizeof(*names) * count);
+	return headers;
+}
+
+/*
+ * Runtime data
+ */
+
+struct sieve_binary_runtime_data {
+	const void *owner;
+	unsigned int block_id;
+	sieve_size_t address;
+
+	void *data;
+	sieve_binary_runtime_data_free_t *data_free;
+};
+
+static unsigned int sieve_binary_runtime_data_hash
+(const struct sieve_binary_runtime_data *rdata)
+{
+	return (unsigned int)POINTER_CAST_TO(rdata->owner, size_t) ^
+		(rdata->block_id << 24) ^ (unsigned int)rdata->address;
+}
+
+static int sieve_binary_runtime_data_cmp
+(const struct sieve_binary_runtime_data *rdata1,
+	const struct sieve_binary_runtime_data *rdata2)
+{
+	if ( rdata1->owner != rdata2->owner )
+		return 1;
+	if ( rdata1->block_id != rdata2->block_id )
+		return 1;
+	return ( rdata1->address == rdata2->address ? 0 : 1 );
+}
+
+bool sieve_binary_runtime_data_lookup
+(struct sieve_binary *sbin, const void *owner,
+	const struct sieve_binary_block *sblock, sieve_size_t address,
+	void **data_r)
+{
+	struct sieve_binary_runtime_data lookup, *rdata;
+
+	*data_r = NULL;
+	if ( !hash_table_is_created(sbin->runtime_data) )
+		return FALSE;
+
+	i_zero(&lookup);
+	lookup.owner = owner;
+	lookup.block_id = sblock->id;
+	lookup.address = address;
+
+	rdata = hash_table_lookup(sbin->runtime_data, &lookup);
+	if ( rdata == NULL )
+		return FALSE;
+
+	*data_r = rdata->data;
+	return TRUE;
+}
+
+void sieve_binary_runtime_data_add
+(struct sieve_binary *sbin, const void *owner,
+	const struct sieve_binary_block *sblock, sieve_size_t address,
+	void *data, sieve_binary_runtime_data_free_t *data_free)
+{
+	struct sieve_binary_runtime_data *rdata;
+
+	i_assert( sblock->sbin == sbin );
+
+	if ( !hash_table_is_created(sbin->runtime_data) ) {
+		hash_table_create(&sbin->runtime_data, default_pool, 0,
+			sieve_binary_runtime_data_hash, sieve_binary_runtime_data_cmp);
+	}
+
+	rdata = p_new(sbin->pool, struct sieve_binary_runtime_data, 1);
+	rdata->owner = owner;
+	rdata->block_id = sblock->id;
+	rdata->address = address;
+	rdata->data = data;
+	rdata->data_free = data_free;
+
+	i_assert( hash_table_lookup(sbin->runtime_data, rdata) == NULL );
+	hash_table_insert(sbin->runtime_data, rdata, rdata);
+}
+
+static void sieve_binary_runtime_data_free(struct sieve_binary *sbin)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_binary_runtime_data *key, *rdata;
+
+	if ( !hash_table_is_created(sbin->runtime_data) )
+		return;
+
+	iter = hash_table_iterate_init(sbin->runtime_data);
+	while ( hash_table_iterate(iter, sbin->runtime_data, &key, &rdata) ) {
+		if ( rdata->data_free != NULL && rdata->data != NULL )
+			rdata->data_free(rdata->data);
+	}
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_destroy(&sbin->runtime_data);
+}
@@ -13,7 +13,7 @@
  */
 
 #define SIEVE_BINARY_VERSION_MAJOR     1
-#define SIEVE_BINARY_VERSION_MINOR     4
+#define SIEVE_BINARY_VERSION_MINOR     5
 
 /*
  * Binary object
@@ -44,6 +44,7 @@ const char *sieve_binary_script_location(struct sieve_binary *sbin);
 const char *sieve_binary_source(struct sieve_binary *sbin);
 bool sieve_binary_loaded(struct sieve_binary *sbin);
 bool sieve_binary_saved(struct sieve_binary *sbin);
+bool sieve_binary_shared(struct sieve_binary *sbin);
 
 /*
  * Utility
@@ -75,6 +76,77 @@ struct sieve_binary *sieve_binary_open
 bool sieve_binary_up_to_date
 	(struct sieve_binary *sbin, enum sieve_compile_flags cpflags);
 
+/*
+ * Compile lock
+ */
+
+struct dotlock;
+
+/* Serializes compiling a script among processes. Returns TRUE when the lock is
+   obtained, possibly after waiting for another process to finish compiling
+   and saving the binary. Returns FALSE when no lock could be obtained, in
+   which case the caller just compiles the script. */
+bool sieve_binary_compile_lock
+	(struct sieve_script *script, struct dotlock **lock_r);
+void sieve_binary_compile_unlock(struct dotlock **lock);
+
+/* Keeps the lock until the binary is saved or freed */
+void sieve_binary_set_compile_lock
+	(struct sieve_binary *sbin, struct dotlock **lock);
+void sieve_binary_release_compile_lock(struct sieve_binary *sbin);
+
+/*
+ * Binary cache
+ */
+
+struct sieve_binary_cache_stats {
+	unsigned int hits, misses;
+	unsigned int stale, evictions;
+
+	unsigned int count;
+	size_t memory;
+};
+
+void sieve_binary_cache_init(struct sieve_instance *svinst);
+void sieve_binary_cache_deinit(struct sieve_instance *svinst);
+
+/* Returns the cached binary for this path if the file was not changed since
+   it was loaded. The binary is bound to the provided script. */
+struct sieve_binary *sieve_binary_cache_lookup
+	(struct sieve_instance *svinst, const char *path,
+		struct sieve_script *script);
+/* Adds a loaded binary to the cache; only do this once it is verified to be
+   up-to-date. */
+void sieve_binary_cache_add(struct sieve_binary *sbin);
+
+void sieve_binary_cache_get_stats
+	(struct sieve_instance *svinst, struct sieve_binary_cache_stats *stats_r);
+
+/* Binaries for scripts that cannot be saved at their own location are kept in
+   the directory configured by sieve_binary_cache_dir. */
+const char *sieve_binary_cache_dir_get_path(struct sieve_script *script);
+struct sieve_binary *sieve_binary_cache_dir_open
+	(struct sieve_script *script, enum sieve_error *error_r);
+int sieve_binary_cache_dir_save
+	(struct sieve_script *script, struct sieve_binary *sbin, bool update,
+		enum sieve_error *error_r);
+
+/*
+ * Shared binary store
+ */
+
+void sieve_binary_store_init(struct sieve_instance *svinst);
+
+/* Returns the binary from the shared store that was compiled from identical
+   source with the same configuration. When the store is enabled, key_r is set
+   for use with sieve_binary_store_save(), even when no binary is returned. */
+struct sieve_binary *sieve_binary_store_open
+	(struct sieve_script *script, enum sieve_compile_flags cpflags,
+		const char **key_r);
+/* Adds a newly compiled binary to the shared store, if it is suitable for
+   sharing. */
+void sieve_binary_store_save(struct sieve_binary *sbin, const char *key);
+
 /*
  * Block management
  */
@@ -83,6 +155,7 @@ enum sieve_binary_system_block {
 	SBIN_SYSBLOCK_SCRIPT_DATA,
 	SBIN_SYSBLOCK_EXTENSIONS,
 	SBIN_SYSBLOCK_MAIN_PROGRAM,
+	SBIN_SYSBLOCK_WANTED_HEADERS,
 	SBIN_SYSBLOCK_LAST
 };
 
@@ -155,6 +228,39 @@ int sieve_binary_extension_get_index
 	(struct sieve_binary *sbin, const struct sieve_extension *ext);
 int sieve_binary_extensions_count(struct sieve_binary *sbin);
 
+/*
+ * Wanted headers
+ *
+ *   The generator records the header fields the script accesses by a constant
+ *   name, so that these can be prefetched before the script is executed.
+ */
+
+void sieve_binary_add_wanted_header
+	(struct sieve_binary *sbin, const char *field_name);
+/* Returns a NULL-terminated list allocated from the data stack */
+const char *const *sieve_binary_get_wanted_headers
+	(struct sieve_binary *sbin);
+
+/*
+ * Runtime data
+ *
+ *   Data derived from the code at runtime (e.g. precompiled key lists) can be
+ *   stored with the binary, so that it is shared by all subsequent executions.
+ *   It is identified by an owner pointer and a code address in a block.
+ */
+
+typedef void sieve_binary_runtime_data_free_t(void *data);
+
+/* Returns TRUE when data was recorded for this address, even if NULL */
+bool sieve_binary_runtime_data_lookup
+	(struct sieve_binary *sbin, const void *owner,
+		const struct sieve_binary_block *sblock, sieve_size_t address,
+		void **data_r);
+void sieve_binary_runtime_data_add
+	(struct sieve_binary *sbin, const void *owner,
+		const struct sieve_binary_block *sblock, sieve_size_t address,
+		void *data, sieve_binary_runtime_data_free_t *data_free)
+		ATTR_NULL(5, 6);
 
 /*
  * Code emission
@@ -115,6 +115,75 @@ static int sieve_code_stringlist_get_length
 	return strlist->length;
 }
 
+/* Direct access to the coded list */
+
+bool sieve_code_stringlist_get_address
+(struct sieve_stringlist *_strlist, struct sieve_binary_block **sblock_r,
+	sieve_size_t *address_r)
+{
+	struct sieve_code_stringlist *strlist =
+		(struct sieve_code_stringlist *) _strlist;
+
+	if ( _strlist->next_item != sieve_code_stringlist_next_item )
+		return FALSE;
+
+	*sblock_r = _strlist->runenv->sblock;
+	*address_r = strlist->start_address;
+	return TRUE;
+}
+
+int sieve_code_stringlist_read_literals
+(struct sieve_stringlist *_strlist, ARRAY(string_t *) *items)
+{
+	struct sieve_code_stringlist *strlist =
+		(struct sieve_code_stringlist *) _strlist;
+	struct sieve_binary_block *sblock = _strlist->runenv->sblock;
+	sieve_size_t address = strlist->start_address;
+	int i;
+
+	i_assert( _strlist->next_item == sieve_code_stringlist_next_item );
+
+	for ( i = 0; i < strlist->length; i++ ) {
+		struct sieve_operand operand;
+		string_t *item;
+
+		if ( !sieve_operand_read(sblock, &address, NULL, &operand) )
+			return -1;
+
+		/* Items of which the value is determined at runtime (e.g. variables)
+		   make the whole list non-constant */
+		if ( !sieve_operand_is_string_literal(&operand) )
+			return 0;
+
+		if ( !sieve_binary_read_string(sblock, &address, &item) )
+			return -1;
+		array_append(items, &item, 1);
+	}
+	return 1;
+}
+
+bool sieve_code_stringlist_is_constant(struct sieve_stringlist *strlist)
+{
+	int ret;
+
+	if ( strlist->constant )
+		return TRUE;
+	if ( strlist->next_item != sieve_code_stringlist_next_item )
+		return FALSE;
+
+	T_BEGIN {
+		ARRAY(string_t *) items;
+
+		t_array_init(&items, 16);
+		ret = sieve_code_stringlist_read_literals(strlist, &items);
+	} T_END;
+
+	if ( ret <= 0 )
+		return FALSE;
+	strlist->constant = TRUE;
+	return TRUE;
+}
+
 static bool sieve_code_stringlist_dump
 (const struct sieve_dumptime_env *denv, sieve_size_t *address,
 	unsigned int length, sieve_size_t end, const char *field_name)
@@ -810,6 +879,7 @@ int sieve_opr_stringlist_read_data
 
 			*strlist_r = sieve_single_stringlist_create
 				(renv, stritem, FALSE);
+			(*strlist_r)->constant = sieve_operand_is_string_literal(oprnd);
 		}
 		return SIEVE_EXEC_OK;
 	}
@@ -266,6 +266,15 @@ int sieve_opr_stringlist_read_ex
 	(const struct sieve_runtime_env *renv, sieve_size_t *address,
 		const char *field_name, bool optional, struct sieve_stringlist **strlist_r);
 
+/* Code stringlist: the list as it is stored in the binary */
+bool sieve_code_stringlist_get_address
+	(struct sieve_stringlist *strlist, struct sieve_binary_block **sblock_r,
+		sieve_size_t *address_r);
+int sieve_code_stringlist_read_literals
+	(struct sieve_stringlist *strlist, ARRAY(string_t *) *items);
+/* Returns TRUE when the items of the list cannot change at runtime */
+bool sieve_code_stringlist_is_constant(struct sieve_stringlist *strlist);
+
 static inline bool sieve_operand_is_stringlist
 (const struct sieve_operand *operand)
 {
@@ -159,10 +159,18 @@ bool sieve_validate
 
 #include "sieve-address-source.h"
 
+struct sieve_instance_setting {
+	const char *identifier;
+	const char *value;
+};
+
 struct sieve_instance {
 	/* Main engine pool */
 	pool_t pool;
 
+	/* Pool for the (user) environment; cleared by sieve_reinit() */
+	pool_t env_pool;
+
 	/* System environment */
 	const char *hostname;
 	const char *domainname;
@@ -183,12 +191,35 @@ struct sieve_instance {
 	/* Engine debug */
 	bool debug;
 
+	/* Settings consulted during initialization; used to determine whether
+	   this instance can be reused for a different environment */
+	ARRAY(struct sieve_instance_setting) init_settings;
+	/* Number of recorded settings read by the core engine itself */
+	unsigned int init_settings_core_count;
+	bool init_settings_recording;
+
 	/* Extension registry */
 	struct sieve_extension_registry *ext_reg;
 
 	/* Storage class registry */
 	struct sieve_storage_class_registry *storage_reg;
 
+	/* Execution profile of this process (sieve_profile_file) */
+	struct sieve_profile *profile;
+	const char *profile_path;
+	time_t profile_interval, profile_last_flush;
+
+	/* Cache of loaded binaries */
+	struct sieve_binary_cache *binary_cache;
+	/* Binaries shared between users */
+	struct sieve_binary_store *binary_store;
+	/* Recycled pools for runtime allocations */
+	struct sieve_runtime_pools *runtime_pools;
+	/* Analysis of the most recently executed message */
+	struct sieve_message_analysis *message_analysis;
+	/* Spool for outgoing messages (sieve_smtp_spool) */
+	struct sieve_smtp_spool *smtp_spool;
+
 	/* System error handler */
 	struct sieve_error_handler *system_ehandler;
 
@@ -201,9 +232,20 @@ struct sieve_instance {
 	size_t max_script_size;
 	unsigned int max_actions;
 	unsigned int max_redirects;
+	unsigned int max_instructions;
+	uoff_t max_match_size;
+	unsigned int max_regex_executions;
+	uoff_t max_body_decode_size;
+	unsigned int max_execution_time;
 	const struct sieve_address *user_email;
 	struct sieve_address_source redirect_from;
 	unsigned int redirect_duplicate_period;
+	size_t body_max_scan_size;
+	const char *binary_cache_dir;
+	uoff_t binary_cache_dir_max_size;
+	unsigned int compile_lock_timeout;
+	bool binary_mmap;
+	bool message_analysis_cache;
 };
 
 /*
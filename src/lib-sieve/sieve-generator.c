@@ -361,6 +361,37 @@ bool sieve_generate_argument_parameters
 	return TRUE;
 }
 
+static void sieve_generate_wanted_header
+(const struct sieve_codegen_env *cgenv, struct sieve_ast_argument *arg)
+{
+	/* Only header names known at compile time can be prefetched */
+	if ( arg->argument == NULL || !sieve_argument_is_string_literal(arg) )
+		return;
+
+	sieve_binary_add_wanted_header
+		(cgenv->sbin, sieve_ast_argument_strc(arg));
+}
+
+void sieve_generate_wanted_headers
+(const struct sieve_codegen_env *cgenv, struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *stritem;
+
+	if ( sieve_ast_argument_type(arg) == SAAT_STRING ) {
+		sieve_generate_wanted_header(cgenv, arg);
+		return;
+	}
+
+	if ( sieve_ast_argument_type(arg) != SAAT_STRING_LIST )
+		return;
+
+	stritem = sieve_ast_strlist_first(arg);
+	while ( stritem != NULL ) {
+		sieve_generate_wanted_header(cgenv, stritem);
+		stritem = sieve_ast_strlist_next(stritem);
+	}
+}
+
 bool sieve_generate_test
 (const struct sieve_codegen_env *cgenv, struct sieve_ast_node *tst_node,
 	struct sieve_jumplist *jlist, bool jump_true)
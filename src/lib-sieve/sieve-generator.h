@@ -102,6 +102,9 @@ bool sieve_generate_argument_parameters
 	(const struct sieve_codegen_env *cgenv, struct sieve_command *cmd,
 		struct sieve_ast_argument *arg);
 
+void sieve_generate_wanted_headers
+	(const struct sieve_codegen_env *cgenv, struct sieve_ast_argument *arg);
+
 bool sieve_generate_block
 	(const struct sieve_codegen_env *cgenv, struct sieve_ast_node *block);
 bool sieve_generate_test
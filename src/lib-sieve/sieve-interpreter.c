@@ -22,10 +22,12 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-profile.h"
 
 #include "sieve-interpreter.h"
 
 #include <string.h>
+#include <time.h>
 
 /*
  * Interpreter extension
@@ -53,6 +55,80 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Runtime pools
+ */
+
+struct sieve_runtime_pool_cache {
+	ARRAY(pool_t) free_pools;
+
+	/* Statistics */
+	unsigned int created, reused;
+};
+
+struct sieve_runtime_pools {
+	struct sieve_runtime_pool_cache caches[SIEVE_RUNTIME_POOL_TYPE_COUNT];
+};
+
+static const struct {
+	const char *name;
+	size_t size;
+} sieve_runtime_pool_types[] = {
+	{ "sieve_interpreter", 4096 },
+	{ "sieve_match_context", 1024 }
+};
+
+/*
+ * Resource budget
+ */
+
+/* Reading the clock for every instruction is relatively expensive; charges
+   for other resources accompany substantial work and always check it */
+#define SIEVE_BUDGET_TIME_CHECK_INSTRUCTIONS 64
+
+struct sieve_interpreter_budget {
+	/* Limits in effect when the execution started */
+	uint64_t limit[SIEVE_RESOURCE_COUNT];
+	unsigned int max_execution_time;
+
+	uint64_t used[SIEVE_RESOURCE_COUNT];
+	struct timespec start;
+
+	bool exceeded:1;
+};
+
+static uint64_t sieve_resource_limit
+(struct sieve_instance *svinst, enum sieve_resource resource)
+{
+	switch ( resource ) {
+	case SIEVE_RESOURCE_INSTRUCTIONS:
+		return svinst->max_instructions;
+	case SIEVE_RESOURCE_MATCH_SIZE:
+		return svinst->max_match_size;
+	case SIEVE_RESOURCE_REGEX_EXECUTIONS:
+		return svinst->max_regex_executions;
+	case SIEVE_RESOURCE_BODY_DECODE_SIZE:
+		return svinst->max_body_decode_size;
+	case SIEVE_RESOURCE_COUNT:
+		break;
+	}
+	i_unreached();
+}
+
+static struct sieve_interpreter_budget *sieve_interpreter_budget_create
+(pool_t pool, struct sieve_instance *svinst)
+{
+	struct sieve_interpreter_budget *budget;
+	unsigned int i;
+
+	budget = p_new(pool, struct sieve_interpreter_budget, 1);
+	for ( i = 0; i < SIEVE_RESOURCE_COUNT; i++ )
+		budget->limit[i] = sieve_resource_limit(svinst, i);
+	budget->max_execution_time = svinst->max_execution_time;
+	(void)clock_gettime(CLOCK_MONOTONIC, &budget->start);
+	return budget;
+}
+
 /*
  * Interpreter
  */
@@ -87,6 +163,13 @@ struct sieve_interpreter {
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
+
+	/* Resources used by this execution; shared with included scripts */
+	struct sieve_interpreter_budget *budget;
+
+	/* Profiling; sample of the operation being executed */
+	struct sieve_profile *profile;
+	struct sieve_profile_sample *profile_sample;
 };
 
 static struct sieve_interpreter *_sieve_interpreter_create
@@ -109,7 +192,9 @@ static struct sieve_interpreter *_sieve_interpreter_create
 	sieve_size_t *address;
 	bool success = TRUE;
 
-	pool = pool_alloconly_create("sieve_interpreter", 4096);
+	svinst = sieve_binary_svinst(sbin);
+
+	pool = sieve_runtime_pool_get(svinst, SIEVE_RUNTIME_POOL_INTERPRETER);
 	interp = p_new(pool, struct sieve_interpreter, 1);
 	interp->parent = parent;
 	interp->pool = pool;
@@ -124,12 +209,19 @@ static struct sieve_interpreter *_sieve_interpreter_create
 	interp->runenv.flags = flags;
 	sieve_binary_ref(sbin);
 
-	svinst = sieve_binary_svinst(sbin);
-
 	interp->runenv.svinst = svinst;
 	interp->runenv.msgdata = msgdata;
 	interp->runenv.scriptenv = senv;
 
+	interp->profile = ( senv->profile != NULL ?
+		senv->profile : svinst->profile );
+
+	if ( parent != NULL ) {
+		interp->budget = parent->budget;
+	} else {
+		interp->budget = sieve_interpreter_budget_create(pool, svinst);
+	}
+
 	if ( senv->trace_log != NULL ) {
 		interp->trace.log = senv->trace_log;
 		interp->trace.config = senv->trace_config;
@@ -278,6 +370,7 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 	const struct sieve_interpreter_extension_reg *eregs;
 	struct sieve_interpreter_loop *loops;
 	unsigned int count, i;
+	pool_t pool;
 
 	if ( array_is_created(&interp->loop_stack) ) {
 		loops = array_get_modifiable(&interp->loop_stack, &count);
@@ -299,10 +392,94 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 	sieve_binary_unref(&renv->sbin);
 	sieve_error_handler_unref(&renv->ehandler);
 
-	pool_unref(&interp->pool);
+	pool = interp->pool;
+	sieve_runtime_pool_release(renv->svinst,
+		SIEVE_RUNTIME_POOL_INTERPRETER, &pool);
 	*_interp = NULL;
 }
 
+/*
+ * Runtime pools
+ */
+
+pool_t sieve_runtime_pool_get
+(struct sieve_instance *svinst, enum sieve_runtime_pool_type type)
+{
+	struct sieve_runtime_pool_cache *cache;
+	pool_t pool;
+
+	if ( svinst->runtime_pools == NULL ) {
+		svinst->runtime_pools =
+			i_new(struct sieve_runtime_pools, 1);
+	}
+	cache = &svinst->runtime_pools->caches[type];
+
+	if ( array_is_created(&cache->free_pools) &&
+		array_count(&cache->free_pools) > 0 ) {
+		unsigned int last = array_count(&cache->free_pools) - 1;
+
+		pool = *array_idx(&cache->free_pools, last);
+		array_delete(&cache->free_pools, last, 1);
+		cache->reused++;
+		return pool;
+	}
+
+	cache->created++;
+	return pool_alloconly_create(sieve_runtime_pool_types[type].name,
+		sieve_runtime_pool_types[type].size);
+}
+
+void sieve_runtime_pool_release
+(struct sieve_instance *svinst, enum sieve_runtime_pool_type type,
+	pool_t *_pool)
+{
+	struct sieve_runtime_pool_cache *cache =
+		&svinst->runtime_pools->caches[type];
+	pool_t pool = *_pool;
+
+	*_pool = NULL;
+
+	if ( !array_is_created(&cache->free_pools) )
+		i_array_init(&cache->free_pools, SIEVE_RUNTIME_POOL_CACHE_SIZE);
+	if ( array_count(&cache->free_pools) >= SIEVE_RUNTIME_POOL_CACHE_SIZE ) {
+		pool_unref(&pool);
+		return;
+	}
+
+	/* Clearing keeps the first block of the pool */
+	p_clear(pool);
+	array_append(&cache->free_pools, &pool, 1);
+}
+
+void sieve_runtime_pools_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_runtime_pools *pools = svinst->runtime_pools;
+	unsigned int i;
+
+	if ( pools == NULL )
+		return;
+
+	for ( i = 0; i < SIEVE_RUNTIME_POOL_TYPE_COUNT; i++ ) {
+		struct sieve_runtime_pool_cache *cache = &pools->caches[i];
+		pool_t *poolp;
+
+		if ( svinst->debug && (cache->created + cache->reused) > 0 ) {
+			sieve_sys_debug(svinst, "runtime pools: %s: "
+				"%u created, %u reused",
+				sieve_runtime_pool_types[i].name,
+				cache->created, cache->reused);
+		}
+
+		if ( !array_is_created(&cache->free_pools) )
+			continue;
+		array_foreach_modifiable(&cache->free_pools, poolp)
+			pool_unref(poolp);
+		array_free(&cache->free_pools);
+	}
+
+	i_free(svinst->runtime_pools);
+}
+
 /*
  * Accessors
  */
@@ -348,6 +525,67 @@ void sieve_interpreter_set_result
 	sieve_result_ref(result);
 }
 
+/*
+ * Resource budgets
+ */
+
+static const char *const sieve_resource_names[] = {
+	"instruction", "match size", "regex execution", "body decode size"
+};
+
+static void sieve_runtime_resource_exceeded
+(const struct sieve_runtime_env *renv, const char *reason)
+{
+	struct sieve_interpreter_budget *budget = renv->interp->budget;
+
+	budget->exceeded = TRUE;
+
+	sieve_runtime_error(renv, NULL,
+		"execution aborted: %s", reason);
+	sieve_sys_warning(renv->svinst,
+		"%s: execution aborted: %s (falling back to implicit keep)",
+		sieve_runtime_get_full_command_location(renv), reason);
+}
+
+bool sieve_runtime_resource_charge
+(const struct sieve_runtime_env *renv, enum sieve_resource resource,
+	uint64_t amount)
+{
+	struct sieve_interpreter_budget *budget = renv->interp->budget;
+	uint64_t limit;
+
+	if ( budget->exceeded )
+		return FALSE;
+
+	budget->used[resource] += amount;
+
+	limit = budget->limit[resource];
+	if ( limit > 0 && budget->used[resource] > limit ) {
+		sieve_runtime_resource_exceeded(renv, t_strdup_printf(
+			"%s limit exceeded (> %llu)", sieve_resource_names[resource],
+			(unsigned long long)limit));
+		return FALSE;
+	}
+
+	if ( budget->max_execution_time > 0 &&
+		(resource != SIEVE_RESOURCE_INSTRUCTIONS || (budget->used[resource] %
+			SIEVE_BUDGET_TIME_CHECK_INSTRUCTIONS) == 0) ) {
+		struct timespec now;
+		int64_t msecs;
+
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		msecs = (int64_t)(now.tv_sec - budget->start.tv_sec) * 1000 +
+			(now.tv_nsec - budget->start.tv_nsec) / 1000000;
+		if ( msecs > (int64_t)budget->max_execution_time * 1000 ) {
+			sieve_runtime_resource_exceeded(renv, t_strdup_printf(
+				"execution time limit exceeded (> %u s)",
+				budget->max_execution_time));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 /*
  * Error handling
  */
@@ -885,6 +1123,52 @@ bool sieve_interpreter_get_test_result
 	return interp->test_result;
 }
 
+/*
+ * Profiling
+ */
+
+static const char *sieve_interpreter_profile_script
+(struct sieve_interpreter *interp)
+{
+	if ( interp->runenv.script == NULL )
+		return "(unknown)";
+	return sieve_script_name(interp->runenv.script);
+}
+
+static const char *sieve_interpreter_profile_stack
+(struct sieve_interpreter *interp)
+{
+	struct sieve_interpreter *parent = interp->parent;
+	const char *frames;
+
+	if ( parent == NULL )
+		return "";
+
+	frames = sieve_profile_frames
+		(sieve_interpreter_profile_script(parent),
+			sieve_runtime_get_command_location(&parent->runenv),
+			sieve_operation_mnemonic(&parent->oprtn));
+	if ( parent->parent == NULL )
+		return frames;
+	return t_strconcat(sieve_interpreter_profile_stack(parent), ";",
+		frames, NULL);
+}
+
+static void sieve_interpreter_profile_record
+(struct sieve_interpreter *interp, struct sieve_profile_sample *sample)
+{
+	struct sieve_interpreter *parent = interp->parent;
+
+	T_BEGIN {
+		sieve_profile_sample_end(interp->profile, sample,
+			( parent == NULL ? NULL : parent->profile_sample ),
+			sieve_interpreter_profile_stack(interp),
+			sieve_interpreter_profile_script(interp),
+			sieve_runtime_get_command_location(&interp->runenv),
+			sieve_operation_mnemonic(&interp->oprtn));
+	} T_END;
+}
+
 /*
  * Code execute
  */
@@ -894,6 +1178,7 @@ static int sieve_interpreter_operation_execute
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	struct sieve_profile_sample sample;
 
 	sieve_runtime_trace_toplevel(&interp->runenv);
 
@@ -907,9 +1192,19 @@ static int sieve_interpreter_operation_execute
 
 		/* Execute the operation */
 		if ( op->execute != NULL ) { /* Noop ? */
+			if ( interp->profile != NULL ) {
+				sieve_profile_sample_begin(&sample);
+				interp->profile_sample = &sample;
+			}
+
 			T_BEGIN {
 				result = op->execute(&(interp->runenv), address);
 			} T_END;
+
+			if ( interp->profile != NULL ) {
+				interp->profile_sample = NULL;
+				sieve_interpreter_profile_record(interp, &sample);
+			}
 		} else {
 			sieve_runtime_trace
 				(&interp->runenv, SIEVE_TRLVL_COMMANDS, "OP: %s (NOOP)",
@@ -946,6 +1241,12 @@ int sieve_interpreter_continue
 			break;
 		}
 
+		if ( !sieve_runtime_resource_charge
+			(renv, SIEVE_RESOURCE_INSTRUCTIONS, 1) ) {
+			ret = SIEVE_EXEC_FAILURE;
+			break;
+		}
+
 		ret = sieve_interpreter_operation_execute(interp);
 	}
 
@@ -127,6 +127,51 @@ unsigned int sieve_runtime_get_command_location
 const char *sieve_runtime_get_full_command_location
 	(const struct sieve_runtime_env *renv);
 
+/*
+ * Runtime pools
+ */
+
+enum sieve_runtime_pool_type {
+	SIEVE_RUNTIME_POOL_INTERPRETER = 0,
+	SIEVE_RUNTIME_POOL_MATCH,
+
+	SIEVE_RUNTIME_POOL_TYPE_COUNT
+};
+
+/* Returns an empty pool for runtime allocations. Pools released with
+   sieve_runtime_pool_release() are cleared and kept by the instance for reuse,
+   so that their memory is recycled across operations, included scripts and
+   messages. Pools are reused in LIFO order. */
+pool_t sieve_runtime_pool_get
+	(struct sieve_instance *svinst, enum sieve_runtime_pool_type type);
+void sieve_runtime_pool_release
+	(struct sieve_instance *svinst, enum sieve_runtime_pool_type type,
+		pool_t *_pool);
+
+void sieve_runtime_pools_deinit(struct sieve_instance *svinst);
+
+/*
+ * Resource budgets
+ */
+
+enum sieve_resource {
+	SIEVE_RESOURCE_INSTRUCTIONS = 0,
+	SIEVE_RESOURCE_MATCH_SIZE,
+	SIEVE_RESOURCE_REGEX_EXECUTIONS,
+	SIEVE_RESOURCE_BODY_DECODE_SIZE,
+
+	SIEVE_RESOURCE_COUNT
+};
+
+/* Charges the amount to the budget of the running script, which includes the
+   scripts it includes. The limits are those configured when the execution
+   started. Returns FALSE once the budget or the execution time is
+   exceeded; the caller must then abort with SIEVE_EXEC_FAILURE, after which
+   the implicit keep is performed. */
+bool sieve_runtime_resource_charge
+	(const struct sieve_runtime_env *renv, enum sieve_resource resource,
+		uint64_t amount);
+
 /*
  * Error handling
  */
@@ -35,6 +35,12 @@
 
 #define SIEVE_MAX_MATCH_VALUES         32
 
+/* Maximum number of cleared pools kept for reuse, per type */
+#define SIEVE_RUNTIME_POOL_CACHE_SIZE  8
+
+/* Minimum number of constant keys for which a key set is precompiled */
+#define SIEVE_MATCH_KEYSET_MIN_KEYS    4
+
 /*
  * Actions
  */
@@ -42,4 +48,20 @@
 #define SIEVE_DEFAULT_MAX_ACTIONS      32
 #define SIEVE_DEFAULT_MAX_REDIRECTS    4
 
+/*
+ * Binary cache
+ */
+
+#define SIEVE_DEFAULT_BINARY_CACHE_SIZE        32
+#define SIEVE_DEFAULT_BINARY_CACHE_MAX_MEMORY  (8 << 20)
+#define SIEVE_DEFAULT_BINARY_CACHE_DIR_MAX_SIZE (64 << 20)
+
+#define SIEVE_DEFAULT_COMPILE_LOCK_TIMEOUT     10
+
+/*
+ * Profiling
+ */
+
+#define SIEVE_DEFAULT_PROFILE_INTERVAL         60
+
 #endif /* __SIEVE_LIMITS_H */
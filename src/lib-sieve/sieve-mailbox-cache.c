@@ -0,0 +1,291 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "seq-range-array.h"
+#include "str-sanitize.h"
+#include "mail-storage.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-mailbox-cache.h"
+
+#define SIEVE_MAILBOX_CACHE_DEFAULT_COMMIT_INTERVAL 100
+
+struct sieve_mailbox_cache_entry {
+	struct sieve_mailbox_cache_entry *prev, *next;
+
+	char *name;
+	enum mailbox_flags flags;
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+
+	/* UIDs of the source messages saved in trans */
+	ARRAY_TYPE(seq_range) pending_uids;
+	unsigned int pending;
+	/* Store actions currently using the mailbox */
+	unsigned int refcount;
+};
+
+struct sieve_mailbox_cache {
+	struct sieve_instance *svinst;
+	struct mail_user *user;
+
+	unsigned int max_mailboxes;
+	unsigned int commit_interval;
+
+	/* Most recently used first */
+	struct sieve_mailbox_cache_entry *entries;
+	unsigned int count;
+
+	/* UIDs of the source messages lost since the last flush */
+	ARRAY_TYPE(seq_range) lost_uids;
+};
+
+/*
+ * Entries
+ */
+
+static struct sieve_mailbox_cache_entry *sieve_mailbox_cache_find_box
+(struct sieve_mailbox_cache *mbcache, struct mailbox *box)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	for ( entry = mbcache->entries; entry != NULL; entry = entry->next ) {
+		if ( entry->box == box )
+			return entry;
+	}
+	return NULL;
+}
+
+static int sieve_mailbox_cache_entry_commit
+(struct sieve_mailbox_cache *mbcache, struct sieve_mailbox_cache_entry *entry)
+{
+	enum mail_error error_code;
+	const char *error;
+	unsigned int pending = entry->pending;
+
+	if ( entry->trans == NULL )
+		return 0;
+
+	entry->pending = 0;
+	if ( mailbox_transaction_commit(&entry->trans) == 0 ) {
+		array_clear(&entry->pending_uids);
+		return 0;
+	}
+
+	error = mailbox_get_last_error(entry->box, &error_code);
+	sieve_sys_error(mbcache->svinst,
+		"failed to commit %u messages stored into mailbox '%s': %s",
+		pending, str_sanitize(entry->name, 128), error);
+	seq_range_array_merge(&mbcache->lost_uids, &entry->pending_uids);
+	array_clear(&entry->pending_uids);
+	return -1;
+}
+
+static void sieve_mailbox_cache_entry_free
+(struct sieve_mailbox_cache *mbcache,
+	struct sieve_mailbox_cache_entry **_entry, bool commit)
+{
+	struct sieve_mailbox_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	i_assert( entry->refcount == 0 );
+
+	DLLIST_REMOVE(&mbcache->entries, entry);
+	mbcache->count--;
+
+	if ( commit )
+		(void)sieve_mailbox_cache_entry_commit(mbcache, entry);
+	else if ( entry->trans != NULL )
+		mailbox_transaction_rollback(&entry->trans);
+
+	mailbox_free(&entry->box);
+	array_free(&entry->pending_uids);
+	i_free(entry->name);
+	i_free(entry);
+}
+
+static void sieve_mailbox_cache_trim(struct sieve_mailbox_cache *mbcache)
+{
+	struct sieve_mailbox_cache_entry *entry, *prev, *last = NULL;
+
+	if ( mbcache->count <= mbcache->max_mailboxes )
+		return;
+
+	for ( entry = mbcache->entries; entry != NULL; entry = entry->next )
+		last = entry;
+
+	/* Close the least recently used mailboxes that are not in use */
+	for ( entry = last; entry != NULL &&
+		mbcache->count > mbcache->max_mailboxes; entry = prev ) {
+		prev = entry->prev;
+
+		if ( entry->refcount == 0 )
+			sieve_mailbox_cache_entry_free(mbcache, &entry, TRUE);
+	}
+}
+
+/*
+ * Cache
+ */
+
+struct sieve_mailbox_cache *sieve_mailbox_cache_create
+(struct sieve_instance *svinst, struct mail_user *user)
+{
+	struct sieve_mailbox_cache *mbcache;
+	unsigned long long int uint_setting;
+	unsigned int max_mailboxes = 0;
+
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_mailbox_cache_max_mailboxes", &uint_setting) )
+		max_mailboxes = ( uint_setting > UINT_MAX ? UINT_MAX : uint_setting );
+	if ( max_mailboxes == 0 )
+		return NULL;
+
+	mbcache = i_new(struct sieve_mailbox_cache, 1);
+	mbcache->svinst = svinst;
+	mbcache->user = user;
+	mbcache->max_mailboxes = max_mailboxes;
+	i_array_init(&mbcache->lost_uids, 16);
+
+	mbcache->commit_interval = SIEVE_MAILBOX_CACHE_DEFAULT_COMMIT_INTERVAL;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_mailbox_cache_commit_interval", &uint_setting) ) {
+		mbcache->commit_interval = ( uint_setting > UINT_MAX ?
+			UINT_MAX : uint_setting );
+	}
+
+	return mbcache;
+}
+
+void sieve_mailbox_cache_destroy(struct sieve_mailbox_cache **_mbcache)
+{
+	struct sieve_mailbox_cache *mbcache = *_mbcache;
+	struct sieve_mailbox_cache_entry *entry;
+
+	*_mbcache = NULL;
+
+	while ( (entry=mbcache->entries) != NULL )
+		sieve_mailbox_cache_entry_free(mbcache, &entry, FALSE);
+	array_free(&mbcache->lost_uids);
+	i_free(mbcache);
+}
+
+int sieve_mailbox_cache_flush
+(struct sieve_mailbox_cache *mbcache, ARRAY_TYPE(seq_range) *lost_uids)
+{
+	struct sieve_mailbox_cache_entry *entry;
+	int ret = 0;
+
+	for ( entry = mbcache->entries; entry != NULL; entry = entry->next )
+		(void)sieve_mailbox_cache_entry_commit(mbcache, entry);
+
+	if ( array_count(&mbcache->lost_uids) > 0 ) {
+		if ( lost_uids != NULL )
+			seq_range_array_merge(lost_uids, &mbcache->lost_uids);
+		array_clear(&mbcache->lost_uids);
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Store action interface
+ */
+
+struct mailbox *sieve_mailbox_cache_get
+(struct sieve_mailbox_cache *mbcache, struct mail_user *user,
+	const char *name, enum mailbox_flags flags)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	if ( user != mbcache->user )
+		return NULL;
+
+	for ( entry = mbcache->entries; entry != NULL; entry = entry->next ) {
+		if ( entry->flags == flags && strcmp(entry->name, name) == 0 )
+			break;
+	}
+	if ( entry == NULL )
+		return NULL;
+
+	if ( entry != mbcache->entries ) {
+		DLLIST_REMOVE(&mbcache->entries, entry);
+		DLLIST_PREPEND(&mbcache->entries, entry);
+	}
+	entry->refcount++;
+	return entry->box;
+}
+
+bool sieve_mailbox_cache_add
+(struct sieve_mailbox_cache *mbcache, struct mail_user *user,
+	const char *name, enum mailbox_flags flags, struct mailbox *box)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	if ( user != mbcache->user )
+		return FALSE;
+
+	entry = i_new(struct sieve_mailbox_cache_entry, 1);
+	entry->name = i_strdup(name);
+	entry->flags = flags;
+	entry->box = box;
+	entry->refcount = 1;
+	i_array_init(&entry->pending_uids, 16);
+
+	DLLIST_PREPEND(&mbcache->entries, entry);
+	mbcache->count++;
+
+	sieve_mailbox_cache_trim(mbcache);
+	return TRUE;
+}
+
+void sieve_mailbox_cache_release
+(struct sieve_mailbox_cache *mbcache, struct mailbox **_box)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	entry = sieve_mailbox_cache_find_box(mbcache, *_box);
+	i_assert( entry != NULL && entry->refcount > 0 );
+
+	*_box = NULL;
+	entry->refcount--;
+
+	sieve_mailbox_cache_trim(mbcache);
+}
+
+struct mailbox_transaction_context *sieve_mailbox_cache_get_transaction
+(struct sieve_mailbox_cache *mbcache, struct mailbox *box)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	entry = sieve_mailbox_cache_find_box(mbcache, box);
+	i_assert( entry != NULL );
+
+	if ( entry->trans == NULL ) {
+		entry->trans = mailbox_transaction_begin
+			(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	}
+	return entry->trans;
+}
+
+int sieve_mailbox_cache_saved
+(struct sieve_mailbox_cache *mbcache, struct mailbox *box, uint32_t uid)
+{
+	struct sieve_mailbox_cache_entry *entry;
+
+	entry = sieve_mailbox_cache_find_box(mbcache, box);
+	i_assert( entry != NULL && entry->trans != NULL );
+
+	seq_range_array_add(&entry->pending_uids, uid);
+	entry->pending++;
+	if ( mbcache->commit_interval == 0 ||
+		entry->pending < mbcache->commit_interval )
+		return 0;
+
+	return sieve_mailbox_cache_entry_commit(mbcache, entry);
+}
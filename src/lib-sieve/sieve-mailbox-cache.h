@@ -0,0 +1,64 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_MAILBOX_CACHE_H
+#define __SIEVE_MAILBOX_CACHE_H
+
+#include "seq-range-array.h"
+#include "mail-storage.h"
+
+#include "sieve-common.h"
+
+/*
+ * Mailbox cache
+ *
+ *   Keeps the target mailboxes of store actions open across the executions
+ *   for a series of messages, e.g. those filtered by sieve-filter or those
+ *   handled by one IMAPSIEVE event. Messages stored into a cached mailbox are
+ *   saved into a transaction that is shared by all executions and committed
+ *   once every sieve_mailbox_cache_commit_interval messages and when the cache
+ *   is flushed. A message is saved only when the result is committed, so that
+ *   the failure or rollback of one execution does not affect the others.
+ *
+ *   A failed commit still loses all messages saved in that transaction. The
+ *   cache records the UIDs of their source messages and reports these when it
+ *   is flushed, so that the caller can keep exactly those source messages.
+ */
+
+/* Returns NULL when sieve_mailbox_cache_max_mailboxes is 0 */
+struct sieve_mailbox_cache *sieve_mailbox_cache_create
+	(struct sieve_instance *svinst, struct mail_user *user);
+/* Discards the messages saved since the last flush */
+void sieve_mailbox_cache_destroy(struct sieve_mailbox_cache **_mbcache);
+
+/* Commits all pending messages. Returns -1 when any of the messages saved
+   since the last flush could not be committed. The UIDs of the source
+   messages that were lost are then added to lost_uids, unless it is NULL. */
+int sieve_mailbox_cache_flush
+	(struct sieve_mailbox_cache *mbcache, ARRAY_TYPE(seq_range) *lost_uids);
+
+/*
+ * Store action interface
+ */
+
+/* Returns the mailbox and references it, or NULL when it is not cached */
+struct mailbox *sieve_mailbox_cache_get
+	(struct sieve_mailbox_cache *mbcache, struct mail_user *user,
+		const char *name, enum mailbox_flags flags);
+/* Adds a successfully opened mailbox to the cache; the cache takes over the
+   mailbox and references it. Returns FALSE when the cache cannot take it. */
+bool sieve_mailbox_cache_add
+	(struct sieve_mailbox_cache *mbcache, struct mail_user *user,
+		const char *name, enum mailbox_flags flags, struct mailbox *box);
+void sieve_mailbox_cache_release
+	(struct sieve_mailbox_cache *mbcache, struct mailbox **_box);
+
+struct mailbox_transaction_context *sieve_mailbox_cache_get_transaction
+	(struct sieve_mailbox_cache *mbcache, struct mailbox *box);
+/* Records that the source message with the given UID was saved in the
+   transaction of the mailbox. Returns -1 when the transaction was committed
+   as a result and this failed. */
+int sieve_mailbox_cache_saved
+	(struct sieve_mailbox_cache *mbcache, struct mailbox *box, uint32_t uid);
+
+#endif
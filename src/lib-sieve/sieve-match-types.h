@@ -67,6 +67,28 @@ struct sieve_match_type_def {
 			const char *key, size_t key_size);
 
 	void (*match_deinit)(struct sieve_match_context *mctx);
+
+	/* Precompiled key set (optional; only used for constant key lists) */
+
+	void *(*keyset_compile)
+		(pool_t pool, const struct sieve_comparator *cmp,
+			string_t *const *keys, unsigned int count);
+	int (*keyset_match)
+		(struct sieve_match_context *mctx, void *keyset,
+			const char *val, size_t val_size);
+
+	/* Streaming match (optional; used for large values such as message bodies).
+	   The keys are all known beforehand, and values are presented in chunks.
+	   stream_init() returns FALSE when streaming is not possible for these keys
+	   or this comparator. */
+
+	bool (*stream_init)
+		(struct sieve_match_context *mctx, string_t *const *keys,
+			unsigned int count);
+	void (*stream_value_begin)(struct sieve_match_context *mctx);
+	int (*stream_value_more)
+		(struct sieve_match_context *mctx, const char *data, size_t size);
+	int (*stream_value_end)(struct sieve_match_context *mctx);
 };
 
 /*
@@ -233,4 +255,12 @@ bool sieve_match_substring_validate_context
 		struct sieve_match_type_context *ctx,
 		struct sieve_ast_argument *key_arg);
 
+/* Common substring search for the i;octet (casemap=FALSE) and
+   i;ascii-casemap (casemap=TRUE) comparators; returns the first occurrence
+   of key in val or NULL */
+
+const char *sieve_match_substring_find
+	(const char *val, size_t val_size, const char *key, size_t key_size,
+		bool casemap);
+
 #endif /* __SIEVE_MATCH_TYPES_H */
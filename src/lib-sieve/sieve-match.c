@@ -5,8 +5,10 @@
 #include "mempool.h"
 #include "hash.h"
 #include "array.h"
+#include "str.h"
 #include "str-sanitize.h"
 
+#include "sieve-limits.h"
 #include "sieve-extensions.h"
 #include "sieve-commands.h"
 #include "sieve-stringlist.h"
@@ -22,6 +24,101 @@
 
 #include "sieve-match.h"
 
+/*
+ * Precompiled key sets
+ *
+ *   For key lists that consist of string literals only, the match type can
+ *   compile the keys into a more efficient structure once. The result is
+ *   stored with the binary, so that it is reused for every value and for every
+ *   subsequent execution of the same binary.
+ */
+
+struct sieve_match_keyset {
+	pool_t pool;
+
+	const struct sieve_match_type_def *mcht_def;
+	const struct sieve_comparator_def *cmp_def;
+
+	void *keyset;
+};
+
+static int sieve_match_keyset_owner;
+
+static void sieve_match_keyset_free(void *data)
+{
+	struct sieve_match_keyset *mkset = (struct sieve_match_keyset *)data;
+
+	pool_unref(&mkset->pool);
+}
+
+static struct sieve_match_keyset *sieve_match_keyset_compile
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct sieve_match_keyset *mkset = NULL;
+
+	T_BEGIN {
+		ARRAY(string_t *) keys;
+		pool_t pool;
+
+		t_array_init(&keys, 16);
+
+		/* Read errors are reported once the list is evaluated normally */
+		if ( sieve_code_stringlist_read_literals(key_list, &keys) > 0 &&
+			array_count(&keys) >= SIEVE_MATCH_KEYSET_MIN_KEYS ) {
+			pool = pool_alloconly_create("sieve_match_keyset", 4096);
+			mkset = p_new(pool, struct sieve_match_keyset, 1);
+			mkset->pool = pool;
+			mkset->mcht_def = mcht->def;
+			mkset->cmp_def = cmp->def;
+			mkset->keyset = mcht->def->keyset_compile
+				(pool, cmp, array_idx(&keys, 0), array_count(&keys));
+
+			if ( mkset->keyset == NULL ) {
+				pool_unref(&pool);
+				mkset = NULL;
+			}
+		}
+	} T_END;
+
+	return mkset;
+}
+
+static void *sieve_match_keyset_get
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_match_type_def *mcht_def = mctx->match_type->def;
+	struct sieve_match_keyset *mkset;
+	struct sieve_binary_block *sblock;
+	sieve_size_t address;
+	void *data;
+
+	/* Tracing reports the result for each individual key */
+	if ( mctx->trace || mcht_def->keyset_compile == NULL ||
+		mcht_def->keyset_match == NULL )
+		return NULL;
+
+	if ( !sieve_code_stringlist_get_address(key_list, &sblock, &address) )
+		return NULL;
+
+	if ( sieve_binary_runtime_data_lookup
+		(renv->sbin, &sieve_match_keyset_owner, sblock, address, &data) ) {
+		mkset = (struct sieve_match_keyset *)data;
+	} else {
+		/* Also record failure, so that we don't try again */
+		mkset = sieve_match_keyset_compile(mctx, key_list);
+		sieve_binary_runtime_data_add(renv->sbin, &sieve_match_keyset_owner,
+			sblock, address, mkset, sieve_match_keyset_free);
+	}
+
+	if ( mkset == NULL || mkset->mcht_def != mcht_def ||
+		mkset->cmp_def != mctx->comparator->def )
+		return NULL;
+	return mkset->keyset;
+}
+
 /*
  * Matching implementation
  */
@@ -40,7 +137,7 @@ struct sieve_match_context *sieve_match_begin
 			return NULL;
 
 	/* Create match context */
-	pool = pool_alloconly_create("sieve_match_context", 1024);
+	pool = sieve_runtime_pool_get(renv->svinst, SIEVE_RUNTIME_POOL_MATCH);
 	mctx = p_new(pool, struct sieve_match_context, 1);
 	mctx->pool = pool;
 	mctx->runenv = renv;
@@ -71,6 +168,7 @@ int sieve_match_value
 {
 	const struct sieve_match_type *mcht = mctx->match_type;
 	const struct sieve_runtime_env *renv = mctx->runenv;
+	void *keyset;
 	int match, ret;
 
 	if ( mctx->trace ) {
@@ -78,6 +176,13 @@ int sieve_match_value
 			"matching value `%s'", str_sanitize(value, 80));
 	}
 
+	if ( !sieve_runtime_resource_charge
+		(renv, SIEVE_RESOURCE_MATCH_SIZE, value_size) ) {
+		mctx->exec_status = SIEVE_EXEC_FAILURE;
+		mctx->match_status = -1;
+		return -1;
+	}
+
 	/* Match to key values */
 
 	sieve_stringlist_reset(key_list);
@@ -90,6 +195,9 @@ int sieve_match_value
 	if ( mcht->def->match_keys != NULL ) {
 		/* Call match-type's own key match handler */
 		match = mcht->def->match_keys(mctx, value, value_size, key_list);
+	} else if ( (keyset=sieve_match_keyset_get(mctx, key_list)) != NULL ) {
+		/* Use precompiled key set */
+		match = mcht->def->keyset_match(mctx, keyset, value, value_size);
 	} else {
 		string_t *key_item = NULL;
 
@@ -129,6 +237,7 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 {
 	const struct sieve_match_type *mcht = (*mctx)->match_type;
 	const struct sieve_runtime_env *renv = (*mctx)->runenv;
+	pool_t pool = (*mctx)->pool;
 	int match = (*mctx)->match_status;
 
 	if ( mcht->def != NULL && mcht->def->match_deinit != NULL )
@@ -137,7 +246,7 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 	if ( exec_status != NULL )
 		*exec_status = (*mctx)->exec_status;
 
-	pool_unref(&(*mctx)->pool);
+	sieve_runtime_pool_release(renv->svinst, SIEVE_RUNTIME_POOL_MATCH, &pool);
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
 		"finishing match with result: %s",
@@ -147,6 +256,97 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 	return match;
 }
 
+/*
+ * Streaming match
+ *
+ *   Values too large to be materialized (e.g. message bodies) are presented to
+ *   the match type in chunks, which only needs to retain as much of the value
+ *   as its keys can span. Once any key matches, the remaining chunks are
+ *   ignored. The same holds once the match fails (match_status < 0), e.g.
+ *   because the resource budget is exhausted.
+ */
+
+struct sieve_match_context *sieve_match_stream_begin
+(const struct sieve_runtime_env *renv,
+	const struct sieve_match_type *mcht,
+	const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *exec_status)
+{
+	struct sieve_match_context *mctx;
+	ARRAY(string_t *) keys;
+	string_t *key_item = NULL, *key;
+	unsigned int count;
+	int ret;
+
+	*exec_status = SIEVE_EXEC_OK;
+
+	/* Tracing reports the result for each individual value and key, and
+	   streamed values cannot be assigned to match variables */
+	if ( mcht->def == NULL || mcht->def->stream_init == NULL ||
+		sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING) ||
+		sieve_match_values_are_enabled(renv) )
+		return NULL;
+
+	if ( (mctx=sieve_match_begin(renv, mcht, cmp)) == NULL )
+		return NULL;
+
+	/* Keys are needed all at once */
+	p_array_init(&keys, mctx->pool, 16);
+	sieve_stringlist_reset(key_list);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		key = str_new(mctx->pool, str_len(key_item));
+		str_append_str(key, key_item);
+		array_append(&keys, &key, 1);
+	}
+
+	if ( ret < 0 ) {
+		*exec_status = key_list->exec_status;
+		(void)sieve_match_end(&mctx, NULL);
+		return NULL;
+	}
+
+	if ( !mcht->def->stream_init
+		(mctx, array_get(&keys, &count), count) ) {
+		(void)sieve_match_end(&mctx, NULL);
+		return NULL;
+	}
+	return mctx;
+}
+
+void sieve_match_stream_value_begin(struct sieve_match_context *mctx)
+{
+	if ( mctx->match_status != 0 )
+		return;
+
+	mctx->match_type->def->stream_value_begin(mctx);
+}
+
+int sieve_match_stream_value_more
+(struct sieve_match_context *mctx, const char *data, size_t size)
+{
+	if ( mctx->match_status != 0 )
+		return mctx->match_status;
+
+	if ( !sieve_runtime_resource_charge
+		(mctx->runenv, SIEVE_RESOURCE_MATCH_SIZE, size) ) {
+		mctx->exec_status = SIEVE_EXEC_FAILURE;
+		mctx->match_status = -1;
+	} else if ( mctx->match_type->def->stream_value_more
+		(mctx, data, size) > 0 )
+		mctx->match_status = 1;
+	return mctx->match_status;
+}
+
+int sieve_match_stream_value_end(struct sieve_match_context *mctx)
+{
+	if ( mctx->match_status != 0 )
+		return mctx->match_status;
+
+	if ( mctx->match_type->def->stream_value_end(mctx) > 0 )
+		mctx->match_status = 1;
+	return mctx->match_status;
+}
+
 int sieve_match
 (const struct sieve_runtime_env *renv,
 	const struct sieve_match_type *mcht,
@@ -19,6 +19,7 @@ struct sieve_match_context {
 	const struct sieve_comparator *comparator;
 
 	void *data;
+	void *stream_data;
 
 	int match_status;
 	int exec_status;
@@ -40,6 +41,18 @@ int sieve_match_value
 		struct sieve_stringlist *key_list);
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status);
 
+/* Streaming value matching; returns NULL when the match type does not support
+   it for these keys, or when reading the keys fails (exec_status != OK) */
+struct sieve_match_context *sieve_match_stream_begin
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_match_type *mcht,
+		const struct sieve_comparator *cmp,
+		struct sieve_stringlist *key_list, int *exec_status);
+void sieve_match_stream_value_begin(struct sieve_match_context *mctx);
+int sieve_match_stream_value_more
+	(struct sieve_match_context *mctx, const char *data, size_t size);
+int sieve_match_stream_value_end(struct sieve_match_context *mctx);
+
 /* Default matching operation */
 int sieve_match
 	(const struct sieve_runtime_env *renv,
@@ -6,7 +6,9 @@
 #include "mempool.h"
 #include "array.h"
 #include "str.h"
+#include "sha2.h"
 #include "str-sanitize.h"
+#include "hash.h"
 #include "istream.h"
 #include "rfc822-parser.h"
 #include "message-date.h"
@@ -73,8 +75,13 @@ struct sieve_message_part {
 	size_t decoded_body_size;
 	size_t text_body_size;
 
+	/* Location of the part in the message; only known for parts without
+	   nested parts, which can be decoded on their own */
+	uoff_t physical_pos, physical_size;
+
 	bool have_body:1; /* there's the empty end-of-headers line */
 	bool epilogue:1;  /* this is a multipart epilogue */
+	bool decodable:1; /* physical_pos and physical_size are known */
 };
 
 struct sieve_message_version {
@@ -84,6 +91,12 @@ struct sieve_message_version {
 	struct edit_mail *edit_mail;
 };
 
+struct sieve_message_header_cache {
+	/* Right-trimmed header values; NULL until fetched */
+	const char *const *values;
+	const char *const *utf8_values;
+};
+
 struct sieve_message_context {
 	pool_t pool;
 	pool_t context_pool;
@@ -112,16 +125,244 @@ struct sieve_message_context {
 
 	ARRAY(void *) ext_contexts;
 
-	/* Body */
+	/* Header and body analysis */
+
+	struct sieve_message_analysis *analysis;
+	/* Analysis replaced by that of an identical message during this
+	   execution */
+	struct sieve_message_analysis *replaced_analysis;
+
+	/* Header values after the headers were edited */
+	HASH_TABLE(const char *, struct sieve_message_header_cache *) header_cache;
+	unsigned int header_cache_hits, header_cache_misses;
 
-	ARRAY(struct sieve_message_part *) cached_body_parts;
 	ARRAY(struct sieve_message_part_data) return_body_parts;
-	buffer_t *raw_body;
 
+	bool edited_headers:1;
 	bool edit_snapshot:1;
 	bool substitute_snapshot:1;
 };
 
+/*
+ * Message analysis
+ *
+ *   The results of parsing the message that do not depend on the recipient:
+ *   header values and body parts. With sieve_message_analysis_cache enabled,
+ *   the analysis of the message as it was received is kept by the instance and
+ *   shared by subsequent executions for the same message of the same mail
+ *   object, e.g. for all recipients of an LMTP transaction that are delivered
+ *   from the same mail. This is checked without reading the message.
+ *
+ *   A different mail may still hold the same message, e.g. the copy saved for
+ *   the first recipient. Body data is only shared between such mails when their
+ *   complete messages are identical, so that a crafted message can never reuse
+ *   the body of another. The message is therefore hashed once body data is
+ *   first needed, rather than for every execution; an analysis with body data
+ *   is kept as a candidate until then. A shared analysis always describes the
+ *   received message; header values change once the headers are edited, so
+ *   these are then cached separately by the message context.
+ */
+
+struct sieve_message_analysis {
+	pool_t pool;
+	int refcount;
+
+	/* Message this analysis is shared for */
+	const struct mail *mail;
+	const struct mailbox *box;
+	uint32_t seq, uid;
+
+	/* Digest of the complete message; computed once body data is needed */
+	unsigned char digest[SHA256_RESULTLEN];
+	/* Analysis of the previous message, which is adopted once the digest
+	   shows it is the same message */
+	struct sieve_message_analysis *candidate;
+
+	/* Header cache */
+	HASH_TABLE(const char *, struct sieve_message_header_cache *) header_cache;
+
+	/* Body */
+	ARRAY(struct sieve_message_part *) cached_body_parts;
+	buffer_t *raw_body;
+
+	/* All parts of the message were listed in cached_body_parts */
+	bool body_parts_complete:1;
+	bool shared:1;
+	bool have_digest:1;
+};
+
+static struct sieve_message_analysis *sieve_message_analysis_create(void)
+{
+	struct sieve_message_analysis *analysis;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_message_analysis", 1024);
+	analysis = p_new(pool, struct sieve_message_analysis, 1);
+	analysis->pool = pool;
+	analysis->refcount = 1;
+
+	hash_table_create(&analysis->header_cache, pool, 0,
+		strcase_hash, strcasecmp);
+	p_array_init(&analysis->cached_body_parts, pool, 8);
+
+	return analysis;
+}
+
+static void sieve_message_analysis_unref
+(struct sieve_message_analysis **_analysis)
+{
+	struct sieve_message_analysis *analysis = *_analysis;
+
+	*_analysis = NULL;
+
+	i_assert(analysis->refcount > 0);
+	if (--analysis->refcount != 0)
+		return;
+
+	if ( analysis->candidate != NULL )
+		sieve_message_analysis_unref(&analysis->candidate);
+	hash_table_destroy(&analysis->header_cache);
+	pool_unref(&analysis->pool);
+}
+
+static void sieve_message_analysis_bind
+(struct sieve_message_analysis *analysis, const struct mail *mail)
+{
+	analysis->mail = mail;
+	analysis->box = mail->box;
+	analysis->seq = mail->seq;
+	analysis->uid = mail->uid;
+}
+
+static bool sieve_message_analysis_is_bound
+(const struct sieve_message_analysis *analysis, const struct mail *mail)
+{
+	return ( analysis->mail == mail && analysis->box == mail->box &&
+		analysis->seq == mail->seq && analysis->uid == mail->uid );
+}
+
+static int sieve_message_analysis_digest
+(struct mail *mail, unsigned char digest_r[SHA256_RESULTLEN])
+{
+	struct istream *input;
+	const unsigned char *data;
+	struct sha256_ctx ctx;
+	size_t size;
+
+	if ( mail_get_stream(mail, NULL, NULL, &input) < 0 )
+		return -1;
+
+	/* Hash the complete message; only messages that are identical may share
+	   the analysis of their body */
+	sha256_init(&ctx);
+	i_stream_seek(input, 0);
+	while ( i_stream_read_more(input, &data, &size) > 0 ) {
+		sha256_loop(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if ( input->stream_errno != 0 )
+		return -1;
+	i_stream_seek(input, 0);
+
+	sha256_result(&ctx, digest_r);
+	return 0;
+}
+
+static struct sieve_message_analysis *sieve_message_analysis_get
+(struct sieve_message_context *msgctx)
+{
+	struct sieve_instance *svinst = msgctx->svinst;
+	struct mail *mail = msgctx->msgdata->mail;
+	struct sieve_message_analysis *analysis;
+
+	if ( !svinst->message_analysis_cache || mail == NULL )
+		return sieve_message_analysis_create();
+
+	analysis = svinst->message_analysis;
+	if ( analysis != NULL && sieve_message_analysis_is_bound(analysis, mail) ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "message analysis cache: "
+				"reusing analysis of message");
+		}
+		analysis->refcount++;
+		return analysis;
+	}
+
+	/* Only the most recent message is retained */
+	svinst->message_analysis = sieve_message_analysis_create();
+	sieve_message_analysis_bind(svinst->message_analysis, mail);
+	svinst->message_analysis->shared = TRUE;
+
+	/* Its body data may be adopted once the messages prove identical */
+	if ( analysis != NULL ) {
+		if ( analysis->have_digest )
+			svinst->message_analysis->candidate = analysis;
+		else
+			sieve_message_analysis_unref(&analysis);
+	}
+
+	svinst->message_analysis->refcount++;
+	return svinst->message_analysis;
+}
+
+/* Called before body data of the message is looked up or added to the
+   analysis */
+static void sieve_message_analysis_body_prepare
+(struct sieve_message_context *msgctx)
+{
+	struct sieve_instance *svinst = msgctx->svinst;
+	struct sieve_message_analysis *analysis = msgctx->analysis;
+	struct sieve_message_analysis *candidate;
+	struct mail *mail = msgctx->msgdata->mail;
+
+	if ( !analysis->shared || analysis->have_digest ||
+		svinst->message_analysis != analysis )
+		return;
+
+	if ( sieve_message_analysis_digest(mail, analysis->digest) < 0 ) {
+		/* Never share body data that is not keyed by a digest */
+		analysis->shared = FALSE;
+		if ( analysis->candidate != NULL )
+			sieve_message_analysis_unref(&analysis->candidate);
+		sieve_message_analysis_unref(&svinst->message_analysis);
+		return;
+	}
+	analysis->have_digest = TRUE;
+
+	candidate = analysis->candidate;
+	analysis->candidate = NULL;
+	if ( candidate == NULL )
+		return;
+	if ( memcmp(candidate->digest, analysis->digest,
+		sizeof(analysis->digest)) != 0 ) {
+		sieve_message_analysis_unref(&candidate);
+		return;
+	}
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "message analysis cache: "
+			"reusing analysis of identical message");
+	}
+
+	/* Adopt the analysis of the identical message. The replaced one is kept
+	   until the message context is flushed, since the values it returned
+	   may still be in use. */
+	sieve_message_analysis_bind(candidate, mail);
+	sieve_message_analysis_unref(&svinst->message_analysis);
+	svinst->message_analysis = candidate;
+	candidate->refcount++;
+
+	i_assert( msgctx->replaced_analysis == NULL );
+	msgctx->replaced_analysis = msgctx->analysis;
+	msgctx->analysis = candidate;
+}
+
+void sieve_message_analysis_cache_deinit(struct sieve_instance *svinst)
+{
+	if ( svinst->message_analysis != NULL )
+		sieve_message_analysis_unref(&svinst->message_analysis);
+}
+
 /*
  * Message versions
  */
@@ -219,11 +460,21 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 	if (--(*msgctx)->refcount != 0)
 		return;
 
+	if ( (*msgctx)->svinst->debug && (*msgctx)->header_cache_hits > 0 ) {
+		sieve_sys_debug((*msgctx)->svinst, "message header cache: "
+			"%u header fetches saved (%u fetched)",
+			(*msgctx)->header_cache_hits, (*msgctx)->header_cache_misses);
+	}
+
 	if ( (*msgctx)->raw_mail_user != NULL )
 		mail_user_unref(&(*msgctx)->raw_mail_user);
 
 	sieve_message_context_clear(*msgctx);
 
+	if ( (*msgctx)->analysis != NULL )
+		sieve_message_analysis_unref(&(*msgctx)->analysis);
+	if ( (*msgctx)->replaced_analysis != NULL )
+		sieve_message_analysis_unref(&(*msgctx)->replaced_analysis);
 	if ( (*msgctx)->context_pool != NULL )
 		pool_unref(&((*msgctx)->context_pool));
 
@@ -244,9 +495,21 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
-	p_array_init(&msgctx->cached_body_parts, pool, 8);
+	hash_table_create(&msgctx->header_cache, pool, 0,
+		strcase_hash, strcasecmp);
+	msgctx->edited_headers = FALSE;
+
 	p_array_init(&msgctx->return_body_parts, pool, 8);
-	msgctx->raw_body = NULL;
+
+	/* Only the message as it was received can be shared */
+	if ( msgctx->analysis != NULL )
+		sieve_message_analysis_unref(&msgctx->analysis);
+	if ( msgctx->replaced_analysis != NULL )
+		sieve_message_analysis_unref(&msgctx->replaced_analysis);
+	if ( array_count(&msgctx->versions) == 0 )
+		msgctx->analysis = sieve_message_analysis_get(msgctx);
+	else
+		msgctx->analysis = sieve_message_analysis_create();
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
@@ -478,6 +741,27 @@ struct mail *sieve_message_get_mail
 	return versions[count-1].mail;
 }
 
+static bool sieve_message_is_edited(struct sieve_message_context *msgctx)
+{
+	const struct sieve_message_version *versions;
+	unsigned int count;
+
+	/* A shared analysis is made from the received message */
+	if ( msgctx->analysis->shared )
+		return FALSE;
+
+	versions = array_get(&msgctx->versions, &count);
+	return ( count > 0 && versions[count-1].edit_mail != NULL );
+}
+
+static struct mail *sieve_message_get_body_mail
+(struct sieve_message_context *msgctx)
+{
+	if ( msgctx->analysis->shared )
+		return msgctx->msgdata->mail;
+	return sieve_message_get_mail(msgctx);
+}
+
 struct edit_mail *sieve_message_edit
 (struct sieve_message_context *msgctx)
 {
@@ -494,6 +778,10 @@ struct edit_mail *sieve_message_edit
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The caller is about to modify the headers */
+	hash_table_clear(msgctx->header_cache, FALSE);
+	msgctx->edited_headers = TRUE;
+
 	return version->edit_mail;
 }
 
@@ -551,23 +839,94 @@ struct sieve_header_list *sieve_message_header_list_create
 	return &hdrlist->hdrlist;
 }
 
-// NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+/*
+ * Header cache
+ *
+ *   Header values are fetched from the mail and right-trimmed only once per
+ *   message version, no matter how many tests (and scripts) use them. The
+ *   cache is cleared when the message is substituted or edited.
+ */
+
+static const char *_header_right_trim(pool_t pool, const char *raw)
 {
-	string_t *result;
 	const char *p, *pend;
 
 	pend = raw + strlen(raw);
-	if (raw == pend) {
-		result = t_str_new(1);
+	for ( p = pend; p > raw; p-- ) {
+		if ( p[-1] != ' ' && p[-1] != '\t' ) break;
+	}
+	if ( p == pend )
+		return p_strdup(pool, raw);
+	return p_strdup_until(pool, raw, p);
+}
+
+int sieve_message_get_header_values
+(struct sieve_message_context *msgctx, const char *field_name,
+	bool mime_decode, const char *const **values_r)
+{
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	struct sieve_message_analysis *analysis = msgctx->analysis;
+	pool_t pool;
+	struct sieve_message_header_cache *hcache;
+	const char *const *headers, *const **cached;
+	const char **values;
+	unsigned int count, i;
+	int ret;
+
+	if ( msgctx->edited_headers ) {
+		pool = msgctx->context_pool;
+		hcache = hash_table_lookup(msgctx->header_cache, field_name);
+		if ( hcache == NULL ) {
+			hcache = p_new(pool, struct sieve_message_header_cache, 1);
+			hash_table_insert(msgctx->header_cache,
+				p_strdup(pool, field_name), hcache);
+		}
 	} else {
-		for ( p = pend-1; p >= raw; p-- ) {
-			if ( *p != ' ' && *p != '\t' ) break;
+		pool = analysis->pool;
+		hcache = hash_table_lookup(analysis->header_cache, field_name);
+		if ( hcache == NULL ) {
+			hcache = p_new(pool, struct sieve_message_header_cache, 1);
+			hash_table_insert(analysis->header_cache,
+				p_strdup(pool, field_name), hcache);
 		}
-		result = t_str_new(p - raw + 1);
-		str_append_n(result, raw, p - raw + 1);
 	}
-	return result;
+
+	cached = ( mime_decode ? &hcache->utf8_values : &hcache->values );
+	if ( *cached != NULL ) {
+		msgctx->header_cache_hits++;
+		*values_r = *cached;
+		return ( (*cached)[0] == NULL ? 0 : 1 );
+	}
+	msgctx->header_cache_misses++;
+
+	/* Fetch all matching headers from the e-mail */
+	if ( mime_decode )
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if ( ret < 0 )
+		return -1;
+
+	if ( ret == 0 || headers == NULL ) {
+		*cached = p_new(pool, const char *, 1);
+	} else {
+		count = str_array_length(headers);
+		values = p_new(pool, const char *, count + 1);
+		for ( i = 0; i < count; i++ )
+			values[i] = _header_right_trim(pool, headers[i]);
+		*cached = values;
+	}
+
+	*values_r = *cached;
+	return ( (*cached)[0] == NULL ? 0 : 1 );
+}
+
+void sieve_message_header_cache_get_stats
+(struct sieve_message_context *msgctx, unsigned int *hits_r,
+	unsigned int *misses_r)
+{
+	*hits_r = msgctx->header_cache_hits;
+	*misses_r = msgctx->header_cache_misses;
 }
 
 /* String list implementation */
@@ -579,7 +938,7 @@ static int sieve_message_header_list_next_item
 	struct sieve_message_header_list *hdrlist =
 		(struct sieve_message_header_list *) _hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
-	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	const char *value;
 
 	if ( name_r != NULL )
 		*name_r = NULL;
@@ -611,23 +970,19 @@ static int sieve_message_header_list_next_item
 				str_sanitize(str_c(hdr_item), 80));
 		}
 
-		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
+		/* Fetch all matching headers from the e-mail (cached) */
+		ret = sieve_message_get_header_values(renv->msgctx,
+			str_c(hdr_item), hdrlist->mime_decode, &hdrlist->headers);
 
 		if (ret < 0) {
 			_hdrlist->strlist.exec_status =
-				sieve_runtime_mail_error(renv, mail,
+				sieve_runtime_mail_error(renv,
+					sieve_message_get_mail(renv->msgctx),
 					"failed to read header field `%s'", str_c(hdr_item));
 			return -1;
 		}
 
-		if ( ret == 0 || hdrlist->headers[0] == NULL ) {
+		if ( ret == 0 ) {
 			/* Try next item when no headers found */
 			hdrlist->headers = NULL;
 		}
@@ -636,7 +991,8 @@ static int sieve_message_header_list_next_item
 	/* Return next item */
 	if ( name_r != NULL )
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(hdrlist->headers[hdrlist->headers_index++]);
+	value = hdrlist->headers[hdrlist->headers_index++];
+	*value_r = t_str_new_const(value, strlen(value));
 	return 1;
 }
 
@@ -990,12 +1346,15 @@ static bool sieve_message_body_get_return_parts
 	bool extract_text)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
+	size_t max_size = msgctx->svinst->body_max_scan_size;
 	struct sieve_message_part *const *body_parts;
 	unsigned int i, count;
 	struct sieve_message_part_data *return_part;
 
+	sieve_message_analysis_body_prepare(msgctx);
+
 	/* Check whether any body parts are cached already */
-	body_parts = array_get(&msgctx->cached_body_parts, &count);
+	body_parts = array_get(&msgctx->analysis->cached_body_parts, &count);
 	if ( count == 0 )
 		return FALSE;
 
@@ -1034,8 +1393,12 @@ static bool sieve_message_body_get_return_parts
 			if (body_parts[i]->decoded_body == NULL)
 				return FALSE;
 			return_part->content = body_parts[i]->decoded_body;
-			return_part->size = body_parts[i]->decoded_body_size;				
+			return_part->size = body_parts[i]->decoded_body_size;
 		}
+
+		/* Only the configured amount of each part is scanned */
+		if ( max_size > 0 && return_part->size > max_size )
+			return_part->size = max_size;
 	}
 
 	return TRUE;
@@ -1047,7 +1410,7 @@ static void sieve_message_part_save
 	bool extract_text)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	pool_t pool = msgctx->analysis->pool;
 	buffer_t *result_buf, *text_buf = NULL;
 	char *part_data;
 	size_t part_size;
@@ -1099,6 +1462,89 @@ static void sieve_message_part_save
 	buffer_set_used_size(buf, 0);
 }
 
+/* Body part stream
+ *
+ *   Rather than storing the body parts in the cache, their content can be
+ *   passed directly to a streaming match as it is decoded.
+ */
+
+struct sieve_message_part_stream {
+	struct sieve_match_context *mctx;
+
+	struct mail_html2text *html2text;
+	buffer_t *text_buf;
+
+	size_t max_size, size;
+
+	bool active:1;
+};
+
+static void sieve_message_part_stream_begin
+(struct sieve_message_part_stream *pstream,
+	struct sieve_message_part *body_part, bool extract_text)
+{
+	i_assert( !pstream->active );
+
+	pstream->active = TRUE;
+	pstream->size = 0;
+
+	/* Remove HTML markup while streaming */
+	if ( extract_text && !body_part->epilogue &&
+		mail_html2text_content_type_match(body_part->content_type) )
+		pstream->html2text = mail_html2text_init(0);
+
+	sieve_match_stream_value_begin(pstream->mctx);
+}
+
+static void sieve_message_part_stream_more
+(struct sieve_message_part_stream *pstream,
+	const unsigned char *data, size_t size)
+{
+	if ( !pstream->active )
+		return;
+	if ( pstream->max_size > 0 && pstream->size >= pstream->max_size )
+		return;
+
+	if ( pstream->html2text != NULL ) {
+		buffer_set_used_size(pstream->text_buf, 0);
+		mail_html2text_more(pstream->html2text, data, size, pstream->text_buf);
+		data = pstream->text_buf->data;
+		size = pstream->text_buf->used;
+	}
+
+	if ( pstream->max_size > 0 && size > pstream->max_size - pstream->size )
+		size = pstream->max_size - pstream->size;
+	pstream->size += size;
+
+	(void)sieve_match_stream_value_more
+		(pstream->mctx, (const char *)data, size);
+}
+
+static void sieve_message_part_stream_end
+(struct sieve_message_part_stream *pstream)
+{
+	if ( !pstream->active )
+		return;
+
+	if ( pstream->html2text != NULL )
+		mail_html2text_deinit(&pstream->html2text);
+
+	(void)sieve_match_stream_value_end(pstream->mctx);
+	pstream->active = FALSE;
+}
+
+static inline void sieve_message_part_append
+(struct sieve_message_part_stream *pstream, buffer_t *buf,
+	const void *data, size_t size)
+{
+	if ( pstream != NULL ) {
+		sieve_message_part_stream_more
+			(pstream, (const unsigned char *)data, size);
+	} else {
+		buffer_append(buf, data, size);
+	}
+}
+
 static const char *
 _parse_content_type(const struct message_header_line *hdr)
 {
@@ -1147,18 +1593,156 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
+/* sieve_message_part_decode():
+ *   Decode the body of a single part, using the MIME structure recorded while
+ *   the message was parsed before. This avoids parsing the whole message again
+ *   when other content types are requested later on.
+ */
+static int sieve_message_part_decode
+(const struct sieve_runtime_env *renv, struct istream *input,
+	struct sieve_message_part *body_part, bool extract_text,
+	buffer_t *buf, struct sieve_message_part_stream *pstream)
+	ATTR_NULL(6)
+{
+	struct message_parser_ctx *parser;
+	struct message_decoder_context *decoder;
+	struct message_block block, decoded;
+	struct message_part *parts;
+	struct istream *part_input;
+	bool exceeded = FALSE;
+	int status = SIEVE_EXEC_OK;
+
+	i_assert( body_part->decodable );
+	part_input = i_stream_create_range(input, body_part->physical_pos,
+		body_part->physical_size);
+
+	/* The part headers determine how the body is decoded */
+	decoder = message_decoder_init(NULL, 0);
+	parser = message_parser_init(pool_datastack_create(), part_input,
+		MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP, 0);
+
+	if ( pstream != NULL )
+		sieve_message_part_stream_begin(pstream, body_part, extract_text);
+	while ( (pstream == NULL || pstream->mctx->match_status == 0) &&
+		message_parser_parse_next_block(parser, &block) > 0 ) {
+		(void)message_decoder_decode_next_block(decoder, &block, &decoded);
+		if ( block.hdr != NULL || block.size == 0 )
+			continue;
+
+		if ( !sieve_runtime_resource_charge
+			(renv, SIEVE_RESOURCE_BODY_DECODE_SIZE, decoded.size) ) {
+			exceeded = TRUE;
+			break;
+		}
+		sieve_message_part_append
+			(pstream, buf, decoded.data, decoded.size);
+	}
+	if ( pstream != NULL )
+		sieve_message_part_stream_end(pstream);
+
+	(void)message_parser_deinit(&parser, &parts);
+	message_decoder_deinit(&decoder);
+
+	if ( part_input->stream_errno != 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to read input message",
+			"read(%s) failed: %s",
+			i_stream_get_name(part_input),
+			i_stream_get_error(part_input));
+		status = SIEVE_EXEC_TEMP_FAILURE;
+	} else if ( exceeded ) {
+		status = SIEVE_EXEC_FAILURE;
+	}
+	i_stream_unref(&part_input);
+
+	if ( status != SIEVE_EXEC_OK ) {
+		buffer_set_used_size(buf, 0);
+		return status;
+	}
+
+	if ( pstream == NULL )
+		sieve_message_part_save(renv, buf, body_part, extract_text);
+	return SIEVE_EXEC_OK;
+}
+
+/* sieve_message_parts_decode_missing():
+ *   Decode the requested parts individually. Returns FALSE when this is not
+ *   possible, in which case the whole message needs to be parsed.
+ */
+static bool sieve_message_parts_decode_missing
+(const struct sieve_runtime_env *renv,
+	const char *const *content_types, bool extract_text,
+	struct sieve_message_part_stream *pstream, int *status_r)
+	ATTR_NULL(2, 4)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct mail *mail = sieve_message_get_body_mail(renv->msgctx);
+	struct sieve_message_part *const *body_parts;
+	struct istream *input;
+	unsigned int count, i;
+	buffer_t *buf;
+	int status = SIEVE_EXEC_OK;
+
+	/* Edited messages differ from the MIME structure of the mail */
+	if ( !msgctx->analysis->body_parts_complete ||
+		sieve_message_is_edited(msgctx) )
+		return FALSE;
+
+	body_parts = array_get(&msgctx->analysis->cached_body_parts, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( body_parts[i]->have_body && !body_parts[i]->decodable &&
+			_is_wanted_content_type(content_types, body_parts[i]->content_type) )
+			return FALSE;
+	}
+
+	if ( mail_get_stream(mail, NULL, NULL, &input) < 0 ) {
+		*status_r = sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+		return TRUE;
+	}
+
+	buf = buffer_create_dynamic(default_pool, 4096);
+	for ( i = 0; i < count && status == SIEVE_EXEC_OK &&
+		(pstream == NULL || pstream->mctx->match_status == 0); i++ ) {
+		struct sieve_message_part *body_part = body_parts[i];
+
+		/* Parts without a body never match */
+		if ( !body_part->have_body || !_is_wanted_content_type
+			(content_types, body_part->content_type) )
+			continue;
+		if ( pstream == NULL && (extract_text ?
+			body_part->text_body : body_part->decoded_body) != NULL )
+			continue;
+
+		status = sieve_message_part_decode
+			(renv, input, body_part, extract_text, buf, pstream);
+	}
+	buffer_free(&buf);
+
+	if ( status == SIEVE_EXEC_OK && pstream == NULL ) {
+		/* Failure is a bug */
+		i_assert( sieve_message_body_get_return_parts
+			(renv, content_types, extract_text) );
+	}
+
+	*status_r = status;
+	return TRUE;
+}
+
 /* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+ *   Add requested message body parts to the cache that are missing. If pstream
+ *   is not NULL, the requested parts are passed to the stream instead.
  */
 static int sieve_message_parts_add_missing
 (const struct sieve_runtime_env *renv,
 	const char *const *content_types,
-	bool extract_text, bool iter_all)
-	ATTR_NULL(2)
+	bool extract_text, bool iter_all,
+	struct sieve_message_part_stream *pstream)
+	ATTR_NULL(2, 5)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
-	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	pool_t pool;
+	struct mail *mail = sieve_message_get_body_mail(renv->msgctx);
 	enum message_parser_flags mparser_flags =
 		MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS;
 	enum message_header_parser_flags hparser_flags =
@@ -1169,20 +1753,30 @@ static int sieve_message_parts_add_missing
 	struct message_decoder_context *decoder;
 	struct message_block block, decoded;
 	struct message_part *mparts, *prev_mpart = NULL;
+	HASH_TABLE(struct message_part *, struct sieve_message_part *) part_map;
 	buffer_t *buf;
 	struct istream *input;
 	unsigned int idx = 0;
-	bool save_body = FALSE, have_all;
+	bool save_body = FALSE, have_all, exceeded = FALSE, from_parts;
 	string_t *hdr_content = NULL;
-	int ret;
+	int status, ret = 0;
+
+	/* May adopt the analysis of an identical message */
+	sieve_message_analysis_body_prepare(msgctx);
+	pool = msgctx->analysis->pool;
 
 	/* First check whether any are missing */
-	if ( !iter_all && sieve_message_body_get_return_parts
+	if ( !iter_all && pstream == NULL && sieve_message_body_get_return_parts
 		(renv, content_types, extract_text) ) {
 		/* Cache hit; all are present */
 		return SIEVE_EXEC_OK;
 	}
 
+	/* Decode only the missing parts if the structure is known already */
+	if ( !iter_all && sieve_message_parts_decode_missing
+		(renv, content_types, extract_text, pstream, &status) )
+		return status;
+
 	/* Get the message stream */
 	if ( mail_get_stream(mail, NULL, NULL, &input) < 0 ) {
 		return sieve_runtime_mail_error(renv, mail,
@@ -1207,13 +1801,22 @@ static int sieve_message_parts_add_missing
 	/* Initialize body decoder */
 	decoder = message_decoder_init(NULL, 0);
 
-	// FIXME: currently not tested with edit-mail.
-		//parser = message_parser_init_from_parts(parts, input,
-		// hparser_flags, mparser_flags);
-	parser = message_parser_init(pool_datastack_create(),
-		input, hparser_flags, mparser_flags);
-	while ( (ret=message_parser_parse_next_block
-		(parser, &block)) > 0 ) {
+	/* Reuse the MIME structure of the mail (often from its index), unless the
+	   headers were edited; the edited message stream does not match it. */
+	from_parts = !sieve_message_is_edited(msgctx);
+	if ( from_parts ) {
+		parser = message_parser_init_from_parts(mparts,
+			input, hparser_flags, mparser_flags);
+	} else {
+		parser = message_parser_init(pool_datastack_create(),
+			input, hparser_flags, mparser_flags);
+	}
+
+	/* The context field of the mail's parts is not ours to use */
+	hash_table_create_direct(&part_map, default_pool, 0);
+
+	while ( (pstream == NULL || pstream->mctx->match_status == 0) &&
+		(ret=message_parser_parse_next_block(parser, &block)) > 0 ) {
 		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
 		struct sieve_message_header *header;
@@ -1228,11 +1831,11 @@ static int sieve_message_parts_add_missing
 				if ( block.part->parent == prev_mpart &&
 					strcmp(body_part->content_type, "message/rfc822") == 0 ) {
 					message_rfc822 = TRUE;
-				} else {
-					if ( save_body ) {
-						sieve_message_part_save
-							(renv, buf, body_part, extract_text);
-					}
+				} else if ( pstream != NULL ) {
+					sieve_message_part_stream_end(pstream);
+				} else if ( save_body ) {
+					sieve_message_part_save
+						(renv, buf, body_part, extract_text);
 				}
 				if ( iter_all && !array_is_created(&body_part->headers) &&
 					array_count(&headers) > 0 ) {
@@ -1244,19 +1847,19 @@ static int sieve_message_parts_add_missing
 
 			/* Start processing next part */
 			body_part_idx = array_idx_modifiable
-				(&msgctx->cached_body_parts, idx);
+				(&msgctx->analysis->cached_body_parts, idx);
 			if ( *body_part_idx == NULL )
 				*body_part_idx = p_new(pool, struct sieve_message_part, 1);
 			body_part = *body_part_idx;
 			body_part->content_type = "text/plain";
+			body_part->decodable = FALSE;
 			if ( iter_all )
 				array_clear(&headers);
 
 			/* Copy tree structure */
-			if ( block.part->context != NULL ) {
+			if ( hash_table_lookup(part_map, block.part) != NULL ) {
 				struct sieve_message_part *epipart =
-					(struct sieve_message_part *)block.part->context;
-				i_assert(epipart != NULL);
+					hash_table_lookup(part_map, block.part);
 
 				/* multipart epilogue */
 				body_part->content_type = epipart->content_type;
@@ -1264,18 +1867,31 @@ static int sieve_message_parts_add_missing
 				body_part->epilogue = TRUE;
 				save_body = iter_all || _is_wanted_content_type
 					(content_types, body_part->content_type);
+				if ( pstream != NULL && save_body ) {
+					sieve_message_part_stream_begin
+						(pstream, body_part, extract_text);
+				}
 
 			} else {
 				struct sieve_message_part *parent = NULL;
 
 				if ( block.part->parent != NULL ) {
 					body_part->parent = parent =
-						(struct sieve_message_part *)
-							block.part->parent->context;
+						hash_table_lookup(part_map, block.part->parent);
 				}
 
 				/* new part */
-				block.part->context = (void*)body_part;
+				hash_table_insert(part_map, block.part, body_part);
+				if ( from_parts && (block.part->flags &
+					(MESSAGE_PART_FLAG_MULTIPART |
+						MESSAGE_PART_FLAG_MESSAGE_RFC822)) == 0 ) {
+					/* Copied, since the MIME structure belongs to the mail */
+					body_part->physical_pos = block.part->physical_pos;
+					body_part->physical_size =
+						block.part->header_size.physical_size +
+						block.part->body_size.physical_size;
+					body_part->decodable = TRUE;
+				}
 
 				if ( last_part != NULL ) {
 					i_assert( parent != NULL );
@@ -1300,7 +1916,7 @@ static int sieve_message_parts_add_missing
 			if ( message_rfc822 ) {
 				i_assert(idx > 0);
 				body_part_idx = array_idx_modifiable
-					(&msgctx->cached_body_parts, idx-1);
+					(&msgctx->analysis->cached_body_parts, idx-1);
 				header_part = *body_part_idx;
 			} else {
 				header_part = NULL;
@@ -1327,8 +1943,12 @@ static int sieve_message_parts_add_missing
 			if ( hdr == NULL ) {
 				/* Save headers for message/rfc822 part */
 				if ( header_part != NULL ) {
-					sieve_message_part_save
-						(renv, buf, header_part, FALSE);
+					if ( pstream != NULL ) {
+						sieve_message_part_stream_end(pstream);
+					} else {
+						sieve_message_part_save
+							(renv, buf, header_part, FALSE);
+					}
 					header_part = NULL;
 				}
 
@@ -1336,6 +1956,12 @@ static int sieve_message_parts_add_missing
 				i_assert( body_part != NULL );
 				save_body = iter_all || _is_wanted_content_type
 					(content_types, body_part->content_type);
+
+				/* Parts without a body never match */
+				if ( pstream != NULL && save_body && body_part->have_body ) {
+					sieve_message_part_stream_begin
+						(pstream, body_part, extract_text);
+				}
 				continue;
 			}
 
@@ -1349,14 +1975,18 @@ static int sieve_message_parts_add_missing
 			} else if ( header_part != NULL ) {
 				/* Save message/rfc822 header as part content */
 				if ( hdr->continued ) {
-					buffer_append(buf, hdr->value, hdr->value_len);
+					sieve_message_part_append
+						(pstream, buf, hdr->value, hdr->value_len);
 				} else {
-					buffer_append(buf, hdr->name, hdr->name_len);
-					buffer_append(buf, hdr->middle, hdr->middle_len);
-					buffer_append(buf, hdr->value, hdr->value_len);
+					sieve_message_part_append
+						(pstream, buf, hdr->name, hdr->name_len);
+					sieve_message_part_append
+						(pstream, buf, hdr->middle, hdr->middle_len);
+					sieve_message_part_append
+						(pstream, buf, hdr->value, hdr->value_len);
 				}
 				if ( !hdr->no_newline ) {
-					buffer_append(buf, "\r\n", 2);
+					sieve_message_part_append(pstream, buf, "\r\n", 2);
 				}
 			}
 
@@ -1455,12 +2085,36 @@ static int sieve_message_parts_add_missing
 		if ( save_body ) {
 			(void)message_decoder_decode_next_block
 					(decoder, &block, &decoded);
-			buffer_append(buf, decoded.data, decoded.size);
+			if ( !sieve_runtime_resource_charge
+				(renv, SIEVE_RESOURCE_BODY_DECODE_SIZE, decoded.size) ) {
+				exceeded = TRUE;
+				break;
+			}
+			sieve_message_part_append
+				(pstream, buf, decoded.data, decoded.size);
 		}
 	}
 
+	hash_table_destroy(&part_map);
+
+	if ( exceeded ) {
+		/* Execution is aborted; cache nothing of the partial part */
+		if ( pstream != NULL )
+			sieve_message_part_stream_end(pstream);
+		(void)message_parser_deinit(&parser, &mparts);
+		message_decoder_deinit(&decoder);
+		buffer_free(&buf);
+		return SIEVE_EXEC_FAILURE;
+	}
+
+	/* The structure is complete when the whole message was parsed */
+	msgctx->analysis->body_parts_complete = ( ret < 0 && input->stream_errno == 0 );
+
 	/* Save last body part if necessary */
-	if ( header_part != NULL ) {
+	if ( pstream != NULL ) {
+		/* Also ends a part when the stream stopped early */
+		sieve_message_part_stream_end(pstream);
+	} else if ( header_part != NULL ) {
 		sieve_message_part_save
 			(renv, buf, header_part, FALSE);
 	} else if ( body_part != NULL && save_body ) {
@@ -1475,14 +2129,25 @@ static int sieve_message_parts_add_missing
 	}
 
 	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all || sieve_message_body_get_return_parts
-		(renv, content_types, extract_text);
+	have_all = iter_all || pstream != NULL ||
+		sieve_message_body_get_return_parts
+			(renv, content_types, extract_text);
 
 	/* This time, failure is a bug */
 	i_assert(have_all);
 
 	/* Cleanup */
-	(void)message_parser_deinit(&parser, &mparts);
+	if ( message_parser_deinit(&parser, &mparts) < 0 && from_parts ) {
+		/* The parts are rebuilt next time the message is parsed */
+		mail_set_cache_corrupted(mail, MAIL_FETCH_MESSAGE_PARTS);
+		msgctx->analysis->body_parts_complete = FALSE;
+		message_decoder_deinit(&decoder);
+		buffer_free(&buf);
+		sieve_runtime_critical(renv, NULL,
+			"failed to parse input message",
+			"cached MIME structure of message does not match its content");
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
 	message_decoder_deinit(&decoder);
 	buffer_free(&buf);
 
@@ -1509,7 +2174,7 @@ int sieve_message_body_get_content
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, content_types, FALSE, FALSE);
+			(renv, content_types, FALSE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1523,27 +2188,27 @@ int sieve_message_body_get_content
 	return status;
 }
 
+/* We currently only support extracting plain text from:
+
+    - text/html -> HTML
+    - application/xhtml+xml -> XHTML
+
+   Other text types are read as is. Any non-text types are skipped.
+ */
+static const char * const _text_content_types[] =
+	{ "application/xhtml+xml", "text", NULL };
+
 int sieve_message_body_get_text
 (const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data **parts_r)
 {
-	static const char * const _text_content_types[] =
-		{ "application/xhtml+xml", "text", NULL };
 	struct sieve_message_context *msgctx = renv->msgctx;
 	int status;
 
-	/* We currently only support extracting plain text from:
-
-	    - text/html -> HTML
-	    - application/xhtml+xml -> XHTML
-
-	   Other text types are read as is. Any non-text types are skipped.
-	 */
-
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, _text_content_types, TRUE, FALSE);
+			(renv, _text_content_types, TRUE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1565,16 +2230,18 @@ int sieve_message_body_get_raw
 	struct sieve_message_part_data *return_part;
 	buffer_t *buf;
 
-	if ( msgctx->raw_body == NULL ) {
-		struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	sieve_message_analysis_body_prepare(msgctx);
+
+	if ( msgctx->analysis->raw_body == NULL ) {
+		struct mail *mail = sieve_message_get_body_mail(renv->msgctx);
 		struct istream *input;
 		struct message_size hdr_size, body_size;
 		const unsigned char *data;
 		size_t size;
 		int ret;
 
-		msgctx->raw_body = buf = buffer_create_dynamic
-			(msgctx->context_pool, 1024*64);
+		msgctx->analysis->raw_body = buf = buffer_create_dynamic
+			(msgctx->analysis->pool, 1024*64);
 
 		/* Get stream for message */
  		if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
@@ -1605,7 +2272,7 @@ int sieve_message_body_get_raw
 		buffer_append_c(buf, '\0');
 
 	} else {
-		buf = msgctx->raw_body;
+		buf = msgctx->analysis->raw_body;
 	}
 
 	/* Clear result array */
@@ -1630,6 +2297,139 @@ int sieve_message_body_get_raw
 	return SIEVE_EXEC_OK;
 }
 
+/*
+ * Message body matching
+ *
+ *   Body parts that are not cached yet are matched while they are decoded,
+ *   without storing them. Matching stops at the first match.
+ */
+
+static int sieve_message_body_match
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types, bool extract_text,
+	struct sieve_match_context *mctx)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_part_stream pstream;
+	int status;
+
+	/* Match cached parts from memory */
+	if ( sieve_message_body_get_return_parts
+		(renv, content_types, extract_text) ) {
+		const struct sieve_message_part_data *parts;
+		unsigned int count, i;
+
+		parts = array_get(&msgctx->return_body_parts, &count);
+		for ( i = 0; i < count && mctx->match_status == 0; i++ ) {
+			sieve_match_stream_value_begin(mctx);
+			(void)sieve_match_stream_value_more
+				(mctx, parts[i].content, parts[i].size);
+			(void)sieve_match_stream_value_end(mctx);
+		}
+		return mctx->exec_status;
+	}
+
+	i_zero(&pstream);
+	pstream.mctx = mctx;
+	pstream.max_size = msgctx->svinst->body_max_scan_size;
+	pstream.text_buf = buffer_create_dynamic(default_pool, 4096);
+
+	T_BEGIN {
+		status = sieve_message_parts_add_missing
+			(renv, content_types, extract_text, FALSE, &pstream);
+	} T_END;
+
+	buffer_free(&pstream.text_buf);
+	if ( status == SIEVE_EXEC_OK )
+		status = mctx->exec_status;
+	return status;
+}
+
+int sieve_message_body_match_content
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types,
+	struct sieve_match_context *mctx)
+{
+	return sieve_message_body_match(renv, content_types, FALSE, mctx);
+}
+
+int sieve_message_body_match_text
+(const struct sieve_runtime_env *renv,
+	struct sieve_match_context *mctx)
+{
+	return sieve_message_body_match(renv, _text_content_types, TRUE, mctx);
+}
+
+int sieve_message_body_match_raw
+(const struct sieve_runtime_env *renv,
+	struct sieve_match_context *mctx)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	size_t max_size = msgctx->svinst->body_max_scan_size;
+	struct mail *mail = sieve_message_get_body_mail(renv->msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size, scanned = 0;
+	int ret;
+
+	sieve_message_analysis_body_prepare(msgctx);
+
+	/* Match cached raw body from memory */
+	if ( msgctx->analysis->raw_body != NULL ) {
+		size = msgctx->analysis->raw_body->used - 1;
+		if ( size == 0 )
+			return SIEVE_EXEC_OK;
+		if ( max_size > 0 && size > max_size )
+			size = max_size;
+
+		sieve_match_stream_value_begin(mctx);
+		(void)sieve_match_stream_value_more
+			(mctx, msgctx->analysis->raw_body->data, size);
+		(void)sieve_match_stream_value_end(mctx);
+		return mctx->exec_status;
+	}
+
+	/* Get stream for message */
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* An empty body is not a value */
+	if ( body_size.physical_size == 0 )
+		return SIEVE_EXEC_OK;
+
+	/* Skip stream to beginning of body */
+	i_stream_skip(input, hdr_size.physical_size);
+
+	/* Match raw message body as it is read */
+	sieve_match_stream_value_begin(mctx);
+	while ( mctx->match_status == 0 &&
+		(max_size == 0 || scanned < max_size) &&
+		(ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+		if ( max_size > 0 && size > max_size - scanned )
+			size = max_size - scanned;
+		scanned += size;
+
+		(void)sieve_match_stream_value_more
+			(mctx, (const char *)data, size);
+		i_stream_skip(input, size);
+	}
+
+	if ( input->stream_errno != 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to read input message",
+			"read(%s) failed: %s",
+			i_stream_get_name(input),
+			i_stream_get_error(input));
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+
+	(void)sieve_match_stream_value_end(mctx);
+	return mctx->exec_status;
+}
+
 /*
  * Message part iterator
  */
@@ -1646,7 +2446,7 @@ int sieve_message_part_iter_init
 	T_BEGIN {
 		/* Fill the return_body_parts array */
 		status = sieve_message_parts_add_missing
-			(renv, NULL, TRUE, TRUE);
+			(renv, NULL, TRUE, TRUE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1658,7 +2458,7 @@ int sieve_message_part_iter_init
 	iter->index = 0;
 	iter->offset = 0;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->cached_body_parts, &count);
 	if (count == 0)
 		iter->root = NULL;
 	else
@@ -1677,7 +2477,7 @@ void sieve_message_part_iter_subtree(struct sieve_message_part_iter *iter,
 
 	*subtree = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->cached_body_parts, &count);
 	if ( subtree->index >= count)
 		subtree->root = NULL;
 	else
@@ -1695,7 +2495,7 @@ void sieve_message_part_iter_children(struct sieve_message_part_iter *iter,
 
 	*child = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);	
+	parts = array_get(&msgctx->analysis->cached_body_parts, &count);	
 	if ( (child->index+1) >= count || parts[child->index]->children == NULL)
 		child->root = NULL;
 	else
@@ -1714,7 +2514,7 @@ struct sieve_message_part *sieve_message_part_iter_current
 	if ( iter->root == NULL )
 		return NULL;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->cached_body_parts, &count);
 	if ( iter->index >= count )
 		return NULL;
 	do {
@@ -1734,7 +2534,7 @@ struct sieve_message_part *sieve_message_part_iter_next
 	const struct sieve_runtime_env *renv = iter->renv;
 	struct sieve_message_context *msgctx = renv->msgctx;
 
-	if ( iter->index >= array_count(&msgctx->cached_body_parts) )
+	if ( iter->index >= array_count(&msgctx->analysis->cached_body_parts) )
 		return NULL;
 	iter->index++;
 
@@ -28,6 +28,9 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx);
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx);
 
+/* Frees the message analysis kept for sieve_message_analysis_cache */
+void sieve_message_analysis_cache_deinit(struct sieve_instance *svinst);
+
 pool_t sieve_message_context_pool
 	(struct sieve_message_context *msgctx) ATTR_PURE;
 void sieve_message_context_time(struct sieve_message_context *msgctx,
@@ -71,6 +74,15 @@ struct edit_mail *sieve_message_edit
 void sieve_message_snapshot
 	(struct sieve_message_context *msgctx);
 
+/* Header cache */
+
+int sieve_message_get_header_values
+	(struct sieve_message_context *msgctx, const char *field_name,
+		bool mime_decode, const char *const **values_r);
+void sieve_message_header_cache_get_stats
+	(struct sieve_message_context *msgctx, unsigned int *hits_r,
+		unsigned int *misses_r);
+
 /*
  * Header stringlist
  */
@@ -252,6 +264,19 @@ int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
 
+/* Match body parts using a streaming match (see sieve_match_stream_begin());
+   the match result is recorded in the match context */
+int sieve_message_body_match_content
+	(const struct sieve_runtime_env *renv,
+		const char * const *content_types,
+		struct sieve_match_context *mctx);
+int sieve_message_body_match_text
+	(const struct sieve_runtime_env *renv,
+		struct sieve_match_context *mctx);
+int sieve_message_body_match_raw
+	(const struct sieve_runtime_env *renv,
+		struct sieve_match_context *mctx);
+
 /*
  * Message part iterator
  */
@@ -0,0 +1,359 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "array.h"
+#include "hash.h"
+#include "ioloop.h"
+#include "write-full.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+
+#include "sieve.h"
+#include "sieve-profile.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Profile object
+ */
+
+struct sieve_profile_entry {
+	/* Folded stack: enclosing frames followed by the frames of this entry */
+	const char *key;
+
+	const char *script;
+	unsigned int line;
+	const char *operation;
+
+	unsigned int count;
+	uint64_t wall_usecs, cpu_usecs;
+};
+
+struct sieve_profile {
+	pool_t pool;
+	struct sieve_instance *svinst;
+
+	HASH_TABLE(const char *, struct sieve_profile_entry *) entries;
+	ARRAY(struct sieve_profile_entry *) entry_list;
+};
+
+struct sieve_profile *sieve_profile_create(struct sieve_instance *svinst)
+{
+	struct sieve_profile *profile;
+	pool_t pool;
+
+	/* The pool only holds the entries, so that it can be cleared after each
+	   flush */
+	pool = pool_alloconly_create("sieve_profile", 4096);
+	profile = i_new(struct sieve_profile, 1);
+	profile->pool = pool;
+	profile->svinst = svinst;
+	hash_table_create(&profile->entries, default_pool, 0, str_hash, strcmp);
+	i_array_init(&profile->entry_list, 64);
+
+	return profile;
+}
+
+void sieve_profile_free(struct sieve_profile **_profile)
+{
+	struct sieve_profile *profile = *_profile;
+
+	*_profile = NULL;
+	hash_table_destroy(&profile->entries);
+	array_free(&profile->entry_list);
+	pool_unref(&profile->pool);
+	i_free(profile);
+}
+
+static void sieve_profile_clear(struct sieve_profile *profile)
+{
+	hash_table_clear(profile->entries, FALSE);
+	array_clear(&profile->entry_list);
+	p_clear(profile->pool);
+}
+
+/*
+ * Recording
+ */
+
+static const char *sieve_profile_frame_name(const char *name)
+{
+	string_t *frame;
+	const char *p;
+
+	/* Separators of the folded-stack format */
+	if ( strpbrk(name, "; \t\n") == NULL )
+		return name;
+
+	frame = t_str_new(strlen(name));
+	for ( p = name; *p != '\0'; p++ ) {
+		if ( *p == ';' || *p == ' ' || *p == '\t' || *p == '\n' )
+			str_append_c(frame, '_');
+		else
+			str_append_c(frame, *p);
+	}
+	return str_c(frame);
+}
+
+const char *sieve_profile_frames
+(const char *script, unsigned int line, const char *operation)
+{
+	script = sieve_profile_frame_name(script);
+
+	return t_strdup_printf("%s;%s:%u;%s", script, script, line,
+		sieve_profile_frame_name(operation));
+}
+
+static inline uint64_t
+sieve_profile_elapsed_usecs(const struct timespec *start,
+	const struct timespec *end)
+{
+	int64_t usecs;
+
+	usecs = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+		(end->tv_nsec - start->tv_nsec) / 1000;
+	return ( usecs < 0 ? 0 : (uint64_t)usecs );
+}
+
+void sieve_profile_sample_end
+(struct sieve_profile *profile, struct sieve_profile_sample *sample,
+	struct sieve_profile_sample *parent, const char *stack,
+	const char *script, unsigned int line, const char *operation)
+{
+	struct sieve_profile_entry *entry;
+	struct timespec wall_end, cpu_end;
+	uint64_t wall, cpu;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+
+	wall = sieve_profile_elapsed_usecs(&sample->wall_start, &wall_end);
+	cpu = sieve_profile_elapsed_usecs(&sample->cpu_start, &cpu_end);
+
+	if ( parent != NULL ) {
+		parent->child_wall += wall;
+		parent->child_cpu += cpu;
+	}
+
+	T_BEGIN {
+		const char *frames = sieve_profile_frames(script, line, operation);
+		const char *key = ( *stack == '\0' ? frames :
+			t_strconcat(stack, ";", frames, NULL) );
+
+		entry = hash_table_lookup(profile->entries, key);
+		if ( entry == NULL ) {
+			entry = p_new(profile->pool, struct sieve_profile_entry, 1);
+			entry->key = p_strdup(profile->pool, key);
+			entry->script = p_strdup(profile->pool, script);
+			entry->line = line;
+			entry->operation = p_strdup(profile->pool, operation);
+
+			hash_table_insert(profile->entries, entry->key, entry);
+			array_append(&profile->entry_list, &entry, 1);
+		}
+	} T_END;
+
+	/* Only count the time spent in this script */
+	entry->count++;
+	entry->wall_usecs +=
+		( wall > sample->child_wall ? wall - sample->child_wall : 0 );
+	entry->cpu_usecs +=
+		( cpu > sample->child_cpu ? cpu - sample->child_cpu : 0 );
+}
+
+/*
+ * Output
+ */
+
+struct sieve_profile_total {
+	const char *name;
+
+	unsigned int count;
+	uint64_t wall_usecs, cpu_usecs;
+};
+
+static int
+sieve_profile_total_cmp(struct sieve_profile_total *const *t1,
+	struct sieve_profile_total *const *t2)
+{
+	if ( (*t1)->wall_usecs > (*t2)->wall_usecs )
+		return -1;
+	if ( (*t1)->wall_usecs < (*t2)->wall_usecs )
+		return 1;
+	return strcmp((*t1)->name, (*t2)->name);
+}
+
+static void sieve_profile_write_totals
+(struct sieve_profile *profile, string_t *out, const char *title,
+	bool by_line)
+{
+	HASH_TABLE(const char *, struct sieve_profile_total *) totals;
+	ARRAY(struct sieve_profile_total *) total_list;
+	struct sieve_profile_entry *const *entryp;
+	struct sieve_profile_total *const *totalp;
+	struct sieve_profile_total *total;
+
+	hash_table_create(&totals, default_pool, 0, str_hash, strcmp);
+	t_array_init(&total_list, 64);
+
+	array_foreach(&profile->entry_list, entryp) {
+		const struct sieve_profile_entry *entry = *entryp;
+		const char *name = ( by_line ?
+			t_strdup_printf("%s:%u", entry->script, entry->line) :
+			entry->operation );
+
+		total = hash_table_lookup(totals, name);
+		if ( total == NULL ) {
+			total = t_new(struct sieve_profile_total, 1);
+			total->name = name;
+			hash_table_insert(totals, name, total);
+			array_append(&total_list, &total, 1);
+		}
+		total->count += entry->count;
+		total->wall_usecs += entry->wall_usecs;
+		total->cpu_usecs += entry->cpu_usecs;
+	}
+	hash_table_destroy(&totals);
+
+	array_sort(&total_list, sieve_profile_total_cmp);
+
+	str_printfa(out, "%s:\n%10s %12s %12s  %s\n", title,
+		"count", "wall (us)", "cpu (us)", ( by_line ? "line" : "operation" ));
+	array_foreach(&total_list, totalp) {
+		str_printfa(out, "%10u %12llu %12llu  %s\n", (*totalp)->count,
+			(unsigned long long)(*totalp)->wall_usecs,
+			(unsigned long long)(*totalp)->cpu_usecs, (*totalp)->name);
+	}
+}
+
+static void sieve_profile_write_folded
+(struct sieve_profile *profile, string_t *out)
+{
+	struct sieve_profile_entry *const *entryp;
+
+	array_foreach(&profile->entry_list, entryp) {
+		if ( (*entryp)->wall_usecs == 0 )
+			continue;
+		str_printfa(out, "%s %llu\n", (*entryp)->key,
+			(unsigned long long)(*entryp)->wall_usecs);
+	}
+}
+
+static int sieve_profile_write_str
+(struct sieve_instance *svinst, const char *path, const string_t *out)
+{
+	int fd, ret = 0;
+
+	if ( path == NULL ) {
+		if ( write_full(STDOUT_FILENO, str_data(out), str_len(out)) < 0 ) {
+			sieve_sys_error(svinst, "profile: "
+				"write(stdout) failed: %m");
+			return -1;
+		}
+		return 0;
+	}
+
+	fd = open(path, O_CREAT | O_APPEND | O_WRONLY, 0600);
+	if ( fd == -1 ) {
+		sieve_sys_error(svinst, "profile: "
+			"creat(%s) failed: %m", path);
+		return -1;
+	}
+
+	/* Written at once, so that concurrent processes can share the file */
+	if ( write_full(fd, str_data(out), str_len(out)) < 0 ) {
+		sieve_sys_error(svinst, "profile: "
+			"write(%s) failed: %m", path);
+		ret = -1;
+	}
+
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst, "profile: "
+			"close(%s) failed: %m", path);
+	}
+	return ret;
+}
+
+int sieve_profile_write
+(struct sieve_profile *profile, const char *path,
+	enum sieve_profile_format format)
+{
+	int ret;
+
+	T_BEGIN {
+		string_t *out = t_str_new(1024);
+
+		switch ( format ) {
+		case SIEVE_PROFILE_FORMAT_TABLE:
+			sieve_profile_write_totals(profile, out,
+				"Operations", FALSE);
+			str_append_c(out, '\n');
+			sieve_profile_write_totals(profile, out,
+				"Lines", TRUE);
+			break;
+		case SIEVE_PROFILE_FORMAT_FOLDED:
+			sieve_profile_write_folded(profile, out);
+			break;
+		}
+
+		ret = sieve_profile_write_str(profile->svinst, path, out);
+	} T_END;
+
+	return ret;
+}
+
+/*
+ * Process profile
+ */
+
+void sieve_profile_process_init(struct sieve_instance *svinst)
+{
+	const char *path;
+	sieve_number_t interval;
+
+	path = sieve_setting_get(svinst, "sieve_profile_file");
+	if ( path == NULL || *path == '\0' )
+		return;
+
+	svinst->profile_path = p_strdup(svinst->pool, path);
+	svinst->profile_interval = SIEVE_DEFAULT_PROFILE_INTERVAL;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_profile_interval", &interval) )
+		svinst->profile_interval = (time_t)interval;
+
+	svinst->profile = sieve_profile_create(svinst);
+	svinst->profile_last_flush = ioloop_time;
+}
+
+void sieve_profile_process_deinit(struct sieve_instance *svinst)
+{
+	if ( svinst->profile == NULL )
+		return;
+
+	sieve_profile_process_flush(svinst, TRUE);
+	sieve_profile_free(&svinst->profile);
+}
+
+void sieve_profile_process_flush(struct sieve_instance *svinst, bool force)
+{
+	struct sieve_profile *profile = svinst->profile;
+
+	if ( profile == NULL || array_count(&profile->entry_list) == 0 )
+		return;
+	if ( !force &&
+		ioloop_time < svinst->profile_last_flush + svinst->profile_interval )
+		return;
+
+	/* Appending the counts since the last flush yields the totals, because
+	   tools for flame graphs add up identical stacks */
+	(void)sieve_profile_write(profile, svinst->profile_path,
+		SIEVE_PROFILE_FORMAT_FOLDED);
+
+	sieve_profile_clear(profile);
+	svinst->profile_last_flush = ioloop_time;
+}
@@ -0,0 +1,58 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_PROFILE_H
+#define __SIEVE_PROFILE_H
+
+#include "sieve-common.h"
+
+#include <time.h>
+
+/*
+ * Execution profile
+ *
+ *   Records the number of executions and the wall clock and CPU time spent per
+ *   operation, per source line of the script that contains it. The time an
+ *   operation spends executing an included script is attributed to the
+ *   operations of that script instead.
+ */
+
+struct sieve_profile_sample {
+	struct timespec wall_start, cpu_start;
+
+	/* Time spent in nested scripts (usecs) */
+	uint64_t child_wall, child_cpu;
+};
+
+static inline void sieve_profile_sample_begin
+(struct sieve_profile_sample *sample)
+{
+	(void)clock_gettime(CLOCK_MONOTONIC, &sample->wall_start);
+	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &sample->cpu_start);
+	sample->child_wall = sample->child_cpu = 0;
+}
+
+/* Records the sample; stack lists the frames of the enclosing scripts (may be
+   empty). The elapsed time is added to the parent sample, if any. */
+void sieve_profile_sample_end
+	(struct sieve_profile *profile, struct sieve_profile_sample *sample,
+		struct sieve_profile_sample *parent, const char *stack,
+		const char *script, unsigned int line, const char *operation)
+	ATTR_NULL(3);
+
+/* Frames describing the location of an operation in folded-stack format */
+const char *sieve_profile_frames
+	(const char *script, unsigned int line, const char *operation);
+
+/*
+ * Process profile
+ */
+
+void sieve_profile_process_init(struct sieve_instance *svinst);
+void sieve_profile_process_deinit(struct sieve_instance *svinst);
+
+/* Appends the profile to the file configured by sieve_profile_file once the
+   configured interval has passed, or immediately when force is TRUE. */
+void sieve_profile_process_flush(struct sieve_instance *svinst, bool force);
+
+#endif
@@ -19,6 +19,7 @@
 #include "sieve-interpreter.h"
 #include "sieve-actions.h"
 #include "sieve-message.h"
+#include "sieve-smtp-spool.h"
 
 #include "sieve-result.h"
 
@@ -39,6 +40,26 @@ struct sieve_result_action {
 	struct sieve_side_effects_list *seffects;
 
 	struct sieve_result_action *prev, *next;
+
+	/* Position in the list of actions; increases towards the end */
+	unsigned int seq;
+	/* Identity of the action when it was indexed */
+	const char *identity;
+	bool indexed;
+};
+ARRAY_DEFINE_TYPE(sieve_result_action, struct sieve_result_action *);
+
+struct sieve_result_action_list {
+	ARRAY_TYPE(sieve_result_action) actions;
+};
+
+struct sieve_result_action_index {
+	/* Number of actions with this definition */
+	unsigned int count;
+
+	/* Actions with this definition; by identity if the definition has one */
+	struct sieve_result_action_list all;
+	HASH_TABLE(const char *, struct sieve_result_action_list *) identities;
 };
 
 struct sieve_side_effects_list {
@@ -83,6 +104,15 @@ struct sieve_result {
 
 	struct sieve_result_action *last_attempted_action;
 
+	/* Index of the actions that need to be checked when a new action is
+	   added: by definition, keep actions and actions that check for
+	   conflicts with other actions */
+	unsigned int action_seq;
+	HASH_TABLE(const struct sieve_action_def *,
+		struct sieve_result_action_index *) action_index;
+	ARRAY_TYPE(sieve_result_action) keep_actions;
+	ARRAY_TYPE(sieve_result_action) conflict_actions;
+
 	HASH_TABLE(const struct sieve_action_def *,
 			   struct sieve_result_action_context *) action_contexts;
 
@@ -122,6 +152,10 @@ struct sieve_result *sieve_result_create
 	result->first_action = NULL;
 	result->last_action = NULL;
 
+	hash_table_create_direct(&result->action_index, pool, 0);
+	p_array_init(&result->keep_actions, pool, 4);
+	p_array_init(&result->conflict_actions, pool, 4);
+
 	return result;
 }
 
@@ -141,6 +175,7 @@ void sieve_result_unref(struct sieve_result **result)
 
 	if ( hash_table_is_created((*result)->action_contexts) )
         hash_table_destroy(&(*result)->action_contexts);
+	hash_table_destroy(&(*result)->action_index);
 
 	if ( (*result)->action_env.ehandler != NULL )
 		sieve_error_handler_unref(&(*result)->action_env.ehandler);
@@ -447,9 +482,200 @@ static int sieve_result_side_effects_merge
 	return 1;
 }
 
+/*
+ * Action index
+ */
+
+static struct sieve_result_action_list *sieve_result_action_index_get_list
+(struct sieve_result *result, const struct sieve_action_def *act_def,
+	const char *identity, bool create)
+{
+	struct sieve_result_action_index *index;
+	struct sieve_result_action_list *list;
+
+	index = hash_table_lookup(result->action_index, act_def);
+	if ( index == NULL ) {
+		if ( !create )
+			return NULL;
+		index = p_new(result->pool, struct sieve_result_action_index, 1);
+		p_array_init(&index->all.actions, result->pool, 4);
+		hash_table_insert(result->action_index, act_def, index);
+	}
+
+	if ( identity == NULL )
+		return &index->all;
+
+	if ( !hash_table_is_created(index->identities) ) {
+		if ( !create )
+			return NULL;
+		hash_table_create(&index->identities, result->pool, 0,
+			strcase_hash, strcasecmp);
+	}
+
+	list = hash_table_lookup(index->identities, identity);
+	if ( list == NULL && create ) {
+		list = p_new(result->pool, struct sieve_result_action_list, 1);
+		p_array_init(&list->actions, result->pool, 2);
+		hash_table_insert(index->identities, identity, list);
+	}
+	return list;
+}
+
+static const char *sieve_result_action_get_identity
+(struct sieve_result *result, const struct sieve_action *action)
+{
+	const struct sieve_action_def *act_def = action->def;
+
+	if ( act_def == NULL || act_def->get_identity == NULL )
+		return NULL;
+	return act_def->get_identity(result->action_env.scriptenv, action);
+}
+
+static void sieve_result_action_list_remove
+(ARRAY_TYPE(sieve_result_action) *actions,
+	struct sieve_result_action *raction)
+{
+	struct sieve_result_action *const *ractions;
+	unsigned int count, i;
+
+	ractions = array_get(actions, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( ractions[i] == raction ) {
+			array_delete(actions, i, 1);
+			break;
+		}
+	}
+}
+
+static void sieve_result_action_index_add
+(struct sieve_result *result, struct sieve_result_action *raction)
+{
+	const struct sieve_action_def *act_def = raction->action.def;
+	struct sieve_result_action_index *index;
+	struct sieve_result_action_list *list;
+
+	i_assert( !raction->indexed );
+	raction->indexed = TRUE;
+
+	if ( raction->keep )
+		array_append(&result->keep_actions, &raction, 1);
+
+	if ( act_def == NULL )
+		return;
+
+	if ( act_def->check_conflict != NULL )
+		array_append(&result->conflict_actions, &raction, 1);
+
+	raction->identity = sieve_result_action_get_identity
+		(result, &raction->action);
+	if ( raction->identity != NULL )
+		raction->identity = p_strdup(result->pool, raction->identity);
+
+	list = sieve_result_action_index_get_list
+		(result, act_def, raction->identity, TRUE);
+	array_append(&list->actions, &raction, 1);
+
+	index = hash_table_lookup(result->action_index, act_def);
+	index->count++;
+}
+
+static void sieve_result_action_index_remove
+(struct sieve_result *result, struct sieve_result_action *raction)
+{
+	const struct sieve_action_def *act_def = raction->action.def;
+	struct sieve_result_action_index *index;
+	struct sieve_result_action_list *list;
+
+	if ( !raction->indexed )
+		return;
+	raction->indexed = FALSE;
+
+	if ( raction->keep )
+		sieve_result_action_list_remove(&result->keep_actions, raction);
+
+	if ( act_def == NULL )
+		return;
+
+	if ( act_def->check_conflict != NULL )
+		sieve_result_action_list_remove(&result->conflict_actions, raction);
+
+	list = sieve_result_action_index_get_list
+		(result, act_def, raction->identity, FALSE);
+	i_assert( list != NULL );
+	sieve_result_action_list_remove(&list->actions, raction);
+
+	index = hash_table_lookup(result->action_index, act_def);
+	index->count--;
+}
+
+static int sieve_result_action_seq_cmp
+(struct sieve_result_action *const *ract1,
+	struct sieve_result_action *const *ract2)
+{
+	if ( (*ract1)->seq < (*ract2)->seq )
+		return -1;
+	return ( (*ract1)->seq > (*ract2)->seq ? 1 : 0 );
+}
+
+static void sieve_result_action_candidates_add
+(ARRAY_TYPE(sieve_result_action) *candidates,
+	const ARRAY_TYPE(sieve_result_action) *actions)
+{
+	if ( array_count(actions) > 0 )
+		array_append_array(candidates, actions);
+}
+
+/* Lists the existing actions that a new action needs to be checked against
+   for duplicates and conflicts, in the order of the result */
+static void sieve_result_action_get_candidates
+(struct sieve_result *result, const struct sieve_action *action, bool keep,
+	ARRAY_TYPE(sieve_result_action) *candidates)
+{
+	const struct sieve_action_def *act_def = action->def;
+	struct sieve_result_action_list *list;
+	struct sieve_result_action **ractions;
+	struct sieve_result_action *raction;
+	unsigned int count, i, j;
+
+	if ( act_def != NULL && act_def->check_conflict != NULL ) {
+		/* Conflicts with any other action */
+		raction = result->first_action;
+		while ( raction != NULL ) {
+			array_append(candidates, &raction, 1);
+			raction = raction->next;
+		}
+		return;
+	}
+
+	if ( keep )
+		sieve_result_action_candidates_add(candidates, &result->keep_actions);
+
+	if ( act_def == NULL )
+		return;
+
+	sieve_result_action_candidates_add(candidates, &result->conflict_actions);
+
+	list = sieve_result_action_index_get_list(result, act_def,
+		sieve_result_action_get_identity(result, action), FALSE);
+	if ( list != NULL )
+		sieve_result_action_candidates_add(candidates, &list->actions);
+
+	/* Sort and drop actions listed more than once */
+	array_sort(candidates, sieve_result_action_seq_cmp);
+	ractions = array_get_modifiable(candidates, &count);
+	for ( i = 1, j = 1; i < count; i++ ) {
+		if ( ractions[i] != ractions[j-1] )
+			ractions[j++] = ractions[i];
+	}
+	if ( j < count )
+		array_delete(candidates, j, count - j);
+}
+
 static void sieve_result_action_detach
 (struct sieve_result *result, struct sieve_result_action *raction)
 {
+	sieve_result_action_index_remove(result, raction);
+
 	if ( result->first_action == raction )
 		result->first_action = raction->next;
 
@@ -480,6 +706,10 @@ static int _sieve_result_add_action
 	struct sieve_instance *svinst = renv->svinst;
 	struct sieve_result *result = renv->result;
 	struct sieve_result_action *raction = NULL, *kaction = NULL;
+	struct sieve_result_action_index *index;
+	ARRAY_TYPE(sieve_result_action) candidates;
+	struct sieve_result_action *const *ractions;
+	unsigned int count, i;
 	struct sieve_action action;
 
 	action.def = act_def;
@@ -488,10 +718,22 @@ static int _sieve_result_add_action
 	action.context = context;
 	action.executed = FALSE;
 
+	if ( act_def != NULL ) {
+		index = hash_table_lookup(result->action_index, act_def);
+		if ( index != NULL )
+			instance_count = index->count;
+	}
+
 	/* First, check for duplicates or conflicts */
-	raction = result->first_action;
-	while ( raction != NULL ) {
-		const struct sieve_action *oact = &raction->action;
+	t_array_init(&candidates, 16);
+	sieve_result_action_get_candidates(result, &action, keep, &candidates);
+
+	ractions = array_get(&candidates, &count);
+	for ( i = 0; i < count; i++ ) {
+		const struct sieve_action *oact;
+
+		raction = ractions[i];
+		oact = &raction->action;
 
 		if ( keep && raction->keep ) {
 
@@ -516,8 +758,6 @@ static int _sieve_result_add_action
 			}
 
 		} if ( act_def != NULL && raction->action.def == act_def ) {
-			instance_count++;
-
 			/* Possible duplicate */
 			if ( act_def->check_duplicate != NULL ) {
 				if ( (ret=act_def->check_duplicate(renv, &action, &raction->action))
@@ -574,7 +814,10 @@ static int _sieve_result_add_action
 					return ret;
 			}
 		}
-		raction = raction->next;
+
+		/* Checks end at a detached action */
+		if ( !raction->indexed )
+			break;
 	}
 
 	if ( kaction != NULL ) {
@@ -606,6 +849,9 @@ static int _sieve_result_add_action
 		raction->success = FALSE;
 	}
 
+	/* The identity of an action that is taken over may change */
+	sieve_result_action_index_remove(result, raction);
+
 	raction->action.context = context;
 	raction->action.def = act_def;
 	raction->action.ext = ext;
@@ -614,6 +860,7 @@ static int _sieve_result_add_action
 
 	if ( raction->prev == NULL && raction != result->first_action ) {
 		/* Add */
+		raction->seq = result->action_seq++;
 		if ( result->first_action == NULL ) {
 			result->first_action = raction;
 			result->last_action = raction;
@@ -673,6 +920,8 @@ static int _sieve_result_add_action
 		}
 	}
 
+	sieve_result_action_index_add(result, raction);
+
 	if ( preserve_mail ) {
 		raction->action.mail = sieve_message_get_mail(renv->msgctx);
 		sieve_message_snapshot(renv->msgctx);
@@ -1381,6 +1630,7 @@ int sieve_result_execute
 {
 	int status = SIEVE_EXEC_OK, result_status;
 	struct sieve_result_action *first_action, *last_action;
+	struct sieve_instance *prev_svinst;
 	bool implicit_keep = TRUE;
 	int ret;
 
@@ -1389,6 +1639,7 @@ int sieve_result_execute
 	/* Prepare environment */
 
 	_sieve_result_prepare_execution(result, ehandler, flags);
+	prev_svinst = sieve_smtp_spool_activate(result->svinst);
 
 	/* Make notice of this attempt */
 
@@ -1446,6 +1697,8 @@ int sieve_result_execute
 	sieve_result_transaction_finish
 		(result, first_action, status);
 
+	sieve_smtp_spool_deactivate(result->svinst, prev_svinst);
+
 	result->action_env.ehandler = NULL;
 	return result_status;
 }
@@ -1508,6 +1761,8 @@ void sieve_result_iterate_delete
 
 	/* Delete action */
 
+	sieve_result_action_index_remove(result, rac);
+
 	if ( rac->prev == NULL )
 		result->first_action = rac->next;
 	else
@@ -492,6 +492,11 @@ bool sieve_script_binary_dump_metadata
 struct sieve_binary *sieve_script_binary_load
 (struct sieve_script *script, enum sieve_error *error_r)
 {
+	enum sieve_error error;
+
+	if ( error_r == NULL )
+		error_r = &error;
+
 	if ( script->v.binary_load == NULL ) {
 		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
 		return NULL;
@@ -505,16 +510,33 @@ int sieve_script_binary_save
 	enum sieve_error *error_r)
 {
 	struct sieve_script *bin_script = sieve_binary_script(sbin);
-
+	struct sieve_instance *svinst = script->storage->svinst;
+	enum sieve_error error = SIEVE_ERROR_NONE;
+	int ret;
 
 	i_assert(bin_script == NULL || sieve_script_equals(bin_script, script));
 
 	if ( script->v.binary_save == NULL ) {
-		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
-		return -1;
+		error = SIEVE_ERROR_NOT_POSSIBLE;
+		ret = -1;
+	} else {
+		ret = script->v.binary_save(script, sbin, update, &error);
+	}
+
+	/* Fall back to the binary cache directory when the binary cannot be
+	   stored with the script (e.g. a read-only global script) */
+	if ( ret < 0 && svinst->binary_cache_dir != NULL ) {
+		if ( svinst->debug ) {
+			sieve_script_sys_debug(script,
+				"Cannot save binary with the script; "
+				"using binary cache directory instead");
+		}
+		ret = sieve_binary_cache_dir_save(script, sbin, update, &error);
 	}
 
-	return script->v.binary_save(script, sbin, update, error_r);
+	if ( error_r != NULL )
+		*error_r = error;
+	return ret;
 }
 
 const char *sieve_script_binary_get_prefix
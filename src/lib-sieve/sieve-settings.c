@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
@@ -16,6 +17,22 @@
  * Access to settings
  */
 
+void sieve_setting_record
+(struct sieve_instance *svinst, const char *identifier,
+	const char *value)
+{
+	struct sieve_instance_setting *setting;
+
+	array_foreach_modifiable(&svinst->init_settings, setting) {
+		if ( strcmp(setting->identifier, identifier) == 0 )
+			return;
+	}
+
+	setting = array_append_space(&svinst->init_settings);
+	setting->identifier = p_strdup(svinst->pool, identifier);
+	setting->value = p_strdup(svinst->pool, value);
+}
+
 bool sieve_setting_get_uint_value
 (struct sieve_instance *svinst, const char *setting,
 	unsigned long long int *value_r)
@@ -226,6 +243,39 @@ void sieve_settings_load
 		svinst->max_redirects = (unsigned int) uint_setting;
 	}
 
+	svinst->max_instructions = 0;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_max_instructions", &uint_setting) ) {
+		svinst->max_instructions = (unsigned int) uint_setting;
+	}
+
+	svinst->max_match_size = 0;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_max_match_size", &size_setting) ) {
+		svinst->max_match_size = size_setting;
+	}
+
+	svinst->max_regex_executions = 0;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_max_regex_executions", &uint_setting) ) {
+		svinst->max_regex_executions = (unsigned int) uint_setting;
+	}
+
+	svinst->max_body_decode_size = 0;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_max_body_decode_size", &size_setting) ) {
+		svinst->max_body_decode_size = size_setting;
+	}
+
+	svinst->max_execution_time = 0;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_max_execution_time", &period) ) {
+		if (period > UINT_MAX)
+			svinst->max_execution_time = UINT_MAX;
+		else
+			svinst->max_execution_time = (unsigned int)period;
+	}
+
 	(void)sieve_address_source_parse_from_setting(svinst,
 		svinst->pool, "sieve_redirect_envelope_from",
 		&svinst->redirect_from);
@@ -239,6 +289,47 @@ void sieve_settings_load
 			svinst->redirect_duplicate_period = (unsigned int)period;
 	}
 
+	svinst->body_max_scan_size = 0;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_body_max_scan_size", &size_setting) ) {
+		svinst->body_max_scan_size = size_setting;
+	}
+
+	svinst->binary_mmap = TRUE;
+	(void)sieve_setting_get_bool_value
+		(svinst, "sieve_binary_mmap", &svinst->binary_mmap);
+
+	svinst->message_analysis_cache = FALSE;
+	(void)sieve_setting_get_bool_value(svinst,
+		"sieve_message_analysis_cache", &svinst->message_analysis_cache);
+
+	svinst->binary_cache_dir = NULL;
+	str_setting = sieve_setting_get(svinst, "sieve_binary_cache_dir");
+	if ( str_setting != NULL && *str_setting != '\0' ) {
+		if ( *str_setting != '/' ) {
+			sieve_sys_warning(svinst,
+				"sieve_binary_cache_dir must be an absolute path: %s",
+				str_setting);
+		} else {
+			svinst->binary_cache_dir = p_strdup(svinst->pool, str_setting);
+		}
+	}
+
+	svinst->binary_cache_dir_max_size = SIEVE_DEFAULT_BINARY_CACHE_DIR_MAX_SIZE;
+	if ( sieve_setting_get_size_value
+		(svinst, "sieve_binary_cache_dir_max_size", &size_setting) ) {
+		svinst->binary_cache_dir_max_size = size_setting;
+	}
+
+	svinst->compile_lock_timeout = SIEVE_DEFAULT_COMPILE_LOCK_TIMEOUT;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_compile_lock_timeout", &period) ) {
+		if (period > UINT_MAX)
+			svinst->compile_lock_timeout = UINT_MAX;
+		else
+			svinst->compile_lock_timeout = (unsigned int)period;
+	}
+
 	str_setting = sieve_setting_get(svinst, "sieve_user_email");
 	if ( str_setting != NULL && *str_setting != '\0' ) {
 		svinst->user_email =
@@ -252,4 +343,25 @@ void sieve_settings_load
 	}
 }
 
+/*
+ * Recorded settings
+ */
+
+bool sieve_settings_recorded_equal
+(struct sieve_instance *svinst, void *context)
+{
+	const struct sieve_callbacks *callbacks = svinst->callbacks;
+	const struct sieve_instance_setting *setting;
+
+	if ( callbacks == NULL || callbacks->get_setting == NULL )
+		return TRUE;
+
+	array_foreach(&svinst->init_settings, setting) {
+		const char *value =
+			callbacks->get_setting(context, setting->identifier);
 
+		if ( null_strcmp(value, setting->value) != 0 )
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -10,15 +10,23 @@
  * Access to settings
  */
 
+void sieve_setting_record
+	(struct sieve_instance *svinst, const char *identifier,
+		const char *value);
+
 static inline const char *sieve_setting_get
 (struct sieve_instance *svinst, const char *identifier)
 {
 	const struct sieve_callbacks *callbacks = svinst->callbacks;
+	const char *value;
 
 	if ( callbacks == NULL || callbacks->get_setting == NULL )
 		return NULL;
 
-	return callbacks->get_setting(svinst->context, identifier);
+	value = callbacks->get_setting(svinst->context, identifier);
+	if ( svinst->init_settings_recording )
+		sieve_setting_record(svinst, identifier, value);
+	return value;
 }
 
 bool sieve_setting_get_uint_value
@@ -44,6 +52,9 @@ bool sieve_setting_get_duration_value
 void sieve_settings_load
 	(struct sieve_instance *svinst);
 
+bool sieve_settings_recorded_equal
+	(struct sieve_instance *svinst, void *context);
+
 /*
  * Home directory
  */
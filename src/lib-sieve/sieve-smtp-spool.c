@@ -0,0 +1,900 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "strnum.h"
+#include "hostpid.h"
+#include "istream.h"
+#include "ostream.h"
+#include "mkdir-parents.h"
+#include "eacces-error.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+#include "sieve-smtp-spool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+/*
+ * Outbound mail spool
+ *
+ * Instead of submitting outgoing messages while the result is committed,
+ * they are written to a spool directory from which a separate drain submits
+ * them later on. A message is written to <spool>/tmp and synced, after which
+ * it is renamed into <spool>/new. The directory itself is synced only once
+ * for all messages queued by an execution. A drain claims a message by
+ * locking it (flock) and renaming it into <spool>/cur. It holds the lock until
+ * the message is submitted, and moves it back into new when submission fails
+ * temporarily. A message in cur that is not locked belongs to a drain that
+ * was interrupted; the next drain moves it back into new. Messages that fail
+ * permanently or for too long are moved into <spool>/failed.
+ *
+ * Messages are named
+ *
+ *   <queue time>.M<usecs>P<pid>Q<sequence>.<hostname>,<attempts>
+ *
+ * where the sequence is counted per process, so that the spools of several
+ * instances in one process never produce the same name. A message is moved
+ * into new with link() so that an existing message is never replaced.
+ *
+ * and the modification time of a message in new is the time of its next
+ * submission attempt. The file starts with the envelope, one line per item,
+ * followed by an empty line and the message itself:
+ *
+ *   S<return path>
+ *   R<recipient>
+ */
+
+#define SIEVE_SMTP_SPOOL_DEFAULT_RETRY_INTERVAL (5*60)
+#define SIEVE_SMTP_SPOOL_MAX_RETRY_INTERVAL (4*60*60)
+#define SIEVE_SMTP_SPOOL_DEFAULT_MAX_AGE (5*24*60*60)
+#define SIEVE_SMTP_SPOOL_MAX_NAME_ATTEMPTS 10
+
+struct sieve_smtp_spool {
+	struct sieve_instance *svinst;
+
+	const char *path;
+	const char *tmp_dir, *new_dir, *cur_dir, *failed_dir;
+	unsigned int retry_interval, max_age;
+
+	bool dirs_created:1;
+	bool new_dir_dirty:1;
+};
+
+/* Instance whose result is being executed */
+static struct sieve_instance *sieve_smtp_spool_active_svinst = NULL;
+/* Sequence of the messages queued by this process */
+static unsigned int sieve_smtp_spool_seq = 0;
+
+struct sieve_smtp_spool_msg {
+	pool_t pool;
+	struct sieve_smtp_spool *spool;
+
+	const char *name, *tmp_path;
+	string_t *envelope;
+
+	int fd;
+	struct ostream *output;
+};
+
+/*
+ * Spool object
+ */
+
+void sieve_smtp_spool_init(struct sieve_instance *svinst)
+{
+	struct sieve_smtp_spool *spool;
+	const char *path;
+	sieve_number_t period;
+
+	path = sieve_setting_get(svinst, "sieve_smtp_spool");
+	if ( path == NULL || *path == '\0' )
+		return;
+
+	if ( *path != '/' ) {
+		sieve_sys_error(svinst,
+			"smtp spool: sieve_smtp_spool must be an absolute path: %s",
+			path);
+		return;
+	}
+
+	spool = p_new(svinst->pool, struct sieve_smtp_spool, 1);
+	spool->svinst = svinst;
+	spool->path = p_strdup(svinst->pool, path);
+	spool->tmp_dir = p_strconcat(svinst->pool, path, "/tmp", NULL);
+	spool->new_dir = p_strconcat(svinst->pool, path, "/new", NULL);
+	spool->cur_dir = p_strconcat(svinst->pool, path, "/cur", NULL);
+	spool->failed_dir = p_strconcat(svinst->pool, path, "/failed", NULL);
+
+	spool->retry_interval = SIEVE_SMTP_SPOOL_DEFAULT_RETRY_INTERVAL;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_smtp_spool_retry_interval", &period) &&
+		period > 0 ) {
+		spool->retry_interval = ( period > SIEVE_SMTP_SPOOL_MAX_RETRY_INTERVAL ?
+			SIEVE_SMTP_SPOOL_MAX_RETRY_INTERVAL : (unsigned int)period );
+	}
+
+	spool->max_age = SIEVE_SMTP_SPOOL_DEFAULT_MAX_AGE;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_smtp_spool_max_age", &period) ) {
+		spool->max_age = ( period > UINT_MAX ?
+			UINT_MAX : (unsigned int)period );
+	}
+
+	svinst->smtp_spool = spool;
+}
+
+void sieve_smtp_spool_deinit(struct sieve_instance *svinst)
+{
+	if ( svinst->smtp_spool == NULL )
+		return;
+
+	sieve_smtp_spool_flush(svinst);
+	svinst->smtp_spool = NULL;
+}
+
+static int sieve_smtp_spool_mkdir
+(struct sieve_smtp_spool *spool, const char *dir)
+{
+	struct sieve_instance *svinst = spool->svinst;
+
+	if ( mkdir_parents(dir, 0700) == 0 || errno == EEXIST )
+		return 0;
+
+	if ( errno == EACCES ) {
+		sieve_sys_error(svinst, "smtp spool: %s",
+			eacces_error_get_creating("mkdir_parents", dir));
+	} else {
+		sieve_sys_error(svinst, "smtp spool: "
+			"mkdir_parents(%s) failed: %m", dir);
+	}
+	return -1;
+}
+
+static int sieve_smtp_spool_create_dirs(struct sieve_smtp_spool *spool)
+{
+	if ( spool->dirs_created )
+		return 0;
+
+	if ( sieve_smtp_spool_mkdir(spool, spool->tmp_dir) < 0 ||
+		sieve_smtp_spool_mkdir(spool, spool->new_dir) < 0 ||
+		sieve_smtp_spool_mkdir(spool, spool->cur_dir) < 0 )
+		return -1;
+
+	spool->dirs_created = TRUE;
+	return 0;
+}
+
+void sieve_smtp_spool_flush(struct sieve_instance *svinst)
+{
+	struct sieve_smtp_spool *spool = svinst->smtp_spool;
+	int fd;
+
+	if ( spool == NULL || !spool->new_dir_dirty )
+		return;
+	spool->new_dir_dirty = FALSE;
+
+	/* Makes the renames of all messages queued since the last flush durable
+	   at once */
+	if ( (fd=open(spool->new_dir, O_RDONLY)) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"open(%s) failed: %m", spool->new_dir);
+		return;
+	}
+	if ( fsync(fd) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"fsync(%s) failed: %m", spool->new_dir);
+	}
+	if ( close(fd) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"close(%s) failed: %m", spool->new_dir);
+	}
+}
+
+struct sieve_instance *sieve_smtp_spool_activate
+(struct sieve_instance *svinst)
+{
+	struct sieve_instance *prev_svinst = sieve_smtp_spool_active_svinst;
+
+	sieve_smtp_spool_active_svinst = svinst;
+	return prev_svinst;
+}
+
+void sieve_smtp_spool_deactivate
+(struct sieve_instance *svinst, struct sieve_instance *prev_svinst)
+{
+	i_assert( sieve_smtp_spool_active_svinst == svinst );
+	sieve_smtp_spool_active_svinst = prev_svinst;
+
+	/* Make the messages queued by the actions durable */
+	sieve_smtp_spool_flush(svinst);
+}
+
+struct sieve_instance *sieve_smtp_spool_get_active(void)
+{
+	struct sieve_instance *svinst = sieve_smtp_spool_active_svinst;
+
+	if ( svinst == NULL || svinst->smtp_spool == NULL )
+		return NULL;
+	return svinst;
+}
+
+/*
+ * Message names
+ */
+
+static bool sieve_smtp_spool_parse_name
+(const char *name, time_t *queued_r, unsigned int *attempts_r)
+{
+	const char *p;
+	int64_t queued;
+
+	if ( str_parse_int64(name, &queued, &p) < 0 || *p != '.' )
+		return FALSE;
+	*queued_r = (time_t)queued;
+	if ( (p=strrchr(name, ',')) == NULL ||
+		str_to_uint(p+1, attempts_r) < 0 )
+		return FALSE;
+	return TRUE;
+}
+
+static const char *sieve_smtp_spool_new_name(pool_t pool)
+{
+	struct timeval tv;
+
+	if ( gettimeofday(&tv, NULL) < 0 )
+		i_fatal("gettimeofday() failed: %m");
+	return p_strdup_printf(pool, "%ld.M%ldP%sQ%u.%s,0",
+		(long)tv.tv_sec, (long)tv.tv_usec, my_pid,
+		++sieve_smtp_spool_seq, my_hostname);
+}
+
+static const char *sieve_smtp_spool_retry_name
+(const char *name, unsigned int attempts)
+{
+	const char *p = strrchr(name, ',');
+
+	i_assert( p != NULL );
+	return t_strdup_printf("%s,%u", t_strdup_until(name, p), attempts);
+}
+
+/*
+ * Queueing messages
+ */
+
+struct sieve_smtp_spool_msg *sieve_smtp_spool_start
+(struct sieve_instance *svinst, const char *return_path)
+{
+	struct sieve_smtp_spool *spool = svinst->smtp_spool;
+	struct sieve_smtp_spool_msg *smsg;
+	pool_t pool;
+
+	i_assert( spool != NULL );
+
+	pool = pool_alloconly_create("sieve_smtp_spool_msg", 1024);
+	smsg = p_new(pool, struct sieve_smtp_spool_msg, 1);
+	smsg->pool = pool;
+	smsg->spool = spool;
+	smsg->fd = -1;
+
+	smsg->name = sieve_smtp_spool_new_name(pool);
+	smsg->tmp_path = p_strconcat(pool, spool->tmp_dir, "/", smsg->name, NULL);
+
+	smsg->envelope = str_new(pool, 256);
+	str_printfa(smsg->envelope, "S%s\n",
+		( return_path == NULL ? "" : return_path ));
+	return smsg;
+}
+
+void sieve_smtp_spool_add_rcpt
+(struct sieve_smtp_spool_msg *smsg, const char *address)
+{
+	i_assert( smsg->output == NULL );
+	str_printfa(smsg->envelope, "R%s\n", address);
+}
+
+struct ostream *sieve_smtp_spool_send
+(struct sieve_smtp_spool_msg *smsg)
+{
+	struct sieve_smtp_spool *spool = smsg->spool;
+
+	i_assert( smsg->output == NULL );
+	str_append_c(smsg->envelope, '\n');
+
+	if ( sieve_smtp_spool_create_dirs(spool) == 0 ) {
+		unsigned int attempts = 0;
+
+		while ( (smsg->fd=open(smsg->tmp_path,
+			O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 &&
+			errno == EEXIST &&
+			++attempts < SIEVE_SMTP_SPOOL_MAX_NAME_ATTEMPTS ) {
+			smsg->name = sieve_smtp_spool_new_name(smsg->pool);
+			smsg->tmp_path = p_strconcat(smsg->pool,
+				spool->tmp_dir, "/", smsg->name, NULL);
+		}
+		if ( smsg->fd < 0 ) {
+			sieve_sys_error(spool->svinst, "smtp spool: "
+				"open(%s) failed: %m", smsg->tmp_path);
+		}
+	}
+
+	if ( smsg->fd < 0 ) {
+		/* The failure is reported by sieve_smtp_spool_finish() */
+		smsg->output = o_stream_create_error(EIO);
+	} else {
+		smsg->output = o_stream_create_fd(smsg->fd, 0);
+		o_stream_set_name(smsg->output, smsg->tmp_path);
+		o_stream_nsend(smsg->output,
+			str_data(smsg->envelope), str_len(smsg->envelope));
+	}
+	return smsg->output;
+}
+
+static void sieve_smtp_spool_msg_free(struct sieve_smtp_spool_msg **_smsg)
+{
+	struct sieve_smtp_spool_msg *smsg = *_smsg;
+
+	*_smsg = NULL;
+
+	if ( smsg->output != NULL ) {
+		o_stream_ignore_last_errors(smsg->output);
+		o_stream_destroy(&smsg->output);
+	}
+	if ( smsg->fd != -1 && close(smsg->fd) < 0 ) {
+		sieve_sys_error(smsg->spool->svinst, "smtp spool: "
+			"close(%s) failed: %m", smsg->tmp_path);
+	}
+	pool_unref(&smsg->pool);
+}
+
+void sieve_smtp_spool_abort
+(struct sieve_smtp_spool_msg **_smsg)
+{
+	struct sieve_smtp_spool_msg *smsg = *_smsg;
+
+	if ( smsg->fd != -1 )
+		i_unlink_if_exists(smsg->tmp_path);
+	sieve_smtp_spool_msg_free(_smsg);
+}
+
+int sieve_smtp_spool_finish
+(struct sieve_smtp_spool_msg **_smsg, const char **error_r)
+{
+	struct sieve_smtp_spool_msg *smsg = *_smsg;
+	struct sieve_smtp_spool *spool = smsg->spool;
+	struct sieve_instance *svinst = spool->svinst;
+	const char *name, *new_path;
+	unsigned int attempts = 0;
+	int ret;
+
+	*error_r = "failed to queue message for submission";
+
+	if ( smsg->fd < 0 ) {
+		sieve_smtp_spool_msg_free(_smsg);
+		return -1;
+	}
+
+	if ( o_stream_nfinish(smsg->output) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"write(%s) failed: %s", smsg->tmp_path,
+			o_stream_get_error(smsg->output));
+		sieve_smtp_spool_abort(_smsg);
+		return -1;
+	}
+	if ( fsync(smsg->fd) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"fsync(%s) failed: %m", smsg->tmp_path);
+		sieve_smtp_spool_abort(_smsg);
+		return -1;
+	}
+
+	/* Never replace a message that is already queued under the same name */
+	name = smsg->name;
+	for (;;) {
+		new_path = t_strconcat(spool->new_dir, "/", name, NULL);
+		if ( (ret=link(smsg->tmp_path, new_path)) == 0 ||
+			errno != EEXIST ||
+			++attempts >= SIEVE_SMTP_SPOOL_MAX_NAME_ATTEMPTS )
+			break;
+		name = sieve_smtp_spool_new_name(unsafe_data_stack_pool);
+	}
+	if ( ret < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"link(%s, %s) failed: %m", smsg->tmp_path, new_path);
+		sieve_smtp_spool_abort(_smsg);
+		return -1;
+	}
+	spool->new_dir_dirty = TRUE;
+	i_unlink(smsg->tmp_path);
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "smtp spool: "
+			"queued message %s", new_path);
+	}
+
+	*error_r = NULL;
+	sieve_smtp_spool_msg_free(_smsg);
+	return 1;
+}
+
+/*
+ * Draining the spool
+ */
+
+struct sieve_smtp_spool_file {
+	const char *name;
+	time_t mtime;
+};
+
+static int
+sieve_smtp_spool_file_cmp(const struct sieve_smtp_spool_file *f1,
+	const struct sieve_smtp_spool_file *f2)
+{
+	if ( f1->mtime < f2->mtime )
+		return -1;
+	if ( f1->mtime > f2->mtime )
+		return 1;
+	return strcmp(f1->name, f2->name);
+}
+
+typedef void
+sieve_smtp_spool_scan_callback_t(struct sieve_smtp_spool *spool,
+	const char *name, const struct stat *st, void *context);
+
+static int sieve_smtp_spool_scan
+(struct sieve_smtp_spool *spool, const char *dir,
+	sieve_smtp_spool_scan_callback_t *callback, void *context)
+{
+	struct sieve_instance *svinst = spool->svinst;
+	struct dirent *dp;
+	struct stat st;
+	DIR *dirp;
+	int ret = 0;
+
+	if ( (dirp=opendir(dir)) == NULL ) {
+		if ( errno == ENOENT )
+			return 0;
+		sieve_sys_error(svinst, "smtp spool: "
+			"opendir(%s) failed: %m", dir);
+		return -1;
+	}
+
+	for (;;) {
+		errno = 0;
+		if ( (dp=readdir(dirp)) == NULL ) {
+			if ( errno != 0 ) {
+				sieve_sys_error(svinst, "smtp spool: "
+					"readdir(%s) failed: %m", dir);
+				ret = -1;
+			}
+			break;
+		}
+		if ( dp->d_name[0] == '.' )
+			continue;
+
+		T_BEGIN {
+			const char *path = t_strconcat(dir, "/", dp->d_name, NULL);
+
+			if ( stat(path, &st) == 0 && S_ISREG(st.st_mode) )
+				callback(spool, dp->d_name, &st, context);
+		} T_END;
+	}
+
+	if ( closedir(dirp) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"closedir(%s) failed: %m", dir);
+	}
+	return ret;
+}
+
+struct sieve_smtp_spool_drain_context {
+	ARRAY(struct sieve_smtp_spool_file) files;
+	time_t now;
+};
+
+static int sieve_smtp_spool_lock
+(struct sieve_smtp_spool *spool, const char *path, int *fd_r)
+{
+	struct sieve_instance *svinst = spool->svinst;
+	int fd;
+
+	*fd_r = -1;
+
+	if ( (fd=open(path, O_RDONLY)) < 0 ) {
+		if ( errno == ENOENT )
+			return 0;
+		sieve_sys_error(svinst, "smtp spool: "
+			"open(%s) failed: %m", path);
+		return -1;
+	}
+	if ( flock(fd, LOCK_EX | LOCK_NB) < 0 ) {
+		if ( errno == EWOULDBLOCK ) {
+			/* Being submitted by another drain */
+			i_close_fd(&fd);
+			return 0;
+		}
+		sieve_sys_error(svinst, "smtp spool: "
+			"flock(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	*fd_r = fd;
+	return 1;
+}
+
+static void sieve_smtp_spool_release_stale
+(struct sieve_smtp_spool *spool, const char *name,
+	const struct stat *st ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+	const char *cur_path, *new_path;
+	int fd;
+
+	/* A message that is not locked is no longer being submitted */
+	cur_path = t_strconcat(spool->cur_dir, "/", name, NULL);
+	if ( sieve_smtp_spool_lock(spool, cur_path, &fd) <= 0 )
+		return;
+
+	/* The interrupted drain may have submitted the message already; sending
+	   it twice is preferred over losing it */
+	new_path = t_strconcat(spool->new_dir, "/", name, NULL);
+	if ( rename(cur_path, new_path) == 0 )
+		spool->new_dir_dirty = TRUE;
+	else if ( errno != ENOENT ) {
+		sieve_sys_error(spool->svinst, "smtp spool: "
+			"rename(%s, %s) failed: %m", cur_path, new_path);
+	}
+	i_close_fd(&fd);
+}
+
+static void sieve_smtp_spool_collect_due
+(struct sieve_smtp_spool *spool ATTR_UNUSED, const char *name,
+	const struct stat *st, void *context)
+{
+	struct sieve_smtp_spool_drain_context *dctx =
+		(struct sieve_smtp_spool_drain_context *)context;
+	struct sieve_smtp_spool_file *file;
+
+	if ( st->st_mtime > dctx->now )
+		return;
+
+	file = array_append_space(&dctx->files);
+	file->name = p_strdup(default_pool, name);
+	file->mtime = st->st_mtime;
+}
+
+static int sieve_smtp_spool_submit
+(struct sieve_smtp_spool *spool, const struct sieve_script_env *senv,
+	int fd, const char *path, const char **rcpts_r, const char **error_r)
+{
+	struct sieve_instance *svinst = spool->svinst;
+	struct istream *input;
+	struct ostream *output;
+	const char *line, *return_path = NULL;
+	ARRAY_TYPE(const_string) rcpts;
+	const char *const *rcpt;
+	void *handle;
+	int ret;
+
+	*rcpts_r = "";
+	*error_r = NULL;
+
+	/* Read through the locked descriptor */
+	input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	i_stream_set_name(input, path);
+
+	/* Read envelope */
+	t_array_init(&rcpts, 4);
+	while ( (line=i_stream_read_next_line(input)) != NULL &&
+		*line != '\0' ) {
+		switch ( *line ) {
+		case 'S':
+			if ( line[1] != '\0' )
+				return_path = t_strdup(line+1);
+			break;
+		case 'R':
+			line = t_strdup(line+1);
+			array_append(&rcpts, &line, 1);
+			break;
+		}
+	}
+	if ( line == NULL ) {
+		if ( input->stream_errno != 0 ) {
+			sieve_sys_error(svinst, "smtp spool: "
+				"read(%s) failed: %s", path, i_stream_get_error(input));
+			i_stream_unref(&input);
+			*error_r = "failed to read message from spool";
+			return -1;
+		}
+		array_clear(&rcpts);
+	}
+	if ( array_count(&rcpts) == 0 ) {
+		i_stream_unref(&input);
+		*error_r = "message in spool is corrupt";
+		return 0;
+	}
+	array_append_zero(&rcpts);
+	*rcpts_r = t_strarray_join(array_idx(&rcpts, 0), ", ");
+	array_delete(&rcpts, array_count(&rcpts)-1, 1);
+
+	/* Submit message */
+	handle = senv->smtp_start(senv, return_path);
+	array_foreach(&rcpts, rcpt)
+		senv->smtp_add_rcpt(senv, handle, *rcpt);
+	output = senv->smtp_send(senv, handle);
+
+	o_stream_nsend_istream(output, input);
+	if ( input->stream_errno != 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"read(%s) failed: %s", path, i_stream_get_error(input));
+		i_stream_unref(&input);
+		if ( senv->smtp_abort != NULL )
+			senv->smtp_abort(senv, handle);
+		else
+			(void)senv->smtp_finish(senv, handle, error_r);
+		*error_r = "failed to read message from spool";
+		return -1;
+	}
+	i_stream_unref(&input);
+
+	if ( (ret=senv->smtp_finish(senv, handle, error_r)) <= 0 &&
+		*error_r == NULL )
+		*error_r = "unknown error";
+	return ret;
+}
+
+static int sieve_smtp_spool_fail_file
+(struct sieve_smtp_spool *spool, const char *name, const char *cur_path)
+{
+	struct sieve_instance *svinst = spool->svinst;
+	const char *failed_path;
+
+	/* Keep the message for inspection by the administrator */
+	failed_path = t_strconcat(spool->failed_dir, "/", name, NULL);
+	if ( sieve_smtp_spool_mkdir(spool, spool->failed_dir) < 0 )
+		return -1;
+	if ( rename(cur_path, failed_path) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"rename(%s, %s) failed: %m", cur_path, failed_path);
+		return -1;
+	}
+	return 0;
+}
+
+static int sieve_smtp_spool_drain_file
+(struct sieve_smtp_spool *spool, const struct sieve_script_env *senv,
+	const char *name, time_t now)
+{
+	struct sieve_instance *svinst = spool->svinst;
+	const char *new_path, *cur_path, *rcpts, *error;
+	struct utimbuf ut;
+	unsigned int attempts, delay;
+	time_t queued;
+	int fd, ret;
+
+	new_path = t_strconcat(spool->new_dir, "/", name, NULL);
+	cur_path = t_strconcat(spool->cur_dir, "/", name, NULL);
+
+	if ( !sieve_smtp_spool_parse_name(name, &queued, &attempts) ) {
+		sieve_sys_warning(svinst, "smtp spool: "
+			"ignoring file with invalid name %s", new_path);
+		return 0;
+	}
+
+	/* Claim the message; the lock is held until it has left cur again */
+	if ( (ret=sieve_smtp_spool_lock(spool, new_path, &fd)) <= 0 )
+		return ret;
+	if ( rename(new_path, cur_path) < 0 ) {
+		if ( errno == ENOENT ) {
+			/* Claimed and finished by another drain meanwhile */
+			ret = 0;
+		} else {
+			sieve_sys_error(svinst, "smtp spool: "
+				"rename(%s, %s) failed: %m", new_path, cur_path);
+			ret = -1;
+		}
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	ret = sieve_smtp_spool_submit
+		(spool, senv, fd, cur_path, &rcpts, &error);
+	attempts++;
+
+	if ( ret > 0 ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp spool: "
+				"submitted message %s to <%s> (attempt %u)",
+				name, str_sanitize(rcpts, 256), attempts);
+		}
+		i_unlink(cur_path);
+		i_close_fd(&fd);
+		return 1;
+	}
+
+	if ( ret == 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"failed to submit message %s to <%s>: %s (permanent failure; "
+			"moved to %s)", name, str_sanitize(rcpts, 256),
+			str_sanitize(error, 512), spool->failed_dir);
+		ret = sieve_smtp_spool_fail_file(spool, name, cur_path);
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	if ( now - queued >= (time_t)spool->max_age ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"failed to submit message %s to <%s>: %s "
+			"(giving up after %u attempts; moved to %s)",
+			name, str_sanitize(rcpts, 256), str_sanitize(error, 512),
+			attempts, spool->failed_dir);
+		ret = sieve_smtp_spool_fail_file(spool, name, cur_path);
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	/* Defer the message; the retry interval doubles with each attempt */
+	delay = spool->retry_interval << I_MIN(attempts - 1, 10);
+	if ( delay > SIEVE_SMTP_SPOOL_MAX_RETRY_INTERVAL ||
+		delay < spool->retry_interval )
+		delay = SIEVE_SMTP_SPOOL_MAX_RETRY_INTERVAL;
+
+	sieve_sys_warning(svinst, "smtp spool: "
+		"failed to submit message %s to <%s>: %s "
+		"(temporary failure; retrying in %u seconds)",
+		name, str_sanitize(rcpts, 256), str_sanitize(error, 512), delay);
+
+	ut.actime = ut.modtime = now + delay;
+	if ( utime(cur_path, &ut) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"utime(%s) failed: %m", cur_path);
+	}
+	new_path = t_strconcat(spool->new_dir, "/",
+		sieve_smtp_spool_retry_name(name, attempts), NULL);
+	ret = 0;
+	if ( rename(cur_path, new_path) < 0 ) {
+		sieve_sys_error(svinst, "smtp spool: "
+			"rename(%s, %s) failed: %m", cur_path, new_path);
+		ret = -1;
+	} else {
+		spool->new_dir_dirty = TRUE;
+	}
+	i_close_fd(&fd);
+	return ret;
+}
+
+int sieve_smtp_spool_drain
+(struct sieve_instance *svinst, const struct sieve_script_env *senv,
+	unsigned int max_count, unsigned int *submitted_r)
+{
+	struct sieve_smtp_spool *spool = svinst->smtp_spool;
+	struct sieve_smtp_spool_drain_context dctx;
+	struct sieve_smtp_spool_file *file;
+	unsigned int count = 0;
+	int ret = 0;
+
+	*submitted_r = 0;
+
+	if ( spool == NULL )
+		return 0;
+	i_assert( senv->smtp_start != NULL && senv->smtp_add_rcpt != NULL &&
+		senv->smtp_send != NULL && senv->smtp_finish != NULL );
+
+	i_zero(&dctx);
+	dctx.now = time(NULL);
+	i_array_init(&dctx.files, 64);
+
+	if ( sieve_smtp_spool_scan(spool, spool->cur_dir,
+			sieve_smtp_spool_release_stale, &dctx) < 0 ||
+		sieve_smtp_spool_scan(spool, spool->new_dir,
+			sieve_smtp_spool_collect_due, &dctx) < 0 )
+		ret = -1;
+
+	/* Submit the messages that have been waiting the longest first */
+	array_sort(&dctx.files, sieve_smtp_spool_file_cmp);
+	array_foreach_modifiable(&dctx.files, file) {
+		if ( ret == 0 && (max_count == 0 || count < max_count) ) {
+			T_BEGIN {
+				switch ( sieve_smtp_spool_drain_file
+					(spool, senv, file->name, dctx.now) ) {
+				case 1:
+					(*submitted_r)++;
+					break;
+				case -1:
+					ret = -1;
+					break;
+				}
+			} T_END;
+			count++;
+		}
+		i_free(file->name);
+	}
+	array_free(&dctx.files);
+
+	/* Messages that were moved back into new */
+	sieve_smtp_spool_flush(svinst);
+	return ret;
+}
+
+/*
+ * Status
+ */
+
+static void sieve_smtp_spool_count_queued
+(struct sieve_smtp_spool *spool ATTR_UNUSED, const char *name,
+	const struct stat *st ATTR_UNUSED, void *context)
+{
+	struct sieve_smtp_spool_status *status =
+		(struct sieve_smtp_spool_status *)context;
+	unsigned int attempts;
+	time_t queued;
+
+	if ( !sieve_smtp_spool_parse_name(name, &queued, &attempts) )
+		return;
+
+	status->queued++;
+	if ( attempts > 0 )
+		status->deferred++;
+	if ( status->oldest == 0 || queued < status->oldest )
+		status->oldest = queued;
+}
+
+static void sieve_smtp_spool_count_active
+(struct sieve_smtp_spool *spool ATTR_UNUSED, const char *name,
+	const struct stat *st ATTR_UNUSED, void *context)
+{
+	struct sieve_smtp_spool_status *status =
+		(struct sieve_smtp_spool_status *)context;
+	unsigned int attempts;
+	time_t queued;
+
+	if ( !sieve_smtp_spool_parse_name(name, &queued, &attempts) )
+		return;
+
+	status->active++;
+	if ( status->oldest == 0 || queued < status->oldest )
+		status->oldest = queued;
+}
+
+static void sieve_smtp_spool_count_failed
+(struct sieve_smtp_spool *spool ATTR_UNUSED, const char *name ATTR_UNUSED,
+	const struct stat *st ATTR_UNUSED, void *context)
+{
+	struct sieve_smtp_spool_status *status =
+		(struct sieve_smtp_spool_status *)context;
+
+	status->failed++;
+}
+
+int sieve_smtp_spool_get_status
+(struct sieve_instance *svinst, struct sieve_smtp_spool_status *status_r)
+{
+	struct sieve_smtp_spool *spool = svinst->smtp_spool;
+	int ret = 0;
+
+	i_zero(status_r);
+	if ( spool == NULL )
+		return 0;
+
+	if ( sieve_smtp_spool_scan(spool, spool->new_dir,
+		sieve_smtp_spool_count_queued, status_r) < 0 )
+		ret = -1;
+	if ( sieve_smtp_spool_scan(spool, spool->cur_dir,
+		sieve_smtp_spool_count_active, status_r) < 0 )
+		ret = -1;
+	if ( sieve_smtp_spool_scan(spool, spool->failed_dir,
+		sieve_smtp_spool_count_failed, status_r) < 0 )
+		ret = -1;
+	return ret;
+}
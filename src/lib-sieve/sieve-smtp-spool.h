@@ -0,0 +1,81 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __SIEVE_SMTP_SPOOL_H
+#define __SIEVE_SMTP_SPOOL_H
+
+#include "sieve-common.h"
+
+/*
+ * Outbound mail spool
+ */
+
+void sieve_smtp_spool_init(struct sieve_instance *svinst);
+void sieve_smtp_spool_deinit(struct sieve_instance *svinst);
+
+/* Syncs the spool directory once for all messages queued since the last
+   flush */
+void sieve_smtp_spool_flush(struct sieve_instance *svinst);
+
+/* Marks the instance whose result is being executed; sieve_smtp_start()
+   queues the messages sent by its actions in its spool. Returns the instance
+   that was active before, which is to be passed to the matching
+   sieve_smtp_spool_deactivate() call. */
+struct sieve_instance *sieve_smtp_spool_activate
+	(struct sieve_instance *svinst);
+void sieve_smtp_spool_deactivate
+	(struct sieve_instance *svinst, struct sieve_instance *prev_svinst);
+/* Returns the active instance when it has a spool, and NULL otherwise */
+struct sieve_instance *sieve_smtp_spool_get_active(void);
+
+/*
+ * Queueing messages
+ */
+
+struct sieve_smtp_spool_msg;
+
+struct sieve_smtp_spool_msg *sieve_smtp_spool_start
+	(struct sieve_instance *svinst, const char *return_path);
+void sieve_smtp_spool_add_rcpt
+	(struct sieve_smtp_spool_msg *smsg, const char *address);
+struct ostream *sieve_smtp_spool_send
+	(struct sieve_smtp_spool_msg *smsg);
+
+void sieve_smtp_spool_abort
+	(struct sieve_smtp_spool_msg **_smsg);
+int sieve_smtp_spool_finish
+	(struct sieve_smtp_spool_msg **_smsg, const char **error_r);
+
+/*
+ * Draining the spool
+ */
+
+/* Submits at most max_count messages (0 for no limit) that are due, using the
+   SMTP interface of the script environment. Returns -1 when the spool could
+   not be read. */
+int sieve_smtp_spool_drain
+	(struct sieve_instance *svinst, const struct sieve_script_env *senv,
+		unsigned int max_count, unsigned int *submitted_r);
+
+/*
+ * Status
+ */
+
+struct sieve_smtp_spool_status {
+	/* Messages waiting for submission */
+	unsigned int queued;
+	/* Of those, the ones that failed temporarily before */
+	unsigned int deferred;
+	/* Messages being submitted by a drain */
+	unsigned int active;
+	/* Messages that could not be submitted; kept in the failed directory */
+	unsigned int failed;
+
+	/* Queue time of the oldest message; 0 when the spool is empty */
+	time_t oldest;
+};
+
+int sieve_smtp_spool_get_status
+	(struct sieve_instance *svinst, struct sieve_smtp_spool_status *status_r);
+
+#endif /* __SIEVE_SMTP_SPOOL_H */
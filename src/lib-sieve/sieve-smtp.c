@@ -3,12 +3,16 @@
 #include "lib.h"
 
 #include "sieve-common.h"
+#include "sieve-smtp-spool.h"
 #include "sieve-smtp.h"
 
 struct sieve_smtp_context {
 	const struct sieve_script_env *senv;
 	void *handle;
-	
+
+	/* Message is queued in the spool instead */
+	struct sieve_smtp_spool_msg *spool_msg;
+
 	bool sent:1;
 };
 
@@ -22,17 +26,24 @@ bool sieve_smtp_available
 struct sieve_smtp_context *sieve_smtp_start
 (const struct sieve_script_env *senv, const char *return_path)
 {
+	struct sieve_instance *svinst;
 	struct sieve_smtp_context *sctx;
 	void *handle;
 
 	if ( !sieve_smtp_available(senv) )
 		return NULL;
 
-	handle = senv->smtp_start(senv, return_path);
-	i_assert( handle != NULL );
-	
 	sctx = i_new(struct sieve_smtp_context, 1);
 	sctx->senv = senv;
+
+	/* Submission is left to the spool drain if a spool is configured */
+	if ( (svinst=sieve_smtp_spool_get_active()) != NULL ) {
+		sctx->spool_msg = sieve_smtp_spool_start(svinst, return_path);
+		return sctx;
+	}
+
+	handle = senv->smtp_start(senv, return_path);
+	i_assert( handle != NULL );
 	sctx->handle = handle;
 
 	return sctx;
@@ -42,6 +53,10 @@ void sieve_smtp_add_rcpt
 (struct sieve_smtp_context *sctx, const char *address)
 {
 	i_assert(!sctx->sent);
+	if ( sctx->spool_msg != NULL ) {
+		sieve_smtp_spool_add_rcpt(sctx->spool_msg, address);
+		return;
+	}
 	sctx->senv->smtp_add_rcpt(sctx->senv, sctx->handle, address);
 }
 
@@ -51,12 +66,14 @@ struct ostream *sieve_smtp_send
 	i_assert(!sctx->sent);
 	sctx->sent = TRUE;
 
+	if ( sctx->spool_msg != NULL )
+		return sieve_smtp_spool_send(sctx->spool_msg);
 	return sctx->senv->smtp_send(sctx->senv, sctx->handle);
 }
 
 struct sieve_smtp_context *sieve_smtp_start_single
 (const struct sieve_script_env *senv, const char *destination,
- 	const char *return_path, struct ostream **output_r)
+	const char *return_path, struct ostream **output_r)
 {
 	struct sieve_smtp_context *sctx;
 
@@ -73,6 +90,12 @@ void sieve_smtp_abort
 	const struct sieve_script_env *senv = sctx->senv;
 	void *handle = sctx->handle;
 
+	if ( sctx->spool_msg != NULL ) {
+		sieve_smtp_spool_abort(&sctx->spool_msg);
+		i_free(sctx);
+		return;
+	}
+
 	i_free(sctx);
 	i_assert(senv->smtp_abort != NULL);
 	senv->smtp_abort(senv, handle);
@@ -83,6 +106,13 @@ int sieve_smtp_finish
 {
 	const struct sieve_script_env *senv = sctx->senv;
 	void *handle = sctx->handle;
+	int ret;
+
+	if ( sctx->spool_msg != NULL ) {
+		ret = sieve_smtp_spool_finish(&sctx->spool_msg, error_r);
+		i_free(sctx);
+		return ret;
+	}
 
 	i_free(sctx);
 	return senv->smtp_finish(senv, handle, error_r);
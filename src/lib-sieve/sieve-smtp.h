@@ -11,6 +11,9 @@ bool sieve_smtp_available
 
 struct sieve_smtp_context;
 
+/* Messages sent while a result is executed are queued in the spool of its
+   instance when sieve_smtp_spool is configured; sieve_smtp_finish() then
+   reports the result of queueing. */
 struct sieve_smtp_context *sieve_smtp_start
 	(const struct sieve_script_env *senv, const char *return_path);
 void sieve_smtp_add_rcpt
@@ -20,7 +23,7 @@ struct ostream *sieve_smtp_send
 
 struct sieve_smtp_context *sieve_smtp_start_single
 	(const struct sieve_script_env *senv, const char *destination,
- 		const char *return_path, struct ostream **output_r);
+		const char *return_path, struct ostream **output_r);
 
 void sieve_smtp_abort
 	(struct sieve_smtp_context *sctx);
@@ -27,6 +27,8 @@ struct sieve_stringlist {
 	int exec_status;
 
 	bool trace:1;
+	/* Items are string literals from the binary */
+	bool constant:1;
 };
 
 static inline void sieve_stringlist_set_trace
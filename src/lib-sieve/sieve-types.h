@@ -22,6 +22,8 @@ struct sieve_message_data;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
+struct sieve_profile;
+struct sieve_mailbox_cache;
 
 /*
  * System environment
@@ -230,6 +232,12 @@ struct sieve_script_env {
 	/* Runtime trace*/
 	struct sieve_trace_log *trace_log;
 	struct sieve_trace_config trace_config;
+
+	/* Execution profile; defaults to the process profile, if configured */
+	struct sieve_profile *profile;
+
+	/* Target mailboxes kept open across executions; NULL when disabled */
+	struct sieve_mailbox_cache *mailbox_cache;
 };
 
 #define SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) \
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "istream.h"
 #include "ostream.h"
@@ -11,6 +12,7 @@
 #include "home-expand.h"
 #include "hostpid.h"
 #include "mail-user.h"
+#include "mail-storage.h"
 
 #include "sieve-settings.h"
 #include "sieve-extensions.h"
@@ -28,7 +30,10 @@
 #include "sieve-validator.h"
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
+#include "sieve-message.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-profile.h"
+#include "sieve-smtp-spool.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -45,21 +50,12 @@
  * Main Sieve library interface
  */
 
-struct sieve_instance *sieve_init
-(const struct sieve_environment *env,
-	const struct sieve_callbacks *callbacks, void *context, bool debug)
+static void sieve_init_environment
+(struct sieve_instance *svinst, const struct sieve_environment *env)
 {
-	struct sieve_instance *svinst;
+	pool_t pool = svinst->env_pool;
 	const char *domain;
-	pool_t pool;
 
-	/* Create Sieve engine instance */
-	pool = pool_alloconly_create("sieve", 8192);
-	svinst = p_new(pool, struct sieve_instance, 1);
-	svinst->pool = pool;
-	svinst->callbacks = callbacks;
-	svinst->context = context;
-	svinst->debug = debug;
 	svinst->base_dir = p_strdup_empty(pool, env->base_dir);
 	svinst->username = p_strdup_empty(pool, env->username);
 	svinst->home_dir = p_strdup_empty(pool, env->home_dir);
@@ -91,6 +87,26 @@ struct sieve_instance *sieve_init
 	}
 	svinst->hostname = p_strdup_empty(pool, env->hostname);
 	svinst->domainname = p_strdup(pool, domain);
+}
+
+struct sieve_instance *sieve_init
+(const struct sieve_environment *env,
+	const struct sieve_callbacks *callbacks, void *context, bool debug)
+{
+	struct sieve_instance *svinst;
+	pool_t pool;
+
+	/* Create Sieve engine instance */
+	pool = pool_alloconly_create("sieve", 8192);
+	svinst = p_new(pool, struct sieve_instance, 1);
+	svinst->pool = pool;
+	svinst->env_pool = pool_alloconly_create("sieve environment", 1024);
+	svinst->callbacks = callbacks;
+	svinst->context = context;
+	svinst->debug = debug;
+	p_array_init(&svinst->init_settings, pool, 32);
+
+	sieve_init_environment(svinst, env);
 
 	sieve_errors_init(svinst);
 
@@ -99,9 +115,14 @@ struct sieve_instance *sieve_init
 			PIGEONHOLE_NAME, PIGEONHOLE_VERSION_FULL);
 	}
 
+	/* Record all settings read from here on; these determine whether this
+	   instance can later be reused by sieve_reinit() */
+	svinst->init_settings_recording = TRUE;
+
 	/* Read configuration */
 
 	sieve_settings_load(svinst);
+	svinst->init_settings_core_count = array_count(&svinst->init_settings);
 
 	/* Initialize extensions */
 	if ( !sieve_extensions_init(svinst) ) {
@@ -118,18 +139,71 @@ struct sieve_instance *sieve_init
 	/* Configure extensions */
 	sieve_extensions_configure(svinst);
 
+	/* Initialize binary cache and shared store */
+	sieve_binary_cache_init(svinst);
+	sieve_binary_store_init(svinst);
+
+	/* Initialize process profile */
+	sieve_profile_process_init(svinst);
+
+	/* Initialize outgoing mail spool */
+	sieve_smtp_spool_init(svinst);
+
+	svinst->init_settings_recording = FALSE;
+
 	return svinst;
 }
 
+bool sieve_reinit
+(struct sieve_instance *svinst, const struct sieve_environment *env,
+	void *context, bool debug)
+{
+	/* The instance can only be reused when the new context yields the same
+	   values for all settings that influenced its initialization */
+	if ( !sieve_settings_recorded_equal(svinst, context) ) {
+		if ( debug ) {
+			sieve_sys_debug(svinst,
+				"Settings changed; engine instance cannot be reused");
+		}
+		return FALSE;
+	}
+
+	p_clear(svinst->env_pool);
+	svinst->context = context;
+	svinst->debug = debug;
+
+	sieve_init_environment(svinst, env);
+
+	if ( debug ) {
+		sieve_sys_debug(svinst, "%s version %s reinitialized",
+			PIGEONHOLE_NAME, PIGEONHOLE_VERSION_FULL);
+	}
+	return TRUE;
+}
+
+void sieve_detach(struct sieve_instance *svinst)
+{
+	svinst->context = NULL;
+}
+
 void sieve_deinit(struct sieve_instance **_svinst)
 {
 	struct sieve_instance *svinst = *_svinst;
 
+	svinst->init_settings_recording = FALSE;
+
+	sieve_profile_process_deinit(svinst);
+	sieve_smtp_spool_deinit(svinst);
+	sieve_binary_cache_deinit(svinst);
+	sieve_runtime_pools_deinit(svinst);
+	sieve_message_analysis_cache_deinit(svinst);
+
 	sieve_plugins_unload(svinst);
 	sieve_storages_deinit(svinst);
 	sieve_extensions_deinit(svinst);
 	sieve_errors_deinit(svinst);
 
+	pool_unref(&svinst->env_pool);
 	pool_unref(&(svinst)->pool);
 	*_svinst = NULL;
 }
@@ -350,6 +424,7 @@ static int sieve_run
 	/* Free the interpreter */
 	sieve_interpreter_free(&interp);
 
+	sieve_profile_process_flush(sieve_binary_svinst(sbin), FALSE);
 	return ret;
 }
 
@@ -363,6 +438,47 @@ struct sieve_binary *sieve_load
 	return sieve_binary_open(svinst, bin_path, NULL, error_r);
 }
 
+static void sieve_open_check_up_to_date
+(struct sieve_binary **sbin, enum sieve_compile_flags flags)
+{
+	struct sieve_instance *svinst;
+
+	if ( *sbin == NULL )
+		return;
+
+	/* Ok, it exists; now let's see if it is up to date */
+	if ( !sieve_binary_up_to_date(*sbin, flags) ) {
+		/* Not up to date */
+		svinst = sieve_binary_svinst(*sbin);
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "Script binary %s is not up-to-date",
+				sieve_binary_path(*sbin));
+		}
+
+		sieve_binary_unref(sbin);
+	}
+}
+
+static struct sieve_binary *sieve_open_existing_binary
+(struct sieve_script *script, enum sieve_compile_flags flags,
+	enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary *sbin;
+
+	sbin = sieve_script_binary_load(script, error_r);
+	sieve_open_check_up_to_date(&sbin, flags);
+
+	/* The binary may have been saved in the binary cache directory
+	   instead, if it could not be saved with the script */
+	if ( sbin == NULL && svinst->binary_cache_dir != NULL ) {
+		sbin = sieve_binary_cache_dir_open(script, error_r);
+		sieve_open_check_up_to_date(&sbin, flags);
+	}
+
+	return sbin;
+}
+
 struct sieve_binary *sieve_open_script
 (struct sieve_script *script, struct sieve_error_handler *ehandler,
 	enum sieve_compile_flags flags, enum sieve_error *error_r)
@@ -371,20 +487,29 @@ struct sieve_binary *sieve_open_script
 	struct sieve_binary *sbin;
 
 	T_BEGIN {
+		const char *store_key = NULL;
+
+		struct dotlock *lock = NULL;
+
 		/* Then try to open the matching binary */
-		sbin = sieve_script_binary_load(script, error_r);
+		sbin = sieve_open_existing_binary(script, flags, error_r);
 
-		if (sbin != NULL) {
-			/* Ok, it exists; now let's see if it is up to date */
-			if ( !sieve_binary_up_to_date(sbin, flags) ) {
-				/* Not up to date */
-				if ( svinst->debug ) {
-					sieve_sys_debug(svinst, "Script binary %s is not up-to-date",
-						sieve_binary_path(sbin));
-				}
+		/* Try a binary compiled earlier from identical source */
+		if ( sbin == NULL ) {
+			sbin = sieve_binary_store_open(script, flags, &store_key);
+			if ( sbin != NULL && error_r != NULL )
+				*error_r = SIEVE_ERROR_NONE;
+		}
 
-				sieve_binary_unref(&sbin);
-				sbin = NULL;
+		/* Make sure only one process compiles the script at a time; if
+		   another process held the lock, it has most likely saved a fresh
+		   binary by now */
+		if ( sbin == NULL && sieve_binary_compile_lock(script, &lock) ) {
+			sbin = sieve_open_existing_binary(script, flags, NULL);
+			if ( sbin != NULL ) {
+				sieve_binary_compile_unlock(&lock);
+				if ( error_r != NULL )
+					*error_r = SIEVE_ERROR_NONE;
 			}
 		}
 
@@ -398,6 +523,9 @@ struct sieve_binary *sieve_open_script
 					sieve_binary_path(sbin));
 			}
 
+			/* Keep it in memory for subsequent use */
+			sieve_binary_cache_add(sbin);
+
 		} else {
 			sbin = sieve_compile_script(script, ehandler, flags, error_r);
 
@@ -407,8 +535,16 @@ struct sieve_binary *sieve_open_script
 						"Script `%s' from %s successfully compiled",
 						sieve_script_name(script), sieve_script_location(script));
 				}
+
+				sieve_binary_store_save(sbin, store_key);
+
+				/* Other processes wait until the binary is saved */
+				if ( lock != NULL )
+					sieve_binary_set_compile_lock(sbin, &lock);
 			}
 		}
+
+		sieve_binary_compile_unlock(&lock);
 	} T_END;
 
 	return sbin;
@@ -459,6 +595,20 @@ bool sieve_is_loaded(struct sieve_binary *sbin)
 	return sieve_binary_loaded(sbin);
 }
 
+void sieve_prefetch_headers(struct sieve_binary *sbin, struct mail *mail)
+{
+	const char *const *headers;
+	struct mailbox_header_lookup_ctx *wanted_headers;
+
+	headers = sieve_binary_get_wanted_headers(sbin);
+	if ( headers[0] == NULL )
+		return;
+
+	wanted_headers = mailbox_header_lookup_init(mail->box, headers);
+	mail_add_temp_wanted_fields(mail, 0, wanted_headers);
+	mailbox_header_lookup_unref(&wanted_headers);
+}
+
 int sieve_save_as
 (struct sieve_binary *sbin, const char *bin_path, bool update,
 	mode_t save_mode, enum sieve_error *error_r)
@@ -473,12 +623,22 @@ int sieve_save
 (struct sieve_binary *sbin, bool update, enum sieve_error *error_r)
 {
 	struct sieve_script *script = sieve_binary_script(sbin);
+	int ret;
+
+	/* A binary from the shared store is used as it is; copying it would
+	   only produce a binary that describes a different script */
+	if ( sieve_binary_shared(sbin) )
+		return 0;
 
 	if ( script == NULL ) {
 		return sieve_binary_save(sbin, NULL, update, 0600, error_r);
 	}
 
-	return sieve_script_binary_save(script, sbin, update, error_r);
+	ret = sieve_script_binary_save(script, sbin, update, error_r);
+
+	/* Let other processes waiting to compile this script use it now */
+	sieve_binary_release_compile_lock(sbin);
+	return ret;
 }
 
 void sieve_close(struct sieve_binary **sbin)
@@ -23,6 +23,25 @@ struct sieve_instance *sieve_init
 	(const struct sieve_environment *env, const struct sieve_callbacks *callbacks,
 		void *context, bool debug);
 
+/* sieve_reinit():
+ *   Prepares an existing engine instance for use in a different environment
+ *   (e.g. for the next recipient), avoiding the cost of a full sieve_init().
+ *   This only succeeds when all settings consulted during sieve_init() yield
+ *   the same values for the new context. Otherwise, FALSE is returned and the
+ *   caller needs to deinitialize this instance and create a new one.
+ */
+bool sieve_reinit
+	(struct sieve_instance *svinst, const struct sieve_environment *env,
+		void *context, bool debug);
+
+/* sieve_detach():
+ *   Detaches the engine instance from the context passed to sieve_init() or
+ *   sieve_reinit(). This must be called before that context is freed when the
+ *   instance is kept for reuse; until the next sieve_reinit(), settings are
+ *   looked up with a NULL context.
+ */
+void sieve_detach(struct sieve_instance *svinst);
+
 /* sieve_deinit():
  *   Frees all memory allocated by the sieve engine.
  */
@@ -132,6 +151,14 @@ const char *sieve_get_source(struct sieve_binary *sbin);
  */
 bool sieve_is_loaded(struct sieve_binary *sbin);
 
+/*
+ * sieve_prefetch_headers:
+ *
+ *   Tells the mail storage which header fields the binary is going to access,
+ *   so that these can be fetched (and cached) in one go before execution.
+ */
+void sieve_prefetch_headers(struct sieve_binary *sbin, struct mail *mail);
+
 /*
  * Debugging
  */
@@ -255,4 +282,25 @@ void sieve_trace_log_free(struct sieve_trace_log **_trace_log);
 int sieve_trace_config_get(struct sieve_instance *svinst,
 	struct sieve_trace_config *tr_config);
 
+/*
+ * Execution profile
+ */
+
+enum sieve_profile_format {
+	/* Totals per operation and per source line */
+	SIEVE_PROFILE_FORMAT_TABLE,
+	/* Folded stacks, as used for flame graphs */
+	SIEVE_PROFILE_FORMAT_FOLDED
+};
+
+struct sieve_profile *sieve_profile_create(struct sieve_instance *svinst);
+void sieve_profile_free(struct sieve_profile **_profile);
+
+/* Appends the profile to the file at path, or writes it to stdout when path
+   is NULL */
+int sieve_profile_write
+	(struct sieve_profile *profile, const char *path,
+		enum sieve_profile_format format)
+	ATTR_NULL(2);
+
 #endif
@@ -218,8 +218,10 @@ static struct sieve_binary *sieve_dict_script_binary_load
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
 
-	if ( sieve_dict_script_get_binpath(dscript) == NULL )
+	if ( sieve_dict_script_get_binpath(dscript) == NULL ) {
+		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
 		return NULL;
+	}
 
 	return sieve_binary_open(script->storage->svinst,
 		dscript->binpath, script, error_r);
@@ -232,8 +234,14 @@ static int sieve_dict_script_binary_save
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
 
-	if ( sieve_dict_script_get_binpath(dscript) == NULL )
-		return 0;
+	if ( sieve_dict_script_get_binpath(dscript) == NULL ) {
+		/* Nothing to do, unless the binary can be saved in the binary
+		   cache directory instead */
+		if ( script->storage->svinst->binary_cache_dir == NULL )
+			return 0;
+		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
+		return -1;
+	}
 	if ( sieve_storage_setup_bindir(script->storage, 0700) < 0 )
 		return -1;
 
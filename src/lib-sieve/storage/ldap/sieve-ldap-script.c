@@ -252,8 +252,10 @@ static struct sieve_binary *sieve_ldap_script_binary_load
 	struct sieve_ldap_script *lscript =
 		(struct sieve_ldap_script *)script;
 
-	if ( sieve_ldap_script_get_binpath(lscript) == NULL )
+	if ( sieve_ldap_script_get_binpath(lscript) == NULL ) {
+		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
 		return NULL;
+	}
 
 	return sieve_binary_open(storage->svinst,
 		lscript->binpath, script, error_r);
@@ -266,8 +268,14 @@ static int sieve_ldap_script_binary_save
 	struct sieve_ldap_script *lscript =
 		(struct sieve_ldap_script *)script;
 
-	if ( sieve_ldap_script_get_binpath(lscript) == NULL )
-		return 0;
+	if ( sieve_ldap_script_get_binpath(lscript) == NULL ) {
+		/* Nothing to do, unless the binary can be saved in the binary
+		   cache directory instead */
+		if ( script->storage->svinst->binary_cache_dir == NULL )
+			return 0;
+		*error_r = SIEVE_ERROR_NOT_POSSIBLE;
+		return -1;
+	}
 
 	if ( sieve_storage_setup_bindir(script->storage, 0700) < 0 )
 		return -1;
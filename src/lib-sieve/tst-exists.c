@@ -82,6 +82,9 @@ static bool tst_exists_generate
 {
 	sieve_operation_emit(cgenv->sblock, NULL, &tst_exists_operation);
 
+	/* Record header names for prefetching */
+	sieve_generate_wanted_headers(cgenv, tst->first_positional);
+
  	/* Generate arguments */
     return sieve_generate_arguments(cgenv, tst, NULL);
 }
@@ -123,6 +123,9 @@ static bool tst_header_generate
 {
 	sieve_operation_emit(cgenv->sblock, NULL, &tst_header_operation);
 
+	/* Record header names for prefetching */
+	sieve_generate_wanted_headers(cgenv, tst->first_positional);
+
  	/* Generate arguments */
 	return sieve_generate_arguments(cgenv, tst, NULL);
 }
@@ -5,6 +5,7 @@
 #include "array.h"
 #include "str.h"
 #include "mempool.h"
+#include "hash.h"
 #include "llist.h"
 #include "istream-private.h"
 #include "master-service.h"
@@ -35,8 +36,7 @@ static struct mail_vfuncs edit_mail_vfuncs;
 struct edit_mail_istream;
 struct istream *edit_mail_istream_create(struct edit_mail *edmail);
 
-static struct _header_index *edit_mail_header_clone
-	(struct edit_mail *edmail, struct _header *header);
+static void edit_mail_headers_unshare(struct edit_mail *edmail);
 
 /*
  * Raw storage
@@ -71,13 +71,16 @@ static void edit_mail_raw_storage_drop(void)
 
 /*
  * Headers
+ *
+ *   Header names and fields are allocated from a pool that is shared by an
+ *   edit mail and all its snapshots, since snapshots refer to the fields of the
+ *   mail they were made from. The index items are allocated from the pool of
+ *   each individual edit mail and recycled when removed.
  */
 
 struct _header_field {
 	struct _header *header;
 
-	unsigned int refcount;
-
 	char *data;
 	size_t size;
 	size_t virtual_size;
@@ -90,6 +93,7 @@ struct _header_field {
 };
 
 struct _header_field_index {
+	/* Also used to link free items */
 	struct _header_field_index *prev, *next;
 
 	struct _header_field *field;
@@ -97,12 +101,11 @@ struct _header_field_index {
 };
 
 struct _header {
-	unsigned int refcount;
-
 	char *name;
 };
 
 struct _header_index {
+	/* Also used to link free items */
 	struct _header_index *prev, *next;
 
 	struct _header *header;
@@ -112,66 +115,28 @@ struct _header_index {
 	unsigned int count;
 };
 
-static inline struct _header *_header_create(const char *name)
+static inline struct _header *_header_create
+(pool_t pool, const char *name)
 {
 	struct _header *header;
 
-	header = i_new(struct _header, 1);
-	header->name = i_strdup(name);
-	header->refcount = 1;
+	header = p_new(pool, struct _header, 1);
+	header->name = p_strdup(pool, name);
 
 	return header;
 }
 
-static inline void _header_ref(struct _header *header)
-{
-	header->refcount++;
-}
-
-static inline void _header_unref(struct _header *header)
-{
-	i_assert( header->refcount > 0 );
-	if ( --header->refcount != 0 )
-		return;
-
-	i_free(header->name);
-	i_free(header);
-}
-
-static inline struct _header_field *_header_field_create(struct _header *header)
+static inline struct _header_field *_header_field_create
+(pool_t pool, struct _header *header)
 {
 	struct _header_field *hfield;
 
-	hfield = i_new(struct _header_field, 1);
-	hfield->refcount = 1;
+	hfield = p_new(pool, struct _header_field, 1);
 	hfield->header = header;
-	if ( header != NULL )
-		_header_ref(header);
 
 	return hfield;
 }
 
-static inline void _header_field_ref(struct _header_field *hfield)
-{
-	hfield->refcount++;
-}
-
-static inline void _header_field_unref(struct _header_field *hfield)
-{
-	i_assert( hfield->refcount > 0 );
-	if ( --hfield->refcount != 0 )
-		return;
-
-	if ( hfield->header != NULL )
-		_header_unref(hfield->header);
-
-	if ( hfield->data != NULL )
-		i_free(hfield->data);
-	if ( hfield->utf8_value != NULL )
-		i_free(hfield->utf8_value);
-	i_free(hfield);
-}
-
 /*
  * Edit mail object
  */
@@ -186,10 +151,23 @@ struct edit_mail {
 	struct istream *wrapped_stream;
 	struct istream *stream;
 
+	/* Pool shared with snapshots for header names and fields */
+	pool_t header_pool;
+
 	struct _header_index *headers_head, *headers_tail;
 	struct _header_field_index *header_fields_head, *header_fields_tail;
 	struct message_size hdr_size, body_size;
 
+	/* Header index items by (case-insensitive) name */
+	HASH_TABLE(const char *, struct _header_index *) header_index;
+	/* Recycled index items */
+	struct _header_index *free_headers;
+	struct _header_field_index *free_header_fields;
+
+	/* Snapshot that still uses the header index of this mail; the index is
+	   copied once the snapshot is modified */
+	struct edit_mail *cow_source;
+
 	struct message_size wrapped_hdr_size, wrapped_body_size;
 
 	struct _header_field_index *header_fields_appended;
@@ -254,6 +232,10 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 	if ( size_diff == 0 || size_diff <= (hdr_size.lines + body_size.lines)/2 )
 		edmail->crlf = edmail->eoh_crlf = TRUE;
 
+	edmail->header_pool = pool_alloconly_create("edit_mail_headers", 4096);
+	hash_table_create(&edmail->header_index, default_pool, 0,
+		strcase_hash, strcasecmp);
+
 	array_create(&edmail->mail.module_contexts, pool, sizeof(void *), 5);
 
 	edmail->mail.v = edit_mail_vfuncs;
@@ -268,7 +250,6 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 
 struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 {
-	struct _header_field_index *field_idx, *field_idx_new;
 	struct edit_mail *edmail_new;
 	pool_t pool;
 
@@ -294,6 +275,11 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	edmail_new->crlf = edmail->crlf;
 	edmail_new->eoh_crlf = edmail->eoh_crlf;
 
+	edmail_new->header_pool = edmail->header_pool;
+	pool_ref(edmail_new->header_pool);
+	hash_table_create(&edmail_new->header_index, default_pool, 0,
+		strcase_hash, strcasecmp);
+
 	array_create(&edmail_new->mail.module_contexts, pool, sizeof(void *), 5);
 
 	edmail_new->mail.v = edit_mail_vfuncs;
@@ -306,33 +292,15 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 	edmail_new->stream = NULL;
 
 	if ( edmail->modified ) {
-		field_idx = edmail->header_fields_head;
-		while ( field_idx != NULL ) {
-			struct _header_field_index *next = field_idx->next;
-
-			field_idx_new = i_new(struct _header_field_index, 1);
-
-			field_idx_new->header =
-				edit_mail_header_clone(edmail_new, field_idx->header->header);
-
-			field_idx_new->field = field_idx->field;
-			_header_field_ref(field_idx_new->field);
-
-			DLLIST2_APPEND
-				(&edmail_new->header_fields_head, &edmail_new->header_fields_tail,
-					field_idx_new);
-
-			field_idx_new->header->count++;
-			if ( field_idx->header->first == field_idx )
-				field_idx_new->header->first = field_idx_new;
-			if ( field_idx->header->last == field_idx )
-				field_idx_new->header->last = field_idx_new;
-
-			if ( field_idx == edmail->header_fields_appended )
-				edmail_new->header_fields_appended = field_idx_new;
-
-			field_idx = next;
-		}
+		/* Share the header index until the snapshot is modified; the mail
+		   itself is not modified anymore once a snapshot is made. */
+		edmail_new->cow_source = ( edmail->cow_source != NULL ?
+			edmail->cow_source : edmail );
+		edmail_new->headers_head = edmail->headers_head;
+		edmail_new->headers_tail = edmail->headers_tail;
+		edmail_new->header_fields_head = edmail->header_fields_head;
+		edmail_new->header_fields_tail = edmail->header_fields_tail;
+		edmail_new->header_fields_appended = edmail->header_fields_appended;
 
 		edmail_new->modified = TRUE;
 	}
@@ -347,34 +315,32 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 
 void edit_mail_reset(struct edit_mail *edmail)
 {
-	struct _header_index *header_idx;
-	struct _header_field_index *field_idx;
-
 	if ( edmail->stream != NULL ) {
 		i_stream_unref(&edmail->stream);
 		edmail->stream = NULL;
 	}
 
-	field_idx = edmail->header_fields_head;
-	while ( field_idx != NULL ) {
-		struct _header_field_index *next = field_idx->next;
-
-		_header_field_unref(field_idx->field);
-		i_free(field_idx);
-
-		field_idx = next;
+	/* Index items of a shared header index belong to its source */
+	if ( edmail->cow_source == NULL ) {
+		if ( edmail->header_fields_tail != NULL ) {
+			edmail->header_fields_tail->next = edmail->free_header_fields;
+			edmail->free_header_fields = edmail->header_fields_head;
+		}
+		if ( edmail->headers_tail != NULL ) {
+			edmail->headers_tail->next = edmail->free_headers;
+			edmail->free_headers = edmail->headers_head;
+		}
+		hash_table_clear(edmail->header_index, FALSE);
 	}
+	edmail->cow_source = NULL;
 
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		struct _header_index *next = header_idx->next;
-
-		_header_unref(header_idx->header);
-		i_free(header_idx);
-
-		header_idx = next;
-	}
+	edmail->headers_head = edmail->headers_tail = NULL;
+	edmail->header_fields_head = edmail->header_fields_tail = NULL;
+	edmail->header_fields_appended = NULL;
+	i_zero(&edmail->hdr_size);
+	i_zero(&edmail->appended_hdr_size);
 
+	edmail->headers_parsed = FALSE;
 	edmail->modified = FALSE;
 }
 
@@ -387,6 +353,8 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 		return;
 
 	edit_mail_reset(*edmail);
+	hash_table_destroy(&(*edmail)->header_index);
+	pool_unref(&(*edmail)->header_pool);
 
 	if ( (*edmail)->wrapped_stream != NULL ) {
 		i_stream_unref(&(*edmail)->wrapped_stream);
@@ -423,6 +391,8 @@ struct mail *edit_mail_get_mail(struct edit_mail *edmail)
 
 static inline void edit_mail_modify(struct edit_mail *edmail)
 {
+	edit_mail_headers_unshare(edmail);
+
 	edmail->mail.mail.seq++;
 	edmail->modified = TRUE;
 	edmail->snapshot_modified = TRUE;
@@ -431,7 +401,7 @@ static inline void edit_mail_modify(struct edit_mail *edmail)
 /* Header modification */
 
 static inline char *_header_value_unfold
-(const char *value)
+(pool_t pool, const char *value)
 {
 	string_t *out;
 	unsigned int i;
@@ -441,7 +411,7 @@ static inline char *_header_value_unfold
 			break;
 	}
 	if ( value[i] == '\0' ) {
-		return i_strdup(value);
+		return p_strdup(pool, value);
 	}
 
 	out = t_str_new(i + strlen(value+i) + 10);
@@ -466,23 +436,63 @@ static inline char *_header_value_unfold
 		}
 	}
 
-	return i_strndup(str_c(out), str_len(out));
+	return p_strndup(pool, str_c(out), str_len(out));
 }
 
-static struct _header_index *edit_mail_header_find
-(struct edit_mail *edmail, const char *field_name)
+/* Index items */
+
+static struct _header_index *edit_mail_header_index_new
+(struct edit_mail *edmail)
 {
-	struct _header_index *header_idx;
+	struct _header_index *header_idx = edmail->free_headers;
 
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		if ( strcasecmp(header_idx->header->name, field_name) == 0 )
-			return header_idx;
+	if ( header_idx == NULL )
+		return p_new(edmail->mail.pool, struct _header_index, 1);
 
-		header_idx = header_idx->next;
-	}
+	edmail->free_headers = header_idx->next;
+	i_zero(header_idx);
+	return header_idx;
+}
+
+static void edit_mail_header_index_remove
+(struct edit_mail *edmail, struct _header_index *header_idx)
+{
+	hash_table_remove(edmail->header_index, header_idx->header->name);
+	DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
+
+	header_idx->next = edmail->free_headers;
+	edmail->free_headers = header_idx;
+}
+
+static struct _header_field_index *edit_mail_header_field_index_new
+(struct edit_mail *edmail)
+{
+	struct _header_field_index *field_idx = edmail->free_header_fields;
+
+	if ( field_idx == NULL )
+		return p_new(edmail->mail.pool, struct _header_field_index, 1);
+
+	edmail->free_header_fields = field_idx->next;
+	i_zero(field_idx);
+	return field_idx;
+}
+
+static inline void edit_mail_header_field_index_free
+(struct edit_mail *edmail, struct _header_field_index *field_idx)
+{
+	field_idx->next = edmail->free_header_fields;
+	edmail->free_header_fields = field_idx;
+}
+
+static struct _header_index *edit_mail_header_find
+(struct edit_mail *edmail, const char *field_name)
+{
+	struct edit_mail *index_mail =
+		( edmail->cow_source != NULL ? edmail->cow_source : edmail );
 
-	return NULL;
+	if ( field_name == NULL )
+		return NULL;
+	return hash_table_lookup(index_mail->header_index, field_name);
 }
 
 static struct _header_index *edit_mail_header_create
@@ -491,10 +501,12 @@ static struct _header_index *edit_mail_header_create
 	struct _header_index *header_idx;
 
 	if ( (header_idx=edit_mail_header_find(edmail, field_name)) == NULL ) {
-		header_idx = i_new(struct _header_index, 1);
-		header_idx->header = _header_create(field_name);
+		header_idx = edit_mail_header_index_new(edmail);
+		header_idx->header = _header_create(edmail->header_pool, field_name);
 
 		DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+		hash_table_insert(edmail->header_index,
+			header_idx->header->name, header_idx);
 	}
 
 	return header_idx;
@@ -505,22 +517,62 @@ static struct _header_index *edit_mail_header_clone
 {
 	struct _header_index *header_idx;
 
-	header_idx = edmail->headers_head;
-	while ( header_idx != NULL ) {
-		if ( header_idx->header == header )
-			return header_idx;
-
-		header_idx = header_idx->next;
+	if ( (header_idx=edit_mail_header_find(edmail, header->name)) != NULL ) {
+		i_assert( header_idx->header == header );
+		return header_idx;
 	}
 
-	header_idx = i_new(struct _header_index, 1);
+	header_idx = edit_mail_header_index_new(edmail);
 	header_idx->header = header;
-	_header_ref(header);
 	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail, header_idx);
+	hash_table_insert(edmail->header_index, header->name, header_idx);
 
 	return header_idx;
 }
 
+static void edit_mail_headers_unshare(struct edit_mail *edmail)
+{
+	struct _header_field_index *field_idx, *field_idx_new, *appended;
+
+	if ( edmail->cow_source == NULL )
+		return;
+
+	/* Copy the index of the mail this snapshot was made from; the header
+	   fields themselves remain shared. */
+	field_idx = edmail->header_fields_head;
+	appended = edmail->header_fields_appended;
+
+	edmail->cow_source = NULL;
+	edmail->headers_head = edmail->headers_tail = NULL;
+	edmail->header_fields_head = edmail->header_fields_tail = NULL;
+	edmail->header_fields_appended = NULL;
+
+	while ( field_idx != NULL ) {
+		struct _header_field_index *next = field_idx->next;
+
+		field_idx_new = edit_mail_header_field_index_new(edmail);
+
+		field_idx_new->header =
+			edit_mail_header_clone(edmail, field_idx->header->header);
+		field_idx_new->field = field_idx->field;
+
+		DLLIST2_APPEND
+			(&edmail->header_fields_head, &edmail->header_fields_tail,
+				field_idx_new);
+
+		field_idx_new->header->count++;
+		if ( field_idx->header->first == field_idx )
+			field_idx_new->header->first = field_idx_new;
+		if ( field_idx->header->last == field_idx )
+			field_idx_new->header->last = field_idx_new;
+
+		if ( field_idx == appended )
+			edmail->header_fields_appended = field_idx_new;
+
+		field_idx = next;
+	}
+}
+
 static struct _header_field_index *
 edit_mail_header_field_create
 (struct edit_mail *edmail, const char *field_name, const char *value)
@@ -536,9 +588,10 @@ edit_mail_header_field_create
 	header = header_idx->header;
 
 	/* Create new field index item */
-	field_idx = i_new(struct _header_field_index, 1);
+	field_idx = edit_mail_header_field_index_new(edmail);
 	field_idx->header = header_idx;
-	field_idx->field = field = _header_field_create(header);
+	field_idx->field = field =
+		_header_field_create(edmail->header_pool, header);
 
 	/* Create header field data (folded if necessary) */
 	T_BEGIN {
@@ -553,14 +606,15 @@ edit_mail_header_field_create
 			(data, field_name, str_c(enc_value), edmail->crlf, &field->body_offset);
 
 		/* Copy to new field */
-		field->data = i_strndup(str_data(data), str_len(data));
+		field->data = p_strndup(edmail->header_pool,
+			str_data(data), str_len(data));
 		field->size = str_len(data);
 		field->virtual_size = ( edmail->crlf ? field->size : field->size + lines );
 		field->lines = lines;
 	} T_END;
 
 	/* Record original (utf8) value */
-	field->utf8_value = _header_value_unfold(value);
+	field->utf8_value = _header_value_unfold(edmail->header_pool, value);
 
 	return field_idx;
 }
@@ -581,9 +635,7 @@ static void edit_mail_header_field_delete
 	header_idx->count--;
 	if ( update_index ) {
 		if ( header_idx->count == 0 ) {
-			DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
+			edit_mail_header_index_remove(edmail, header_idx);
 		} else if ( header_idx->first == field_idx ) {
 			struct _header_field_index *hfield = header_idx->first->next;
 
@@ -607,8 +659,7 @@ static void edit_mail_header_field_delete
 
 	DLLIST2_REMOVE
 		(&edmail->header_fields_head, &edmail->header_fields_tail, field_idx);
-	_header_field_unref(field_idx->field);
-	i_free(field_idx);
+	edit_mail_header_field_index_free(edmail, field_idx);
 }
 
 static struct _header_field_index *
@@ -663,9 +714,7 @@ edit_mail_header_field_replace
 
 		if ( update_index ) {
 			if ( header_idx->count == 0 ) {
-				DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
+				edit_mail_header_index_remove(edmail, header_idx);
 			} else if ( header_idx->first == field_idx ) {
 				struct _header_field_index *hfield = header_idx->first->next;
 
@@ -707,13 +756,12 @@ edit_mail_header_field_replace
 		}
 	}
 
-	_header_field_unref(field_idx->field);
-	i_free(field_idx);
+	edit_mail_header_field_index_free(edmail, field_idx);
 	return field_idx_new;
 }
 
 static inline char *_header_decode
-(const unsigned char *hdr_data, size_t hdr_data_len)
+(pool_t pool, const unsigned char *hdr_data, size_t hdr_data_len)
 {
 	string_t *str = t_str_new(512);
 
@@ -722,7 +770,7 @@ static inline char *_header_decode
 	/* Decode MIME encoded-words. */
 	message_header_decode_utf8
 		((const unsigned char *)hdr_data, hdr_data_len, str, NULL);
-	return i_strdup(str_c(str));
+	return p_strdup(pool, str_c(str));
 }
 
 static int edit_mail_headers_parse
@@ -740,6 +788,9 @@ static int edit_mail_headers_parse
 	unsigned int lines = 0;
 	int ret;
 
+	/* Callers modify the index after parsing */
+	edit_mail_headers_unshare(edmail);
+
 	if ( edmail->headers_parsed ) return 1;
 
 	i_stream_seek(edmail->wrapped_stream, 0);
@@ -798,21 +849,24 @@ static int edit_mail_headers_parse
 
 			/* Create new header field index entry */
 
-			field_idx_new = i_new(struct _header_field_index, 1);
+			field_idx_new = edit_mail_header_field_index_new(edmail);
 
 			header_idx = edit_mail_header_create(edmail, hdr->name);
 			header_idx->count++;
 			field_idx_new->header = header_idx;
-			field_idx_new->field = field = _header_field_create(header_idx->header);
+			field_idx_new->field = field =
+				_header_field_create(edmail->header_pool, header_idx->header);
 
 			i_assert( body_offset > 0 );
 			field->body_offset = body_offset;
 
-			field->utf8_value = _header_decode(hdr->full_value, hdr->full_value_len);
+			field->utf8_value = _header_decode(edmail->header_pool,
+				hdr->full_value, hdr->full_value_len);
 
 			field->size = str_len(hdr_data);
 			field->virtual_size = field->size + vsize_diff;
-			field->data = i_strndup(str_data(hdr_data), field->size);
+			field->data = p_strndup(edmail->header_pool,
+				str_data(hdr_data), field->size);
 			field->offset = offset;
 			field->lines = lines;
 
@@ -838,9 +892,7 @@ static int edit_mail_headers_parse
 		while ( current != NULL ) {
 			struct _header_field_index *next = current->next;
 
-			_header_field_unref(current->field);
-			i_free(current);
-
+			edit_mail_header_field_index_free(edmail, current);
 			current = next;
 		}
 
@@ -993,9 +1045,7 @@ int edit_mail_header_delete
 	}
 
 	if ( index == 0 || header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
 		struct _header_field_index *current = edmail->header_fields_head;
 
@@ -1069,9 +1119,7 @@ int edit_mail_header_replace
 
 	/* Update old header index */
 	if ( header_idx->count == 0 ) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if ( header_idx->first == NULL || header_idx->last == NULL ) {
 		struct _header_field_index *current = edmail->header_fields_head;
 
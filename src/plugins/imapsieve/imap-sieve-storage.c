@@ -592,6 +592,11 @@ imap_sieve_mailbox_run_copy_source(
 	ret = imap_sieve_run_mail
 		(isrun, *src_mail, NULL);
 	if (ret > 0) {
+		/* The source message is only discarded once the messages stored
+		   for it are committed */
+		if (imap_sieve_run_flush(isrun, NULL) < 0)
+			return;
+
 		/* Discard */
 		mail_update_flags(*src_mail, MODIFY_ADD, MAIL_DELETED);
 	}
@@ -616,9 +621,12 @@ imap_sieve_mailbox_transaction_run(
 	struct mailbox *sbox;
 	struct imap_sieve_run *isrun, *isrun_src;
 	struct seq_range_iter siter;
+	ARRAY_TYPE(seq_range) discard_uids, lost_uids;
 	const char *cause, *script_name = NULL;
 	bool can_discard;
 	struct mail *mail, *src_mail = NULL;
+	unsigned int n;
+	uint32_t uid;
 	int ret;
 
 	if (ismt == NULL || !array_is_created(&ismt->events)) {
@@ -730,10 +738,9 @@ imap_sieve_mailbox_transaction_run(
 	mailbox_header_lookup_unref(&headers_ctx);
 
 	/* Iterate through all events */
+	i_array_init(&discard_uids, 64);
 	seq_range_array_iter_init(&siter, &changes->saved_uids);
 	array_foreach(&ismt->events, mevent) {
-		uint32_t uid;
-
 		/* Determine UID for saved message */
 		if (mevent->dest_mail_uid > 0 ||
 			!seq_range_array_iter_nth(&siter, mevent->save_seq, &uid))
@@ -758,8 +765,9 @@ imap_sieve_mailbox_transaction_run(
 			/* Sieve error; keep */
 		} else {
 			if (ret > 0 && can_discard) {
-				/* Discard */
-				mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+				/* Discard once the messages stored for it are
+				   committed */
+				seq_range_array_add(&discard_uids, uid);
 			}
 
 			imap_sieve_mailbox_run_copy_source
@@ -767,6 +775,25 @@ imap_sieve_mailbox_transaction_run(
 		}
 	}
 
+	/* Keep the messages for which stored messages were lost */
+	i_array_init(&lost_uids, 16);
+	if (imap_sieve_run_flush(isrun, &lost_uids) < 0) {
+		imap_sieve_mailbox_error(sbox,
+			"Failed to store %u messages; these are not discarded",
+			seq_range_count(&lost_uids));
+		seq_range_array_remove_seq_range(&discard_uids, &lost_uids);
+	}
+	array_free(&lost_uids);
+
+	/* Discard */
+	seq_range_array_iter_init(&siter, &discard_uids);
+	n = 0;
+	while (seq_range_array_iter_nth(&siter, n++, &uid)) {
+		if (mail_set_uid(mail, uid))
+			mail_update_flags(mail, MODIFY_ADD, MAIL_DELETED);
+	}
+	array_free(&discard_uids);
+
 	/* Cleanup */
 	mail_free(&mail);
 	ret = mailbox_transaction_commit(&st);
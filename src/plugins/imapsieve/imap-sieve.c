@@ -13,6 +13,7 @@
 #include "sieve.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
+#include "sieve-mailbox-cache.h"
 
 #include "ext-imapsieve-common.h"
 
@@ -264,6 +265,8 @@ struct imap_sieve_run {
 	struct sieve_script *user_script;
 	struct imap_sieve_run_script *scripts;
 	unsigned int scripts_count;
+
+	struct sieve_mailbox_cache *mailbox_cache;
 };
 
 static void
@@ -378,6 +381,8 @@ int imap_sieve_run_init(struct imap_sieve *isieve,
 	isrun->user_script = user_script;
 	isrun->scripts = scripts;
 	isrun->scripts_count = count;
+	isrun->mailbox_cache =
+		sieve_mailbox_cache_create(svinst, isieve->client->user);
 
 	imap_sieve_run_init_user_log(isrun);
 
@@ -400,10 +405,20 @@ void imap_sieve_run_deinit(struct imap_sieve_run **_isrun)
 	}
 	if (isrun->user_ehandler != NULL)
 		sieve_error_handler_unref(&isrun->user_ehandler);
+	if (isrun->mailbox_cache != NULL)
+		sieve_mailbox_cache_destroy(&isrun->mailbox_cache);
 
 	pool_unref(&isrun->pool);
 }
 
+int imap_sieve_run_flush(struct imap_sieve_run *isrun,
+			 ARRAY_TYPE(seq_range) *lost_uids)
+{
+	if (isrun->mailbox_cache == NULL)
+		return 0;
+	return sieve_mailbox_cache_flush(isrun->mailbox_cache, lost_uids);
+}
+
 static struct sieve_binary *
 imap_sieve_run_open_script(
 	struct imap_sieve_run *isrun,
@@ -626,6 +641,8 @@ static int imap_sieve_run_scripts
 			}
 		}
 
+		sieve_prefetch_headers(sbin, msgdata->mail);
+
 		/* Execute */
 		if ( debug ) {
 			sieve_sys_debug(svinst,
@@ -653,6 +670,7 @@ static int imap_sieve_run_scripts
 				}
 
 				/* Execute again */
+				sieve_prefetch_headers(sbin, msgdata->mail);
 				more = sieve_multiscript_run(mscript, sbin,
 					ehandler, ehandler, exflags);
 
@@ -752,6 +770,7 @@ int imap_sieve_run_mail
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
 		scriptenv.script_context = (void *)&context;
+		scriptenv.mailbox_cache = isrun->mailbox_cache;
 
 		/* Execute script(s) */
 
@@ -4,6 +4,8 @@
 #ifndef __IMAP_SIEVE_H
 #define __IMAP_SIEVE_H
 
+#include "seq-range-array.h"
+
 struct client;
 
 /*
@@ -59,4 +61,10 @@ int imap_sieve_run_mail
 
 void imap_sieve_run_deinit(struct imap_sieve_run **_isrun);
 
+/* Commits the messages stored into mailboxes by the runs so far. Returns -1
+   when some of these messages were lost; the UIDs of the messages for which
+   they were stored are then added to lost_uids, unless it is NULL. */
+int imap_sieve_run_flush(struct imap_sieve_run *isrun,
+			 ARRAY_TYPE(seq_range) *lost_uids);
+
 #endif
@@ -0,0 +1,50 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+
+#include "sieve.h"
+
+#include "lda-sieve-instance.h"
+
+/*
+ * Engine instance
+ *
+ *   The instance is kept for the lifetime of the process and reused for
+ *   subsequent deliveries as long as the relevant settings do not change.
+ *   Its settings context is the delivery context, which only lives as long as
+ *   the delivery itself.
+ */
+
+static struct sieve_instance *lda_sieve_svinst = NULL;
+
+struct sieve_instance *lda_sieve_instance_begin
+(const struct sieve_environment *svenv,
+	const struct sieve_callbacks *callbacks, void *context, bool debug)
+{
+	if ( lda_sieve_svinst != NULL &&
+		!sieve_reinit(lda_sieve_svinst, svenv, context, debug) )
+		sieve_deinit(&lda_sieve_svinst);
+	if ( lda_sieve_svinst == NULL ) {
+		lda_sieve_svinst =
+			sieve_init(svenv, callbacks, context, debug);
+	}
+	return lda_sieve_svinst;
+}
+
+void lda_sieve_instance_end(void)
+{
+	if ( lda_sieve_svinst != NULL )
+		sieve_detach(lda_sieve_svinst);
+}
+
+struct sieve_instance *lda_sieve_instance_get(void)
+{
+	return lda_sieve_svinst;
+}
+
+void lda_sieve_instance_deinit(void)
+{
+	if ( lda_sieve_svinst != NULL )
+		sieve_deinit(&lda_sieve_svinst);
+}
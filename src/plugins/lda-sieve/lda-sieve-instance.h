@@ -0,0 +1,29 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __LDA_SIEVE_INSTANCE_H
+#define __LDA_SIEVE_INSTANCE_H
+
+#include "sieve.h"
+
+/*
+ * Engine instance
+ */
+
+/* Returns the engine instance for a delivery with the given environment and
+   settings context. The instance of the previous delivery is reused when the
+   settings it was initialized with are unchanged; otherwise, it is replaced by
+   a new one. Returns NULL when the engine fails to initialize. */
+struct sieve_instance *lda_sieve_instance_begin
+	(const struct sieve_environment *svenv,
+		const struct sieve_callbacks *callbacks, void *context, bool debug);
+/* Ends the delivery; the instance no longer references its settings context
+   afterwards, so that context can be freed. */
+void lda_sieve_instance_end(void);
+
+/* Returns the instance of the current delivery. */
+struct sieve_instance *lda_sieve_instance_get(void);
+
+void lda_sieve_instance_deinit(void);
+
+#endif /* __LDA_SIEVE_INSTANCE_H */
@@ -18,6 +18,8 @@
 #include "sieve-storage.h"
 
 #include "lda-sieve-log.h"
+#include "lda-sieve-instance.h"
+#include "lda-sieve-smtp.h"
 #include "lda-sieve-plugin.h"
 
 #include <sys/stat.h>
@@ -114,6 +116,47 @@ static int lda_sieve_smtp_finish
 	return ret;
 }
 
+static void *lda_sieve_smtp_pool_start
+(const struct sieve_script_env *senv ATTR_UNUSED, const char *return_path)
+{
+	return (void *)lda_sieve_smtp_msg_start
+		(lda_sieve_instance_get(), return_path);
+}
+
+static void lda_sieve_smtp_pool_add_rcpt
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle,
+	const char *address)
+{
+	struct lda_sieve_smtp_msg *smsg = (struct lda_sieve_smtp_msg *) handle;
+
+	lda_sieve_smtp_msg_add_rcpt(smsg, address);
+}
+
+static struct ostream *lda_sieve_smtp_pool_send
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct lda_sieve_smtp_msg *smsg = (struct lda_sieve_smtp_msg *) handle;
+
+	return lda_sieve_smtp_msg_send(smsg);
+}
+
+static void lda_sieve_smtp_pool_abort
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct lda_sieve_smtp_msg *smsg = (struct lda_sieve_smtp_msg *) handle;
+
+	lda_sieve_smtp_msg_abort(&smsg);
+}
+
+static int lda_sieve_smtp_pool_finish
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle,
+	const char **error_r)
+{
+	struct lda_sieve_smtp_msg *smsg = (struct lda_sieve_smtp_msg *) handle;
+
+	return lda_sieve_smtp_msg_finish(&smsg, error_r);
+}
+
 static int lda_sieve_reject_mail
 (const struct sieve_script_env *senv, const char *recipient,
 	const char *reason)
@@ -455,6 +498,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 	if ( sbin == NULL )
 		return FALSE;
 
+	sieve_prefetch_headers(sbin, srctx->msgdata->mail);
+
 	/* Execute */
 
 	if ( debug ) {
@@ -488,6 +533,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 			if ( sbin == NULL )
 				return FALSE;
 
+			sieve_prefetch_headers(sbin, srctx->msgdata->mail);
+
 			/* Execute again */
 
 			action_ehandler = lda_sieve_log_ehandler_create
@@ -850,11 +897,20 @@ static int lda_sieve_execute
 		scriptenv.mailbox_autocreate = mdctx->set->lda_mailbox_autocreate;
 		scriptenv.mailbox_autosubscribe = mdctx->set->lda_mailbox_autosubscribe;
 		scriptenv.user = mdctx->dest_user;
-		scriptenv.smtp_start = lda_sieve_smtp_start;
-		scriptenv.smtp_add_rcpt = lda_sieve_smtp_add_rcpt;
-		scriptenv.smtp_send = lda_sieve_smtp_send;
-		scriptenv.smtp_abort = lda_sieve_smtp_abort;
-		scriptenv.smtp_finish = lda_sieve_smtp_finish;
+		if ( lda_sieve_smtp_pool_configure(svinst, mdctx->smtp_set) ) {
+			/* Keep submission connections open across deliveries */
+			scriptenv.smtp_start = lda_sieve_smtp_pool_start;
+			scriptenv.smtp_add_rcpt = lda_sieve_smtp_pool_add_rcpt;
+			scriptenv.smtp_send = lda_sieve_smtp_pool_send;
+			scriptenv.smtp_abort = lda_sieve_smtp_pool_abort;
+			scriptenv.smtp_finish = lda_sieve_smtp_pool_finish;
+		} else {
+			scriptenv.smtp_start = lda_sieve_smtp_start;
+			scriptenv.smtp_add_rcpt = lda_sieve_smtp_add_rcpt;
+			scriptenv.smtp_send = lda_sieve_smtp_send;
+			scriptenv.smtp_abort = lda_sieve_smtp_abort;
+			scriptenv.smtp_finish = lda_sieve_smtp_finish;
+		}
 		scriptenv.duplicate_mark = lda_sieve_duplicate_mark;
 		scriptenv.duplicate_check = lda_sieve_duplicate_check;
 		scriptenv.duplicate_flush = lda_sieve_duplicate_flush;
@@ -910,7 +966,8 @@ static int lda_sieve_deliver_mail
 	svenv.location = SIEVE_ENV_LOCATION_MDA;
 	svenv.delivery_phase = SIEVE_DELIVERY_PHASE_DURING;
 
-	srctx.svinst = sieve_init(&svenv, &lda_sieve_callbacks, mdctx, debug);
+	srctx.svinst = lda_sieve_instance_begin
+		(&svenv, &lda_sieve_callbacks, mdctx, debug);
 
 	/* Initialize master error handler */
 
@@ -941,7 +998,9 @@ static int lda_sieve_deliver_mail
 	if ( srctx.user_ehandler != NULL )
 		sieve_error_handler_unref(&srctx.user_ehandler);
 	sieve_error_handler_unref(&srctx.master_ehandler);
-	sieve_deinit(&srctx.svinst);
+
+	/* The delivery context is freed once the delivery is finished */
+	lda_sieve_instance_end();
 
 	return ret;
 }
@@ -963,4 +1022,7 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	lda_sieve_smtp_pool_deinit();
+	lda_sieve_instance_deinit();
 }
@@ -0,0 +1,725 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "llist.h"
+#include "hostpid.h"
+#include "ioloop.h"
+#include "net.h"
+#include "fd-set-nonblock.h"
+#include "istream.h"
+#include "istream-crlf.h"
+#include "ostream.h"
+#include "ostream-dot.h"
+#include "iostream-temp.h"
+#include "smtp-submit-settings.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-error.h"
+
+#include "lda-sieve-smtp.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/*
+ * Pool of submission connections
+ *
+ *   Messages sent by Sieve actions are normally submitted through a new
+ *   connection each. When the pool is enabled, the connections to
+ *   submission_host are kept open after the transaction, so that later
+ *   messages sent by the same process, e.g. for the next recipients of an LMTP
+ *   delivery, reuse them. A connection that has been idle for a while is
+ *   checked with NOOP before it is reused; a connection that turns out to be
+ *   closed by the server is replaced by a new one transparently.
+ */
+
+#define LDA_SIEVE_SMTP_DEFAULT_PORT 25
+#define LDA_SIEVE_SMTP_DEFAULT_TIMEOUT 30
+#define LDA_SIEVE_SMTP_MAX_LINE_LENGTH 4096
+
+#define LDA_SIEVE_SMTP_POOL_DEFAULT_MAX_MESSAGES 100
+#define LDA_SIEVE_SMTP_POOL_DEFAULT_IDLE_TIMEOUT 30
+#define LDA_SIEVE_SMTP_POOL_DEFAULT_CHECK_INTERVAL 5
+
+struct lda_sieve_smtp_conn {
+	struct lda_sieve_smtp_conn *prev, *next;
+
+	int fd;
+	struct istream *input;
+	struct ostream *output;
+
+	unsigned int messages;
+	time_t last_used;
+};
+
+struct lda_sieve_smtp_pool {
+	char *host, *my_hostname;
+	struct ip_addr ip;
+	in_port_t port;
+	unsigned int timeout_secs;
+
+	unsigned int max_idle, max_messages;
+	unsigned int idle_timeout_secs, check_interval_secs;
+
+	/* Idle connections; most recently used first */
+	struct lda_sieve_smtp_conn *idle;
+	unsigned int idle_count;
+	struct timeout *to_idle;
+};
+
+struct lda_sieve_smtp_msg {
+	pool_t pool;
+	struct sieve_instance *svinst;
+
+	const char *return_path;
+	ARRAY_TYPE(const_string) rcpts;
+
+	struct ostream *output;
+};
+
+static struct lda_sieve_smtp_pool *lda_sieve_smtp_pool = NULL;
+
+/*
+ * Connection
+ */
+
+static int lda_sieve_smtp_conn_read_reply
+(struct lda_sieve_smtp_conn *conn, unsigned int *code_r,
+	const char **reply_r)
+{
+	string_t *reply = t_str_new(128);
+	const char *line;
+
+	for (;;) {
+		if ( (line=i_stream_read_next_line(conn->input)) == NULL ) {
+			if ( conn->input->stream_errno != 0 ) {
+				*reply_r = t_strdup_printf("read() failed: %s",
+					i_stream_get_error(conn->input));
+			} else if ( conn->input->eof ) {
+				*reply_r = "Connection closed by server";
+			} else {
+				*reply_r = "Timed out waiting for reply";
+			}
+			return -1;
+		}
+
+		if ( strlen(line) < 3 || !i_isdigit(line[0]) ||
+			!i_isdigit(line[1]) || !i_isdigit(line[2]) ||
+			(line[3] != '\0' && line[3] != ' ' && line[3] != '-') ) {
+			*reply_r = t_strdup_printf("Invalid reply: %s",
+				str_sanitize(line, 128));
+			return -1;
+		}
+
+		if ( str_len(reply) > 0 )
+			str_append_c(reply, ' ');
+		str_append(reply, line);
+
+		if ( line[3] != '-' ) {
+			*code_r = (line[0] - '0') * 100 + (line[1] - '0') * 10 +
+				(line[2] - '0');
+			break;
+		}
+	}
+
+	*reply_r = str_c(reply);
+	return 0;
+}
+
+static int lda_sieve_smtp_conn_flush
+(struct lda_sieve_smtp_conn *conn, const char **error_r)
+{
+	if ( o_stream_flush(conn->output) > 0 )
+		return 0;
+
+	if ( conn->output->stream_errno != 0 ) {
+		*error_r = t_strdup_printf("write() failed: %s",
+			o_stream_get_error(conn->output));
+	} else {
+		*error_r = "Timed out sending data";
+	}
+	return -1;
+}
+
+static int lda_sieve_smtp_conn_command
+(struct lda_sieve_smtp_conn *conn, const char *cmd,
+	unsigned int *code_r, const char **reply_r)
+{
+	o_stream_nsend_str(conn->output, t_strconcat(cmd, "\r\n", NULL));
+	if ( lda_sieve_smtp_conn_flush(conn, reply_r) < 0 )
+		return -1;
+
+	return lda_sieve_smtp_conn_read_reply(conn, code_r, reply_r);
+}
+
+static void lda_sieve_smtp_conn_close
+(struct lda_sieve_smtp_conn **_conn, bool quit)
+{
+	struct lda_sieve_smtp_conn *conn = *_conn;
+
+	*_conn = NULL;
+
+	if ( quit ) {
+		o_stream_nsend_str(conn->output, "QUIT\r\n");
+		(void)o_stream_flush(conn->output);
+	}
+
+	i_stream_destroy(&conn->input);
+	o_stream_destroy(&conn->output);
+	i_close_fd(&conn->fd);
+	i_free(conn);
+}
+
+static int lda_sieve_smtp_connect_ip
+(const struct ip_addr *ip, in_port_t port, unsigned int timeout_secs)
+{
+	struct pollfd pfd;
+	int fd, ret, err;
+
+	if ( (fd=net_connect_ip(ip, port, NULL)) < 0 )
+		return -1;
+
+	/* Wait for the non-blocking connect() to finish */
+	i_zero(&pfd);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while ( (ret=poll(&pfd, 1, timeout_secs * 1000)) < 0 && errno == EINTR );
+
+	if ( ret == 0 )
+		err = ETIMEDOUT;
+	else if ( ret < 0 )
+		err = errno;
+	else
+		err = net_geterror(fd);
+	if ( err != 0 ) {
+		i_close_fd(&fd);
+		errno = err;
+		return -1;
+	}
+
+	fd_set_nonblock(fd, FALSE);
+	return fd;
+}
+
+static struct lda_sieve_smtp_conn *lda_sieve_smtp_conn_connect
+(struct lda_sieve_smtp_pool *pool, const char **error_r)
+{
+	struct lda_sieve_smtp_conn *conn;
+	unsigned int code;
+	struct timeval tv;
+	const char *reply;
+	int fd;
+
+	if ( (fd=lda_sieve_smtp_connect_ip
+		(&pool->ip, pool->port, pool->timeout_secs)) < 0 ) {
+		*error_r = t_strdup_printf("connect(%s:%u) failed: %m",
+			pool->host, pool->port);
+		return NULL;
+	}
+
+	/* The conversation is synchronous; the timeouts apply to each read and
+	   write on the socket */
+	i_zero(&tv);
+	tv.tv_sec = pool->timeout_secs;
+	if ( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ) {
+		*error_r = t_strdup_printf("setsockopt(%s:%u) failed: %m",
+			pool->host, pool->port);
+		i_close_fd(&fd);
+		return NULL;
+	}
+
+	conn = i_new(struct lda_sieve_smtp_conn, 1);
+	conn->fd = fd;
+	conn->input = i_stream_create_fd(fd, LDA_SIEVE_SMTP_MAX_LINE_LENGTH);
+	conn->output = o_stream_create_fd(fd, (size_t)-1);
+	o_stream_set_no_error_handling(conn->output, TRUE);
+
+	/* Greeting */
+	if ( lda_sieve_smtp_conn_read_reply(conn, &code, &reply) < 0 ||
+		code != 220 ) {
+		*error_r = t_strdup_printf("Failed to connect to %s:%u: %s",
+			pool->host, pool->port, reply);
+		lda_sieve_smtp_conn_close(&conn, FALSE);
+		return NULL;
+	}
+
+	/* Fall back to HELO for servers without ESMTP support */
+	if ( lda_sieve_smtp_conn_command(conn,
+		t_strconcat("EHLO ", pool->my_hostname, NULL), &code, &reply) < 0 ||
+		(code / 100 == 5 && lda_sieve_smtp_conn_command(conn,
+			t_strconcat("HELO ", pool->my_hostname, NULL),
+			&code, &reply) < 0) ||
+		code / 100 != 2 ) {
+		*error_r = t_strdup_printf("Failed to greet %s:%u: %s",
+			pool->host, pool->port, reply);
+		lda_sieve_smtp_conn_close(&conn, FALSE);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/* Returns 1 on success, 0 on permanent failure and -1 on temporary failure.
+   When the connection can no longer be used, broken_r is set. */
+static int lda_sieve_smtp_conn_transaction
+(struct lda_sieve_smtp_conn *conn, struct lda_sieve_smtp_msg *smsg,
+	struct istream *input, bool *broken_r, bool *started_r,
+	const char **error_r)
+{
+	struct istream *crlf_input;
+	struct ostream *dot_output;
+	const char *const *rcptp;
+	const char *reply, *rset_reply;
+	unsigned int code;
+	int ret;
+
+	*broken_r = *started_r = FALSE;
+
+	/* Envelope */
+	if ( lda_sieve_smtp_conn_command(conn, t_strdup_printf("MAIL FROM:<%s>",
+		( smsg->return_path == NULL ? "" : smsg->return_path )),
+		&code, &reply) < 0 ) {
+		*broken_r = TRUE;
+		*error_r = reply;
+		return -1;
+	}
+	*started_r = TRUE;
+	if ( code / 100 != 2 )
+		goto failed;
+
+	array_foreach(&smsg->rcpts, rcptp) {
+		if ( lda_sieve_smtp_conn_command(conn,
+			t_strdup_printf("RCPT TO:<%s>", *rcptp), &code, &reply) < 0 ) {
+			*broken_r = TRUE;
+			*error_r = reply;
+			return -1;
+		}
+		if ( code / 100 != 2 )
+			goto failed;
+	}
+
+	/* Message */
+	if ( lda_sieve_smtp_conn_command(conn, "DATA", &code, &reply) < 0 ) {
+		*broken_r = TRUE;
+		*error_r = reply;
+		return -1;
+	}
+	if ( code != 354 )
+		goto failed;
+
+	crlf_input = i_stream_create_crlf(input);
+	dot_output = o_stream_create_dot(conn->output, FALSE);
+	o_stream_nsend_istream(dot_output, crlf_input);
+	/* The dot stream writes the final "." line only when it is finished */
+	ret = o_stream_finish(dot_output);
+	if ( crlf_input->stream_errno != 0 ) {
+		*error_r = t_strdup_printf("read(%s) failed: %s",
+			i_stream_get_name(crlf_input), i_stream_get_error(crlf_input));
+		ret = -1;
+	} else if ( ret <= 0 ) {
+		if ( dot_output->stream_errno != 0 ) {
+			*error_r = t_strdup_printf("write() failed: %s",
+				o_stream_get_error(dot_output));
+		} else {
+			*error_r = "Timed out sending data";
+		}
+		ret = -1;
+	}
+	o_stream_destroy(&dot_output);
+	i_stream_unref(&crlf_input);
+
+	/* The message cannot be ended cleanly anymore */
+	if ( ret < 0 || lda_sieve_smtp_conn_flush(conn, error_r) < 0 ) {
+		*broken_r = TRUE;
+		return -1;
+	}
+
+	if ( lda_sieve_smtp_conn_read_reply(conn, &code, &reply) < 0 ) {
+		*broken_r = TRUE;
+		*error_r = reply;
+		return -1;
+	}
+	if ( code / 100 == 2 )
+		return 1;
+
+	/* The server does not expect RSET after a rejected DATA; the
+	   transaction is over already */
+	*error_r = reply;
+	return ( code / 100 == 5 ? 0 : -1 );
+
+failed:
+	*error_r = reply;
+	ret = ( code / 100 == 5 ? 0 : -1 );
+
+	/* Abort the transaction so that the connection can be reused */
+	if ( lda_sieve_smtp_conn_command(conn, "RSET", &code, &rset_reply) < 0 ||
+		code / 100 != 2 )
+		*broken_r = TRUE;
+	return ret;
+}
+
+/*
+ * Pool
+ */
+
+static void lda_sieve_smtp_pool_expire(struct lda_sieve_smtp_pool *pool)
+{
+	struct lda_sieve_smtp_conn *conn, *next;
+
+	for ( conn = pool->idle; conn != NULL; conn = next ) {
+		next = conn->next;
+
+		if ( conn->last_used + (time_t)pool->idle_timeout_secs > ioloop_time )
+			continue;
+
+		DLLIST_REMOVE(&pool->idle, conn);
+		pool->idle_count--;
+		lda_sieve_smtp_conn_close(&conn, TRUE);
+	}
+
+	if ( pool->idle == NULL && pool->to_idle != NULL )
+		timeout_remove(&pool->to_idle);
+}
+
+static void lda_sieve_smtp_pool_trim(struct lda_sieve_smtp_pool *pool)
+{
+	struct lda_sieve_smtp_conn *conn, *last = NULL;
+
+	/* Close the least recently used connections first */
+	while ( pool->idle_count > pool->max_idle ) {
+		for ( conn = pool->idle; conn != NULL; conn = conn->next )
+			last = conn;
+		i_assert( last != NULL );
+
+		DLLIST_REMOVE(&pool->idle, last);
+		pool->idle_count--;
+		lda_sieve_smtp_conn_close(&last, TRUE);
+	}
+
+	if ( pool->idle == NULL && pool->to_idle != NULL )
+		timeout_remove(&pool->to_idle);
+}
+
+bool lda_sieve_smtp_pool_configure
+(struct sieve_instance *svinst, const struct smtp_submit_settings *smtp_set)
+{
+	struct lda_sieve_smtp_pool *pool = lda_sieve_smtp_pool;
+	unsigned long long int uint_setting;
+	sieve_number_t period;
+	struct ip_addr ip, *ips;
+	unsigned int ips_count, max_idle = 0;
+	const char *host, *my_hostname;
+	in_port_t port;
+	int ret;
+
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_smtp_pool_max_idle", &uint_setting) )
+		max_idle = ( uint_setting > UINT_MAX ? UINT_MAX : uint_setting );
+
+	/* Only submission through SMTP can be pooled; not sendmail */
+	if ( max_idle == 0 || smtp_set->submission_host == NULL ||
+		*smtp_set->submission_host == '\0' )
+		return FALSE;
+
+	/* Pooled connections support neither SSL nor STARTTLS */
+	if ( smtp_set->submission_ssl != NULL &&
+		*smtp_set->submission_ssl != '\0' &&
+		strcmp(smtp_set->submission_ssl, "no") != 0 ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp pool: "
+				"not used, because submission_ssl = %s",
+				smtp_set->submission_ssl);
+		}
+		return FALSE;
+	}
+
+	if ( net_str2hostport(smtp_set->submission_host,
+		LDA_SIEVE_SMTP_DEFAULT_PORT, &host, &port) < 0 ) {
+		sieve_sys_error(svinst, "smtp pool: "
+			"invalid submission_host: %s", smtp_set->submission_host);
+		return FALSE;
+	}
+	my_hostname = ( smtp_set->hostname != NULL && *smtp_set->hostname != '\0' ?
+		smtp_set->hostname : my_hostdomain() );
+
+	/* The pool is shared by all users of the process, so it is configured
+	   only once. Users with a different submission server do not use it. */
+	if ( pool != NULL ) {
+		if ( strcmp(pool->host, host) == 0 && pool->port == port &&
+			strcmp(pool->my_hostname, my_hostname) == 0 )
+			return TRUE;
+
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp pool: "
+				"not used for submission to %s:%u; "
+				"the pool is configured for %s:%u",
+				host, port, pool->host, pool->port);
+		}
+		return FALSE;
+	}
+
+	/* The host is resolved only once; the lookup itself has no timeout */
+	if ( net_addr2ip(host, &ip) < 0 ) {
+		ret = net_gethostbyname(host, &ips, &ips_count);
+		if ( ret != 0 ) {
+			sieve_sys_error(svinst, "smtp pool: "
+				"failed to look up %s: %s", host, net_gethosterror(ret));
+			return FALSE;
+		}
+		ip = ips[0];
+	}
+
+	pool = i_new(struct lda_sieve_smtp_pool, 1);
+	pool->host = i_strdup(host);
+	pool->ip = ip;
+	pool->port = port;
+	pool->my_hostname = i_strdup(my_hostname);
+	lda_sieve_smtp_pool = pool;
+
+	pool->timeout_secs = ( smtp_set->submission_timeout > 0 ?
+		smtp_set->submission_timeout : LDA_SIEVE_SMTP_DEFAULT_TIMEOUT );
+	pool->max_idle = max_idle;
+
+	pool->max_messages = LDA_SIEVE_SMTP_POOL_DEFAULT_MAX_MESSAGES;
+	if ( sieve_setting_get_uint_value
+		(svinst, "sieve_smtp_pool_max_messages", &uint_setting) ) {
+		pool->max_messages = ( uint_setting > UINT_MAX ?
+			UINT_MAX : uint_setting );
+	}
+
+	pool->idle_timeout_secs = LDA_SIEVE_SMTP_POOL_DEFAULT_IDLE_TIMEOUT;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_smtp_pool_idle_timeout", &period) && period > 0 ) {
+		pool->idle_timeout_secs = ( period > UINT_MAX/1000 ?
+			UINT_MAX/1000 : (unsigned int)period );
+	}
+
+	pool->check_interval_secs = LDA_SIEVE_SMTP_POOL_DEFAULT_CHECK_INTERVAL;
+	if ( sieve_setting_get_duration_value
+		(svinst, "sieve_smtp_pool_check_interval", &period) ) {
+		pool->check_interval_secs = ( period > UINT_MAX ?
+			UINT_MAX : (unsigned int)period );
+	}
+	return TRUE;
+}
+
+void lda_sieve_smtp_pool_deinit(void)
+{
+	struct lda_sieve_smtp_pool *pool = lda_sieve_smtp_pool;
+	struct lda_sieve_smtp_conn *conn;
+
+	if ( pool == NULL )
+		return;
+	lda_sieve_smtp_pool = NULL;
+
+	while ( (conn=pool->idle) != NULL ) {
+		DLLIST_REMOVE(&pool->idle, conn);
+		lda_sieve_smtp_conn_close(&conn, TRUE);
+	}
+	if ( pool->to_idle != NULL )
+		timeout_remove(&pool->to_idle);
+
+	i_free(pool->host);
+	i_free(pool->my_hostname);
+	i_free(pool);
+}
+
+static struct lda_sieve_smtp_conn *lda_sieve_smtp_pool_get
+(struct sieve_instance *svinst, bool *reused_r, const char **error_r)
+{
+	struct lda_sieve_smtp_pool *pool = lda_sieve_smtp_pool;
+	struct lda_sieve_smtp_conn *conn;
+	const char *reply;
+	unsigned int code;
+
+	while ( (conn=pool->idle) != NULL ) {
+		DLLIST_REMOVE(&pool->idle, conn);
+		pool->idle_count--;
+
+		if ( conn->last_used + (time_t)pool->idle_timeout_secs <=
+			ioloop_time ) {
+			lda_sieve_smtp_conn_close(&conn, TRUE);
+			continue;
+		}
+
+		/* Health check */
+		if ( conn->last_used + (time_t)pool->check_interval_secs <=
+			ioloop_time &&
+			(lda_sieve_smtp_conn_command(conn, "NOOP", &code, &reply) < 0 ||
+				code / 100 != 2) ) {
+			if ( svinst->debug ) {
+				sieve_sys_debug(svinst, "smtp pool: "
+					"dropped idle connection to %s:%u: %s",
+					pool->host, pool->port, reply);
+			}
+			lda_sieve_smtp_conn_close(&conn, FALSE);
+			continue;
+		}
+
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp pool: "
+				"reusing connection to %s:%u (%u messages sent)",
+				pool->host, pool->port, conn->messages);
+		}
+		*reused_r = TRUE;
+		return conn;
+	}
+
+	*reused_r = FALSE;
+	if ( (conn=lda_sieve_smtp_conn_connect(pool, error_r)) == NULL )
+		return NULL;
+
+	if ( svinst->debug ) {
+		sieve_sys_debug(svinst, "smtp pool: "
+			"opened new connection to %s:%u", pool->host, pool->port);
+	}
+	return conn;
+}
+
+static void lda_sieve_smtp_pool_release
+(struct sieve_instance *svinst, struct lda_sieve_smtp_conn *conn)
+{
+	struct lda_sieve_smtp_pool *pool = lda_sieve_smtp_pool;
+
+	if ( pool->max_messages > 0 && conn->messages >= pool->max_messages ) {
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp pool: "
+				"closing connection to %s:%u after %u messages",
+				pool->host, pool->port, conn->messages);
+		}
+		lda_sieve_smtp_conn_close(&conn, TRUE);
+		return;
+	}
+
+	conn->last_used = ioloop_time;
+	DLLIST_PREPEND(&pool->idle, conn);
+	pool->idle_count++;
+	lda_sieve_smtp_pool_trim(pool);
+
+	if ( pool->idle != NULL && pool->to_idle == NULL &&
+		current_ioloop != NULL ) {
+		pool->to_idle = timeout_add(pool->idle_timeout_secs * 1000,
+			lda_sieve_smtp_pool_expire, pool);
+	}
+}
+
+/*
+ * Message
+ */
+
+struct lda_sieve_smtp_msg *lda_sieve_smtp_msg_start
+(struct sieve_instance *svinst, const char *return_path)
+{
+	struct lda_sieve_smtp_msg *smsg;
+	pool_t pool;
+
+	pool = pool_alloconly_create("lda_sieve_smtp_msg", 512);
+	smsg = p_new(pool, struct lda_sieve_smtp_msg, 1);
+	smsg->pool = pool;
+	smsg->svinst = svinst;
+	smsg->return_path = p_strdup(pool, return_path);
+	p_array_init(&smsg->rcpts, pool, 4);
+
+	return smsg;
+}
+
+void lda_sieve_smtp_msg_add_rcpt
+(struct lda_sieve_smtp_msg *smsg, const char *address)
+{
+	address = p_strdup(smsg->pool, address);
+	array_append(&smsg->rcpts, &address, 1);
+}
+
+struct ostream *lda_sieve_smtp_msg_send
+(struct lda_sieve_smtp_msg *smsg)
+{
+	const char *temp_dir = smsg->svinst->temp_dir;
+
+	i_assert( smsg->output == NULL );
+
+	/* The message is buffered, so that the connection is only used once the
+	   complete message is available */
+	smsg->output = iostream_temp_create(t_strconcat(
+		( temp_dir == NULL ? "/tmp" : temp_dir ),
+		"/dovecot.sieve-smtp.", NULL), 0);
+	return smsg->output;
+}
+
+static void lda_sieve_smtp_msg_free(struct lda_sieve_smtp_msg **_smsg)
+{
+	struct lda_sieve_smtp_msg *smsg = *_smsg;
+
+	*_smsg = NULL;
+
+	if ( smsg->output != NULL ) {
+		o_stream_ignore_last_errors(smsg->output);
+		o_stream_destroy(&smsg->output);
+	}
+	pool_unref(&smsg->pool);
+}
+
+void lda_sieve_smtp_msg_abort
+(struct lda_sieve_smtp_msg **_smsg)
+{
+	lda_sieve_smtp_msg_free(_smsg);
+}
+
+int lda_sieve_smtp_msg_finish
+(struct lda_sieve_smtp_msg **_smsg, const char **error_r)
+{
+	struct lda_sieve_smtp_msg *smsg = *_smsg;
+	struct sieve_instance *svinst = smsg->svinst;
+	struct lda_sieve_smtp_conn *conn;
+	struct istream *input;
+	bool reused, broken, started;
+	int ret;
+
+	*error_r = NULL;
+
+	if ( lda_sieve_smtp_pool == NULL ) {
+		lda_sieve_smtp_msg_free(_smsg);
+		*error_r = "Submission pool is not configured";
+		return -1;
+	}
+
+	i_assert( smsg->output != NULL );
+	input = iostream_temp_finish(&smsg->output, IO_BLOCK_SIZE);
+
+	for (;;) {
+		if ( (conn=lda_sieve_smtp_pool_get
+			(svinst, &reused, error_r)) == NULL ) {
+			ret = -1;
+			break;
+		}
+
+		ret = lda_sieve_smtp_conn_transaction
+			(conn, smsg, input, &broken, &started, error_r);
+		if ( !broken ) {
+			conn->messages++;
+			lda_sieve_smtp_pool_release(svinst, conn);
+			break;
+		}
+		lda_sieve_smtp_conn_close(&conn, FALSE);
+
+		/* The server may have closed an idle connection in the meantime;
+		   try once more on a new connection if it accepted nothing */
+		if ( !reused || started )
+			break;
+		if ( svinst->debug ) {
+			sieve_sys_debug(svinst, "smtp pool: "
+				"reused connection failed: %s", *error_r);
+		}
+		i_stream_seek(input, 0);
+	}
+
+	i_stream_unref(&input);
+	lda_sieve_smtp_msg_free(_smsg);
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#ifndef __LDA_SIEVE_SMTP_H
+#define __LDA_SIEVE_SMTP_H
+
+#include "sieve-common.h"
+
+struct smtp_submit_settings;
+
+/*
+ * Pooled SMTP submission
+ */
+
+/* Configures the process-wide pool of connections to submission_host. The pool
+   is configured by the first call only; later calls merely check whether the
+   pool can be used with the given settings. Returns FALSE when messages are
+   not to be submitted through the pool. */
+bool lda_sieve_smtp_pool_configure
+	(struct sieve_instance *svinst,
+		const struct smtp_submit_settings *smtp_set);
+void lda_sieve_smtp_pool_deinit(void);
+
+struct lda_sieve_smtp_msg;
+
+struct lda_sieve_smtp_msg *lda_sieve_smtp_msg_start
+	(struct sieve_instance *svinst, const char *return_path);
+void lda_sieve_smtp_msg_add_rcpt
+	(struct lda_sieve_smtp_msg *smsg, const char *address);
+struct ostream *lda_sieve_smtp_msg_send
+	(struct lda_sieve_smtp_msg *smsg);
+
+void lda_sieve_smtp_msg_abort
+	(struct lda_sieve_smtp_msg **_smsg);
+/* Returns 1 on success, 0 on permanent failure, -1 on temporary failure. */
+int lda_sieve_smtp_msg_finish
+	(struct lda_sieve_smtp_msg **_smsg, const char **error_r);
+
+#endif /* __LDA_SIEVE_SMTP_H */
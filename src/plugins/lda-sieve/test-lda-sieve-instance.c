@@ -0,0 +1,124 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "test-common.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
+
+#include "lda-sieve-instance.h"
+
+/*
+ * Test delivery
+ *
+ *   Stands in for the delivery context, which is the settings context of the
+ *   engine instance. A finished delivery is considered freed; looking up a
+ *   setting through it is an error.
+ */
+
+struct test_delivery {
+	const char *max_redirects;
+	bool finished;
+};
+
+static const char *test_get_setting
+(void *context, const char *identifier)
+{
+	struct test_delivery *tdel = (struct test_delivery *)context;
+
+	if ( tdel == NULL )
+		return NULL;
+
+	test_assert( !tdel->finished );
+	if ( strcmp(identifier, "sieve_max_redirects") == 0 )
+		return tdel->max_redirects;
+	return NULL;
+}
+
+static const struct sieve_callbacks test_callbacks = {
+	NULL,
+	test_get_setting
+};
+
+static struct sieve_instance *
+test_deliver(struct test_delivery *tdel)
+{
+	struct sieve_environment svenv;
+	struct sieve_instance *svinst;
+
+	i_zero(&svenv);
+	svenv.hostname = "localhost";
+	svenv.temp_dir = "/tmp";
+	svenv.location = SIEVE_ENV_LOCATION_MDA;
+	svenv.delivery_phase = SIEVE_DELIVERY_PHASE_DURING;
+
+	svinst = lda_sieve_instance_begin(&svenv, &test_callbacks, tdel, FALSE);
+	test_assert( svinst != NULL );
+	if ( svinst == NULL )
+		return NULL;
+
+	test_assert( lda_sieve_instance_get() == svinst );
+	test_assert( null_strcmp(sieve_setting_get(svinst, "sieve_max_redirects"),
+		tdel->max_redirects) == 0 );
+
+	lda_sieve_instance_end();
+	tdel->finished = TRUE;
+
+	/* The instance survives the delivery, its context does not */
+	test_assert( sieve_setting_get(svinst, "sieve_max_redirects") == NULL );
+	return svinst;
+}
+
+/*
+ * Tests
+ */
+
+static void test_instance_reuse(void)
+{
+	struct test_delivery tdel1 = { "4", FALSE }, tdel2 = { "4", FALSE };
+	struct sieve_instance *svinst1, *svinst2;
+
+	test_begin("lda-sieve instance reuse");
+
+	svinst1 = test_deliver(&tdel1);
+	svinst2 = test_deliver(&tdel2);
+	test_assert( svinst1 != NULL && svinst1 == svinst2 );
+	test_assert( svinst2 != NULL && svinst2->max_redirects == 4 );
+
+	lda_sieve_instance_deinit();
+	test_assert( lda_sieve_instance_get() == NULL );
+
+	test_end();
+}
+
+static void test_instance_settings_change(void)
+{
+	struct test_delivery tdel1 = { "4", FALSE }, tdel2 = { "8", FALSE };
+	struct sieve_instance *svinst;
+
+	test_begin("lda-sieve instance settings change");
+
+	svinst = test_deliver(&tdel1);
+	test_assert( svinst != NULL && svinst->max_redirects == 4 );
+
+	/* Replaces the instance; the first delivery is no longer consulted */
+	svinst = test_deliver(&tdel2);
+	test_assert( svinst != NULL && svinst->max_redirects == 8 );
+
+	lda_sieve_instance_deinit();
+	test_assert( lda_sieve_instance_get() == NULL );
+
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_instance_reuse,
+		test_instance_settings_change,
+		NULL
+	};
+
+	return test_run(test_functions);
+}
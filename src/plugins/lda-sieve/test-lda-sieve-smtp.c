@@ -0,0 +1,308 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "ioloop.h"
+#include "net.h"
+#include "fd-set-nonblock.h"
+#include "istream.h"
+#include "ostream.h"
+#include "smtp-submit-settings.h"
+#include "test-common.h"
+
+#include "sieve.h"
+
+#include "lda-sieve-smtp.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ * Test SMTP server
+ *
+ *   A minimal SMTP sink that runs in a child process. It reports the
+ *   connections, NOOP commands and messages it receives through a pipe.
+ */
+
+struct test_server_stats {
+	unsigned int connections;
+	unsigned int noops;
+	unsigned int messages;
+};
+
+static struct ip_addr test_server_ip;
+static in_port_t test_server_port;
+static pid_t test_server_pid;
+static int test_server_event_fd;
+
+static void test_server_event(int event_fd, const char *event)
+{
+	if ( write(event_fd, event, strlen(event)) < 0 )
+		i_fatal("write(event pipe) failed: %m");
+}
+
+static void test_server_session
+(int fd, int event_fd, bool close_after_message)
+{
+	struct istream *input;
+	struct ostream *output;
+	const char *line;
+
+	input = i_stream_create_fd(fd, 1024);
+	output = o_stream_create_fd(fd, (size_t)-1);
+	o_stream_set_no_error_handling(output, TRUE);
+
+	o_stream_nsend_str(output, "220 test ESMTP\r\n");
+	(void)o_stream_flush(output);
+
+	while ( (line=i_stream_read_next_line(input)) != NULL ) {
+		if ( strncasecmp(line, "EHLO ", 5) == 0 ) {
+			o_stream_nsend_str(output, "250-test\r\n250 8BITMIME\r\n");
+		} else if ( strncasecmp(line, "MAIL ", 5) == 0 ||
+			strncasecmp(line, "RCPT ", 5) == 0 ||
+			strcasecmp(line, "RSET") == 0 ) {
+			o_stream_nsend_str(output, "250 OK\r\n");
+		} else if ( strcasecmp(line, "NOOP") == 0 ) {
+			test_server_event(event_fd, "noop\n");
+			o_stream_nsend_str(output, "250 OK\r\n");
+		} else if ( strcasecmp(line, "DATA") == 0 ) {
+			o_stream_nsend_str(output, "354 Go ahead\r\n");
+			(void)o_stream_flush(output);
+			while ( (line=i_stream_read_next_line(input)) != NULL &&
+				strcmp(line, ".") != 0 );
+			if ( line == NULL )
+				break;
+			test_server_event(event_fd, "message\n");
+			o_stream_nsend_str(output, "250 OK\r\n");
+			if ( close_after_message ) {
+				(void)o_stream_flush(output);
+				break;
+			}
+		} else if ( strcasecmp(line, "QUIT") == 0 ) {
+			o_stream_nsend_str(output, "221 Bye\r\n");
+			(void)o_stream_flush(output);
+			break;
+		} else {
+			o_stream_nsend_str(output, "500 Unknown command\r\n");
+		}
+		(void)o_stream_flush(output);
+	}
+
+	i_stream_destroy(&input);
+	o_stream_destroy(&output);
+	i_close_fd(&fd);
+}
+
+static void test_server_start(bool close_after_message)
+{
+	int listen_fd, event_fds[2], fd;
+
+	if ( net_addr2ip("127.0.0.1", &test_server_ip) < 0 )
+		i_unreached();
+	test_server_port = 0;
+	if ( (listen_fd=net_listen(&test_server_ip, &test_server_port, 16)) < 0 )
+		i_fatal("listen(127.0.0.1) failed: %m");
+	if ( pipe(event_fds) < 0 )
+		i_fatal("pipe() failed: %m");
+
+	if ( (test_server_pid=fork()) == (pid_t)-1 )
+		i_fatal("fork() failed: %m");
+	if ( test_server_pid == 0 ) {
+		/* Child: serve the connections one at a time until killed */
+		i_close_fd(&event_fds[0]);
+		fd_set_nonblock(listen_fd, FALSE);
+		for (;;) {
+			if ( (fd=net_accept(listen_fd, NULL, NULL)) < 0 )
+				continue;
+			fd_set_nonblock(fd, FALSE);
+			test_server_event(event_fds[1], "connection\n");
+			test_server_session(fd, event_fds[1], close_after_message);
+		}
+	}
+
+	i_close_fd(&event_fds[1]);
+	i_close_fd(&listen_fd);
+	test_server_event_fd = event_fds[0];
+}
+
+static void test_server_stop(struct test_server_stats *stats_r)
+{
+	string_t *events = t_str_new(256);
+	const char *const *event;
+	char buf[256];
+	ssize_t ret;
+
+	(void)kill(test_server_pid, SIGKILL);
+	(void)waitpid(test_server_pid, NULL, 0);
+
+	while ( (ret=read(test_server_event_fd, buf, sizeof(buf))) > 0 )
+		str_append_n(events, buf, ret);
+	i_close_fd(&test_server_event_fd);
+
+	i_zero(stats_r);
+	for ( event = t_strsplit(str_c(events), "\n"); *event != NULL; event++ ) {
+		if ( strcmp(*event, "connection") == 0 )
+			stats_r->connections++;
+		else if ( strcmp(*event, "noop") == 0 )
+			stats_r->noops++;
+		else if ( strcmp(*event, "message") == 0 )
+			stats_r->messages++;
+	}
+}
+
+/*
+ * Test client
+ */
+
+static const char *test_check_interval = NULL;
+
+static const char *test_get_setting
+(void *context ATTR_UNUSED, const char *identifier)
+{
+	if ( strcmp(identifier, "sieve_smtp_pool_max_idle") == 0 )
+		return "1";
+	if ( strcmp(identifier, "sieve_smtp_pool_check_interval") == 0 )
+		return test_check_interval;
+	return NULL;
+}
+
+static const struct sieve_callbacks test_callbacks = {
+	NULL,
+	test_get_setting
+};
+
+static struct sieve_instance *test_client_init(void)
+{
+	struct sieve_environment svenv;
+	struct smtp_submit_settings smtp_set;
+	struct sieve_instance *svinst;
+
+	i_zero(&svenv);
+	svenv.hostname = "localhost";
+	svenv.temp_dir = "/tmp";
+	svinst = sieve_init(&svenv, &test_callbacks, NULL, FALSE);
+	test_assert( svinst != NULL );
+
+	i_zero(&smtp_set);
+	smtp_set.hostname = "localhost";
+	smtp_set.submission_host = t_strdup_printf("127.0.0.1:%u",
+		(unsigned int)test_server_port);
+	smtp_set.submission_timeout = 5;
+	test_assert( lda_sieve_smtp_pool_configure(svinst, &smtp_set) );
+	return svinst;
+}
+
+static void test_client_deinit(struct sieve_instance **_svinst)
+{
+	lda_sieve_smtp_pool_deinit();
+	sieve_deinit(_svinst);
+}
+
+static int test_client_send(struct sieve_instance *svinst)
+{
+	struct lda_sieve_smtp_msg *smsg;
+	struct ostream *output;
+	const char *error;
+
+	smsg = lda_sieve_smtp_msg_start(svinst, "sender@example.com");
+	lda_sieve_smtp_msg_add_rcpt(smsg, "recipient@example.com");
+	output = lda_sieve_smtp_msg_send(smsg);
+	o_stream_nsend_str(output, "Subject: Frop\r\n\r\nFriep!\r\n");
+	return lda_sieve_smtp_msg_finish(&smsg, &error);
+}
+
+/*
+ * Tests
+ */
+
+static void test_smtp_pool_reuse(void)
+{
+	struct test_server_stats stats;
+	struct sieve_instance *svinst;
+	struct ioloop *ioloop;
+
+	test_begin("smtp pool reuse");
+	ioloop = io_loop_create();
+	test_server_start(FALSE);
+	test_check_interval = NULL;
+
+	svinst = test_client_init();
+	test_assert( test_client_send(svinst) == 1 );
+	test_assert( test_client_send(svinst) == 1 );
+	test_client_deinit(&svinst);
+
+	test_server_stop(&stats);
+	test_assert( stats.connections == 1 );
+	test_assert( stats.noops == 0 );
+	test_assert( stats.messages == 2 );
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_smtp_pool_noop(void)
+{
+	struct test_server_stats stats;
+	struct sieve_instance *svinst;
+	struct ioloop *ioloop;
+
+	test_begin("smtp pool noop");
+	ioloop = io_loop_create();
+	test_server_start(FALSE);
+	test_check_interval = "0";
+
+	svinst = test_client_init();
+	test_assert( test_client_send(svinst) == 1 );
+	test_assert( test_client_send(svinst) == 1 );
+	test_client_deinit(&svinst);
+
+	test_server_stop(&stats);
+	test_assert( stats.connections == 1 );
+	test_assert( stats.noops == 1 );
+	test_assert( stats.messages == 2 );
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_smtp_pool_retry(void)
+{
+	struct test_server_stats stats;
+	struct sieve_instance *svinst;
+	struct ioloop *ioloop;
+
+	test_begin("smtp pool retry");
+	ioloop = io_loop_create();
+	/* The server closes the connection once a message is received */
+	test_server_start(TRUE);
+	test_check_interval = NULL;
+
+	svinst = test_client_init();
+	test_assert( test_client_send(svinst) == 1 );
+	test_assert( test_client_send(svinst) == 1 );
+	test_client_deinit(&svinst);
+
+	test_server_stop(&stats);
+	test_assert( stats.connections == 2 );
+	test_assert( stats.messages == 2 );
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_smtp_pool_reuse,
+		test_smtp_pool_noop,
+		test_smtp_pool_retry,
+		NULL
+	};
+
+	/* The server may close a connection while data is still written */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	return test_run(test_functions);
+}
@@ -9,6 +9,7 @@
 #include "str-sanitize.h"
 #include "ostream.h"
 #include "array.h"
+#include "seq-range-array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -16,6 +17,7 @@
 #include "sieve.h"
 #include "sieve-extensions.h"
 #include "sieve-binary.h"
+#include "sieve-mailbox-cache.h"
 
 #include "sieve-tool.h"
 
@@ -33,7 +35,8 @@ static void print_help(void)
 {
 	printf(
 "Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
-"                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
+"                    [-P <plugin>] [-p <profile-file>] [-g]\n"
+"                    [-q <output-mailbox>] [-Q <mail-command>]\n"
 "                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
@@ -64,9 +67,23 @@ struct sieve_filter_context {
 
 	struct mailbox_transaction_context *move_trans;
 
+	/* Source messages to expunge once the mailbox cache is flushed */
+	ARRAY_TYPE(seq_range) expunge_uids;
+
 	struct ostream *teststream;
 };
 
+static void filter_message_expunge_saved
+(struct sieve_filter_context *sfctx, struct mail *mail)
+{
+	/* Messages stored into cached mailboxes are not committed yet */
+	if ( sfctx->data->senv->mailbox_cache != NULL ) {
+		seq_range_array_add(&sfctx->expunge_uids, mail->uid);
+		return;
+	}
+	mail_expunge(mail);
+}
+
 static int filter_message
 (struct sieve_filter_context *sfctx, struct mail *mail)
 {
@@ -161,7 +178,7 @@ static int filter_message
 				"message expunged from source mailbox upon successful move");
 
 			if ( execute )
-				mail_expunge(mail);
+				filter_message_expunge_saved(sfctx, mail);
 
 		} else {
 
@@ -233,7 +250,7 @@ static int filter_message
 			sieve_error(ehandler, NULL,
 				"sieve script execution failed for this message; "
 				"message moved to default mailbox");
-			mail_expunge(mail);
+			filter_message_expunge_saved(sfctx, mail);
 			return 0;
 		}
 		/* Fall through */
@@ -262,11 +279,47 @@ static void mail_search_build_add_flags
 	args->args = arg;
 }
 
+static int filter_mailbox_flush
+(struct sieve_filter_context *sfctx, struct mailbox_transaction_context *t)
+{
+	struct sieve_mailbox_cache *mbcache = sfctx->data->senv->mailbox_cache;
+	struct sieve_error_handler *ehandler = sfctx->data->ehandler;
+	ARRAY_TYPE(seq_range) lost_uids;
+	struct seq_range_iter iter;
+	struct mail *mail;
+	unsigned int n = 0;
+	uint32_t uid;
+	int ret = 0;
+
+	/* Messages stored by the script must be committed before their source
+	   messages are expunged; those that were lost are left in place */
+	i_array_init(&lost_uids, 16);
+	if ( sieve_mailbox_cache_flush(mbcache, &lost_uids) < 0 ) {
+		sieve_error(ehandler, NULL,
+			"failed to store %u messages; "
+			"these messages are left in the source mailbox",
+			seq_range_count(&lost_uids));
+		seq_range_array_remove_seq_range(&sfctx->expunge_uids, &lost_uids);
+		ret = -1;
+	}
+	array_free(&lost_uids);
+
+	mail = mail_alloc(t, 0, NULL);
+	seq_range_array_iter_init(&iter, &sfctx->expunge_uids);
+	while ( seq_range_array_iter_nth(&iter, n++, &uid) ) {
+		if ( mail_set_uid(mail, uid) )
+			mail_expunge(mail);
+	}
+	mail_free(&mail);
+	return ret;
+}
+
 static int filter_mailbox
 (const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 {
 	struct sieve_filter_context sfctx;
 	struct mailbox *move_box = sfdata->move_mailbox;
+	struct sieve_mailbox_cache *mbcache = sfdata->senv->mailbox_cache;
 	struct sieve_error_handler *ehandler = sfdata->ehandler;
 	struct mail_search_args *search_args;
 	struct mailbox_transaction_context *t;
@@ -285,6 +338,8 @@ static int filter_mailbox
 
 	i_zero(&sfctx);
 	sfctx.data = sfdata;
+	if ( mbcache != NULL )
+		i_array_init(&sfctx.expunge_uids, 64);
 
 	/* Create test stream */
 	if ( !sfdata->execute ) {
@@ -328,6 +383,12 @@ static int filter_mailbox
 		}
 	}
 
+	if ( mbcache != NULL ) {
+		if ( filter_mailbox_flush(&sfctx, t) < 0 )
+			ret = -1;
+		array_free(&sfctx.expunge_uids);
+	}
+
 	if ( mailbox_transaction_commit(&t) < 0 ) {
 		ret = -1;
 	}
@@ -358,12 +419,15 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile,	*src_mailbox, *dst_mailbox, *move_mailbox;
+	const char *profilefile;
 	struct sieve_filter_data sfdata;
 	enum sieve_filter_discard_action discard_action = SIEVE_FILTER_DACT_KEEP;
 	struct mail_user *mail_user;
 	struct sieve_binary *main_sbin;
 	struct sieve_script_env scriptenv;
 	struct sieve_error_handler *ehandler;
+	struct sieve_profile *profile = NULL;
+	enum sieve_profile_format profile_format = SIEVE_PROFILE_FORMAT_TABLE;
 	bool force_compile, execute, source_write, verbose, default_move;
 	struct mail_namespace *ns;
 	struct mailbox *src_box = NULL, *move_box = NULL;
@@ -372,12 +436,12 @@ int main(int argc, char **argv)
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-		"m:s:x:P:u:q:Q:DCevW", FALSE);
+		"m:s:x:P:u:p:gq:Q:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
-	dst_mailbox = move_mailbox = NULL;
+	dst_mailbox = move_mailbox = profilefile = NULL;
 	force_compile = execute = source_write = default_move = FALSE;
 	verbose = FALSE;	
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -423,6 +487,14 @@ int main(int argc, char **argv)
 			/* enable verbose output */
 			verbose = TRUE;
 			break;
+		case 'p':
+			/* profile file */
+			profilefile = optarg;
+			break;
+		case 'g':
+			/* profile in folded-stack format */
+			profile_format = SIEVE_PROFILE_FORMAT_FOLDED;
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -548,6 +620,12 @@ int main(int argc, char **argv)
 	scriptenv.mailbox_autocreate = FALSE;
 	scriptenv.default_mailbox = dst_mailbox;
 	scriptenv.user = mail_user;
+	if ( execute )
+		scriptenv.mailbox_cache = sieve_mailbox_cache_create(svinst, mail_user);
+	if ( profilefile != NULL ) {
+		profile = sieve_profile_create(svinst);
+		scriptenv.profile = profile;
+	}
 
 	/* Compose filter context */
 	i_zero(&sfdata);
@@ -563,6 +641,10 @@ int main(int argc, char **argv)
 	/* Apply Sieve filter to all messages found */
 	(void) filter_mailbox(&sfdata, src_box);
 
+	/* Close the mailboxes stored into by the script */
+	if ( scriptenv.mailbox_cache != NULL )
+		sieve_mailbox_cache_destroy(&scriptenv.mailbox_cache);
+
 	/* Close the source mailbox */
 	if ( src_box != NULL )
 		mailbox_free(&src_box);
@@ -575,6 +657,14 @@ int main(int argc, char **argv)
 	if ( main_sbin != NULL )
 		sieve_close(&main_sbin);
 
+	/* Write the execution profile */
+	if ( profile != NULL ) {
+		(void)sieve_profile_write(profile,
+			(strcmp(profilefile, "-") == 0 ? NULL : profilefile),
+			profile_format);
+		sieve_profile_free(&profile);
+	}
+
 	/* Cleanup error handler */
 	sieve_error_handler_unref(&ehandler);
 
@@ -0,0 +1,179 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "strnum.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "smtp-submit-settings.h"
+#include "smtp-submit.h"
+
+#include "sieve.h"
+#include "sieve-settings.h"
+#include "sieve-smtp-spool.h"
+#include "sieve-tool.h"
+
+#include <stdio.h>
+#include <sysexits.h>
+
+/*
+ * Print help
+ */
+
+static void print_help(void)
+{
+	printf(
+"Usage: sieve-spool [-c <config-file>] [-D] [-n <max-count>] [-s]\n"
+"                   [-u <user>]\n"
+	);
+}
+
+/*
+ * SMTP submission
+ */
+
+static void *sieve_spool_smtp_start
+(const struct sieve_script_env *senv, const char *return_path)
+{
+	const struct smtp_submit_settings *smtp_set =
+		(const struct smtp_submit_settings *) senv->script_context;
+
+	return (void *)smtp_submit_init_simple(smtp_set, return_path);
+}
+
+static void sieve_spool_smtp_add_rcpt
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle,
+	const char *address)
+{
+	struct smtp_submit *smtp_submit = (struct smtp_submit *) handle;
+
+	smtp_submit_add_rcpt(smtp_submit, address);
+}
+
+static struct ostream *sieve_spool_smtp_send
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct smtp_submit *smtp_submit = (struct smtp_submit *) handle;
+
+	return smtp_submit_send(smtp_submit);
+}
+
+static void sieve_spool_smtp_abort
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct smtp_submit *smtp_submit = (struct smtp_submit *) handle;
+
+	smtp_submit_deinit(&smtp_submit);
+}
+
+static int sieve_spool_smtp_finish
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle,
+	const char **error_r)
+{
+	struct smtp_submit *smtp_submit = (struct smtp_submit *) handle;
+	int ret;
+
+	ret = smtp_submit_run(smtp_submit, error_r);
+	smtp_submit_deinit(&smtp_submit);
+	return ret;
+}
+
+/*
+ * Status
+ */
+
+static int sieve_spool_print_status(struct sieve_instance *svinst)
+{
+	struct sieve_smtp_spool_status status;
+	long long age;
+
+	if ( sieve_smtp_spool_get_status(svinst, &status) < 0 )
+		return -1;
+
+	age = ( status.oldest == 0 ? 0 :
+		(long long)(time(NULL) - status.oldest) );
+	printf("queued=%u deferred=%u active=%u failed=%u oldest_age=%lld\n",
+		status.queued, status.deferred, status.active, status.failed,
+		( age < 0 ? 0 : age ));
+	return 0;
+}
+
+/*
+ * Tool implementation
+ */
+
+int main(int argc, char **argv)
+{
+	static const struct setting_parser_info *set_roots[] = {
+		&smtp_submit_setting_parser_info,
+		NULL
+	};
+	struct sieve_instance *svinst;
+	struct sieve_script_env scriptenv;
+	const char *error;
+	unsigned int max_count = 0, submitted;
+	bool status_only = FALSE;
+	int exit_status = EXIT_SUCCESS;
+	int c;
+
+	sieve_tool = sieve_tool_init("sieve-spool", &argc, &argv, "n:su:D", FALSE);
+
+	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
+		switch (c) {
+		case 'n':
+			/* max-count */
+			if ( str_to_uint(optarg, &max_count) < 0 ) {
+				print_help();
+				i_fatal_status(EX_USAGE,
+					"Invalid <max-count> argument: %s", optarg);
+			}
+			break;
+		case 's':
+			/* status only */
+			status_only = TRUE;
+			break;
+		default:
+			print_help();
+			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
+			break;
+		}
+	}
+
+	if ( optind < argc ) {
+		print_help();
+		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
+	}
+
+	/* Finish tool initialization */
+	svinst = sieve_tool_init_finish(sieve_tool, FALSE, FALSE);
+
+	if ( sieve_setting_get(svinst, "sieve_smtp_spool") == NULL )
+		i_fatal_status(EX_CONFIG, "sieve_smtp_spool is not configured");
+
+	if ( !status_only ) {
+		if ( master_service_settings_read_simple
+			(master_service, set_roots, &error) < 0 )
+			i_fatal("Error reading configuration: %s", error);
+
+		i_zero(&scriptenv);
+		scriptenv.script_context =
+			master_service_settings_get_others(master_service)[0];
+		scriptenv.smtp_start = sieve_spool_smtp_start;
+		scriptenv.smtp_add_rcpt = sieve_spool_smtp_add_rcpt;
+		scriptenv.smtp_send = sieve_spool_smtp_send;
+		scriptenv.smtp_abort = sieve_spool_smtp_abort;
+		scriptenv.smtp_finish = sieve_spool_smtp_finish;
+
+		if ( sieve_smtp_spool_drain
+			(svinst, &scriptenv, max_count, &submitted) < 0 )
+			exit_status = EX_TEMPFAIL;
+		printf("submitted=%u\n", submitted);
+	}
+
+	if ( sieve_spool_print_status(svinst) < 0 )
+		exit_status = EX_TEMPFAIL;
+
+	sieve_tool_deinit(&sieve_tool);
+
+	return exit_status;
+}
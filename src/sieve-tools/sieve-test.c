@@ -45,6 +45,7 @@ static void print_help(void)
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
 "                  [-m <default-mailbox>] [-P <plugin>]\n"
+"                  [-p <profile-file>] [-g]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
@@ -134,7 +135,7 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile, *recipient, *final_recipient, *sender, *mailbox,
-		*dumpfile, *tracefile, *mailfile, *mailloc;
+		*dumpfile, *tracefile, *profilefile, *mailfile, *mailloc;
 	struct sieve_trace_config trace_config;
 	struct mail *mail;
 	struct sieve_binary *main_sbin, *sbin = NULL;
@@ -144,19 +145,21 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler, *action_ehandler;
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
+	struct sieve_profile *profile = NULL;
+	enum sieve_profile_format profile_format = SIEVE_PROFILE_FORMAT_TABLE;
 	bool force_compile = FALSE, execute = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init
-		("sieve-test", &argc, &argv, "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+		("sieve-test", &argc, &argv, "r:a:f:m:d:l:s:eCt:T:p:gDP:x:u:", FALSE);
 
 	ehandler = action_ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
 	recipient = final_recipient = sender = mailbox = dumpfile =
-		tracefile = mailloc = NULL;
+		tracefile = profilefile = mailloc = NULL;
 	i_zero(&trace_config);
 	trace_config.level = SIEVE_TRLVL_ACTIONS;
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -189,6 +192,14 @@ int main(int argc, char **argv)
 		case 'T':
 			sieve_tool_parse_trace_option(&trace_config, optarg);
 			break;
+		case 'p':
+			/* profile file */
+			profilefile = optarg;
+			break;
+		case 'g':
+			/* profile in folded-stack format */
+			profile_format = SIEVE_PROFILE_FORMAT_FOLDED;
+			break;
 		case 'd':
 			/* dump file */
 			dumpfile = optarg;
@@ -305,6 +316,9 @@ int main(int argc, char **argv)
 				&trace_log);
 		}
 
+		if ( profilefile != NULL )
+			profile = sieve_profile_create(svinst);
+
 		/* Compose script environment */
 		i_zero(&scriptenv);
 		scriptenv.default_mailbox = mailbox;
@@ -318,6 +332,7 @@ int main(int argc, char **argv)
 		scriptenv.duplicate_check = duplicate_check;
 		scriptenv.trace_log = trace_log;
 		scriptenv.trace_config = trace_config;
+		scriptenv.profile = profile;
 		scriptenv.exec_status = &estatus;
 
 		/* Run the test */
@@ -429,6 +444,12 @@ int main(int argc, char **argv)
 			o_stream_destroy(&teststream);
 		if ( trace_log != NULL )
 			sieve_trace_log_free(&trace_log);
+		if ( profile != NULL ) {
+			(void)sieve_profile_write(profile,
+				(strcmp(profilefile, "-") == 0 ? NULL : profilefile),
+				profile_format);
+			sieve_profile_free(&profile);
+		}
 
 		/* Cleanup remaining binaries */
 		if ( sbin != NULL )
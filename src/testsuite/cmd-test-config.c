@@ -11,6 +11,7 @@
 #include "sieve-code.h"
 #include "sieve-binary.h"
 #include "sieve-dump.h"
+#include "sieve-smtp-spool.h"
 
 #include "testsuite-common.h"
 #include "testsuite-settings.h"
@@ -452,6 +453,10 @@ static int cmd_test_config_reload_operation_execute
 
 		sieve_settings_load(renv->svinst);
 
+		/* The spool is only configured when the engine is initialized */
+		sieve_smtp_spool_deinit(renv->svinst);
+		sieve_smtp_spool_init(renv->svinst);
+
 	} else {
 		if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS) ) {
 			sieve_runtime_trace(renv, 0,
@@ -75,7 +75,8 @@ const struct sieve_operation_def *testsuite_operations[] = {
 	&test_mailbox_delete_operation,
 	&test_binary_load_operation,
 	&test_binary_save_operation,
-	&test_imap_metadata_set_operation
+	&test_imap_metadata_set_operation,
+	&test_spool_drain_operation
 };
 
 /*
@@ -143,6 +144,7 @@ static bool ext_testsuite_validator_load
 	sieve_validator_register_command(valdtr, ext, &tst_test_error);
 	sieve_validator_register_command(valdtr, ext, &tst_test_result_action);
 	sieve_validator_register_command(valdtr, ext, &tst_test_result_execute);
+	sieve_validator_register_command(valdtr, ext, &tst_test_spool_drain);
 
 /*	sieve_validator_argument_override(valdtr, SAT_VAR_STRING, ext,
 		&testsuite_string_argument);*/
@@ -18,7 +18,7 @@ extern const struct sieve_extension_def testsuite_extension;
 
 extern const struct sieve_extension *testsuite_ext;
 
-extern const struct sieve_script_env *testsuite_scriptenv;
+extern struct sieve_script_env *testsuite_scriptenv;
 
 extern char *testsuite_test_path;
 
@@ -90,6 +90,7 @@ extern const struct sieve_command_def tst_test_multiscript;
 extern const struct sieve_command_def tst_test_error;
 extern const struct sieve_command_def tst_test_result_action;
 extern const struct sieve_command_def tst_test_result_execute;
+extern const struct sieve_command_def tst_test_spool_drain;
 
 /*
  * Operations
@@ -118,7 +119,8 @@ enum testsuite_operation_code {
 	TESTSUITE_OPERATION_TEST_MAILBOX_DELETE,
 	TESTSUITE_OPERATION_TEST_BINARY_LOAD,
 	TESTSUITE_OPERATION_TEST_BINARY_SAVE,
-	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET
+	TESTSUITE_OPERATION_TEST_IMAP_METADATA_SET,
+	TESTSUITE_OPERATION_TEST_SPOOL_DRAIN
 };
 
 extern const struct sieve_operation_def test_operation;
@@ -144,6 +146,7 @@ extern const struct sieve_operation_def test_mailbox_delete_operation;
 extern const struct sieve_operation_def test_binary_load_operation;
 extern const struct sieve_operation_def test_binary_save_operation;
 extern const struct sieve_operation_def test_imap_metadata_set_operation;
+extern const struct sieve_operation_def test_spool_drain_operation;
 
 /*
  * Operands
@@ -11,6 +11,7 @@
 #include "sieve-actions.h"
 #include "sieve-interpreter.h"
 #include "sieve-result.h"
+#include "sieve-mailbox-cache.h"
 
 #include "testsuite-common.h"
 #include "testsuite-log.h"
@@ -33,6 +34,9 @@ void testsuite_result_deinit(void)
 	if ( _testsuite_result != NULL ) {
 		sieve_result_unref(&_testsuite_result);
 	}
+
+	if ( testsuite_scriptenv->mailbox_cache != NULL )
+		sieve_mailbox_cache_destroy(&testsuite_scriptenv->mailbox_cache);
 }
 
 void testsuite_result_reset
@@ -64,6 +68,7 @@ struct sieve_result_iterate_context *testsuite_result_iterate_init(void)
 
 bool testsuite_result_execute(const struct sieve_runtime_env *renv)
 {
+	struct sieve_instance *svinst = testsuite_sieve_instance;
 	int ret;
 
 	if ( _testsuite_result == NULL ) {
@@ -74,6 +79,12 @@ bool testsuite_result_execute(const struct sieve_runtime_env *renv)
 
 	testsuite_log_clear_messages();
 
+	/* Keep the mailboxes open across results once the cache is configured */
+	if ( testsuite_scriptenv->mailbox_cache == NULL ) {
+		testsuite_scriptenv->mailbox_cache = sieve_mailbox_cache_create
+			(svinst, testsuite_scriptenv->user);
+	}
+
 	/* Execute the result */
 	ret=sieve_result_execute
 		(_testsuite_result, NULL, testsuite_log_ehandler, 0);
@@ -28,6 +28,7 @@ struct testsuite_smtp_message {
 static pool_t testsuite_smtp_pool;
 static const char *testsuite_smtp_tmp;
 static ARRAY(struct testsuite_smtp_message) testsuite_smtp_messages;
+static unsigned int testsuite_smtp_transactions;
 
 /*
  * Initialize
@@ -48,6 +49,7 @@ void testsuite_smtp_init(void)
 	}
 
 	p_array_init(&testsuite_smtp_messages, pool, 16);
+	testsuite_smtp_transactions = 0;
 }
 
 void testsuite_smtp_deinit(void)
@@ -150,6 +152,7 @@ int testsuite_smtp_finish
 	i_free(smtp->msg_file);
 	i_free(smtp->return_path);
 	i_free(smtp);
+	testsuite_smtp_transactions++;
 	return ret;
 }
 
@@ -173,3 +176,8 @@ bool testsuite_smtp_get
 
 	return TRUE;
 }
+
+unsigned int testsuite_smtp_get_transaction_count(void)
+{
+	return testsuite_smtp_transactions;
+}
@@ -34,5 +34,6 @@ int testsuite_smtp_finish
 
 bool testsuite_smtp_get
 	(const struct sieve_runtime_env *renv, unsigned int index);
+unsigned int testsuite_smtp_get_transaction_count(void);
 
 #endif /* __TESTSUITE_SMTP_H */
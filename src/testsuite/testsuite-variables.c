@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "str.h"
 
 #include "sieve-common.h"
 #include "sieve-ast.h"
@@ -12,11 +13,13 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
+#include "sieve-smtp-spool.h"
 
 #include "sieve-ext-variables.h"
 
 #include "testsuite-common.h"
 #include "testsuite-variables.h"
+#include "testsuite-smtp.h"
 
 /*
  *
@@ -134,6 +137,32 @@ bool testsuite_varnamespace_dump_variable
 	return TRUE;
 }
 
+static string_t *testsuite_spool_status_get
+(const struct sieve_runtime_env *renv, const char *item)
+{
+	struct sieve_smtp_spool_status status;
+	unsigned int value;
+	string_t *str;
+
+	if ( sieve_smtp_spool_get_status(renv->svinst, &status) < 0 )
+		return NULL;
+
+	if ( strcmp(item, "queued") == 0 )
+		value = status.queued;
+	else if ( strcmp(item, "deferred") == 0 )
+		value = status.deferred;
+	else if ( strcmp(item, "active") == 0 )
+		value = status.active;
+	else if ( strcmp(item, "failed") == 0 )
+		value = status.failed;
+	else
+		return NULL;
+
+	str = t_str_new(16);
+	str_printfa(str, "%u", value);
+	return str;
+}
+
 int testsuite_varnamespace_read_variable
 (const struct sieve_runtime_env *renv,
 	const struct sieve_variables_namespace *nspc ATTR_UNUSED,
@@ -151,7 +180,15 @@ int testsuite_varnamespace_read_variable
 	if ( str_r != NULL ) {
 		if ( strcmp(str_c(var_name), "path") == 0 )
 			*str_r = t_str_new_const(testsuite_test_path, strlen(testsuite_test_path));
-		else
+		else if ( strcmp(str_c(var_name), "tmp_dir") == 0 )
+			*str_r = t_str_new_const(testsuite_tmp_dir_get(),
+				strlen(testsuite_tmp_dir_get()));
+		else if ( strcmp(str_c(var_name), "smtp_transactions") == 0 ) {
+			*str_r = t_str_new(16);
+			str_printfa(*str_r, "%u", testsuite_smtp_get_transaction_count());
+		} else if ( strncmp(str_c(var_name), "spool_", 6) == 0 ) {
+			*str_r = testsuite_spool_status_get(renv, str_c(var_name)+6);
+		} else
 			*str_r = NULL;
 	}
 	return SIEVE_EXEC_OK;
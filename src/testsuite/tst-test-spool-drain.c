@@ -0,0 +1,309 @@
+/* Copyright (c) 2002-2017 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "ostream.h"
+
+#include "sieve-common.h"
+#include "sieve-commands.h"
+#include "sieve-validator.h"
+#include "sieve-generator.h"
+#include "sieve-interpreter.h"
+#include "sieve-code.h"
+#include "sieve-binary.h"
+#include "sieve-dump.h"
+#include "sieve-smtp-spool.h"
+
+#include "testsuite-common.h"
+
+/*
+ * Test_spool_drain command
+ *
+ * Syntax:
+ *   test_spool_drain [:tempfail / :permfail]
+ */
+
+static bool tst_test_spool_drain_registered
+	(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+		struct sieve_command_registration *cmd_reg);
+static bool tst_test_spool_drain_generate
+	(const struct sieve_codegen_env *cgenv, struct sieve_command *cmd);
+
+const struct sieve_command_def tst_test_spool_drain = {
+	.identifier = "test_spool_drain",
+	.type = SCT_TEST,
+	.positional_args = 0,
+	.subtests = 0,
+	.block_allowed = FALSE,
+	.block_required = FALSE,
+	.registered = tst_test_spool_drain_registered,
+	.generate = tst_test_spool_drain_generate
+};
+
+/*
+ * Operation
+ */
+
+static bool tst_test_spool_drain_operation_dump
+	(const struct sieve_dumptime_env *denv, sieve_size_t *address);
+static int tst_test_spool_drain_operation_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+
+const struct sieve_operation_def test_spool_drain_operation = {
+	.mnemonic = "TEST_SPOOL_DRAIN",
+	.ext_def = &testsuite_extension,
+	.code = TESTSUITE_OPERATION_TEST_SPOOL_DRAIN,
+	.dump = tst_test_spool_drain_operation_dump,
+	.execute = tst_test_spool_drain_operation_execute
+};
+
+/*
+ * Tagged arguments
+ */
+
+static bool tst_test_spool_drain_validate_fail_tag
+	(struct sieve_validator *valdtr, struct sieve_ast_argument **arg,
+		struct sieve_command *cmd);
+
+static const struct sieve_argument_def test_spool_drain_tempfail_tag = {
+	.identifier = "tempfail",
+	.validate = tst_test_spool_drain_validate_fail_tag
+};
+
+static const struct sieve_argument_def test_spool_drain_permfail_tag = {
+	.identifier = "permfail",
+	.validate = tst_test_spool_drain_validate_fail_tag
+};
+
+/* Codes for optional arguments */
+
+enum tst_test_spool_drain_optional {
+	OPT_END,
+	OPT_TEMPFAIL,
+	OPT_PERMFAIL
+};
+
+/*
+ * Tag validation
+ */
+
+static bool tst_test_spool_drain_validate_fail_tag
+(struct sieve_validator *valdtr, struct sieve_ast_argument **arg,
+	struct sieve_command *cmd)
+{
+	if ( cmd->data != NULL ) {
+		sieve_argument_validate_error(valdtr, *arg,
+			"only one of the ':tempfail' or ':permfail' tags may be specified "
+			"for the test_spool_drain test");
+		return FALSE;
+	}
+	cmd->data = (void *) *arg;
+
+	/* Skip the tag itself */
+	*arg = sieve_ast_argument_next(*arg);
+
+	return TRUE;
+}
+
+/*
+ * Command registration
+ */
+
+static bool tst_test_spool_drain_registered
+(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+	struct sieve_command_registration *cmd_reg)
+{
+	sieve_validator_register_tag
+		(valdtr, cmd_reg, ext, &test_spool_drain_tempfail_tag, OPT_TEMPFAIL);
+	sieve_validator_register_tag
+		(valdtr, cmd_reg, ext, &test_spool_drain_permfail_tag, OPT_PERMFAIL);
+
+	return TRUE;
+}
+
+/*
+ * Code generation
+ */
+
+static bool tst_test_spool_drain_generate
+(const struct sieve_codegen_env *cgenv, struct sieve_command *tst)
+{
+	sieve_operation_emit(cgenv->sblock, tst->ext, &test_spool_drain_operation);
+
+	/* Generate arguments */
+	return sieve_generate_arguments(cgenv, tst, NULL);
+}
+
+/*
+ * Code dump
+ */
+
+static bool tst_test_spool_drain_operation_dump
+(const struct sieve_dumptime_env *denv, sieve_size_t *address)
+{
+	int opt_code = 0;
+
+	sieve_code_dumpf(denv, "TEST_SPOOL_DRAIN:");
+	sieve_code_descend(denv);
+
+	/* Dump optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_dump(denv, address, &opt_code)) < 0 )
+			return FALSE;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_TEMPFAIL:
+			sieve_code_dumpf(denv, "tempfail");
+			break;
+		case OPT_PERMFAIL:
+			sieve_code_dumpf(denv, "permfail");
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Failing SMTP
+ *
+ *   Replaces the simulated SMTP of the testsuite for a drain that is to fail;
+ *   the message is discarded and not counted as an SMTP transaction.
+ */
+
+struct tst_test_spool_drain_smtp {
+	buffer_t *buffer;
+	struct ostream *output;
+};
+
+static void *tst_test_spool_drain_smtp_start
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	const char *return_path ATTR_UNUSED)
+{
+	struct tst_test_spool_drain_smtp *smtp;
+
+	smtp = i_new(struct tst_test_spool_drain_smtp, 1);
+	smtp->buffer = buffer_create_dynamic(default_pool, 1024);
+	smtp->output = o_stream_create_buffer(smtp->buffer);
+	return (void *)smtp;
+}
+
+static void tst_test_spool_drain_smtp_add_rcpt
+(const struct sieve_script_env *senv ATTR_UNUSED,
+	void *handle ATTR_UNUSED, const char *address ATTR_UNUSED)
+{
+}
+
+static struct ostream *tst_test_spool_drain_smtp_send
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct tst_test_spool_drain_smtp *smtp =
+		(struct tst_test_spool_drain_smtp *) handle;
+
+	return smtp->output;
+}
+
+static void tst_test_spool_drain_smtp_abort
+(const struct sieve_script_env *senv ATTR_UNUSED, void *handle)
+{
+	struct tst_test_spool_drain_smtp *smtp =
+		(struct tst_test_spool_drain_smtp *) handle;
+
+	o_stream_unref(&smtp->output);
+	buffer_free(&smtp->buffer);
+	i_free(smtp);
+}
+
+static int tst_test_spool_drain_smtp_tempfail
+(const struct sieve_script_env *senv, void *handle, const char **error_r)
+{
+	tst_test_spool_drain_smtp_abort(senv, handle);
+	*error_r = "simulated temporary failure";
+	return -1;
+}
+
+static int tst_test_spool_drain_smtp_permfail
+(const struct sieve_script_env *senv, void *handle, const char **error_r)
+{
+	tst_test_spool_drain_smtp_abort(senv, handle);
+	*error_r = "simulated permanent failure";
+	return 0;
+}
+
+/*
+ * Intepretation
+ */
+
+static int tst_test_spool_drain_operation_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address)
+{
+	struct sieve_script_env senv = *testsuite_scriptenv;
+	int opt_code = 0;
+	unsigned int submitted;
+	bool result;
+
+	/*
+	 * Read operands
+	 */
+
+	/* Optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_read(renv, address, &opt_code)) < 0 )
+			return SIEVE_EXEC_BIN_CORRUPT;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_TEMPFAIL:
+		case OPT_PERMFAIL:
+			senv.smtp_start = tst_test_spool_drain_smtp_start;
+			senv.smtp_add_rcpt = tst_test_spool_drain_smtp_add_rcpt;
+			senv.smtp_send = tst_test_spool_drain_smtp_send;
+			senv.smtp_abort = tst_test_spool_drain_smtp_abort;
+			senv.smtp_finish = ( opt_code == OPT_TEMPFAIL ?
+				tst_test_spool_drain_smtp_tempfail :
+				tst_test_spool_drain_smtp_permfail );
+			break;
+		default:
+			sieve_runtime_trace_error(renv, "unknown optional operand");
+			return SIEVE_EXEC_BIN_CORRUPT;
+		}
+	}
+
+	/*
+	 * Perform operation
+	 */
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS,
+		"testsuite: test_spool_drain test");
+
+	if ( renv->svinst->smtp_spool == NULL ) {
+		testsuite_test_fail_cstr("test_spool_drain: "
+			"no spool is configured (sieve_smtp_spool)");
+		return SIEVE_EXEC_OK;
+	}
+
+	result = ( sieve_smtp_spool_drain
+		(renv->svinst, &senv, 0, &submitted) == 0 );
+
+	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_TESTS) ) {
+		sieve_runtime_trace_descend(renv);
+		sieve_runtime_trace(renv, 0,
+			"drain of spool %s (%u messages submitted)",
+			( result ? "succeeded" : "failed" ), submitted);
+	}
+
+	/* Set result */
+	sieve_interpreter_set_test_result(renv->interp, result);
+
+	return SIEVE_EXEC_OK;
+}